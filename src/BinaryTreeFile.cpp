@@ -1,6 +1,7 @@
 #include "BinaryTreeFile.h"
 #include <stdexcept>
 #include <iostream>
+#include <climits>
 #include <cstring>
 #include <fstream> // Добавляем, чтобы использовать std::ofstream
 
@@ -12,7 +13,12 @@
 // ==========================================
 namespace {
     constexpr char FILE_MAGIC[4] = {'T','R','E','E'}; // NOSONAR
-    constexpr std::uint32_t FILE_VERSION = 1;
+    // 1 — двоичные internal-узлы (left/right), 2 — узлы B+-дерева (до BTREE_MAX_CHILDREN детей),
+    // 3 — длина листа varint вместо int32 (листы и документы больше 2 ГБ)
+    constexpr std::uint32_t FILE_VERSION = 3;
+    constexpr std::uint32_t FILE_VERSION_WIDE = 2;
+    constexpr std::uint32_t FILE_VERSION_BINARY = 1;
+    constexpr int VARINT_MAX_BYTES = 10; // 64 бита по 7 бит на байт
     constexpr std::int64_t OFFSET_NONE = -1;
 }
 
@@ -55,13 +61,13 @@ std::int64_t BinaryTreeFile::writeNodeRecursive(Node* node) {
     if (!node) return OFFSET_NONE;
 
     // Сначала рекурсивно сохраняем детей (Post-order traversal)
-    std::int64_t leftOff = OFFSET_NONE;
-    std::int64_t rightOff = OFFSET_NONE;
+    std::int64_t childOffsets[BTREE_MAX_CHILDREN]; // NOSONAR
+    int childCount = 0;
 
     if (node->getType() == NodeType::NODE_INTERNAL) {
         auto inner = static_cast<InternalNode*>(node);
-        leftOff = writeNodeRecursive(inner->left);
-        rightOff = writeNodeRecursive(inner->right);
+        childCount = inner->childCount;
+        for (int i = 0; i < childCount; ++i) childOffsets[i] = writeNodeRecursive(inner->children[i]);
     }
 
     // Запоминаем текущую позицию для смещения
@@ -74,24 +80,22 @@ std::int64_t BinaryTreeFile::writeNodeRecursive(Node* node) {
     if (!good()) throw BinaryTreeFileError("I/O error writing node type");
 
     if (node->getType() == NodeType::NODE_LEAF) {
-        // 2. Лист: длина + lineCount + данные
+        // 2. Лист: длина + данные
         auto leaf = static_cast<LeafNode*>(node);
 
-        // length (int32)
-        write_le_int32(leaf->length);
+        // length (varint)
+        write_varint(static_cast<std::uint64_t>(leaf->length));
 
-        // lineCount (int32) -- вот что мы добавляем
-        write_le_int32(leaf->lineCount);
-
-        // payload (raw bytes)
+        // payload (raw bytes) — две части вокруг разрыва буфера
         if (leaf->length > 0) {
-            write(leaf->data, leaf->length);
+            write(leaf->data, leaf->gapStart);
+            write(leaf->data + leaf->gapStart + leaf->gapLength(), leaf->length - leaf->gapStart);
             if (!good()) throw BinaryTreeFileError("I/O error writing leaf data");
         }
     } else {
-        // Внутренний узел: смещения детей
-        write_le_int64(leftOff);
-        write_le_int64(rightOff);
+        // Внутренний узел: количество детей и их смещения
+        write_le_uint32(static_cast<std::uint32_t>(childCount));
+        for (int i = 0; i < childCount; ++i) write_le_int64(childOffsets[i]);
     }
     return currentPos;
 }
@@ -132,53 +136,88 @@ void BinaryTreeFile::saveTree(const Tree& tree) {
 
 // --- Загрузка ---
 
-Node* BinaryTreeFile::readLeafNodeAt(std::int64_t offset, std::int64_t fileSize) {
-    // Проверка: требуется минимум 1 (type) + 4 (length) + 4 (lineCount)
-    if (std::int64_t minNeeded = offset + 1 + static_cast<std::int64_t>(sizeof(std::int32_t)) + static_cast<std::int64_t>(sizeof(std::int32_t));
-        minNeeded > fileSize) {
-        throw BinaryTreeFileError("Corrupt file: not enough bytes for leaf header");
-    }
+void BinaryTreeFile::readLeafNodeAt(TreeBuilder& builder, std::int64_t offset, std::int64_t fileSize) {
+    std::int64_t len = 0;
+    std::int64_t headerSize = 0;
+    if (m_version >= FILE_VERSION) {
+        // Версия 3: varint-длина (минимум 1 байт)
+        if (offset + 2 > fileSize) throw BinaryTreeFileError("Corrupt file: not enough bytes for leaf header");
+        std::uint64_t ulen = read_varint();
+        if (ulen > static_cast<std::uint64_t>(INT64_MAX)) throw BinaryTreeFileError("Corrupt file: leaf length overflow");
+        len = static_cast<std::int64_t>(ulen);
+        headerSize = static_cast<std::int64_t>(tellg()) - offset;
+    } else {
+        // Проверка: требуется минимум 1 (type) + 4 (length) + 4 (lineCount)
+        headerSize = 1 + static_cast<std::int64_t>(sizeof(std::int32_t)) + static_cast<std::int64_t>(sizeof(std::int32_t));
+        if (offset + headerSize > fileSize) {
+            throw BinaryTreeFileError("Corrupt file: not enough bytes for leaf header");
+        }
 
-    // В позиции после типа (функция вызывается так, что позиция seekg установлена уже на offset+1)
-    // читаем длину листа
-    std::int32_t len = read_le_int32();
-    if (len < 0) throw BinaryTreeFileError("Corrupt file: negative leaf length");
+        // В позиции после типа (функция вызывается так, что позиция seekg установлена уже на offset+1)
+        // читаем длину листа
+        len = read_le_int32();
+        if (len < 0) throw BinaryTreeFileError("Corrupt file: negative leaf length");
 
-    // читаем сохранённый lineCount
-    std::int32_t lines = read_le_int32();
-    if (lines < 0) throw BinaryTreeFileError("Corrupt file: negative leaf lineCount");
+        // читаем сохранённый lineCount
+        std::int32_t lines = read_le_int32();
+        if (lines < 0) throw BinaryTreeFileError("Corrupt file: negative leaf lineCount");
+    }
 
-    // Проверка, что данные листа влезают в файл
-    if (std::int64_t needed = offset + 1 + static_cast<std::int64_t>(sizeof(std::int32_t)) + static_cast<std::int64_t>(sizeof(std::int32_t)) + static_cast<std::int64_t>(len);
-        needed > fileSize) {
+    // Проверка, что данные листа влезают в файл (через вычитание — без переполнения)
+    if (len > fileSize - offset - headerSize) {
         throw BinaryTreeFileError("Corrupt file: leaf data exceeds file size");
     }
-
-    char* buf = nullptr;
-    if (len > 0) {
-        buf = new char[len]; // NOSONAR
-        read(buf, static_cast<std::streamsize>(len));
-        if (gcount() != static_cast<std::streamsize>(len) || !good()) {
-            delete[] buf; //NOSONAR
+    // Данные читаются прямо в буферы листьев построителя — без временного буфера.
+    // '\n' считает построитель; сохранённый lineCount не используем (в старых файлах он хранил "строки + 1").
+    while (len > 0) {
+        int available = 0;
+        char* dst = builder.prepare(available);
+        int n = len < available ? static_cast<int>(len) : available;
+        read(dst, static_cast<std::streamsize>(n));
+        if (gcount() != static_cast<std::streamsize>(n) || !good()) {
             throw BinaryTreeFileError("I/O error reading leaf data");
         }
+        builder.commit(n);
+        len -= n;
     }
+}
 
-    // Создаём лист — предполагается, что конструктор LeafNode копирует буфер
-    LeafNode* leaf = new LeafNode(buf, len); // NOSONAR
 
-    // Устанавливаем явно сохранённый lineCount (перезапишет, если конструктор сам считал)
-    leaf->lineCount = lines;
+void BinaryTreeFile::readInternalNodeAt(TreeBuilder& builder, std::int64_t offset, std::int64_t fileSize) {
+    if (m_version == FILE_VERSION_BINARY) {
+        readBinaryInternalNodeAt(builder, offset, fileSize);
+        return;
+    }
 
-    // Освобождаем временный буфер (если он был скопирован в LeafNode)
-    if (buf) { delete[] buf; buf = nullptr; } //NOSONAR
+    // Узел B+-дерева: 1 байт типа + uint32 (количество детей) + int64 на каждого ребёнка
+    if (std::int64_t headerNeeded = offset + 1 + static_cast<std::int64_t>(sizeof(std::uint32_t));
+        headerNeeded > fileSize) {
+        throw BinaryTreeFileError("Corrupt file: not enough bytes for internal header (child count)");
+    }
+    std::uint32_t count = read_le_uint32();
+    if (count < 1 || count > static_cast<std::uint32_t>(BTREE_MAX_CHILDREN)) {
+        throw BinaryTreeFileError("Corrupt file: bad internal child count");
+    }
+    if (std::int64_t needed = offset + 1 + static_cast<std::int64_t>(sizeof(std::uint32_t)) +
+                              static_cast<std::int64_t>(sizeof(std::int64_t)) * count;
+        needed > fileSize) {
+        throw BinaryTreeFileError("Corrupt file: not enough bytes for internal header (offsets)");
+    }
 
-    return leaf;
-}
+    std::int64_t childOffsets[BTREE_MAX_CHILDREN]; // NOSONAR
+    for (std::uint32_t i = 0; i < count; ++i) {
+        childOffsets[i] = read_le_int64();
+        if (childOffsets[i] < 0 || childOffsets[i] >= fileSize) {
+            throw BinaryTreeFileError("Corrupt file: child offset out of bounds");
+        }
+    }
 
+    // Рекурсивно читаем детей по порядку (при ошибке прочитанное освобождает построитель)
+    for (std::uint32_t i = 0; i < count; ++i) readNodeRecursive(builder, childOffsets[i], fileSize);
+}
 
-Node* BinaryTreeFile::readInternalNodeAt(std::int64_t offset, std::int64_t fileSize) {
-    // Внутренний узел теперь содержит только 1 байт типа + 2 * int64 (смещения детей)
+void BinaryTreeFile::readBinaryInternalNodeAt(TreeBuilder& builder, std::int64_t offset, std::int64_t fileSize) {
+    // Версия 1: internal-узел содержит только 1 байт типа + 2 * int64 (смещения детей)
     if (std::int64_t headerNeeded = offset + 1 + static_cast<std::int64_t>(sizeof(std::int64_t)) * 2;
         headerNeeded > fileSize) {
         throw BinaryTreeFileError("Corrupt file: not enough bytes for internal header (offsets)");
@@ -186,7 +225,6 @@ Node* BinaryTreeFile::readInternalNodeAt(std::int64_t offset, std::int64_t fileS
 
     std::int64_t lOff = read_le_int64();
     std::int64_t rOff = read_le_int64();
-    // (Удалено: чтение int32 count, т.к. данные вычисляются конструктором)
 
     // Валидация смещений
     if ((lOff != OFFSET_NONE && (lOff < 0 || lOff >= fileSize)) ||
@@ -194,18 +232,13 @@ Node* BinaryTreeFile::readInternalNodeAt(std::int64_t offset, std::int64_t fileS
         throw BinaryTreeFileError("Corrupt file: child offset out of bounds");
     }
 
-    // Рекурсивно читаем детей
-    Node* l = readNodeRecursive(lOff, fileSize);
-    Node* r = readNodeRecursive(rOff, fileSize);
-
-    // InternalNode ctor теперь сам рассчитает totalLength и totalLineCount на основе l и r!
-    InternalNode* node = new InternalNode(l, r); // NOSONAR
-    // (Удалено: node->lineCount = count; — это больше не нужно!)
-    return node;
+    // Двоичное дерево (возможно, несбалансированное) — важен только порядок листьев
+    readNodeRecursive(builder, lOff, fileSize);
+    readNodeRecursive(builder, rOff, fileSize);
 }
 
-Node* BinaryTreeFile::readNodeRecursive(std::int64_t offset, std::int64_t fileSize) {
-    if (offset == OFFSET_NONE) return nullptr;
+void BinaryTreeFile::readNodeRecursive(TreeBuilder& builder, std::int64_t offset, std::int64_t fileSize) {
+    if (offset == OFFSET_NONE) return;
     if (offset < 0 || offset >= fileSize) {
         throw BinaryTreeFileError("Invalid node offset (out of file bounds)");
     }
@@ -222,10 +255,10 @@ Node* BinaryTreeFile::readNodeRecursive(std::int64_t offset, std::int64_t fileSi
         // Смещение узла (offset) указывает на начало типа. Мы уже прочитали тип.
         // Чтобы начать чтение данных листа, нужно вернуться на позицию после типа.
         seekg(offset + 1, std::ios::beg);
-        return readLeafNodeAt(offset, fileSize);
+        readLeafNodeAt(builder, offset, fileSize);
     } else if (type == static_cast<char>(NodeType::NODE_INTERNAL)) {
         seekg(offset + 1, std::ios::beg);
-        return readInternalNodeAt(offset, fileSize);
+        readInternalNodeAt(builder, offset, fileSize);
     } else {
         throw BinaryTreeFileError("Unknown node type in file");
     }
@@ -237,7 +270,7 @@ void BinaryTreeFile::loadTree(Tree& tree) {
         throw BinaryTreeFileError("file not open");
         return;}
 
-    tree.clear();
+    TreeBuilder builder(tree); // очищает дерево; при ошибке оно останется пустым
 
     seekg(0, std::ios::end);
     auto fileSize = static_cast<std::int64_t>(tellg());
@@ -249,17 +282,14 @@ void BinaryTreeFile::loadTree(Tree& tree) {
     if (std::memcmp(magic, FILE_MAGIC, 4) != 0) 
         throw BinaryTreeFileError("Bad file magic - not a tree file");
 
-    if (read_le_uint32() != FILE_VERSION) 
+    m_version = read_le_uint32();
+    if (m_version != FILE_VERSION && m_version != FILE_VERSION_WIDE && m_version != FILE_VERSION_BINARY) 
         throw BinaryTreeFileError("Unsupported file version");
 
     std::int64_t rootOffset = read_le_int64();
-    if (rootOffset == OFFSET_NONE) {
-        tree.setRoot(nullptr);
-        return;
-    }
-
-    Node* newRoot = readNodeRecursive(rootOffset, fileSize);
-    tree.setRoot(newRoot);
+    // Листья файла любой версии дописываются по порядку — дерево собирается сбалансированным
+    readNodeRecursive(builder, rootOffset, fileSize);
+    builder.finish();
 }
 
 
@@ -287,6 +317,34 @@ void BinaryTreeFile::write_le_int64(std::int64_t v) {
     if (!good()) throw BinaryTreeFileError("I/O error writing int64");
 }
 
+void BinaryTreeFile::write_varint(std::uint64_t v) {
+    unsigned char b[VARINT_MAX_BYTES]; // NOSONAR
+    int n = 0;
+    do {
+        auto byte = static_cast<unsigned char>(v & 0x7F);
+        v >>= 7;
+        if (v) byte |= 0x80;
+        b[n++] = byte;
+    } while (v);
+    write(reinterpret_cast<char*>(b), n);
+    if (!good()) throw BinaryTreeFileError("I/O error writing varint");
+}
+
+std::uint64_t BinaryTreeFile::read_varint() {
+    std::uint64_t v = 0;
+    for (int i = 0; i < VARINT_MAX_BYTES; ++i) {
+        char c = 0;
+        read(&c, 1);
+        if (gcount() != 1 || !good()) throw BinaryTreeFileError("I/O error reading varint");
+        auto byte = static_cast<unsigned char>(c);
+        // Десятый байт может нести только старший (64-й) бит
+        if (i == VARINT_MAX_BYTES - 1 && byte > 1) throw BinaryTreeFileError("Corrupt file: varint overflow");
+        v |= static_cast<std::uint64_t>(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) return v;
+    }
+    throw BinaryTreeFileError("Corrupt file: varint too long");
+}
+
 std::uint32_t BinaryTreeFile::read_le_uint32() {
     unsigned char b[4]; // NOSONAR
     read(reinterpret_cast<char*>(b), 4);
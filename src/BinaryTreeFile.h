@@ -2,44 +2,62 @@
 #define BINARY_TREE_FILE_H
 
 #include "Tree.h" // Нужен для доступа к структурам Node и классу Tree
+#include "TreeBuilder.h"
 #include <fstream>
 #include <cstdint>
 
-// Формат узла (leaf):
+// Формат узла (leaf, версия 3):
+// [1 byte type == NODE_LEAF]
+// [varint length]       -- количество байт данных (LEB128, до 64 бит)
+// [length bytes]        -- данные (без '\0'); '\n' считаются при загрузке
+//
+// Формат узла (leaf, версии 1 и 2, только чтение):
 // [1 byte type == NODE_LEAF]
 // [int32 length]        -- количество байт данных
-// [int32 lineCount]     -- целый счётчик (кол-во строк / кэш)
+// [int32 lineCount]     -- количество '\n' (кэш; при загрузке пересчитывается)
 // [length bytes]        -- данные (без '\0')
 //
-// Формат internal:
+// Формат internal (версии 2 и 3, узел B+-дерева):
+// [1 byte type == NODE_INTERNAL]
+// [uint32 childCount]   -- 1..BTREE_MAX_CHILDREN
+// [int64 childOffset] * childCount
+//
+// Формат internal (версия 1, только чтение):
 // [1 byte type == NODE_INTERNAL]
 // [int64 leftOffset]
 // [int64 rightOffset]
 //
 // Заголовок файла:
 // [4 bytes magic "TREE"]
-// [uint32 version]
+// [uint32 version]      -- пишется 3, читаются 1, 2 и 3
 // [int64 rootOffset]    -- OFFSET_NONE (-1) означает пустое дерево
 class BinaryTreeFile : public std::fstream {
 private:
     // Имя файла, чтобы можно было усечь/переоткрыть при сохранении
     std::string m_filename; 
+    // Версия загружаемого файла (формат internal-узлов и длины листа)
+    std::uint32_t m_version = 0;
 
     // Рекурсивные методы I/O, работающие с узлами (Node*)
     std::int64_t  writeNodeRecursive(Node* node);
 
-    Node* readLeafNodeAt(std::int64_t offset, std::int64_t fileSize);
-    Node* readInternalNodeAt(std::int64_t offset, std::int64_t fileSize);
-    Node* readNodeRecursive(std::int64_t offset, std::int64_t fileSize);
+    // Текст листьев идёт в builder по порядку; форму дерева builder строит заново
+    // (сохранённые internal-узлы задают только порядок листьев)
+    void readLeafNodeAt(TreeBuilder& builder, std::int64_t offset, std::int64_t fileSize);
+    void readInternalNodeAt(TreeBuilder& builder, std::int64_t offset, std::int64_t fileSize);
+    void readBinaryInternalNodeAt(TreeBuilder& builder, std::int64_t offset, std::int64_t fileSize); // версия 1
+    void readNodeRecursive(TreeBuilder& builder, std::int64_t offset, std::int64_t fileSize);
 
     // Вспомогательные: чтение/запись в little-endian фиксированных типов
     void write_le_int32(std::int32_t v);
     void write_le_int64(std::int64_t v);
     void write_le_uint32(std::uint32_t v);
+    void write_varint(std::uint64_t v); // LEB128: 7 бит на байт, старший бит — "есть продолжение"
 
     std::int32_t read_le_int32();
     std::int64_t read_le_int64();
     std::uint32_t read_le_uint32();
+    std::uint64_t read_varint();
 
 public:
     BinaryTreeFile();
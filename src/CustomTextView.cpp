@@ -4,6 +4,7 @@
 #include <glib.h>
 #include <pango/pangocairo.h>
 #include <algorithm>
+#include <climits>
 #include <cstring>
 #include <iostream> // для простого логирования ошибок
 #include <cassert>
@@ -68,15 +69,14 @@ void CustomTextView::set_tree(Tree* tree) {
 }
 
 void CustomTextView::reload_from_tree() {
-    m_line_cache.clear(); // инвалидация кэша при смене дерева
     update_size_request();
     queue_draw();
 }
 
-void CustomTextView::set_cursor_byte_offset(int offset) {
+void CustomTextView::set_cursor_byte_offset(TextOffset offset) {
     if (!m_tree) return;
     
-    int maxLen = 0;
+    TextOffset maxLen = 0;
     
     // Используем isEmpty() 
     if (!m_tree->isEmpty()) { 
@@ -89,43 +89,69 @@ void CustomTextView::set_cursor_byte_offset(int offset) {
     m_cursor_byte_offset = offset;
     m_show_caret = true; 
     queue_draw();
+    m_signal_cursor_moved.emit(offset);
+}
+LineIndex CustomTextView::get_cursor_line_index() const {
+    if (!m_tree) return 0;
+    return m_tree->getLineForOffset(m_cursor_byte_offset);
 }
-// Нам нужно найти, в какой строке находится курсор.
-// Так как в Tree.h нет метода getLineIndexByOffset, мы используем бинарный поиск
-// по номерам строк, используя быстрый m_tree->getOffsetForLine().
-int CustomTextView::find_line_index_by_byte_offset(int targetOffset) const {
-    if (!m_tree || m_tree->isEmpty()) return 0;
-
-    int low = 0;
-    int high = m_tree->getTotalLineCount() - 1;
-    int result = 0;
 
-    while (low <= high) {
-        int mid = low + (high - low) / 2;
-        int midOffset = m_tree->getOffsetForLine(mid);
+// === editing ===============================================================
+void CustomTextView::edit_insert(TextOffset pos, const char* data, TextOffset len) {
+    if (m_history) {
+        m_history->insert(pos, data, len);
+    } else {
+        m_tree->insert(pos, data, len);
+    }
+    m_signal_edited.emit();
+}
 
-        if (midOffset <= targetOffset) {
-            result = mid; // запоминаем как кандидата
-            low = mid + 1;
-        } else {
-            high = mid - 1;
-        }
+void CustomTextView::edit_erase(TextOffset pos, TextOffset len) {
+    if (m_history) {
+        m_history->erase(pos, len);
+    } else {
+        m_tree->erase(pos, len);
     }
-    return result;
+    m_signal_edited.emit();
 }
 
-int CustomTextView::get_cursor_line_index() const {
-    return find_line_index_by_byte_offset(m_cursor_byte_offset);
+void CustomTextView::perform_undo_redo(bool undo) {
+    try {
+        TextOffset cursor = undo ? m_history->undo() : m_history->redo();
+        if (cursor < 0) return; // откатывать/повторять нечего
+        m_signal_edited.emit();
+        clear_selection();
+        reload_from_tree();
+        set_cursor_byte_offset(cursor);
+        scroll_to_byte_offset(cursor);
+    } catch (const std::exception& e) {
+        std::cerr << (undo ? "Undo" : "Redo") << " error: " << e.what() << '\n';
+        reload_from_tree();
+    }
 }
 
 // === controllers handlers ================================================
-bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::ModifierType /*state*/) {
+bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::ModifierType state) {
+    m_signal_input.emit();
     if (!m_tree) return false;
 
+    // 0. Отмена / повтор
+    const bool ctrl = (state & Gdk::ModifierType::CONTROL_MASK) == Gdk::ModifierType::CONTROL_MASK;
+    if (ctrl && m_history) {
+        if (keyval == GDK_KEY_z) {
+            perform_undo_redo(true);
+            return true;
+        }
+        if (keyval == GDK_KEY_Z || keyval == GDK_KEY_y || keyval == GDK_KEY_Y) {
+            perform_undo_redo(false);
+            return true;
+        }
+    }
+
     // Вспомогательная лямбда для удаления диапазона и обновления UI
-    auto perform_erase = [&](int start, int len) {
+    auto perform_erase = [&](TextOffset start, TextOffset len) {
         try {
-            m_tree->erase(start, len);
+            edit_erase(start, len);
             // Инвалидация кэша и обновление UI
             clear_selection();
             reload_from_tree(); // Теперь это быстрая операция
@@ -143,30 +169,11 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
             return true;
         }
 
-        // Удаление символа слева
+        // Удаление символа слева (в начале строки это '\n' предыдущей строки).
+        // Границы символа — по счётчикам символов в дереве, строка целиком не читается.
         if (m_cursor_byte_offset > 0) {
-            // Находим строку, в которой курсор
-            int lineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
-            int lineStart = m_tree->getOffsetForLine(lineIdx);
-            int localOffset = m_cursor_byte_offset - lineStart;
-
-            int lenToDelete = 1; // По умолчанию (например, удаляем \n на границе)
-
-            if (localOffset > 0) {
-                // Мы внутри строки, нужно определить длину UTF-8 символа перед курсором
-                char* rawLine = m_tree->getLine(lineIdx);
-                if (rawLine) {
-                    std::unique_ptr<char[]> guard(rawLine);
-                    const char* curPtr = rawLine + localOffset;
-                    const char* prevPtr = g_utf8_prev_char(curPtr);
-                    lenToDelete = static_cast<int>(curPtr - prevPtr);
-                }
-            } else {
-                // Мы в начале строки, удаляем символ перед нами (это \n предыдущей строки)
-                // Оставляем lenToDelete = 1
-            }
-            
-            perform_erase(m_cursor_byte_offset - lenToDelete, lenToDelete);
+            TextOffset prev = m_tree->getByteOffsetForChar(m_tree->getCharOffset(m_cursor_byte_offset) - 1);
+            perform_erase(prev, m_cursor_byte_offset - prev);
         }
         return true;
     } 
@@ -178,30 +185,11 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
             return true;
         }
 
-        int maxLen = m_tree->getRoot() ? m_tree->getRoot()->getLength() : 0;
+        TextOffset maxLen = m_tree->getLength();
         if (m_cursor_byte_offset < maxLen) {
-            int lineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
-            int lineStart = m_tree->getOffsetForLine(lineIdx);
-            int localOffset = m_cursor_byte_offset - lineStart;
-
-            int lenToDelete = 1;
-
-            // Получаем строку, чтобы узнать длину следующего символа
-            char* rawLine = m_tree->getLine(lineIdx);
-            if (rawLine) {
-                std::unique_ptr<char[]> guard(rawLine);
-                size_t lineLen = std::strlen(rawLine);
-                
-                // Если курсор не в самом конце строки (не перед \n или концом файла)
-                if (localOffset < (int)lineLen) {
-                    const char* curPtr = rawLine + localOffset;
-                    const char* nextPtr = g_utf8_next_char(curPtr);
-                    lenToDelete = static_cast<int>(nextPtr - curPtr);
-                }
-                // Иначе удаляем 1 байт (это \n)
-            }
-            
-            perform_erase(m_cursor_byte_offset, lenToDelete);
+            // Символ справа (перед концом строки — её '\n')
+            TextOffset next = m_tree->getByteOffsetForChar(m_tree->getCharOffset(m_cursor_byte_offset) + 1);
+            perform_erase(m_cursor_byte_offset, next - m_cursor_byte_offset);
         }
         return true;
     } 
@@ -209,47 +197,19 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
     // 3. Стрелка ВЛЕВО
     else if (keyval == GDK_KEY_Left) {
         if (m_cursor_byte_offset > 0) {
-            int lineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
-            int lineStart = m_tree->getOffsetForLine(lineIdx);
-            int localOffset = m_cursor_byte_offset - lineStart;
-            
-            int step = 1;
-            if (localOffset > 0) {
-                char* rawLine = m_tree->getLine(lineIdx);
-                if (rawLine) {
-                    std::unique_ptr<char[]> guard(rawLine);
-                    const char* curPtr = rawLine + localOffset;
-                    const char* prevPtr = g_utf8_prev_char(curPtr);
-                    step = static_cast<int>(curPtr - prevPtr);
-                }
-            }
-            set_cursor_byte_offset(m_cursor_byte_offset - step);
+            set_cursor_byte_offset(m_tree->getByteOffsetForChar(m_tree->getCharOffset(m_cursor_byte_offset) - 1));
         }
+        if (m_history) m_history->breakCoalescing(); // набор после перемещения — новая запись
         clear_selection();
         return true;
     } 
     
     // 4. Стрелка ВПРАВО
     else if (keyval == GDK_KEY_Right) {
-        int maxLen = m_tree->getRoot() ? m_tree->getRoot()->getLength() : 0;
-        if (m_cursor_byte_offset < maxLen) {
-            int lineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
-            int lineStart = m_tree->getOffsetForLine(lineIdx);
-            int localOffset = m_cursor_byte_offset - lineStart;
-            
-            int step = 1;
-            char* rawLine = m_tree->getLine(lineIdx);
-            if (rawLine) {
-                std::unique_ptr<char[]> guard(rawLine);
-                size_t lineLen = std::strlen(rawLine);
-                if (localOffset < (int)lineLen) {
-                    const char* curPtr = rawLine + localOffset;
-                    const char* nextPtr = g_utf8_next_char(curPtr);
-                    step = static_cast<int>(nextPtr - curPtr);
-                }
-            }
-            set_cursor_byte_offset(m_cursor_byte_offset + step);
+        if (m_cursor_byte_offset < m_tree->getLength()) {
+            set_cursor_byte_offset(m_tree->getByteOffsetForChar(m_tree->getCharOffset(m_cursor_byte_offset) + 1));
         }
+        if (m_history) m_history->breakCoalescing();
         clear_selection();
         return true;
     } 
@@ -258,7 +218,7 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
     else if (keyval == GDK_KEY_Return || keyval == GDK_KEY_KP_Enter) {
         char ch = '\n';
         try {
-            m_tree->insert(m_cursor_byte_offset, &ch, 1);
+            edit_insert(m_cursor_byte_offset, &ch, 1);
         } catch (const std::exception& e) {
             std::cerr << "Tree::insert error: " << e.what() << '\n';
         }
@@ -276,13 +236,13 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
         
         // Если текст выделен - заменяем его
         if (m_sel_start >= 0 && m_sel_len > 0) {
-            try { m_tree->erase(m_sel_start, m_sel_len); } catch(...) {}
+            try { edit_erase(m_sel_start, m_sel_len); } catch(...) {}
             m_cursor_byte_offset = m_sel_start;
             clear_selection();
         }
         
         try {
-            m_tree->insert(m_cursor_byte_offset, buf, bytes);
+            edit_insert(m_cursor_byte_offset, buf, bytes);
         } catch (const std::exception& e) {
             std::cerr << "Tree::insert error: " << e.what() << '\n';
         }
@@ -297,6 +257,7 @@ bool CustomTextView::on_key_pressed(guint keyval, guint /*keycode*/, Gdk::Modifi
 
 
 void CustomTextView::on_gesture_released(int /*n_press*/, double /*x*/, double /*y*/) {
+    m_signal_input.emit();
     // Завершаем drag-selection
     if (!m_mouse_selecting) return;
     m_mouse_selecting = false;
@@ -312,12 +273,14 @@ void CustomTextView::on_gesture_released(int /*n_press*/, double /*x*/, double /
 
 
 void CustomTextView::on_gesture_pressed(int /*n_press*/, double x, double y) {
+    m_signal_input.emit();
     if (!m_tree) return;
     
+    if (m_history) m_history->breakCoalescing();
     clear_selection();
     grab_focus();
     
-    int newOffset = get_byte_offset_at_xy(x, y);
+    TextOffset newOffset = get_byte_offset_at_xy(x, y);
 
     m_mouse_selecting = true;
     m_sel_anchor = newOffset;
@@ -327,19 +290,20 @@ void CustomTextView::on_gesture_pressed(int /*n_press*/, double x, double y) {
 }
 
 void CustomTextView::on_motion(double x, double y) {
+    m_signal_input.emit();
     // если не в режиме выделения — ничего не делаем
     if (!m_mouse_selecting) return;
     if (!m_tree) return;
 
-    int currentOffset = get_byte_offset_at_xy(x, y);
+    TextOffset currentOffset = get_byte_offset_at_xy(x, y);
 
     // Обновляем выделение между якорем и текущей позицией
     if (m_sel_anchor < 0) {
         m_sel_anchor = currentOffset;
     }
     
-    int selBeg = std::min(m_sel_anchor, currentOffset);
-    int selEnd = std::max(m_sel_anchor, currentOffset);
+    TextOffset selBeg = std::min(m_sel_anchor, currentOffset);
+    TextOffset selEnd = std::max(m_sel_anchor, currentOffset);
     
     select_range_bytes(selBeg, selEnd - selBeg);
 
@@ -349,6 +313,7 @@ void CustomTextView::on_motion(double x, double y) {
 
 
 bool CustomTextView::on_scroll(double /*dx*/, double /*dy*/) {
+    m_signal_input.emit();
     // not intercepted
     return false;
 }
@@ -363,29 +328,12 @@ void CustomTextView::update_size_request() {
         return;
     }
 
-    int total_lines = m_tree->getTotalLineCount(); 
+    LineIndex total_lines = m_tree->getTotalLineCount(); 
     if (total_lines == 0) total_lines = 1;
     
-    int h = total_lines * m_line_height + (TOP_MARGIN * 2);
-    set_size_request(-1, h);
-}
-
-// Получить кешированую строку
-const std::string& CustomTextView::get_cached_line(int line) {
-    auto it = m_line_cache.find(line);
-    if (it != m_line_cache.end()) return it->second;
-    
-    char* raw = m_tree->getLine(line);
-    if (!raw) {
-        // Возвращаем пустую строку для несуществующих строк
-        static std::string empty;
-        m_line_cache[line] = empty;
-        return m_line_cache[line];
-    }
-    
-    std::unique_ptr<char[]> guard(raw);  // гарантированное освобождение
-    auto result = m_line_cache.emplace(line, std::string(raw));
-    return result.first->second;
+    // Высота виджета в GTK — int: для очень длинных документов упираемся в предел
+    LineIndex h = total_lines * m_line_height + (TOP_MARGIN * 2);
+    set_size_request(-1, static_cast<int>(std::min<LineIndex>(h, INT_MAX)));
 }
 
 // === ОТРИСОВКА  ===
@@ -405,111 +353,107 @@ void CustomTextView::draw_with_cairo(const Cairo::RefPtr<Cairo::Context>& cr, in
         }
         return;
     }
-    double clip_x1, clip_y1, clip_x2, clip_y2;
-    cr->get_clip_extents(clip_x1, clip_y1, clip_x2, clip_y2);
+    // Подготовка для вычисления позиции курсора один раз
+    LineIndex cursorLineIdx = -1;
+    int cursor_cx = -1;
+    double cursor_cy = -1;
+    try {
+        double clip_x1, clip_y1, clip_x2, clip_y2;
+        cr->get_clip_extents(clip_x1, clip_y1, clip_x2, clip_y2);
 
-    int total_lines = m_tree->getTotalLineCount();
-    int first_line = static_cast<int>((clip_y1 - TOP_MARGIN) / m_line_height);
+        LineIndex total_lines = m_tree->getTotalLineCount();
+        auto first_line = static_cast<LineIndex>((clip_y1 - TOP_MARGIN) / m_line_height);
 
-    int last_line = static_cast<int>((clip_y2 - TOP_MARGIN) / m_line_height) + 1;
-    first_line = std::clamp(first_line, 0, std::max(0, total_lines - 1));
-    last_line = std::clamp(last_line, 0, total_lines);
-    if (last_line <= first_line) last_line = first_line + 1;
+        auto last_line = static_cast<LineIndex>((clip_y2 - TOP_MARGIN) / m_line_height) + 1;
+        first_line = std::clamp<LineIndex>(first_line, 0, std::max<LineIndex>(0, total_lines - 1));
+        last_line = std::clamp<LineIndex>(last_line, 0, total_lines);
+        if (last_line <= first_line) last_line = first_line + 1;
 
-    Gdk::RGBA text_color("white");
-    Gdk::RGBA sel_bg(0.2, 0.4, 0.8, 0.6);
+        Gdk::RGBA text_color("white");
+        Gdk::RGBA sel_bg(0.2, 0.4, 0.8, 0.6);
 
-    // Подготовка для вычисления позиции курсора один раз
-    int cursorLineIdx = -1;
-    int cursor_cx = -1;
-    int cursor_cy = -1;
-    if (m_show_caret && m_cursor_byte_offset >= 0) {
-        cursorLineIdx = find_line_index_by_byte_offset(m_cursor_byte_offset);
-    }
-    
-    // ОПТИМИЗАЦИЯ: Вычисляем offset только для первой видимой строки (O(log M))
-    // Затем кумулятивно прибавляем длины строк + 1 байт за \n (для не-последних строк)
-    int current_offset = (first_line > 0) ? m_tree->getOffsetForLine(first_line) : 0;  // Для line 0 offset всегда 0
-    
-    // Цикл ТОЛЬКО по видимым строкам
-    for (int i = first_line; i < last_line; ++i) {
-        const std::string& fullLine = get_cached_line(i);
-        int lineLen = static_cast<int>(fullLine.size());  // Длина в байтах, БЕЗ trailing '\n'
-        
-        // Используем current_offset как lineStartOffset (глобальный байтовый offset начала строки)
-        int lineStartOffset = current_offset;
-        int lineEndOffset = lineStartOffset + lineLen;  // Конец строки, позиция ПЕРЕД '\n' (или конец файла)
-        
-        // Готовим текст для отрисовки: копируем fullLine и убираем trailing '\n' (если есть, хотя по логике не должно быть)
-        std::string line_text = fullLine;
-        if (!line_text.empty() && line_text.back() == '\n') {
-            line_text.pop_back();  // Теперь line_text — видимый текст БЕЗ '\n' (сохранена оригинальная логика)
+        if (m_show_caret && m_cursor_byte_offset >= 0) {
+            cursorLineIdx = m_tree->getLineForOffset(m_cursor_byte_offset);
         }
-        int display_len = static_cast<int>(line_text.length());  // Длина видимого текста
+    
+        // ОПТИМИЗАЦИЯ: один спуск от корня к первой видимой строке (O(log M)),
+        // дальше итератор читает строки подряд по листьям
+        auto lines = m_tree->linesAt(first_line);
+
+        // Цикл ТОЛЬКО по видимым строкам
+        for (; lines.valid() && lines.line() < last_line; lines.next()) {
+            LineIndex i = lines.line();
+            std::string_view line_text = lines.text(); // видимый текст БЕЗ '\n'
+            auto lineLen = static_cast<TextOffset>(line_text.size());
+
+            TextOffset lineStartOffset = lines.offset(); // глобальный байтовый offset начала строки
+            TextOffset lineEndOffset = lineStartOffset + lineLen;  // Конец строки, позиция ПЕРЕД '\n' (или конец файла)
+            int display_len = static_cast<int>(line_text.length());  // Длина видимого текста
         
-        // Y-позиция строки 
-        int y_pos = TOP_MARGIN + i * m_line_height;
+            // Y-позиция строки 
+            double y_pos = TOP_MARGIN + static_cast<double>(i) * m_line_height;
         
-        try {
-            // Устанавливаем текст в layout ОДИН РАЗ на строку (только видимый текст)
-            m_layout->set_text(Glib::ustring(line_text));
+            try {
+                // Устанавливаем текст в layout ОДИН РАЗ на строку (только видимый текст)
+                m_layout->set_text(Glib::ustring(line_text.begin(), line_text.end()));
             
-            // Отрисовка выделения (Selection) — логика сохранена: пересечение с глобальными offsets (до '\n')
-            if (m_sel_len > 0) {
-                int sel_start_global = m_sel_start;
-                int sel_end_global = m_sel_start + m_sel_len;
-                // Проверяем пересечение выделения с текущей строкой (до позиции '\n')
-                if (sel_start_global < lineEndOffset && sel_end_global > lineStartOffset) {
-                    // Локальные границы выделения: относительно начала, clamped к видимому тексту
-                    int local_start = std::max(sel_start_global, lineStartOffset) - lineStartOffset;
-                    int local_end = std::min(sel_end_global, lineEndOffset) - lineStartOffset;
-                    local_start = std::clamp(local_start, 0, display_len);
-                    local_end = std::clamp(local_end, 0, display_len);
-                    if (local_start < local_end) {
-                        Pango::Rectangle rect_start, rect_end;
-                        m_layout->get_cursor_pos(local_start, rect_start, rect_start);
-                        m_layout->get_cursor_pos(local_end, rect_end, rect_end);
-                        int x1 = LEFT_MARGIN + rect_start.get_x() / PANGO_SCALE;
-                        int x2 = LEFT_MARGIN + rect_end.get_x() / PANGO_SCALE;
-                        cr->set_source_rgba(sel_bg.get_red(), sel_bg.get_green(), sel_bg.get_blue(), sel_bg.get_alpha());
-                        cr->rectangle(x1, y_pos, x2 - x1, m_line_height);
-                        cr->fill();
+                // Отрисовка выделения (Selection) — логика сохранена: пересечение с глобальными offsets (до '\n')
+                if (m_sel_len > 0) {
+                    TextOffset sel_start_global = m_sel_start;
+                    TextOffset sel_end_global = m_sel_start + m_sel_len;
+                    // Проверяем пересечение выделения с текущей строкой (до позиции '\n')
+                    if (sel_start_global < lineEndOffset && sel_end_global > lineStartOffset) {
+                        // Локальные границы выделения: относительно начала, clamped к видимому тексту
+                        TextOffset sel_from = std::max(sel_start_global, lineStartOffset) - lineStartOffset;
+                        TextOffset sel_to = std::min(sel_end_global, lineEndOffset) - lineStartOffset;
+                        auto local_start = static_cast<int>(std::clamp<TextOffset>(sel_from, 0, display_len));
+                        auto local_end = static_cast<int>(std::clamp<TextOffset>(sel_to, 0, display_len));
+                        if (local_start < local_end) {
+                            Pango::Rectangle rect_start, rect_end;
+                            m_layout->get_cursor_pos(local_start, rect_start, rect_start);
+                            m_layout->get_cursor_pos(local_end, rect_end, rect_end);
+                            int x1 = LEFT_MARGIN + rect_start.get_x() / PANGO_SCALE;
+                            int x2 = LEFT_MARGIN + rect_end.get_x() / PANGO_SCALE;
+                            cr->set_source_rgba(sel_bg.get_red(), sel_bg.get_green(), sel_bg.get_blue(), sel_bg.get_alpha());
+                            cr->rectangle(x1, y_pos, x2 - x1, m_line_height);
+                            cr->fill();
+                        }
                     }
                 }
-            }
             
-            // Отрисовка текста (видимого, без '\n')
-            cr->move_to(LEFT_MARGIN, y_pos);
-            cr->set_source_rgb(text_color.get_red(), text_color.get_green(), text_color.get_blue());
-            pango_cairo_show_layout(cr->cobj(), m_layout->gobj());
+                // Отрисовка текста (видимого, без '\n')
+                cr->move_to(LEFT_MARGIN, y_pos);
+                cr->set_source_rgb(text_color.get_red(), text_color.get_green(), text_color.get_blue());
+                pango_cairo_show_layout(cr->cobj(), m_layout->gobj());
             
-            // Вычисление позиции курсора, если он на этой строке — логика сохранена
-            if (cursorLineIdx == i) {
-                int offsetInLine_bytes = m_cursor_byte_offset - lineStartOffset;  // Относительно начала строки (до '\n')
-                // Clamp к видимому: если курсор на '\n' (offsetInLine == lineLen), станет display_len (конец строки)
-                int cursor_index_for_pango = std::clamp(offsetInLine_bytes, 0, display_len);
-                try {
-                    Pango::Rectangle pos;
-                    m_layout->get_cursor_pos(cursor_index_for_pango, pos, pos);
-                    cursor_cx = LEFT_MARGIN + pos.get_x() / PANGO_SCALE;
-                    cursor_cy = y_pos;
-                } catch (const Glib::Error& ex) {
-                    std::cerr << "Invalid UTF-8 for cursor on line " << cursorLineIdx << ": " << ex.what() << std::endl;
-                    cursor_cx = -1;
+                // Вычисление позиции курсора, если он на этой строке — логика сохранена
+                if (cursorLineIdx == i) {
+                    TextOffset offsetInLine_bytes = m_cursor_byte_offset - lineStartOffset;  // Относительно начала строки (до '\n')
+                    // Clamp к видимому: если курсор на '\n' (offsetInLine == lineLen), станет display_len (конец строки)
+                    auto cursor_index_for_pango = static_cast<int>(std::clamp<TextOffset>(offsetInLine_bytes, 0, display_len));
+                    try {
+                        Pango::Rectangle pos;
+                        m_layout->get_cursor_pos(cursor_index_for_pango, pos, pos);
+                        cursor_cx = LEFT_MARGIN + pos.get_x() / PANGO_SCALE;
+                        cursor_cy = y_pos;
+                    } catch (const Glib::Error& ex) {
+                        std::cerr << "Invalid UTF-8 for cursor on line " << cursorLineIdx << ": " << ex.what() << std::endl;
+                        cursor_cx = -1;
+                    }
                 }
+            } catch (const Glib::Error& ex) {
+                std::cerr << "Invalid UTF-8 in line " << i << ": " << ex.what() << std::endl;
+                cr->set_source_rgb(1, 0, 0);
+                cr->rectangle(LEFT_MARGIN, y_pos, width - LEFT_MARGIN, m_line_height);
+                cr->stroke();
             }
-        } catch (const Glib::Error& ex) {
-            std::cerr << "Invalid UTF-8 in line " << i << ": " << ex.what() << std::endl;
-            cr->set_source_rgb(1, 0, 0);
-            cr->rectangle(LEFT_MARGIN, y_pos, width - LEFT_MARGIN, m_line_height);
-            cr->stroke();
-        }
-        
-        // offset для следующей строки: прибавляем длину + 1 байт за '\n' (только если это не последняя строка в документе)
-        current_offset += lineLen;
-        if (i < total_lines - 1) {
-            current_offset += 1;  // Учёт байта '\n' после строки
         }
+    } catch (const std::exception& ex) {
+        // Отображённый файл изменили на диске, а текст ещё не скопирован к себе
+        // (EditorWindow::on_check_mapped_file): счётчики строк не сходятся с байтами. Кадр
+        // остаётся недорисованным — после копирования текста он перерисуется.
+        std::cerr << "Cannot draw text: " << ex.what() << std::endl;
+        cursor_cx = -1;
     }
     
     // Отрисовка курсора 
@@ -520,46 +464,44 @@ void CustomTextView::draw_with_cairo(const Cairo::RefPtr<Cairo::Context>& cr, in
     }
 }
 
-int CustomTextView::get_byte_offset_at_xy(double x, double y) {
+TextOffset CustomTextView::get_byte_offset_at_xy(double x, double y) {
     if (!m_tree || m_tree->isEmpty()) return 0;
    
-    int lineIdx = static_cast<int>((y - TOP_MARGIN) / m_line_height);
-    int total = m_tree->getTotalLineCount();
+    auto lineIdx = static_cast<LineIndex>((y - TOP_MARGIN) / m_line_height);
+    LineIndex total = m_tree->getTotalLineCount();
     if (lineIdx < 0) lineIdx = 0;
     if (lineIdx >= total) lineIdx = total - 1;
    
-    int lineStartOffset = m_tree->getOffsetForLine(lineIdx);
-   
-    char* rawLine = m_tree->getLine(lineIdx);
-    if (!rawLine) return lineStartOffset;
-   
-    std::unique_ptr<char[]> guard(rawLine);
-    std::string lineStr(rawLine);
-    if (!lineStr.empty() && lineStr.back() == '\n') lineStr.pop_back();
+    // Строка читается прямо из листьев, как в draw_with_cairo: один спуск от корня, без копии
+    // строки в куче (буфер итератора нужен, только если строка пересекает границу листьев)
+    auto line = m_tree->linesAt(lineIdx);
+    if (!line.valid()) return m_tree->getLength();
+    TextOffset lineStartOffset = line.offset();
+    std::string_view lineText = line.text(); // без '\n'
 
     // --- ОПТИМИЗАЦИЯ: Переиспользуем m_layout вместо создания нового ---
     // Это намного быстрее, так как создание Pango::Layout - дорогая операция.
-    m_layout->set_text(lineStr);
+    m_layout->set_text(Glib::ustring(lineText.begin(), lineText.end()));
    
     int index = 0, trailing = 0;
     int clickX = static_cast<int>(x) - LEFT_MARGIN;
     m_layout->xy_to_index(clickX * PANGO_SCALE, 0, index, trailing);
    
-    const char* ptr = lineStr.c_str() + index;
-    if (trailing > 0) {
+    const char* ptr = lineText.data() + index;
+    if (trailing > 0 && index < static_cast<int>(lineText.size())) {
         ptr = g_utf8_next_char(ptr);
     }
    
-    int offsetInLine = static_cast<int>(ptr - lineStr.c_str());
+    TextOffset offsetInLine = ptr - lineText.data();
     return lineStartOffset + offsetInLine;
 }
 
 // === selection / misc =====================================================
-void CustomTextView::select_range_bytes(int startByte, int lengthBytes) {
+void CustomTextView::select_range_bytes(TextOffset startByte, TextOffset lengthBytes) {
     if (!m_tree) return;
 
     // 1. Получаем реальную длину текста из дерева (O(1) или O(logN))
-    int maxLen = 0;
+    TextOffset maxLen = 0;
     if (m_tree->getRoot()) {
         maxLen = m_tree->getRoot()->getLength();
     }
@@ -575,8 +517,8 @@ void CustomTextView::select_range_bytes(int startByte, int lengthBytes) {
         return;
     }
 
-    int endByte = startByte + lengthBytes;
-    if (endByte > maxLen) endByte = maxLen;
+    // Сравнение через вычитание: startByte + lengthBytes может переполниться
+    TextOffset endByte = (lengthBytes > maxLen - startByte) ? maxLen : startByte + lengthBytes;
 
     // 3. Установка выделения
     // Мы доверяем источнику вызова (мышь/клавиатура), что байты попадают на границы символов.
@@ -600,20 +542,19 @@ void CustomTextView::clear_selection() {
     queue_draw();
 }
 
-void CustomTextView::scroll_to_byte_offset(int byteOffset) {
+void CustomTextView::scroll_to_byte_offset(TextOffset byteOffset) {
     if (!m_tree) return;
 
     // 1. Ограничиваем offset
-    int maxLen = m_tree->getRoot() ? m_tree->getRoot()->getLength() : 0;
+    TextOffset maxLen = m_tree->getRoot() ? m_tree->getRoot()->getLength() : 0;
     if (byteOffset < 0) byteOffset = 0;
     if (byteOffset > maxLen) byteOffset = maxLen;
 
-    // 2. Находим индекс строки через Дерево (Virtual List logic)
-    // Используем тот же алгоритм, что и в get_cursor_line_index
-    int lineIndex = find_line_index_by_byte_offset(byteOffset);
+    // 2. Находим индекс строки через Дерево (Virtual List logic): один спуск по счётчикам строк
+    LineIndex lineIndex = m_tree->getLineForOffset(byteOffset);
 
-    // 3. Вычисляем целевую Y координату
-    int y = lineIndex * m_line_height; // Используем TOP_MARGIN если нужно точное позиционирование: + TOP_MARGIN
+    // 3. Вычисляем целевую Y координату (в double: номер строки 64-битный)
+    double y = static_cast<double>(lineIndex) * m_line_height; // Используем TOP_MARGIN если нужно точное позиционирование: + TOP_MARGIN
 
     // 4. Стандартная логика GTK для поиска ScrolledWindow и прокрутки
     Gtk::Widget* w = this;
@@ -639,7 +580,7 @@ void CustomTextView::scroll_to_byte_offset(int byteOffset) {
             // Учитываем размер страницы, чтобы не скроллить, если курсор уже виден
             double page_size = vadj->get_page_size();
             double current_val = vadj->get_value();
-            double target_y = static_cast<double>(y);
+            double target_y = y;
             
             // Если курсор выше видимой области -> скроллим вверх
             if (target_y < current_val) {
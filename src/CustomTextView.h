@@ -3,6 +3,7 @@
 
 #include <gtkmm.h>
 #include "Tree.h"
+#include "EditHistory.h"
 
 class CustomTextView : public Gtk::DrawingArea {
 public:
@@ -10,21 +11,29 @@ public:
     ~CustomTextView() override;
 
     void set_tree(Tree* tree);
+    // Журнал отмены: если задан, правки с клавиатуры идут через него (Ctrl+Z / Ctrl+Shift+Z, Ctrl+Y)
+    void set_history(EditHistory* history) { m_history = history; }
     void reload_from_tree();
 
-    int get_cursor_byte_offset() const { return m_cursor_byte_offset; }
-    void set_cursor_byte_offset(int offset);
+    TextOffset get_cursor_byte_offset() const { return m_cursor_byte_offset; }
+    void set_cursor_byte_offset(TextOffset offset);
+    // Курсор переставлен (новое байтовое смещение) — для строки состояния
+    sigc::signal<void(TextOffset)>& signal_cursor_moved() { return m_signal_cursor_moved; }
+    // Текст изменён с клавиатуры (вставка, удаление, отмена/повтор)
+    sigc::signal<void()>& signal_edited() { return m_signal_edited; }
+    // Любой ввод в виджет: клавиши, нажатия и движение мыши, прокрутка (в том числе без правок)
+    sigc::signal<void()>& signal_input() { return m_signal_input; }
 
     // helper for EditorWindow scrolling/status
     int get_line_height_for_ui() const { return m_line_height; }
-    int get_cursor_line_index() const;
+    LineIndex get_cursor_line_index() const;
 
     // selection API
-    void select_range_bytes(int startByte, int lengthBytes); // выделить диапазон
+    void select_range_bytes(TextOffset startByte, TextOffset lengthBytes); // выделить диапазон
     void clear_selection();                                   // снять выделение
 
     // helper: прокрутить так, чтобы байтовый оффсет оказался вверху/в центре
-    void scroll_to_byte_offset(int byteOffset);
+    void scroll_to_byte_offset(TextOffset byteOffset);
 
 
 protected:
@@ -48,34 +57,35 @@ private:
 
 
     // Получает текст конкретной строки из дерева и измеряет X
-    int get_byte_offset_at_xy(double x, double y);
+    TextOffset get_byte_offset_at_xy(double x, double y);
     
-    // Вспомогательная функция для бинарного поиска строки по байтовому оффсету
-    // (так как в Tree нет прямого метода getLineByOffset, но есть getOffsetForLine)
-    int find_line_index_by_byte_offset(int byteOffset) const;
-
-    // Получить кешированую строку
-    const std::string& get_cached_line(int line);
+    // Правка текста: через журнал отмены, если он задан, иначе прямо в дерево
+    void edit_insert(TextOffset pos, const char* data, TextOffset len);
+    void edit_erase(TextOffset pos, TextOffset len);
+    // Ctrl+Z / Ctrl+Shift+Z
+    void perform_undo_redo(bool undo);
 private:
     Tree* m_tree{nullptr};
+    EditHistory* m_history{nullptr};
 
     // Pango layout можно переиспользовать между строками
     Glib::RefPtr<Pango::Layout> m_layout;
-    // Кеш видимых строк
-    std::unordered_map<int, std::string> m_line_cache;
 
     Pango::FontDescription m_font_desc;
     int m_line_height{16};
     int m_char_width{8};
 
-    int m_cursor_byte_offset{0};
+    TextOffset m_cursor_byte_offset{0};
+    sigc::signal<void(TextOffset)> m_signal_cursor_moved;
+    sigc::signal<void()> m_signal_edited;
+    sigc::signal<void()> m_signal_input;
     bool m_show_caret{true};
     sigc::connection m_caret_timer;
 
-    int m_sel_start = -1; // -1 => нет выделения
-    int m_sel_len = 0;
+    TextOffset m_sel_start = -1; // -1 => нет выделения
+    TextOffset m_sel_len = 0;
 
     bool m_mouse_selecting = false;   // true когда идёт drag-selection
-    int m_sel_anchor = -1;            // байтовый оффсет начала выделения (якорь)
+    TextOffset m_sel_anchor = -1;     // байтовый оффсет начала выделения (якорь)
 };
 #endif // CUSTOM_TEXT_VIEW_H
@@ -0,0 +1,221 @@
+#include "EditHistory.h"
+#include "NodeReclaimer.h"
+#include <memory>
+#include <new>
+#include <utility>
+
+// ==========================================
+// Реализация EditRecord
+// ==========================================
+
+std::size_t EditRecord::memoryUsage() const {
+    return sizeof(EditRecord) + bytes.capacity() + static_cast<std::size_t>(text.getLength());
+}
+
+// ==========================================
+// Реализация EditHistory
+// ==========================================
+
+EditHistory::EditHistory(Tree& tree, std::size_t memoryLimit) : tree(tree), memoryLimit(memoryLimit) {}
+
+void EditHistory::insert(TextOffset pos, const char* data, TextOffset len) {
+    if (len <= 0) return;
+    // Позицию нормализуем так же, как Tree::insert — запись должна совпасть с правкой
+    TextOffset total = tree.getLength();
+    if (pos < 0) pos = 0;
+    if (pos > total) pos = total;
+
+    tree.insert(pos, data, len); // при исключении журнал не трогаем
+
+    try {
+        bool small = len <= COALESCE_MAX_EDIT;
+        if (small && coalesce(EditKind::EDIT_INSERT, pos, data, static_cast<int>(len))) return;
+
+        EditRecord record{EditKind::EDIT_INSERT, pos, len, std::string(), TreeSnapshot()};
+        if (small) {
+            record.bytes.assign(data, static_cast<std::size_t>(len));
+        } else {
+            // Вставленный текст уже в листьях дерева — снимок диапазона его не копирует
+            record.text = tree.snapshotRange(pos, len);
+        }
+        push(std::move(record));
+    } catch (const std::bad_alloc&) {
+        clear();
+    }
+}
+
+void EditHistory::erase(TextOffset pos, TextOffset len) {
+    TextOffset total = tree.getLength();
+    if (pos < 0) pos = 0;
+    if (pos >= total || len <= 0) return;
+    if (len > total - pos) len = total - pos;
+
+    // Удаляемый текст сохраняем: мелкий — байтами до правки, крупный — вырезанным поддеревом
+    EditRecord record{EditKind::EDIT_ERASE, pos, len, std::string(), TreeSnapshot()};
+    bool small = len <= COALESCE_MAX_EDIT;
+    if (small) {
+        std::unique_ptr<char[]> removed(tree.getTextRange(pos, len));
+        record.bytes.assign(removed.get(), static_cast<std::size_t>(len));
+        tree.erase(pos, len);
+    } else {
+        record.text = tree.cut(pos, len);
+    }
+
+    try {
+        if (small && coalesce(EditKind::EDIT_ERASE, pos, record.bytes.data(), static_cast<int>(len))) return;
+        push(std::move(record));
+    } catch (const std::bad_alloc&) {
+        clear();
+    }
+}
+
+bool EditHistory::coalesce(EditKind kind, TextOffset pos, const char* data, int len) {
+    if (undoStack.empty()) return false;
+    EditRecord& last = undoStack.back();
+    if (!last.open || last.kind != kind || !last.text.isEmpty() || last.len + len > COALESCE_MAX_RECORD) return false;
+
+    std::size_t before = last.memoryUsage();
+    if (kind == EditKind::EDIT_INSERT) {
+        // Набор: символ встаёт сразу за предыдущим
+        if (pos != last.pos + last.len) return false;
+        last.bytes.append(data, static_cast<std::size_t>(len));
+    } else if (pos == last.pos) {
+        // Delete: удаляемый текст продолжается вправо
+        last.bytes.append(data, static_cast<std::size_t>(len));
+    } else if (pos + len == last.pos) {
+        // Backspace: удаляемый текст растёт влево
+        last.bytes.insert(0, data, static_cast<std::size_t>(len));
+        last.pos = pos;
+    } else {
+        return false;
+    }
+    last.len += len;
+    memoryUsage = memoryUsage - before + last.memoryUsage();
+
+    clearRedo();
+    trim();
+    return true;
+}
+
+void EditHistory::push(EditRecord record) {
+    clearRedo();
+    if (!undoStack.empty()) undoStack.back().open = false;
+    std::size_t usage = record.memoryUsage();
+    undoStack.push_back(std::move(record));
+    memoryUsage += usage;
+    trim();
+}
+
+// Крупный текст забытой записи разрушается в фоне: снимок может держать миллионы узлов
+static void releaseText(EditRecord& record) {
+    if (record.text.isEmpty()) return;
+    try {
+        NodeReclaimer::shared().release(std::move(record.text));
+    } catch (const std::bad_alloc&) {
+        // Очередь не приняла — снимок разрушится вместе с записью
+    }
+}
+
+void EditHistory::trim() {
+    // Последнюю запись не забываем, иначе крупную правку нельзя было бы откатить вовсе
+    while (memoryUsage > memoryLimit && undoStack.size() + redoStack.size() > 1) {
+        if (!undoStack.empty()) {
+            memoryUsage -= undoStack.front().memoryUsage();
+            releaseText(undoStack.front());
+            undoStack.pop_front();
+        } else {
+            // Дальше всех от текущего состояния — дно стека повтора
+            memoryUsage -= redoStack.front().memoryUsage();
+            releaseText(redoStack.front());
+            redoStack.erase(redoStack.begin());
+        }
+    }
+}
+
+void EditHistory::clearRedo() {
+    for (EditRecord& record : redoStack) {
+        memoryUsage -= record.memoryUsage();
+        releaseText(record);
+    }
+    redoStack.clear();
+}
+
+void EditHistory::insertRecordText(const EditRecord& record) {
+    if (record.text.isEmpty()) {
+        tree.insert(record.pos, record.bytes.data(), record.len);
+        return;
+    }
+    // Поддерево снимка вклеивается в дерево целиком — байты не копируются
+    tree.insertSnapshot(record.pos, record.text);
+}
+
+void EditHistory::apply(const EditRecord& record, bool forward) {
+    bool insertText = (record.kind == EditKind::EDIT_INSERT) == forward;
+    if (insertText) {
+        insertRecordText(record);
+    } else {
+        tree.erase(record.pos, record.len);
+    }
+}
+
+TextOffset EditHistory::undo() {
+    if (undoStack.empty()) return -1;
+    redoStack.reserve(redoStack.size() + 1); // после правки дерева перенос записи не бросает
+
+    EditRecord& record = undoStack.back();
+    apply(record, false);
+    TextOffset cursor = record.kind == EditKind::EDIT_INSERT ? record.pos : record.pos + record.len;
+
+    record.open = false;
+    redoStack.push_back(std::move(record));
+    undoStack.pop_back();
+    return cursor;
+}
+
+TextOffset EditHistory::redo() {
+    if (redoStack.empty()) return -1;
+
+    EditRecord& record = redoStack.back();
+    apply(record, true);
+    TextOffset cursor = record.kind == EditKind::EDIT_INSERT ? record.pos + record.len : record.pos;
+
+    try {
+        undoStack.push_back(std::move(record));
+        redoStack.pop_back();
+    } catch (const std::bad_alloc&) {
+        clear(); // дерево уже изменено, а записи некуда деться
+    }
+    return cursor;
+}
+
+void EditHistory::breakCoalescing() {
+    if (!undoStack.empty()) undoStack.back().open = false;
+}
+
+void EditHistory::clear() {
+    for (EditRecord& record : undoStack) releaseText(record);
+    for (EditRecord& record : redoStack) releaseText(record);
+    undoStack.clear();
+    redoStack.clear();
+    memoryUsage = 0;
+}
+
+bool EditHistory::detachMappedFiles() {
+    std::vector<TreeSnapshot*> texts;
+    texts.reserve(undoStack.size() + redoStack.size());
+    for (EditRecord& record : undoStack) {
+        if (!record.text.isEmpty()) texts.push_back(&record.text);
+    }
+    for (EditRecord& record : redoStack) {
+        if (!record.text.isEmpty()) texts.push_back(&record.text);
+    }
+    if (tree.detachMappedFiles(texts.data(), texts.size())) return true;
+    // Файл усечён: текст укоротился, и позиции записей с ним больше не сходятся
+    clear();
+    return false;
+}
+
+void EditHistory::setMemoryLimit(std::size_t bytes) {
+    memoryLimit = bytes;
+    trim();
+}
@@ -0,0 +1,98 @@
+#ifndef EDIT_HISTORY_H
+#define EDIT_HISTORY_H
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+#include "Tree.h"
+
+enum class EditKind : char {
+    EDIT_INSERT = 0,
+    EDIT_ERASE = 1
+};
+
+// Одна запись журнала: что и где было вставлено/удалено.
+// Текст мелкой правки хранится в bytes (к нему дописываются следующие символы),
+// текст крупной — снимком диапазона дерева: удалённые листья не копируются, а остаются жить в снимке.
+struct EditRecord {
+    EditKind kind;
+    TextOffset pos;
+    TextOffset len;
+    std::string bytes;  // текст, если text пуст
+    TreeSnapshot text;  // текст крупной правки (вставка — Tree::snapshotRange, удаление — Tree::cut)
+    bool open = true;   // к записи ещё можно приклеить следующий символ
+
+    std::size_t memoryUsage() const; // память, которую держит запись
+};
+
+// Журнал отмены/повтора правок дерева. Все правки документа идут через insert/erase журнала.
+// Подряд идущие односимвольные правки (набор, Backspace, Delete) склеиваются в одну запись.
+// Память журнала ограничена: при превышении лимита забываются самые старые записи
+// (последняя запись хранится всегда, даже если она одна больше лимита).
+class EditHistory {
+public:
+    static constexpr std::size_t DEFAULT_MEMORY_LIMIT = 64 * 1024 * 1024;
+    // Правка не длиннее этого — "один символ" (кодовая точка UTF-8 — до 4 байт), она склеивается с соседними
+    static constexpr int COALESCE_MAX_EDIT = 4;
+    // Склеенная запись не растёт дальше этого размера
+    static constexpr int COALESCE_MAX_RECORD = 4096;
+
+    explicit EditHistory(Tree& tree, std::size_t memoryLimit = DEFAULT_MEMORY_LIMIT);
+
+    EditHistory(const EditHistory&) = delete;
+    EditHistory& operator=(const EditHistory&) = delete;
+
+    // Правки с записью в журнал (стек повтора сбрасывается).
+    // Если правка не удалась — журнал не меняется. Если правка прошла, а записать её не хватило
+    // памяти — журнал очищается (откатывать дальше нельзя), исключение не бросается.
+    void insert(TextOffset pos, const char* data, TextOffset len); // O(log M + len)
+    void erase(TextOffset pos, TextOffset len); // O(log M)
+
+    bool canUndo() const { return !undoStack.empty(); }
+    bool canRedo() const { return !redoStack.empty(); }
+
+    // Откатить/повторить последнюю запись. Возвращают позицию курсора после правки или -1, если нечего.
+    // Крупный удалённый текст вклеивается в дерево поддеревом снимка — байты не копируются.
+    TextOffset undo(); // O(log M + len)
+    TextOffset redo(); // O(log M + len)
+
+    // Следующая правка начнёт новую запись (курсор переместился)
+    void breakCoalescing();
+
+    // Забыть всю историю (например, загружен другой документ)
+    void clear();
+
+    // Tree::detachMappedFiles для дерева вместе с текстами записей: вырезанные и вставленные
+    // поддеревья тоже могут ссылаться на отображённый файл, а откат не должен читать его после записи.
+    // false — файл был усечён: часть текста потеряна, и журнал забывается (его позиции уже неверны).
+    bool detachMappedFiles(); // O(N + H) - где H - узлы текстов журнала
+
+    void setMemoryLimit(std::size_t bytes); // лишние старые записи забываются сразу
+    std::size_t getMemoryLimit() const { return memoryLimit; }
+    // Память записей: заголовки, bytes и длина текста в снимках (оценка сверху —
+    // листья снимка могут быть ещё общими с деревом)
+    std::size_t getMemoryUsage() const { return memoryUsage; }
+
+    std::size_t getUndoCount() const { return undoStack.size(); }
+    std::size_t getRedoCount() const { return redoStack.size(); }
+
+private:
+    Tree& tree;
+    std::deque<EditRecord> undoStack; // новые записи в конце
+    std::vector<EditRecord> redoStack;
+    std::size_t memoryLimit;
+    std::size_t memoryUsage = 0;
+
+    // Приклеить односимвольную правку к последней записи (true) — дерево уже изменено
+    bool coalesce(EditKind kind, TextOffset pos, const char* data, int len);
+    void push(EditRecord record);
+    void trim(); // забыть старые записи сверх лимита
+    void clearRedo();
+
+    // Применить запись к дереву (redo) или откатить её (undo)
+    void insertRecordText(const EditRecord& record);
+    void apply(const EditRecord& record, bool forward);
+};
+
+#endif // EDIT_HISTORY_H
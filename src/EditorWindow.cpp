@@ -1,10 +1,12 @@
 #include "EditorWindow.h"
 #include "CustomTextView.h"
 #include "BinaryTreeFile.h"
+#include "TreeBuilder.h"
 #include <fstream>
 #include <glib.h>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 
 // Определение вспомогательной функции
@@ -37,6 +39,12 @@ EditorWindow::EditorWindow() {
     m_btn_show_numbers.set_margin_start(6);
     m_btn_show_numbers.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_show_numbers_clicked));
 
+    // статистика дерева по запросу: почему документ занимает столько памяти
+    m_btn_show_stats.set_tooltip_text("Show tree node and memory statistics");
+    m_btn_show_stats.set_margin_start(6);
+    m_btn_show_stats.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_show_stats_clicked));
+
+    m_header_bar.pack_end(m_btn_show_stats);
     m_header_bar.pack_end(m_btn_show_numbers);
     m_header_bar.pack_end(m_search);
 
@@ -111,6 +119,7 @@ EditorWindow::EditorWindow() {
 
     // Привязываем дерево к кастомному виду
     m_custom_view.set_tree(&m_tree);
+    m_custom_view.set_history(&m_history);
 
     // --- Статус бар ---
     auto status_box = Gtk::Box(Gtk::Orientation::HORIZONTAL, 8);
@@ -124,7 +133,11 @@ EditorWindow::EditorWindow() {
     status_box.append(status_icon);
 
     m_status.set_text("Ready");
+    m_status.set_hexpand(true);
+    m_status.set_xalign(0.0f);
     status_box.append(m_status);
+    m_cursor_position.set_text("Ln 1, Col 1");
+    status_box.append(m_cursor_position);
     m_root.append(status_box);
 
     // Signals (НЕ ИЗМЕНЯЛИСЬ)
@@ -133,10 +146,21 @@ EditorWindow::EditorWindow() {
     m_btn_load_txt.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_load_text));
     m_btn_save_txt.signal_clicked().connect(sigc::mem_fun(*this, &EditorWindow::on_save_text));
 
+    m_custom_view.signal_cursor_moved().connect(sigc::mem_fun(*this, &EditorWindow::on_cursor_moved));
+    m_custom_view.signal_edited().connect(sigc::mem_fun(*this, &EditorWindow::on_text_edited));
+    // Уплотнение ждёт паузы любого ввода, а не только правок: прокрутка и выделение мышью
+    // тоже читают дерево на каждом кадре
+    m_custom_view.signal_input().connect(sigc::mem_fun(*this, &EditorWindow::pause_compaction));
+    if (auto vadj = m_scrolled.get_vadjustment()) {
+        vadj->signal_value_changed().connect(sigc::mem_fun(*this, &EditorWindow::pause_compaction)); // полоса прокрутки
+    }
     m_file_entry.signal_changed().connect(sigc::mem_fun(*this, &EditorWindow::on_path_entry_changed));
     on_path_entry_changed(); 
 
     m_file_entry.signal_activate().connect(sigc::mem_fun(*this, &EditorWindow::on_file_entry_activate));
+
+    // Открытый текстовый файл отображён в память — раз в секунду проверяем, не изменили ли его
+    Glib::signal_timeout().connect_seconds(sigc::mem_fun(*this, &EditorWindow::on_check_mapped_file), 1);
     
     set_default_size(950, 700);
 
@@ -146,7 +170,10 @@ EditorWindow::EditorWindow() {
 
 }
 
-EditorWindow::~EditorWindow()=default;
+EditorWindow::~EditorWindow() {
+    m_compact_quiet.disconnect();
+    m_compact_idle.disconnect();
+}
 
 
 void EditorWindow::set_status(const std::string& s) {
@@ -154,6 +181,53 @@ void EditorWindow::set_status(const std::string& s) {
 }
 
 
+void EditorWindow::on_cursor_moved(TextOffset offset) {
+    // Строка и колонка в символах — спуски по счётчикам дерева, текст строки не читается
+    TextLocation loc = m_tree.locate(offset);
+    m_cursor_position.set_text("Ln " + std::to_string(loc.line + 1) + ", Col " + std::to_string(loc.charColumn + 1));
+    pause_compaction();
+}
+
+
+void EditorWindow::on_text_edited() {
+    ++m_edit_ops_count;
+    pause_compaction();
+}
+
+
+// --- Фоновое уплотнение дерева ---
+void EditorWindow::pause_compaction() {
+    // Идущий проход останавливается сразу; продолжит его (с того же места) следующая пауза ввода
+    m_compact_idle.disconnect();
+    m_compact_quiet.disconnect();
+    if (m_edit_ops_count < COMPACT_AFTER_EDITS) return;
+    m_compact_quiet = Glib::signal_timeout().connect(sigc::mem_fun(*this, &EditorWindow::on_compact_quiet), COMPACT_QUIET_MS);
+}
+
+bool EditorWindow::on_compact_quiet() {
+    m_compact_idle = Glib::signal_idle().connect(sigc::mem_fun(*this, &EditorWindow::on_idle_compact));
+    return false; // таймер одноразовый
+}
+
+bool EditorWindow::on_idle_compact() {
+    // Квант не длиннее COMPACT_SLICE_US (шаг — до 64 КБ текста): ввод, у которого приоритет выше
+    // простоя, обрабатывается между квантами, а первая же правка или движение курсора снимает обработчик
+    gint64 deadline = g_get_monotonic_time() + COMPACT_SLICE_US;
+    try {
+        do {
+            if (!m_tree.compactStep()) {
+                m_edit_ops_count = 0; // проход по тексту закончен — ждём новых правок
+                return false;
+            }
+        } while (g_get_monotonic_time() < deadline);
+    } catch (const std::bad_alloc&) {
+        m_edit_ops_count = 0; // текст не тронут; попробуем после следующих правок
+        return false;
+    }
+    return true;
+}
+
+
 void EditorWindow::on_path_entry_changed() {
     auto path = m_file_entry.get_text();
     bool ok = !path.empty();
@@ -174,7 +248,8 @@ void EditorWindow::on_load_binary() {
     try {
         BinaryTreeFile bf;
         if (!bf.openFile(path.c_str())) { set_status("Cannot open binary: " + path); return; }
-        //  Инициализация дерева
+        //  Инициализация дерева (история прежнего документа больше не нужна)
+        m_history.clear();
         m_tree.clear();        
         bf.loadTree(m_tree);
 
@@ -221,36 +296,40 @@ void EditorWindow::on_load_text() {
     }
 
     try {
+        m_syncing = true;
+        m_history.clear();
+
+        // Обычный файл не копируется: листья ссылаются на его отображение в памяти
+        try {
+            m_tree.fromMappedFile(path);
+            m_custom_view.reload_from_tree();
+            m_custom_view.grab_focus();
+            m_syncing = false;
+            set_status("Loaded txt: " + path);
+            return;
+        } catch (const std::runtime_error&) {
+            // pipe, устройство и т.п. — читаем потоком ниже
+        }
+
         std::ifstream in(path, std::ios::binary);
         if (!in) { 
+            m_syncing = false;
             set_status("Err open txt: " + path); 
             return; 
         }
 
-        m_syncing = true;
-        m_tree.clear();         // очищаем дерево перед загрузкой
-
-        const size_t BUF_SIZE = 4096; // 4 КБ буфер
-        char buffer[BUF_SIZE];
-
-        int current_pos = 0; // позиция для вставки в дереве
-        bool first_chunk = true;
-
-        while (in.read(buffer, BUF_SIZE) || in.gcount() > 0) {
+        // Файл читается прямо в листья: построитель режет их по '\n' и собирает дерево снизу вверх
+        // (размер файла заранее не нужен, файл может быть больше 2 ГБ)
+        TreeBuilder builder(m_tree);
+        for (;;) {
+            int available = 0;
+            char* dst = builder.prepare(available);
+            in.read(dst, available);
             std::streamsize read_bytes = in.gcount();
-            std::string chunk(buffer, static_cast<size_t>(read_bytes));
-
-            if (first_chunk) {
-                // первый блок используем fromText
-                m_tree.fromText(chunk.c_str(), static_cast<int>(chunk.size()));
-                first_chunk = false;
-            } else {
-                // последующие блоки вставляем в дерево по текущей позиции
-                m_tree.insert(current_pos, chunk.c_str(), static_cast<int>(chunk.size()));
-            }
-
-            current_pos += static_cast<int>(read_bytes); // обновляем позицию
+            if (read_bytes <= 0) break;
+            builder.commit(static_cast<int>(read_bytes));
         }
+        builder.finish();
 
         m_custom_view.reload_from_tree();
         m_custom_view.grab_focus();
@@ -269,6 +348,12 @@ void EditorWindow::on_save_text() {
     if (path.empty()) { set_status("Provide path..."); return; }
 
     try {
+        // Запись усекает файл — текст, который ещё ссылается на него, сначала копируем к себе
+        if (m_tree.usesMappedFile(path) && !m_history.detachMappedFiles()) {
+            set_status("Source file was truncated on disk, not saved: " + path);
+            return;
+        }
+
         std::ofstream out(path, std::ios::binary);
         if (!out) { set_status("Err write txt: " + path); return; }
 
@@ -279,14 +364,10 @@ void EditorWindow::on_save_text() {
             return;
         }
 
-        int total_len = m_tree.getRoot()->getLength();
-        int chunk_size = 4096; // можно регулировать размер буфера
-
-        for (int offset = 0; offset < total_len; offset += chunk_size) {
-            int len = std::min(chunk_size, total_len - offset);
-            char* buf = m_tree.getTextRange(offset, len);
-            out.write(buf, len);
-            delete[] buf;//NOSONAR  // освобождаем память
+        // Куски пишутся прямо из листьев дерева — без копий и повторных спусков от корня
+        for (auto it = m_tree.chunksAt(0); it.valid(); it.next()) {
+            std::string_view chunk = *it;
+            out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
         }
 
         set_status("Saved txt: " + path);
@@ -299,6 +380,20 @@ void EditorWindow::on_save_text() {
 }
 
 
+bool EditorWindow::on_check_mapped_file() {
+    if (!m_tree.mappedFilesChanged()) return true;
+    try {
+        bool intact = m_history.detachMappedFiles();
+        m_custom_view.reload_from_tree();
+        set_status(intact ? "File changed on disk: text copied into memory"
+                          : "File truncated on disk: part of the text and the undo history are lost");
+    } catch (const std::bad_alloc&) {
+        set_status("Memory allocation failed");
+    }
+    return true; // таймер продолжает работать
+}
+
+
 // --- Поиск и навигация  ---
 void EditorWindow::on_search_activate() {
     auto queryStr = static_cast<std::string>(m_search.get_text());
@@ -323,7 +418,7 @@ void EditorWindow::on_search_activate() {
                 set_status("Line numbers are 1-based (enter >= 1)");
                 return;
             }
-            go_to_line_index(static_cast<int>(val - 1)); // 0-based
+            go_to_line_index(static_cast<LineIndex>(val - 1)); // 0-based
         } catch (const std::invalid_argument&) {
             set_status("Invalid line number format");
         } catch (const std::out_of_range&) {
@@ -337,7 +432,7 @@ void EditorWindow::on_search_activate() {
     auto patternLen = static_cast<int>(queryStr.size());
 
     // Ищем номер строки (0-based), где начинается совпадение
-    int lineNumber = m_tree.findSubstringLine(pattern, patternLen);
+    LineIndex lineNumber = m_tree.findSubstringLine(pattern, patternLen);
     if (lineNumber == -1) {
         set_status("Not found: \"" + queryStr + "\"");
         return;
@@ -360,8 +455,8 @@ void EditorWindow::on_search_activate() {
     }
 
     // Устанавливаем курсор в CustomTextView на позицию начала совпадения
-    int lineStart = m_tree.getOffsetForLine(lineNumber);
-    int bytePos = lineStart + static_cast<int>(localBytePos);
+    TextOffset lineStart = m_tree.getOffsetForLine(lineNumber);
+    TextOffset bytePos = lineStart + static_cast<TextOffset>(localBytePos);
     m_custom_view.set_cursor_byte_offset(bytePos);
     m_custom_view.select_range_bytes(bytePos, patternLen);
     m_custom_view.scroll_to_byte_offset(bytePos);
@@ -369,8 +464,8 @@ void EditorWindow::on_search_activate() {
     
     // Прокрутка: установим вертикальную позицию ScrolledWindow по номеру строки
     if (auto vadj = m_scrolled.get_vadjustment()) {
-        int y = lineNumber * m_custom_view.get_line_height_for_ui();
-        auto maxv = static_cast<int>(vadj->get_upper() - vadj->get_page_size());
+        double y = static_cast<double>(lineNumber) * m_custom_view.get_line_height_for_ui();
+        double maxv = vadj->get_upper() - vadj->get_page_size();
         if (y < 0) y = 0;
         if (y > maxv) y = maxv;
         vadj->set_value(y);
@@ -381,9 +476,9 @@ void EditorWindow::on_search_activate() {
 }
 
 
-void EditorWindow::go_to_line_index(int lineIndex0Based) {
+void EditorWindow::go_to_line_index(LineIndex lineIndex0Based) {
     // Проверяем диапазон на стороне дерева
-    auto total_lines = static_cast<int>(m_tree.getTotalLineCount());
+    LineIndex total_lines = m_tree.getTotalLineCount();
     if (lineIndex0Based < 0 || lineIndex0Based >= total_lines) {
         std::ostringstream oss;
         oss << "Line out of range (1.." << total_lines << ")";
@@ -392,13 +487,13 @@ void EditorWindow::go_to_line_index(int lineIndex0Based) {
     }
 
     // Получаем байтовый оффсет начала строки в дереве и ставим курсор
-    int lineStart = m_tree.getOffsetForLine(lineIndex0Based);
+    TextOffset lineStart = m_tree.getOffsetForLine(lineIndex0Based);
     m_custom_view.set_cursor_byte_offset(lineStart);
 
     // Скроллим ScrolledWindow к нужной строке
     if (auto vadj = m_scrolled.get_vadjustment()) {
-        int y = lineIndex0Based * m_custom_view.get_line_height_for_ui();
-        auto maxv = static_cast<int>(vadj->get_upper() - vadj->get_page_size());
+        double y = static_cast<double>(lineIndex0Based) * m_custom_view.get_line_height_for_ui();
+        double maxv = vadj->get_upper() - vadj->get_page_size();
         if (y < 0) y = 0;
         if (y > maxv) y = maxv;
         vadj->set_value(y);
@@ -428,34 +523,81 @@ void EditorWindow::go_to_line_index(int lineIndex0Based) {
 void EditorWindow::on_show_numbers_clicked() {
     if (!m_tree.getRoot()) { set_status("Tree empty"); return; }
 
-    size_t total_lines = m_tree.getTotalLineCount();
+    LineIndex total_lines = m_tree.getTotalLineCount();
     if (total_lines == 0) {
         set_status("Tree has no lines");
         return;
     }
 
-    // Получаем весь текст один раз (getTextRange на весь диапазон)
-    int total_len = m_tree.getRoot()->getLength();
-    char* all = m_tree.getTextRange(0, total_len); 
-    if (!all) { set_status("Failed to extract text from tree"); return; }
-
+    // Текст читается кусками прямо из листьев: номер ставится перед каждой строкой
     std::ostringstream numbered;
+    LineIndex line = 0;
+    bool at_line_start = true;
+    for (auto it = m_tree.chunksAt(0); it.valid(); it.next()) {
+        std::string_view chunk = *it;
+        while (!chunk.empty()) {
+            if (at_line_start) numbered << ++line << ": ";
+            std::size_t nl = chunk.find('\n');
+            std::size_t take = nl == std::string_view::npos ? chunk.size() : nl + 1;
+            numbered << chunk.substr(0, take);
+            at_line_start = nl != std::string_view::npos;
+            chunk.remove_prefix(take);
+        }
+    }
+    // Пустая последняя строка (текст кончается '\n') тоже получает номер
+    if (line < total_lines) numbered << total_lines << ": ";
+
+    show_text_window("Numbered lines", numbered.str());
+}
 
-    for (size_t i = 0; i < total_lines; ++i) {
-        int start = m_tree.getOffsetForLine(static_cast<int>(i));
-        int end   = (i + 1 < total_lines) ? m_tree.getOffsetForLine(static_cast<int>(i) + 1) : total_len;
-        int len = end - start;
-        // безопасно создаём строку из байт (не предполагаем \0)
-        numbered << (i + 1) << ": " << std::string(all + start, static_cast<size_t>(len));
+
+// Узлы, глубина, заполненность листьев и память дерева — O(M) по узлам, только по кнопке
+void EditorWindow::on_show_stats_clicked() {
+    TreeStats st = m_tree.stats();
+    const TextOffset inMemory = st.payloadBytes - st.mappedBytes;
+    std::ostringstream report;
+    report << std::fixed;
+    report.precision(2);
+    report << "Text: " << st.payloadBytes << " bytes, " << m_tree.getTotalLineCount() << " newlines\n";
+    report << "Nodes: " << st.nodeCount() << " (" << st.leafCount << " leaves, " << st.internalCount << " internal, "
+           << st.sharedCount << " shared with undo/snapshots)\n";
+    report << "Depth: " << m_tree.depth() << " (max " << st.maxDepth << ", avg " << st.averageDepth() << ")\n";
+
+    report << "\nLeaf fill (of " << MAX_LEAF_SIZE << " bytes):\n";
+    for (int i = 0; i < TreeStats::LEAF_FILL_BUCKETS; ++i) {
+        report << "  " << (i * 100 / TreeStats::LEAF_FILL_BUCKETS) << "-" << ((i + 1) * 100 / TreeStats::LEAF_FILL_BUCKETS)
+               << "%: " << st.leafFill[i] << "\n";
+    }
+
+    report << "\nMemory:\n";
+    report << "  text in memory:       " << inMemory << "\n";
+    report << "  text in mapped file:  " << st.mappedBytes << "\n";
+    report << "  leaf buffers:         " << st.leafBufferBytes << " (gaps " << (static_cast<TextOffset>(st.leafBufferBytes) - inMemory) << ")\n";
+    report << "  node headers:         " << st.nodeHeaderBytes << "\n";
+    report << "  line indexes:         " << st.lineIndexBytes << " (" << st.lineIndexCount << " leaves)\n";
+    report << "  allocated by nodes:   " << st.allocatedBytes() << "\n";
+    report << "  reserved by pool:     " << m_tree.getReservedBytes() << "\n";
+    report << "  undo history:         " << m_history.getMemoryUsage() << " (" << m_history.getUndoCount() << " records)\n";
+    report << "  overhead per node:    " << st.overheadPerNode() << " bytes\n";
+    if (inMemory > 0) {
+        report << "  pool / text:          " << static_cast<double>(m_tree.getReservedBytes()) / static_cast<double>(inMemory) << "x\n";
     }
-    delete[] all; //NOSONAR
 
-    // окно
+    long long hits = m_tree.getFingerHitCount();
+    long long misses = m_tree.getFingerMissCount();
+    report << "\nLeaf cache: " << hits << " hits, " << misses << " misses\n";
+    report << "Merged leaves: " << m_tree.getMergedLeavesCount() << "\n";
+
+    show_text_window("Tree statistics", report.str());
+}
+
+
+void EditorWindow::show_text_window(const std::string& title, const std::string& text) {
     auto win = new Gtk::Window(); //NOSONAR
     win->set_default_size(600, 400);
     win->set_modal(true);
     win->set_transient_for(*this);
-    win->set_title("Numbered lines");
+    win->set_title(title);
 
     auto sc = Gtk::make_managed<Gtk::ScrolledWindow>();
     sc->set_policy(Gtk::PolicyType::AUTOMATIC, Gtk::PolicyType::AUTOMATIC);
@@ -467,7 +609,7 @@ void EditorWindow::on_show_numbers_clicked() {
     sc->set_child(*tv);
     win->set_child(*sc);
 
-    tv->get_buffer()->set_text(numbered.str());
+    tv->get_buffer()->set_text(text);
 
     win->signal_hide().connect([win]() { delete win; }); //NOSONAR
     win->present();
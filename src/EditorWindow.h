@@ -4,6 +4,7 @@
 #include <gtkmm.h>
 #include <string>
 #include "Tree.h"
+#include "EditHistory.h"
 #include "CustomTextView.h"
 
 // Вспомогательная функция для подсчета слов, объявленная здесь, 
@@ -25,24 +26,43 @@ protected:
     void on_path_entry_changed();
     void on_textbuffer_changed();
     void on_file_entry_activate();
+    void on_cursor_moved(TextOffset offset); // строка и колонка курсора в строке состояния
+    void on_text_edited(); // считает правки для фонового уплотнения дерева
     
     // Логика файлов/дерева
     void on_load_binary();
     void on_save_binary();
     void on_load_text();
     void on_save_text();
+    // Таймер: отображённый файл изменили снаружи — копируем текст к себе
+    bool on_check_mapped_file();
+
+    // Фоновое уплотнение дерева: после COMPACT_AFTER_EDITS правок и COMPACT_QUIET_MS без ввода
+    // Tree::compactStep() идёт квантами по COMPACT_SLICE_US из обработчика простоя
+    void pause_compaction(); // ввод пришёл — уплотнение ждёт новой паузы
+    bool on_compact_quiet();
+    bool on_idle_compact();
 
     // Поиск и навигация
     void on_search_activate();
     void on_show_numbers_clicked();
-    void go_to_line_index(int lineIndex0Based);
+    void on_show_stats_clicked(); // узлы и память дерева
+    void go_to_line_index(LineIndex lineIndex0Based);
+    // Модальное окно с текстом только для чтения
+    void show_text_window(const std::string& title, const std::string& text);
 
 private:
     // синхронизация с Tree
     Tree m_tree;
+    EditHistory m_history{m_tree}; // журнал отмены правок m_tree
     std::string m_last_text;      // байтовая копия текста (UTF-8 bytes)
     bool m_syncing = false;       // если true — игнорировать изменения буфера (программные обновления)
-    int m_edit_ops_count = 0;     // счетчик операций (для ребаланса)
+    int m_edit_ops_count = 0;     // правок с последнего уплотнения дерева
+    static constexpr int COMPACT_AFTER_EDITS = 1000;
+    static constexpr unsigned COMPACT_QUIET_MS = 500;
+    static constexpr gint64 COMPACT_SLICE_US = 1000;
+    sigc::connection m_compact_quiet; // таймер паузы перед уплотнением
+    sigc::connection m_compact_idle;  // обработчик простоя, идущий по шагам
 
 
     // Элементы пользовательского интерфейса
@@ -55,9 +75,11 @@ private:
     Gtk::Button m_btn_save_txt;
     Gtk::SearchEntry m_search;                 
     Gtk::Button m_btn_show_numbers{"#️Lines"};
+    Gtk::Button m_btn_show_stats{"Stats"};
     Gtk::ScrolledWindow m_scrolled;
     CustomTextView m_custom_view;
     Gtk::Label m_status;
+    Gtk::Label m_cursor_position; // "Ln N, Col M" (колонка — в символах UTF-8)
 };
 
 #endif // EDITORWINDOW_H
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "MappedFile.h"
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::int64_t modificationTimeNs(const struct stat& st) {
+    return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+namespace {
+    // Отображения под защитой от SIGBUS. Обработчик сигнала не может брать мьютекс,
+    // поэтому слоты — атомарные поля массива фиксированного размера.
+    struct GuardSlot {
+        std::atomic<bool> used{false};
+        std::atomic<char*> base{nullptr};
+        std::atomic<std::int64_t> length{0};
+        std::atomic<bool> faulted{false};
+    };
+    constexpr int GUARD_SLOTS = 256;
+    GuardSlot guardSlots[GUARD_SLOTS]; // NOSONAR
+
+    struct sigaction previousBusAction {};
+    long pageSize = 4096;
+    std::once_flag signalsInstalled;
+
+    void onBusError(int sig, siginfo_t* info, void* context) {
+        auto addr = static_cast<char*>(info->si_addr);
+        for (GuardSlot& slot : guardSlots) {
+            char* base = slot.base.load(std::memory_order_acquire);
+            std::int64_t length = slot.length.load(std::memory_order_relaxed);
+            if (!base || addr < base || addr >= base + length) continue;
+            // Файл усекли: страницы с этой и до конца отображения подменяем нулевыми — чтение
+            // продолжается, а changed() сообщит об усечении (байты за концом уже потеряны)
+            char* from = base + (addr - base) / pageSize * pageSize;
+            auto rest = static_cast<std::size_t>(base + length - from);
+            void* zero = ::mmap(from, rest, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            if (zero == MAP_FAILED) break;
+            slot.faulted.store(true, std::memory_order_release);
+            return;
+        }
+        // Не наше отображение — как без обработчика: прежний обработчик или падение на повторе инструкции
+        if ((previousBusAction.sa_flags & SA_SIGINFO) && previousBusAction.sa_sigaction) {
+            previousBusAction.sa_sigaction(sig, info, context);
+            return;
+        }
+        if (!(previousBusAction.sa_flags & SA_SIGINFO) && previousBusAction.sa_handler != SIG_DFL &&
+            previousBusAction.sa_handler != SIG_IGN) {
+            previousBusAction.sa_handler(sig);
+            return;
+        }
+        ::signal(SIGBUS, SIG_DFL);
+    }
+
+    // Отзыв аренды приходит сигналом SIGIO, который по умолчанию завершает процесс;
+    // сам отзыв замечает changed() через F_GETLEASE, так что обработчику делать нечего
+    void onLeaseBreak(int) {}
+
+    void installSignalHandlers() {
+        long page = ::sysconf(_SC_PAGESIZE);
+        if (page > 0) pageSize = page;
+
+        struct sigaction bus {};
+        bus.sa_sigaction = onBusError;
+        bus.sa_flags = SA_SIGINFO;
+        sigemptyset(&bus.sa_mask);
+        ::sigaction(SIGBUS, &bus, &previousBusAction);
+
+        struct sigaction io {};
+        if (::sigaction(SIGIO, nullptr, &io) == 0 && !(io.sa_flags & SA_SIGINFO) && io.sa_handler == SIG_DFL) {
+            io.sa_handler = onLeaseBreak;
+            io.sa_flags = SA_RESTART;
+            sigemptyset(&io.sa_mask);
+            ::sigaction(SIGIO, &io, nullptr);
+        }
+    }
+
+    int acquireGuardSlot(char* base, std::int64_t length) {
+        for (int i = 0; i < GUARD_SLOTS; ++i) {
+            GuardSlot& slot = guardSlots[i];
+            if (slot.used.exchange(true, std::memory_order_acquire)) continue;
+            slot.length.store(length, std::memory_order_relaxed);
+            slot.faulted.store(false, std::memory_order_relaxed);
+            slot.base.store(base, std::memory_order_release);
+            return i;
+        }
+        return -1;
+    }
+
+    void releaseGuardSlot(int i) {
+        guardSlots[i].base.store(nullptr, std::memory_order_release);
+        guardSlots[i].used.store(false, std::memory_order_release);
+    }
+}
+
+MappedFile::MappedFile(const std::string& path) : path(path) {
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+
+    struct stat st {};
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        throw std::runtime_error("Not a regular file: " + path);
+    }
+    length = static_cast<std::int64_t>(st.st_size);
+    device = static_cast<std::uint64_t>(st.st_dev);
+    inode = static_cast<std::uint64_t>(st.st_ino);
+    mtimeNs = modificationTimeNs(st);
+    if (length == 0) return; // пустой файл не отображается
+
+    void* mem = ::mmap(nullptr, static_cast<std::size_t>(length), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem == MAP_FAILED) {
+        int err = errno;
+        ::close(fd);
+        throw std::runtime_error("Cannot map " + path + ": " + std::strerror(err));
+    }
+    base = static_cast<char*>(mem);
+    // При построении дерева файл читается подряд — пусть ядро читает вперёд
+    ::madvise(base, static_cast<std::size_t>(length), MADV_SEQUENTIAL);
+
+    std::call_once(signalsInstalled, installSignalHandlers);
+    guardSlot = acquireGuardSlot(base, length);
+    // Не выйдет, если файл уже открыт кем-то на запись: тогда остаётся только защита от SIGBUS
+    leased = ::fcntl(fd, F_SETLEASE, F_RDLCK) == 0;
+}
+
+MappedFile::~MappedFile() {
+    if (guardSlot >= 0) releaseGuardSlot(guardSlot);
+    if (base) ::munmap(base, static_cast<std::size_t>(length));
+    if (fd >= 0) ::close(fd); // заодно отпускает аренду
+}
+
+bool MappedFile::changed() const {
+    // Запись ждёт отзыва аренды: файл ещё прежний, но вот-вот изменится
+    if (leased && ::fcntl(fd, F_GETLEASE) != F_RDLCK) return true;
+    if (guardSlot >= 0 && guardSlots[guardSlot].faulted.load(std::memory_order_acquire)) return true;
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) return true;
+    return static_cast<std::int64_t>(st.st_size) != length || modificationTimeNs(st) != mtimeNs;
+}
+
+std::int64_t MappedFile::readableSize() const {
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) return 0;
+    return static_cast<std::int64_t>(st.st_size) < length ? static_cast<std::int64_t>(st.st_size) : length;
+}
+
+void MappedFile::releaseLease() {
+    if (!leased) return;
+    ::fcntl(fd, F_SETLEASE, F_UNLCK);
+    leased = false;
+}
+
+bool MappedFile::isSameFile(const std::string& otherPath) const {
+    struct stat st {};
+    if (::stat(otherPath.c_str(), &st) != 0) return false;
+    return static_cast<std::uint64_t>(st.st_dev) == device && static_cast<std::uint64_t>(st.st_ino) == inode;
+}
+
+void MappedFile::releasePages() const {
+    if (!base) return;
+    // Отображение только для чтения и без своих копий страниц: MADV_DONTNEED лишь выбрасывает
+    // их из памяти процесса, следующее чтение снова возьмёт байты из файла
+    ::madvise(base, static_cast<std::size_t>(length), MADV_DONTNEED);
+    ::madvise(base, static_cast<std::size_t>(length), MADV_NORMAL);
+}
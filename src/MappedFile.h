@@ -0,0 +1,62 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstdint>
+#include <string>
+
+// Файл, отображённый в память только для чтения (mmap). Листья дерева ссылаются прямо на его
+// байты (NODE_FLAG_MAPPED, см. Tree::fromMappedFile): открытие не копирует текст, а в памяти
+// процесса остаются только страницы, которые недавно читались (остальные система подгрузит
+// из файла заново).
+//
+// Файл могут изменить другие программы. changed() замечает запись в файл и его усечение
+// по размеру и времени изменения открытого файла. Замена файла (запись в новый файл и rename
+// поверх старого) отображённые байты не трогает: отображён прежний inode.
+//
+// Пока файл отображён, на нём держится аренда чтения (F_SETLEASE): другая программа, открывшая
+// его на запись или усекающая его, ждёт (до /proc/sys/fs/lease-break-time), а changed() сразу
+// сообщает об этом — текст успевают скопировать к себе до правки (Tree::detachMappedFiles).
+// Аренды может не быть (файл уже открыт кем-то на запись, чужой файл, сетевая ФС) — тогда
+// чтение за новым концом усечённого файла не роняет процесс по SIGBUS: обработчик подменяет
+// страницы за концом нулями и помечает файл изменённым.
+class MappedFile {
+public:
+    // Бросает std::runtime_error, если файл нельзя открыть или отобразить (каталог, pipe и т.п.)
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return base; } // nullptr у пустого файла
+    std::int64_t size() const { return length; } // размер на момент открытия
+    const std::string& getPath() const { return path; }
+
+    // Файл изменён после открытия (размер или mtime), его ждёт запись (аренда отзывается)
+    // или чтение попало за конец усечённого файла
+    bool changed() const; // O(1) - fstat
+    // Отпустить аренду: текст уже скопирован, ждущая запись может идти (и запись самого редактора тоже)
+    void releaseLease();
+    bool hasLease() const { return leased; }
+    // Сколько байт отображения ещё можно читать: меньше size(), если файл усекли
+    std::int64_t readableSize() const; // O(1) - fstat
+    // path — этот же файл (тот же inode)
+    bool isSameFile(const std::string& otherPath) const; // O(1) - stat
+
+    // Вернуть системе прочитанные страницы (текст остаётся доступен, страницы подгрузятся снова)
+    void releasePages() const; // O(P) - где P - количество страниц отображения
+
+private:
+    std::string path;
+    int fd = -1;
+    char* base = nullptr;
+    std::int64_t length = 0;
+    bool leased = false;
+    int guardSlot = -1; // слот защиты от SIGBUS (-1 — все слоты заняты)
+    // Состояние файла при открытии
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::int64_t mtimeNs = 0;
+};
+
+#endif // MAPPED_FILE_H
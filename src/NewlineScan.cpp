@@ -0,0 +1,370 @@
+#include "NewlineScan.h"
+#include <atomic>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NEWLINE_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// ==========================================
+// Скалярная реализация (и хвосты векторных)
+// ==========================================
+
+std::size_t countScalar(const char* data, std::size_t n) {
+    std::size_t cnt = 0;
+    for (std::size_t i = 0; i < n; ++i) cnt += data[i] == '\n' ? 1 : 0;
+    return cnt;
+}
+
+std::int64_t findNthScalar(const char* data, std::size_t n, std::size_t k) {
+    const char* end = data + n;
+    for (const char* p = data; p < end; ++p) {
+        p = static_cast<const char*>(std::memchr(p, '\n', static_cast<std::size_t>(end - p)));
+        if (!p) return -1;
+        if (--k == 0) return p - data;
+    }
+    return -1;
+}
+
+std::int64_t findLastScalar(const char* data, std::size_t n) {
+    for (std::size_t i = n; i-- > 0;) {
+        if (data[i] == '\n') return static_cast<std::int64_t>(i);
+    }
+    return -1;
+}
+
+// Байт начинает символ UTF-8: не продолжение многобайтовой последовательности (10xxxxxx)
+inline bool isCharStart(char c) { return (static_cast<unsigned char>(c) & 0xC0) != 0x80; }
+
+std::size_t countCharsScalar(const char* data, std::size_t n) {
+    std::size_t cnt = 0;
+    for (std::size_t i = 0; i < n; ++i) cnt += isCharStart(data[i]) ? 1 : 0;
+    return cnt;
+}
+
+std::int64_t findNthCharScalar(const char* data, std::size_t n, std::size_t k) {
+    for (std::size_t i = 0; i < n; ++i) {
+        if (isCharStart(data[i]) && --k == 0) return static_cast<std::int64_t>(i);
+    }
+    return -1;
+}
+
+#ifdef NEWLINE_SCAN_X86
+
+// Байтовые счётчики совпадений переполнились бы после 255 шагов — раньше сбрасываем их в сумму
+constexpr std::size_t MAX_ACCUMULATED_STEPS = 255;
+
+// ==========================================
+// SSE2: 16 байт за шаг
+// ==========================================
+
+__attribute__((target("sse2")))
+std::size_t countSse2(const char* data, std::size_t n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    std::size_t cnt = 0;
+    std::size_t i = 0;
+    while (n - i >= 16) {
+        std::size_t steps = (n - i) / 16;
+        if (steps > MAX_ACCUMULATED_STEPS) steps = MAX_ACCUMULATED_STEPS;
+        // cmpeq даёт 0xFF (= -1) на совпадении: вычитание прибавляет 1 к счётчику байта
+        __m128i acc = zero;
+        for (std::size_t s = 0; s < steps; ++s, i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        // Суммы байтов по половинам (не больше 255 * 8 — помещаются в 16 бит)
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        cnt += static_cast<std::size_t>(_mm_cvtsi128_si32(sums)) + static_cast<std::size_t>(_mm_extract_epi16(sums, 4));
+    }
+    return cnt + countScalar(data + i, n - i);
+}
+
+__attribute__((target("sse2")))
+std::int64_t findNthSse2(const char* data, std::size_t n, std::size_t k) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    std::size_t i = 0;
+    for (; n - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+        if (!mask) continue;
+        auto found = static_cast<std::size_t>(__builtin_popcount(mask));
+        if (k > found) {
+            k -= found;
+            continue;
+        }
+        while (--k) mask &= mask - 1; // убираем младшие совпадения до k-го
+        return static_cast<std::int64_t>(i) + __builtin_ctz(mask);
+    }
+    std::int64_t tail = findNthScalar(data + i, n - i, k);
+    return tail < 0 ? -1 : static_cast<std::int64_t>(i) + tail;
+}
+
+__attribute__((target("sse2")))
+std::int64_t findLastSse2(const char* data, std::size_t n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    std::size_t i = n;
+    while (i >= 16) {
+        i -= 16;
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+        if (mask) return static_cast<std::int64_t>(i) + 31 - __builtin_clz(mask);
+    }
+    return findLastScalar(data, i);
+}
+
+// Байты-продолжения 0x80..0xBF как знаковые — это [-128, -65]: одно сравнение "меньше -64"
+__attribute__((target("sse2")))
+std::size_t countCharsSse2(const char* data, std::size_t n) {
+    const __m128i bound = _mm_set1_epi8(-64);
+    const __m128i zero = _mm_setzero_si128();
+    std::size_t continuations = 0;
+    std::size_t i = 0;
+    while (n - i >= 16) {
+        std::size_t steps = (n - i) / 16;
+        if (steps > MAX_ACCUMULATED_STEPS) steps = MAX_ACCUMULATED_STEPS;
+        __m128i acc = zero;
+        for (std::size_t s = 0; s < steps; ++s, i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            acc = _mm_sub_epi8(acc, _mm_cmplt_epi8(v, bound));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        continuations += static_cast<std::size_t>(_mm_cvtsi128_si32(sums)) + static_cast<std::size_t>(_mm_extract_epi16(sums, 4));
+    }
+    return i - continuations + countCharsScalar(data + i, n - i);
+}
+
+__attribute__((target("sse2")))
+std::int64_t findNthCharSse2(const char* data, std::size_t n, std::size_t k) {
+    const __m128i bound = _mm_set1_epi8(-64);
+    std::size_t i = 0;
+    for (; n - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        auto mask = static_cast<unsigned>(~_mm_movemask_epi8(_mm_cmplt_epi8(v, bound))) & 0xFFFFu;
+        auto found = static_cast<std::size_t>(__builtin_popcount(mask));
+        if (k > found) {
+            k -= found;
+            continue;
+        }
+        while (--k) mask &= mask - 1;
+        return static_cast<std::int64_t>(i) + __builtin_ctz(mask);
+    }
+    std::int64_t tail = findNthCharScalar(data + i, n - i, k);
+    return tail < 0 ? -1 : static_cast<std::int64_t>(i) + tail;
+}
+
+// ==========================================
+// AVX2: 32 байта за шаг
+// ==========================================
+
+__attribute__((target("avx2")))
+std::size_t countAvx2(const char* data, std::size_t n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    std::size_t cnt = 0;
+    std::size_t i = 0;
+    while (n - i >= 32) {
+        std::size_t steps = (n - i) / 32;
+        if (steps > MAX_ACCUMULATED_STEPS) steps = MAX_ACCUMULATED_STEPS;
+        __m256i acc = zero;
+        for (std::size_t s = 0; s < steps; ++s, i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        alignas(32) std::uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), _mm256_sad_epu8(acc, zero));
+        cnt += static_cast<std::size_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    }
+    return cnt + countScalar(data + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+std::int64_t findNthAvx2(const char* data, std::size_t n, std::size_t k) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    std::size_t i = 0;
+    for (; n - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        auto mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+        if (!mask) continue;
+        auto found = static_cast<std::size_t>(__builtin_popcount(mask));
+        if (k > found) {
+            k -= found;
+            continue;
+        }
+        while (--k) mask &= mask - 1;
+        return static_cast<std::int64_t>(i) + __builtin_ctz(mask);
+    }
+    std::int64_t tail = findNthScalar(data + i, n - i, k);
+    return tail < 0 ? -1 : static_cast<std::int64_t>(i) + tail;
+}
+
+__attribute__((target("avx2")))
+std::int64_t findLastAvx2(const char* data, std::size_t n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    std::size_t i = n;
+    while (i >= 32) {
+        i -= 32;
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        auto mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+        if (mask) return static_cast<std::int64_t>(i) + 31 - __builtin_clz(mask);
+    }
+    return findLastScalar(data, i);
+}
+
+__attribute__((target("avx2")))
+std::size_t countCharsAvx2(const char* data, std::size_t n) {
+    const __m256i bound = _mm256_set1_epi8(-64);
+    const __m256i zero = _mm256_setzero_si256();
+    std::size_t continuations = 0;
+    std::size_t i = 0;
+    while (n - i >= 32) {
+        std::size_t steps = (n - i) / 32;
+        if (steps > MAX_ACCUMULATED_STEPS) steps = MAX_ACCUMULATED_STEPS;
+        __m256i acc = zero;
+        for (std::size_t s = 0; s < steps; ++s, i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpgt_epi8(bound, v));
+        }
+        alignas(32) std::uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), _mm256_sad_epu8(acc, zero));
+        continuations += static_cast<std::size_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    }
+    return i - continuations + countCharsScalar(data + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+std::int64_t findNthCharAvx2(const char* data, std::size_t n, std::size_t k) {
+    const __m256i bound = _mm256_set1_epi8(-64);
+    std::size_t i = 0;
+    for (; n - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        auto mask = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(bound, v)));
+        auto found = static_cast<std::size_t>(__builtin_popcount(mask));
+        if (k > found) {
+            k -= found;
+            continue;
+        }
+        while (--k) mask &= mask - 1;
+        return static_cast<std::int64_t>(i) + __builtin_ctz(mask);
+    }
+    std::int64_t tail = findNthCharScalar(data + i, n - i, k);
+    return tail < 0 ? -1 : static_cast<std::int64_t>(i) + tail;
+}
+
+#endif // NEWLINE_SCAN_X86
+
+// ==========================================
+// Выбор реализации
+// ==========================================
+
+struct KernelTable {
+    NewlineKernel kind;
+    std::size_t (*count)(const char*, std::size_t);
+    std::int64_t (*findNth)(const char*, std::size_t, std::size_t);
+    std::int64_t (*findLast)(const char*, std::size_t);
+    std::size_t (*countChars)(const char*, std::size_t);
+    std::int64_t (*findNthChar)(const char*, std::size_t, std::size_t);
+};
+
+const KernelTable SCALAR_TABLE = {NewlineKernel::NEWLINE_SCALAR, countScalar, findNthScalar, findLastScalar,
+                                  countCharsScalar, findNthCharScalar};
+#ifdef NEWLINE_SCAN_X86
+const KernelTable SSE2_TABLE = {NewlineKernel::NEWLINE_SSE2, countSse2, findNthSse2, findLastSse2,
+                                countCharsSse2, findNthCharSse2};
+const KernelTable AVX2_TABLE = {NewlineKernel::NEWLINE_AVX2, countAvx2, findNthAvx2, findLastAvx2,
+                                countCharsAvx2, findNthCharAvx2};
+#endif
+
+bool cpuSupports(NewlineKernel kernel) {
+#ifdef NEWLINE_SCAN_X86
+    __builtin_cpu_init();
+    switch (kernel) {
+        case NewlineKernel::NEWLINE_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        case NewlineKernel::NEWLINE_SSE2: return __builtin_cpu_supports("sse2");
+        default: return true;
+    }
+#else
+    return kernel == NewlineKernel::NEWLINE_SCALAR;
+#endif
+}
+
+const KernelTable* tableFor(NewlineKernel kernel) {
+#ifdef NEWLINE_SCAN_X86
+    if (kernel == NewlineKernel::NEWLINE_AVX2) return &AVX2_TABLE;
+    if (kernel == NewlineKernel::NEWLINE_SSE2) return &SSE2_TABLE;
+#endif
+    return &SCALAR_TABLE;
+}
+
+std::atomic<const KernelTable*> activeTable{nullptr};
+
+const KernelTable& kernels() {
+    const KernelTable* table = activeTable.load(std::memory_order_acquire);
+    if (!table) {
+        // Гонка первых вызовов безвредна: все потоки выберут одну и ту же таблицу
+        table = tableFor(bestNewlineKernel());
+        activeTable.store(table, std::memory_order_release);
+    }
+    return *table;
+}
+
+} // namespace
+
+std::size_t countNewlines(const char* data, std::size_t n) {
+    return kernels().count(data, n);
+}
+
+std::int64_t findNthNewline(const char* data, std::size_t n, std::size_t k) {
+    if (k == 0) return -1;
+    return kernels().findNth(data, n, k);
+}
+
+std::int64_t findLastNewline(const char* data, std::size_t n) {
+    return kernels().findLast(data, n);
+}
+
+std::size_t countCodePoints(const char* data, std::size_t n) {
+    return kernels().countChars(data, n);
+}
+
+std::int64_t findNthCodePoint(const char* data, std::size_t n, std::size_t k) {
+    if (k == 0) return -1;
+    return kernels().findNthChar(data, n, k);
+}
+
+std::int64_t findNearestNewline(const char* data, std::size_t n, std::size_t center, std::size_t range) {
+    if (center > n) center = n;
+    // Вправо: [center, center + range)
+    std::size_t rightEnd = range > n - center ? n : center + range;
+    if (center < rightEnd) {
+        std::int64_t r = findNthNewline(data + center, rightEnd - center, 1);
+        if (r >= 0) return static_cast<std::int64_t>(center) + r;
+    }
+    // Влево: (center - range, center], позиция 0 не годится (лист был бы пустым)
+    std::size_t leftBegin = center >= range ? center - range + 1 : 1;
+    std::size_t leftEnd = center < n ? center + 1 : n;
+    if (leftBegin < leftEnd) {
+        std::int64_t l = findLastNewline(data + leftBegin, leftEnd - leftBegin);
+        if (l >= 0) return static_cast<std::int64_t>(leftBegin) + l;
+    }
+    return -1;
+}
+
+NewlineKernel activeNewlineKernel() {
+    return kernels().kind;
+}
+
+bool selectNewlineKernel(NewlineKernel kernel) {
+    if (!cpuSupports(kernel)) return false;
+    activeTable.store(tableFor(kernel), std::memory_order_release);
+    return true;
+}
+
+NewlineKernel bestNewlineKernel() {
+    if (cpuSupports(NewlineKernel::NEWLINE_AVX2)) return NewlineKernel::NEWLINE_AVX2;
+    if (cpuSupports(NewlineKernel::NEWLINE_SSE2)) return NewlineKernel::NEWLINE_SSE2;
+    return NewlineKernel::NEWLINE_SCALAR;
+}
@@ -0,0 +1,44 @@
+#ifndef NEWLINE_SCAN_H
+#define NEWLINE_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Векторные ядра поиска '\n' (и подсчёта символов UTF-8) для листьев дерева и построения из текста.
+// Реализация выбирается один раз при первом вызове по возможностям процессора:
+// AVX2 (32 байта за шаг), SSE2 (16 байт) или скалярная (на других архитектурах).
+enum class NewlineKernel : char {
+    NEWLINE_SCALAR = 0,
+    NEWLINE_SSE2 = 1,
+    NEWLINE_AVX2 = 2
+};
+
+// Количество '\n' в [data, data + n)
+std::size_t countNewlines(const char* data, std::size_t n); // O(n)
+
+// Позиция k-го (k >= 1) '\n' в [data, data + n) или -1, если '\n' меньше k
+std::int64_t findNthNewline(const char* data, std::size_t n, std::size_t k); // O(n)
+
+// Позиция последнего '\n' в [data, data + n) или -1
+std::int64_t findLastNewline(const char* data, std::size_t n); // O(n)
+
+// Количество символов UTF-8 в [data, data + n): байтов, начинающих символ (не 10xxxxxx).
+// Некорректная последовательность считается посимвольно по своим начальным байтам.
+std::size_t countCodePoints(const char* data, std::size_t n); // O(n)
+
+// Позиция начала k-го (k >= 1) символа UTF-8 в [data, data + n) или -1, если символов меньше k
+std::int64_t findNthCodePoint(const char* data, std::size_t n, std::size_t k); // O(n)
+
+// Точка разреза текста рядом с center: первый '\n' в [center, center + range),
+// иначе ближайший слева в (center - range, center]. Позиция '\n' или -1, если рядом его нет.
+// (Правая сторона в приоритете — так листы режутся и при построении, и при переполнении.)
+std::int64_t findNearestNewline(const char* data, std::size_t n, std::size_t center, std::size_t range); // O(range)
+
+// Текущая реализация и её принудительный выбор (для тестов и замеров).
+// selectNewlineKernel возвращает false, если процессор не поддерживает запрошенную.
+NewlineKernel activeNewlineKernel();
+bool selectNewlineKernel(NewlineKernel kernel);
+// Лучшая реализация, доступная на этом процессоре
+NewlineKernel bestNewlineKernel();
+
+#endif // NEWLINE_SCAN_H
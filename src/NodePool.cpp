@@ -0,0 +1,171 @@
+#include "NodePool.h"
+#include "Tree.h"
+#include <algorithm>
+#include <new>
+
+// ==========================================
+// Реализация SlabAllocator
+// ==========================================
+
+SlabAllocator::SlabAllocator(std::size_t objectSize, std::size_t objectsPerSlab)
+    : objectSize(objectSize < sizeof(FreeBlock) ? sizeof(FreeBlock) : objectSize),
+      objectsPerSlab(objectsPerSlab) {
+    // Выравниваем размер блока, чтобы каждый заголовок в слэбе был выровнен под указатель
+    constexpr std::size_t align = alignof(std::max_align_t);
+    this->objectSize = (this->objectSize + align - 1) / align * align;
+}
+
+void* SlabAllocator::allocate() {
+    if (freeList) {
+        FreeBlock* block = freeList;
+        freeList = block->next;
+        return block;
+    }
+    if (bumpPtr == bumpEnd) {
+        // Новый слэб; если new бросит — состояние аллокатора не изменится
+        slabs.emplace_back(new char[objectSize * objectsPerSlab]); // NOSONAR
+        bumpPtr = slabs.back().get();
+        bumpEnd = bumpPtr + objectSize * objectsPerSlab;
+    }
+    void* result = bumpPtr;
+    bumpPtr += objectSize;
+    return result;
+}
+
+void SlabAllocator::deallocate(void* ptr) {
+    auto block = static_cast<FreeBlock*>(ptr);
+    block->next = freeList;
+    freeList = block;
+}
+
+void SlabAllocator::reset() {
+    slabs.clear();
+    freeList = nullptr;
+    bumpPtr = nullptr;
+    bumpEnd = nullptr;
+}
+
+// ==========================================
+// Реализация PayloadArena
+// ==========================================
+
+namespace {
+    // Классы размеров: шаг 16 байт до 128, дальше по 4 класса на каждое удвоение.
+    // Крупные классы на LEAF_PAYLOAD_HEAD больше круглых, чтобы лист из 2^k байт текста вместе
+    // с головой буфера не уходил в следующий класс. Самый крупный — лист перед разрезом (2 * MAX_LEAF_SIZE).
+    constexpr int H = LEAF_PAYLOAD_HEAD;
+    constexpr int PAYLOAD_CLASSES[] = { // NOSONAR
+        16, 32, 48, 64, 80, 96, 112, 128,
+        160 + H, 192 + H, 224 + H, 256 + H,
+        320 + H, 384 + H, 448 + H, 512 + H,
+        640 + H, 768 + H, 896 + H, 1024 + H,
+        1280 + H, 1536 + H, 1792 + H, 2048 + H,
+        2560 + H, 3072 + H, 3584 + H, 4096 + H,
+        5120 + H, 6144 + H, 7168 + H, 8192 + H
+    };
+    constexpr int PAYLOAD_CLASS_COUNT = sizeof(PAYLOAD_CLASSES) / sizeof(PAYLOAD_CLASSES[0]);
+
+    static_assert(PAYLOAD_CLASSES[PAYLOAD_CLASS_COUNT - 1] >= 2 * MAX_LEAF_SIZE + LEAF_PAYLOAD_HEAD,
+                  "largest payload class must fit a leaf right before its split");
+}
+
+PayloadArena::PayloadArena() : freeLists(PAYLOAD_CLASS_COUNT, nullptr) {}
+
+PayloadArena::~PayloadArena() {
+    reset();
+}
+
+int PayloadArena::classIndex(int size) {
+    const int* end = PAYLOAD_CLASSES + PAYLOAD_CLASS_COUNT;
+    const int* it = std::lower_bound(PAYLOAD_CLASSES, end, size);
+    if (it == end) return -1;
+    return static_cast<int>(it - PAYLOAD_CLASSES);
+}
+
+char* PayloadArena::allocate(int size, int& capacity) {
+    if (size < 1) size = 1;
+
+    int cls = classIndex(size);
+    if (cls < 0) {
+        // Крупный буфер (огромная вставка) — отдельное выделение
+        auto buf = new char[size]; // NOSONAR
+        try {
+            largeBuffers.insert(buf);
+        } catch (...) {
+            delete[] buf; // NOSONAR
+            throw;
+        }
+        largeBytes += static_cast<std::size_t>(size);
+        capacity = size;
+        return buf;
+    }
+
+    capacity = PAYLOAD_CLASSES[cls];
+    if (FreeBlock* block = freeLists[cls]) {
+        freeLists[cls] = block->next;
+        return reinterpret_cast<char*>(block);
+    }
+
+    if (bumpEnd - bumpPtr < capacity) {
+        // Остаток текущего блока слишком мал — начинаем новый (остаток пропадает до reset)
+        blocks.emplace_back(new char[BLOCK_SIZE]); // NOSONAR
+        bumpPtr = blocks.back().get();
+        bumpEnd = bumpPtr + BLOCK_SIZE;
+    }
+    char* result = bumpPtr;
+    bumpPtr += capacity;
+    return result;
+}
+
+void PayloadArena::deallocate(char* ptr, int capacity) {
+    if (!ptr) return;
+    int cls = classIndex(capacity);
+    if (cls < 0 || PAYLOAD_CLASSES[cls] != capacity) {
+        // Не размер класса — значит крупный буфер
+        if (largeBuffers.erase(ptr) > 0) {
+            largeBytes -= static_cast<std::size_t>(capacity);
+            delete[] ptr; // NOSONAR
+        }
+        return;
+    }
+    auto block = reinterpret_cast<FreeBlock*>(ptr);
+    block->next = freeLists[cls];
+    freeLists[cls] = block;
+}
+
+void PayloadArena::reset() {
+    for (char* buf : largeBuffers) delete[] buf; // NOSONAR
+    largeBuffers.clear();
+    largeBytes = 0;
+    std::fill(freeLists.begin(), freeLists.end(), nullptr);
+    blocks.clear();
+    bumpPtr = nullptr;
+    bumpEnd = nullptr;
+}
+
+std::size_t PayloadArena::reservedBytes() const {
+    return blocks.size() * static_cast<std::size_t>(BLOCK_SIZE) + largeBytes;
+}
+
+// ==========================================
+// Реализация NodePool
+// ==========================================
+
+namespace {
+    // Слэб ~32 КБ: 1024 листа или ~120 широких internal-узлов
+    constexpr std::size_t SLAB_BYTES = 32 * 1024;
+}
+
+NodePool::NodePool()
+    : leafSlab(sizeof(LeafNode), SLAB_BYTES / sizeof(LeafNode)),
+      internalSlab(sizeof(InternalNode), SLAB_BYTES / sizeof(InternalNode)) {}
+
+void NodePool::reset() {
+    leafSlab.reset();
+    internalSlab.reset();
+    payloads.reset();
+}
+
+std::size_t NodePool::reservedBytes() const {
+    return leafSlab.reservedBytes() + internalSlab.reservedBytes() + payloads.reservedBytes();
+}
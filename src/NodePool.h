@@ -0,0 +1,100 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+// Пул блоков фиксированного размера (заголовки узлов дерева).
+// Память берётся крупными слэбами, освобождённые блоки уходят в free-list.
+class SlabAllocator {
+public:
+    SlabAllocator(std::size_t objectSize, std::size_t objectsPerSlab);
+
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    void* allocate();           // O(1)
+    void deallocate(void* ptr); // O(1)
+    void reset();               // O(S) - где S - количество слэбов; все блоки становятся недействительны
+
+    std::size_t reservedBytes() const { return slabs.size() * objectSize * objectsPerSlab; }
+
+private:
+    struct FreeBlock { FreeBlock* next; };
+
+    std::size_t objectSize;
+    std::size_t objectsPerSlab;
+    std::vector<std::unique_ptr<char[]>> slabs;
+    FreeBlock* freeList = nullptr;
+    char* bumpPtr = nullptr; // свободное место в последнем слэбе
+    char* bumpEnd = nullptr;
+};
+
+// Арена буферов листьев с классами размеров.
+// Запрос округляется вверх до класса; лишние байты класса достаются листу как разрыв.
+// Буферы больше самого крупного класса выделяются отдельно и тоже освобождаются в reset().
+class PayloadArena {
+public:
+    PayloadArena();
+    ~PayloadArena();
+
+    PayloadArena(const PayloadArena&) = delete;
+    PayloadArena& operator=(const PayloadArena&) = delete;
+
+    // Выделить буфер минимум на size байт; capacity — фактический размер буфера
+    char* allocate(int size, int& capacity);
+    // capacity должен совпадать с выданным в allocate
+    void deallocate(char* ptr, int capacity);
+    void reset();
+
+    std::size_t reservedBytes() const;
+
+    static constexpr int BLOCK_SIZE = 256 * 1024; // размер блока, из которого нарезаются буферы
+
+private:
+    struct FreeBlock { FreeBlock* next; };
+
+    static int classIndex(int size); // -1 если размер больше самого крупного класса
+
+    std::vector<FreeBlock*> freeLists; // по одному списку на класс
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* bumpPtr = nullptr;
+    char* bumpEnd = nullptr;
+
+    std::unordered_set<char*> largeBuffers;
+    std::size_t largeBytes = 0;
+};
+
+// Пул памяти одного дерева: слэбы для LeafNode/InternalNode и арена буферов листьев.
+// Построение, очистка и удаление большого документа — несколько крупных выделений,
+// а Tree::clear() сводится к reset().
+class NodePool {
+public:
+    NodePool();
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    void* allocateLeaf() { return leafSlab.allocate(); }
+    void freeLeaf(void* ptr) { leafSlab.deallocate(ptr); }
+
+    void* allocateInternal() { return internalSlab.allocate(); }
+    void freeInternal(void* ptr) { internalSlab.deallocate(ptr); }
+
+    char* allocateData(int size, int& capacity) { return payloads.allocate(size, capacity); }
+    void freeData(char* ptr, int capacity) { payloads.deallocate(ptr, capacity); }
+
+    // Освободить всю память разом. Все узлы пула становятся недействительны.
+    void reset();
+
+    std::size_t reservedBytes() const;
+
+private:
+    SlabAllocator leafSlab;
+    SlabAllocator internalSlab;
+    PayloadArena payloads;
+};
+
+#endif // NODE_POOL_H
@@ -0,0 +1,55 @@
+#include "NodeReclaimer.h"
+#include <utility>
+
+NodeReclaimer::NodeReclaimer() : worker(&NodeReclaimer::workerLoop, this) {}
+
+NodeReclaimer::~NodeReclaimer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+NodeReclaimer& NodeReclaimer::shared() {
+    static NodeReclaimer reclaimer;
+    return reclaimer;
+}
+
+void NodeReclaimer::release(TreeSnapshot&& snapshot) {
+    if (snapshot.isEmpty()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(snapshot));
+    }
+    wake.notify_one();
+}
+
+void NodeReclaimer::waitIdle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return queue.empty() && !busy; });
+}
+
+std::size_t NodeReclaimer::getReleasedCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return releasedCount;
+}
+
+void NodeReclaimer::workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+        if (queue.empty()) return; // stopping, очередь разобрана
+
+        TreeSnapshot snapshot = std::move(queue.front());
+        queue.pop_front();
+        busy = true;
+        lock.unlock();
+        snapshot.reset(); // обход поддерева — без блокировки очереди
+        lock.lock();
+        busy = false;
+        ++releasedCount;
+        if (queue.empty()) idle.notify_all();
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef NODE_RECLAIMER_H
+#define NODE_RECLAIMER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "Tree.h"
+
+// Фоновое освобождение крупных поддеревьев. Удаление большого диапазона (Tree::erase) отцепляет
+// целые поддеревья за O(log M), а обход их узлов (O(K)) переносится сюда: снимок поддерева
+// разрушается в отдельном потоке, и узлы уходят в очередь памяти дерева (как у любого снимка,
+// отпущенного из другого потока). В пул их по частям возвращают следующие правки дерева.
+class NodeReclaimer {
+public:
+    NodeReclaimer();
+    ~NodeReclaimer(); // дожидается очереди: все отданные снимки будут разрушены
+
+    NodeReclaimer(const NodeReclaimer&) = delete;
+    NodeReclaimer& operator=(const NodeReclaimer&) = delete;
+
+    // Общий поток процесса (создаётся при первом обращении)
+    static NodeReclaimer& shared();
+
+    // Разрушить снимок в фоновом потоке. При нехватке памяти на очередь бросает bad_alloc,
+    // снимок остаётся у вызывающего.
+    void release(TreeSnapshot&& snapshot); // O(1)
+
+    // Дождаться, пока очередь опустеет (тесты, замеры памяти)
+    void waitIdle();
+
+    std::size_t getReleasedCount() const; // сколько снимков разрушено за всё время
+
+private:
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<TreeSnapshot> queue;
+    bool busy = false; // поток разрушает снимок, взятый из очереди
+    bool stopping = false;
+    std::size_t releasedCount = 0;
+    std::thread worker; // последним: запускается, когда остальные поля готовы
+
+    void workerLoop();
+};
+
+#endif // NODE_RECLAIMER_H
@@ -1,6 +1,12 @@
 #include "Tree.h"
+#include "NewlineScan.h"
+#include "NodeReclaimer.h"
+#include "WorkStealingPool.h"
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstring>
+#include <new>
 #include <stdexcept>
 #include <sstream>
 
@@ -8,743 +14,2878 @@
 // Реализация LeafNode
 // ==========================================
 
-LeafNode::LeafNode(const char* str, int len) {
+LeafNode::LeafNode(const char* str, int len) : Node(NodeType::NODE_LEAF) {
     this->length = len;
-    this->data = new char[len]; // NOSONAR
-    this->lineCount = 1;
-    
-    // Инициализируем всю выделенную память нулями, чтобы избежать чтения "мусора".
-    if (len > 0) {
+    int capacity = 0;
+    this->data = allocateBuffer(len, capacity, nullptr);
+    this->gapStart = len; // разрыва нет — появится при первой правке листа
+    this->lineCount = 0;
+    this->charCount = 0;
+    if (len <= 0) return;
+
+    if (str) {
+        std::memcpy(this->data, str, len);
+        this->lineCount = static_cast<int>(::countNewlines(str, static_cast<std::size_t>(len)));
+        this->charCount = static_cast<int>(countCodePoints(str, static_cast<std::size_t>(len)));
+    } else {
+        // Без исходного текста — нули, чтобы не читать "мусор" (каждый нуль — отдельный символ)
         std::memset(this->data, 0, len);
+        this->charCount = len;
     }
+}
+
+LeafNode::LeafNode(const char* str, int len, char* buffer) : Node(NodeType::NODE_LEAF) {
+    this->length = len;
+    this->data = buffer;
+    this->gapStart = len; // запас класса размера [len, capacity()) сразу служит разрывом
+    this->lineCount = 0;
+    this->charCount = 0;
 
-    // Копируем фактические данные, если str валиден.
-    if (len > 0 && str) { 
+    if (len > 0 && str) {
         std::memcpy(this->data, str, len);
+        recount();
     }
+}
+
+LeafNode::~LeafNode() {
+    // Буфер из пула освобождает Tree::destroyNode (и обнуляет data), байты отображённого файла не наши
+    if (!(flags & NODE_FLAG_POOLED_DATA)) releaseData(nullptr);
+}
 
-    // Расчет теперь безопасен, т.к. this->data инициализирован.
-    for (int i = 0; i < len; i++) {
-        if (this->data[i] == '\n') {
-            this->lineCount++;
+char* LeafNode::allocateBuffer(int size, int& capacity, NodePool* pool) {
+    if (size < 0) size = 0;
+    int total = size + LEAF_PAYLOAD_HEAD;
+    char* block = pool ? pool->allocateData(total, total) : new char[total]; // NOSONAR
+    capacity = total - LEAF_PAYLOAD_HEAD; // запас класса размера достаётся тексту
+    new (block) LeafPayload();
+    reinterpret_cast<LeafPayload*>(block)->capacity = capacity;
+    return block + LEAF_PAYLOAD_HEAD;
+}
+
+void LeafNode::releaseData(NodePool* pool) {
+    if (hasPayload()) {
+        invalidateLineIndex();
+        char* block = data - LEAF_PAYLOAD_HEAD;
+        int blockSize = payload()->capacity + LEAF_PAYLOAD_HEAD;
+        payload()->~LeafPayload();
+        if (flags & NODE_FLAG_POOLED_DATA) {
+            // Буфер из пула дерева: дерево всегда передаёт свой pool при правке листа
+            pool->freeData(block, blockSize);
+        } else {
+            delete[] block; // NOSONAR
         }
     }
+    data = nullptr;
 }
 
-LeafNode::~LeafNode() {
-    delete[] data; // NOSONAR
+void LeafNode::copyOut(int from, int n, char* dst) const {
+    if (n <= 0) return;
+    // Часть до разрыва
+    if (from < gapStart) {
+        int first = gapStart - from;
+        if (first > n) first = n;
+        std::memcpy(dst, data + from, first);
+        dst += first;
+        from += first;
+        n -= first;
+    }
+    // Часть после разрыва
+    if (n > 0) {
+        std::memcpy(dst, data + from + gapLength(), n);
+    }
+}
+
+void LeafNode::moveGap(int pos) {
+    int gap = gapLength();
+    if (gap == 0) {
+        // Разрыва нет — текст непрерывен при любом gapStart (отображённый лист так и не пишется)
+        gapStart = pos;
+        return;
+    }
+    if (pos < gapStart) {
+        // Переносим [pos, gapStart) в конец разрыва
+        std::memmove(data + pos + gap, data + pos, gapStart - pos);
+    } else if (pos > gapStart) {
+        // Переносим [gapStart + gap, pos + gap) в начало разрыва
+        std::memmove(data + gapStart, data + gapStart + gap, pos - gapStart);
+    }
+    gapStart = pos;
+}
+
+void LeafNode::insertAt(int pos, const char* src, int n, NodePool* pool) {
+    if (n <= 0) return;
+
+    if (n > gapLength() || (flags & NODE_FLAG_MAPPED)) {
+        // Разрыв мал (или байты — чужой отображённый файл) — переносим текст в новый буфер
+        // с запасом, чтобы следующие вставки шли без выделений.
+        // Лист, который всё равно будет разрезан (> MAX_LEAF_SIZE), запаса не получает.
+        int needed = length + n;
+        int newCap = needed;
+        if (needed <= MAX_LEAF_SIZE) {
+            int slack = needed / 2;
+            if (slack < LEAF_GAP_MIN) slack = LEAF_GAP_MIN;
+            newCap = needed + slack;
+            if (newCap > MAX_LEAF_SIZE) newCap = MAX_LEAF_SIZE;
+        }
+
+        // Если бросит — лист не изменён
+        char* buf = allocateBuffer(newCap, newCap, pool);
+        // Сразу раскладываем текст так, чтобы разрыв оказался в pos
+        copyOut(0, pos, buf);
+        copyOut(pos, length - pos, buf + newCap - (length - pos));
+        releaseData(pool);
+        data = buf;
+        gapStart = pos;
+        flags &= static_cast<unsigned char>(~(NODE_FLAG_POOLED_DATA | NODE_FLAG_MAPPED));
+        if (pool) flags |= NODE_FLAG_POOLED_DATA;
+    } else {
+        moveGap(pos);
+    }
+
+    std::memcpy(data + gapStart, src, n);
+    gapStart += n;
+    length += n;
+    invalidateLineIndex();
+
+    // Инкрементально обновляем счётчики строк и символов по вставленным байтам
+    lineCount += static_cast<int>(::countNewlines(src, static_cast<std::size_t>(n)));
+    charCount += static_cast<int>(countCodePoints(src, static_cast<std::size_t>(n)));
+}
+
+void LeafNode::eraseAt(int pos, int n, NodePool* pool) {
+    if (n <= 0) return;
+    if (flags & NODE_FLAG_MAPPED) {
+        if (pos > 0 && pos + n < length) {
+            detachData(length, pool); // дыра посреди ссылки на файл — дальше как обычный лист
+        } else {
+            // Отрезаем начало или конец ссылки: копировать нечего, разрыва по-прежнему нет
+            lineCount -= static_cast<int>(::countNewlines(data + pos, static_cast<std::size_t>(n)));
+            charCount -= static_cast<int>(countCodePoints(data + pos, static_cast<std::size_t>(n)));
+            if (pos == 0) data += n;
+            length -= n;
+            gapStart = length;
+            invalidateLineIndex();
+            return;
+        }
+    }
+    // Удаляемые байты оказываются сразу за разрывом — считаем в них '\n' и поглощаем разрывом
+    moveGap(pos);
+    const char* removed = data + gapStart + gapLength();
+    lineCount -= static_cast<int>(::countNewlines(removed, static_cast<std::size_t>(n)));
+    charCount -= static_cast<int>(countCodePoints(removed, static_cast<std::size_t>(n)));
+    length -= n;
+    invalidateLineIndex();
+}
+
+void LeafNode::detachData(int readable, NodePool* pool) {
+    if (!(flags & NODE_FLAG_MAPPED)) return;
+    if (readable < 0) readable = 0;
+    if (readable > length) readable = length;
+
+    int newCap = readable;
+    char* buf = allocateBuffer(readable, newCap, pool);
+    std::memcpy(buf, data, static_cast<std::size_t>(readable));
+    data = buf;
+    length = readable;
+    gapStart = length; // запас класса размера — разрыв в конце
+    flags &= static_cast<unsigned char>(~NODE_FLAG_MAPPED);
+    if (pool) flags |= NODE_FLAG_POOLED_DATA;
+    // Файл мог измениться с момента открытия — счётчики берём по скопированным байтам
+    recount();
+    invalidateLineIndex();
+}
+
+int LeafNode::offsetAfterNewline(int k, TreeStorage* storage) const {
+    if (k < 1 || k > lineCount) return -1;
+    if (const int* index = lineIndex(storage)) return index[k - 1];
+
+    // Индекса нет — ищем векторным ядром по двум частям вокруг разрыва
+    auto head = static_cast<int>(::countNewlines(data, static_cast<std::size_t>(gapStart)));
+    if (k <= head) return static_cast<int>(findNthNewline(data, static_cast<std::size_t>(gapStart), static_cast<std::size_t>(k))) + 1;
+    std::int64_t pos = findNthNewline(data + gapStart + gapLength(), static_cast<std::size_t>(length - gapStart),
+                                      static_cast<std::size_t>(k - head));
+    return pos < 0 ? -1 : gapStart + static_cast<int>(pos) + 1;
+}
+
+int LeafNode::countNewlines(int from, int n) const {
+    if (n <= 0) return 0;
+    std::size_t cnt = 0;
+    // Часть до разрыва
+    if (from < gapStart) {
+        int first = gapStart - from < n ? gapStart - from : n;
+        cnt += ::countNewlines(data + from, static_cast<std::size_t>(first));
+        from += first;
+        n -= first;
+    }
+    // Часть после разрыва
+    if (n > 0) cnt += ::countNewlines(data + from + gapLength(), static_cast<std::size_t>(n));
+    return static_cast<int>(cnt);
+}
+
+int LeafNode::countChars(int from, int n) const {
+    if (n <= 0) return 0;
+    std::size_t cnt = 0;
+    // Часть до разрыва
+    if (from < gapStart) {
+        int first = gapStart - from < n ? gapStart - from : n;
+        cnt += countCodePoints(data + from, static_cast<std::size_t>(first));
+        from += first;
+        n -= first;
+    }
+    // Часть после разрыва
+    if (n > 0) cnt += countCodePoints(data + from + gapLength(), static_cast<std::size_t>(n));
+    return static_cast<int>(cnt);
 }
 
-NodeType LeafNode::getType() const { return NodeType::NODE_LEAF; }
-int LeafNode::getLength() const { return length; }
-int LeafNode::getLineCount() const { return lineCount; }
+int LeafNode::offsetOfChar(int c) const {
+    if (c <= 0) return 0;
+    if (c >= charCount) return length;
+    // Символ с номером c — (c + 1)-й начальный байт: ищем по двум частям вокруг разрыва
+    auto head = static_cast<int>(countCodePoints(data, static_cast<std::size_t>(gapStart)));
+    if (c < head) return static_cast<int>(findNthCodePoint(data, static_cast<std::size_t>(gapStart), static_cast<std::size_t>(c) + 1));
+    std::int64_t pos = findNthCodePoint(data + gapStart + gapLength(), static_cast<std::size_t>(length - gapStart),
+                                        static_cast<std::size_t>(c - head) + 1);
+    return pos < 0 ? length : gapStart + static_cast<int>(pos);
+}
+
+void LeafNode::recount() {
+    lineCount = countNewlines(0, length);
+    charCount = countChars(0, length);
+}
+
+int LeafNode::newlinesBefore(int pos, TreeStorage* storage) const {
+    const int* index = lineIndex(storage);
+    if (!index) return lineCount ? countNewlines(0, pos) : 0;
+    // '\n' в позиции p лежит левее pos, если p + 1 <= pos
+    return static_cast<int>(std::upper_bound(index, index + lineCount, pos) - index);
+}
+
+const int* LeafNode::lineIndex(TreeStorage* storage) const {
+    if (!hasPayload()) return nullptr; // отображённый лист: индексу негде лежать
+    std::atomic<int*>& lineStarts = payload()->lineStarts;
+    int* index = lineStarts.load(std::memory_order_acquire);
+    if (index || lineCount == 0 || !storage) return index;
+
+    index = storage->allocateLineIndex(lineCount);
+    if (!index) return nullptr;
+    // Две части вокруг разрыва; позиции в индексе — логические
+    int k = 0;
+    const int total = lineCount;
+    auto scan = [&index, &k, total](const char* from, int n, int base) {
+        for (int at = 0; at < n && k < total;) {
+            std::int64_t p = findNthNewline(from + at, static_cast<std::size_t>(n - at), 1);
+            if (p < 0) break;
+            at += static_cast<int>(p) + 1;
+            index[k++] = base + at;
+        }
+    };
+    scan(data, gapStart, 0);
+    scan(data + gapStart + gapLength(), length - gapStart, gapStart);
+    while (k < total) index[k++] = -1; // lineCount разошёлся с текстом (не должно случаться)
+
+    // Индекс мог построить параллельно другой читатель (лист общий со снимком) — оставляем его
+    int* expected = nullptr;
+    if (!lineStarts.compare_exchange_strong(expected, index, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        TreeStorage::freeLineIndex(index);
+        return expected;
+    }
+    return index;
+}
+
+void LeafNode::invalidateLineIndex() {
+    if (!hasPayload()) return;
+    if (int* index = payload()->lineStarts.exchange(nullptr, std::memory_order_relaxed)) TreeStorage::freeLineIndex(index);
+}
+
+std::size_t LeafNode::lineIndexBytes() const {
+    if (!hasPayload()) return 0;
+    const int* index = payload()->lineStarts.load(std::memory_order_acquire);
+    return index ? TreeStorage::lineIndexCapacity(index) : 0;
+}
 
 // ==========================================
 // Реализация InternalNode
 // ==========================================
 
-InternalNode::InternalNode(Node* l, Node* r) {
-    this->left = l;
-    this->right = r;
-    
-    // Инициализируем нулями
-    this->totalLength = 0;
-    this->totalLineCount = 0;
+// Высота поддерева: nullptr = -1, лист = 0
+static int nodeHeight(const Node* node) {
+    if (!node) return -1;
+    if (node->getType() == NodeType::NODE_LEAF) return 0;
+    return static_cast<const InternalNode*>(node)->height;
+}
 
-    // Берем готовые данные из детей. Это O(1).
-    if (l) {
-        this->totalLength += l->getLength();
-        this->totalLineCount += l->getLineCount();
+InternalNode::InternalNode() : Node(NodeType::NODE_INTERNAL), height(1), childCount(0) {
+    for (int i = 0; i < BTREE_MAX_CHILDREN; ++i) {
+        lengthPrefix[i] = INT64_MAX;
+        linePrefix[i] = INT64_MAX;
+        charPrefix[i] = INT64_MAX;
+        children[i] = nullptr;
     }
-    if (r) {
-        this->totalLength += r->getLength();
-        this->totalLineCount += r->getLineCount();
+}
+
+InternalNode::InternalNode(Node* l, Node* r) : InternalNode() {
+    // Берем готовые данные из детей. Это O(1).
+    if (l) appendChild(l);
+    if (r) appendChild(r);
+}
+
+// Поиск ребёнка — подсчёт префиксов, не превышающих ключ, по всему массиву фиксированной длины.
+// Без ветвлений и ранних выходов: компилятор превращает цикл в пару SIMD-сравнений.
+int InternalNode::findChildByOffset(TextOffset offset) const {
+    int idx = 0;
+    for (int i = 0; i < BTREE_MAX_CHILDREN; ++i) idx += (lengthPrefix[i] <= offset);
+    return idx < childCount ? idx : childCount - 1;
+}
+
+int InternalNode::findChildForInsert(TextOffset pos) const {
+    int idx = 0;
+    for (int i = 0; i < BTREE_MAX_CHILDREN; ++i) idx += (lengthPrefix[i] < pos);
+    return idx < childCount ? idx : childCount - 1;
+}
+
+int InternalNode::findChildByLine(LineIndex k) const {
+    int idx = 0;
+    for (int i = 0; i < BTREE_MAX_CHILDREN; ++i) idx += (linePrefix[i] < k);
+    return idx < childCount ? idx : childCount - 1;
+}
+
+int InternalNode::findChildByChar(TextOffset c) const {
+    int idx = 0;
+    for (int i = 0; i < BTREE_MAX_CHILDREN; ++i) idx += (charPrefix[i] <= c);
+    return idx < childCount ? idx : childCount - 1;
+}
+
+void InternalNode::insertChild(int i, Node* child) {
+    assert(childCount < BTREE_MAX_CHILDREN && i >= 0 && i <= childCount);
+    TextOffset len = child->getLength();
+    LineIndex lines = child->getLineCount();
+    TextOffset chars = child->getCharCount();
+
+    for (int j = childCount; j > i; --j) {
+        children[j] = children[j - 1];
+        lengthPrefix[j] = lengthPrefix[j - 1] + len;
+        linePrefix[j] = linePrefix[j - 1] + lines;
+        charPrefix[j] = charPrefix[j - 1] + chars;
     }
+    children[i] = child;
+    lengthPrefix[i] = childOffset(i) + len;
+    linePrefix[i] = childLineOffset(i) + lines;
+    charPrefix[i] = childCharOffset(i) + chars;
+    ++childCount;
+
+    int h = nodeHeight(child) + 1;
+    if (h > height) height = h;
 }
 
-void InternalNode::recalc() {
-    totalLength = 0;
-    totalLineCount = 0;
-    if (left) {
-        totalLength += left->getLength();
-        totalLineCount += left->getLineCount();
+Node* InternalNode::removeChild(int i) {
+    assert(i >= 0 && i < childCount);
+    Node* child = children[i];
+    TextOffset len = childLength(i);
+    LineIndex lines = childLineCount(i);
+    TextOffset chars = childCharCount(i);
+
+    for (int j = i; j + 1 < childCount; ++j) {
+        children[j] = children[j + 1];
+        lengthPrefix[j] = lengthPrefix[j + 1] - len;
+        linePrefix[j] = linePrefix[j + 1] - lines;
+        charPrefix[j] = charPrefix[j + 1] - chars;
     }
-    if (right) {
-        totalLength += right->getLength();
-        totalLineCount += right->getLineCount();
+    --childCount;
+    children[childCount] = nullptr;
+    lengthPrefix[childCount] = INT64_MAX;
+    linePrefix[childCount] = INT64_MAX;
+    charPrefix[childCount] = INT64_MAX;
+    return child;
+}
+
+void InternalNode::updateChild(int i) {
+    TextOffset dLen = children[i]->getLength() - childLength(i);
+    LineIndex dLines = children[i]->getLineCount() - childLineCount(i);
+    TextOffset dChars = children[i]->getCharCount() - childCharCount(i);
+    for (int j = i; j < childCount; ++j) {
+        lengthPrefix[j] += dLen;
+        linePrefix[j] += dLines;
+        charPrefix[j] += dChars;
     }
 }
 
-NodeType InternalNode::getType() const { return NodeType::NODE_INTERNAL; }
-int InternalNode::getLength() const { return totalLength; }
-int InternalNode::getLineCount() const { return totalLineCount; }
+// Единственное место (кроме вставки ребёнка), где узел читает всех своих детей:
+// вызывается после перестройки узла, спуск же пользуется только префиксами.
+void InternalNode::recalc() {
+    TextOffset len = 0;
+    LineIndex lines = 0;
+    TextOffset chars = 0;
+    int h = 0;
+    for (int i = 0; i < BTREE_MAX_CHILDREN; ++i) {
+        if (i < childCount) {
+            len += children[i]->getLength();
+            lines += children[i]->getLineCount();
+            chars += children[i]->getCharCount();
+            int hc = nodeHeight(children[i]);
+            if (hc > h) h = hc;
+            lengthPrefix[i] = len;
+            linePrefix[i] = lines;
+            charPrefix[i] = chars;
+        } else {
+            children[i] = nullptr;
+            lengthPrefix[i] = INT64_MAX;
+            linePrefix[i] = INT64_MAX;
+            charPrefix[i] = INT64_MAX;
+        }
+    }
+    height = h + 1;
+}
 
 
 // ==========================================
 // Реализация Tree
 // ==========================================
 
-Tree::Tree() : root(nullptr) {}
+Tree::Tree() : TreeReader(std::make_shared<TreeStorage>(), nullptr) {}
+
+Tree::Tree(std::shared_ptr<TreeStorage> sharedStorage) : TreeReader(std::move(sharedStorage), nullptr) {}
+
+Tree::Tree(Tree&& other) noexcept
+    : TreeReader(std::move(other.storage), other.root), heapNodeCount(other.heapNodeCount), mergedLeavesCount(other.mergedLeavesCount) {
+    other.root = nullptr;
+    other.resetFinger();
+    other.compactCursor = 0;
+    // Память ушла вместе с узлами: other не должен держать её, иначе clear() этого дерева не сбросит пул
+    other.adoptFreshStorage(storage);
+}
+
+Tree& Tree::operator=(Tree&& other) {
+    if (this == &other) return *this;
+    resetFinger();
+    compactCursor = 0;
+    releaseNodes();
+    storage = std::move(other.storage);
+    root = other.root;
+    heapNodeCount = other.heapNodeCount;
+    mergedLeavesCount = other.mergedLeavesCount;
+    other.root = nullptr;
+    other.resetFinger();
+    other.compactCursor = 0;
+    other.adoptFreshStorage(storage);
+    return *this;
+}
 
 Tree::~Tree() {
-    clear();
+    releaseNodes();
 }
 
 // перемещающий конструктор
 LeafNode::LeafNode(LeafNode&& other) noexcept 
-    : length(0), lineCount(0), data(nullptr) {
+    : Node(NodeType::NODE_LEAF), length(0), lineCount(0), charCount(0), gapStart(0), data(nullptr) {
     *this = std::move(other);
 }
 
 LeafNode& LeafNode::operator=(LeafNode&& other) noexcept {
     if (this != &other) {
-        delete[] data; //NOSONAR  // Очищаем текущие данные
-        
+        // Очищаем текущие данные (буфер из пула вернётся в пул при его reset(), отображённый файл не наш).
+        // Индекс строк лежит в голове буфера и переезжает вместе с ним.
+        const unsigned char dataFlags = NODE_FLAG_POOLED_DATA | NODE_FLAG_MAPPED;
+        if (flags & NODE_FLAG_POOLED_DATA) invalidateLineIndex();
+        else releaseData(nullptr);
+        flags = static_cast<unsigned char>((flags & ~dataFlags) | (other.flags & dataFlags));
+        other.flags &= static_cast<unsigned char>(~dataFlags);
+
         length = other.length;
         lineCount = other.lineCount;
+        charCount = other.charCount;
         data = other.data;
+        gapStart = other.gapStart;
         
         other.length = 0;
         other.lineCount = 0;
+        other.charCount = 0;
         other.data = nullptr;
+        other.gapStart = 0;
     }
     return *this;
 }
 
 
 void Tree::clear() {
-    clearRecursive(root);
+    resetFinger();
+    compactCursor = 0;
+    if (!releaseNodes()) adoptFreshStorage(storage);
+}
+
+bool Tree::releaseNodes() {
+    if (storage.use_count() > 1) {
+        // Память общая: узлы могут быть общими со снимками — отпускаем поштучно, пул не сбрасываем
+        destroySubtree(root);
+        root = nullptr;
+        drainReleased(true);
+        return false;
+    }
+    // Снимков нет, но узлы, отпущенные ими раньше, могли ещё не вернуться в пул
+    drainReleased(true);
+    if (heapNodeCount > 0) {
+        // Есть узлы, созданные обычным new — их нужно удалить поштучно
+        destroySubtree(root);
+        heapNodeCount = 0;
+    }
+    // Все остальные узлы живут в пуле: освобождаем его целиком, без обхода дерева
+    // (индексы строк листьев — вместе со своей ареной)
     root = nullptr;
+    storage->pool.reset();
+    // Листьев, ссылающихся на отображённые файлы, больше нет
+    storage->mappedFiles.clear();
+    storage->detachedFiles = 0;
+    std::lock_guard<std::mutex> lock(storage->lineIndexMutex);
+    storage->lineIndexArena.reset();
+    return true;
 }
 
-void Tree::clearRecursive(Node* node) {
-    if (!node) return;
-    
-    if (node->getType() == NodeType::NODE_INTERNAL) {
-        auto inner = static_cast<InternalNode*>(node);
-        clearRecursive(inner->left);
-        clearRecursive(inner->right);
+void Tree::adoptFreshStorage(const std::shared_ptr<TreeStorage>& fallback) noexcept {
+    heapNodeCount = 0; // дерево пусто: узлов из new в нём нет
+    try {
+        storage = std::make_shared<TreeStorage>();
+    } catch (const std::bad_alloc&) {
+        // Остаёмся в общей памяти — clear() будет отпускать узлы поштучно, как раньше
+        storage = fallback;
     }
-    delete node; // NOSONAR // Виртуальный деструктор сработает корректно
 }
 
-bool Tree::isEmpty() const { return root == nullptr; }
-Node* Tree::getRoot() const { return root; }
+LeafNode* Tree::createLeaf(const char* text, int len) {
+    NodePool& pool = storage->pool;
+    void* mem = pool.allocateLeaf();
+    int capacity = 0;
+    char* buf = nullptr;
+    try {
+        buf = LeafNode::allocateBuffer(len, capacity, &pool);
+    } catch (...) {
+        pool.freeLeaf(mem);
+        throw;
+    }
+    auto leaf = new (mem) LeafNode(text, len, buf);
+    leaf->flags = NODE_FLAG_POOLED | NODE_FLAG_POOLED_DATA;
+    return leaf;
+}
 
-void Tree::setRoot(Node* newRoot) {
-    if (root && root != newRoot) clear();
-    root = newRoot;
+LeafNode* Tree::createMappedLeaf(const char* text, int len) {
+    // Буфер листа — сами байты файла: отображение только для чтения, лист в него не пишет
+    auto leaf = new (storage->pool.allocateLeaf()) LeafNode(nullptr, len, const_cast<char*>(text)); // NOSONAR
+    leaf->flags = NODE_FLAG_POOLED | NODE_FLAG_MAPPED;
+    return leaf;
 }
 
-// --- Построение (Logic Update) ---
+InternalNode* Tree::createInternal() {
+    auto inner = new (storage->pool.allocateInternal()) InternalNode();
+    inner->flags = NODE_FLAG_POOLED;
+    return inner;
+}
 
-Node* Tree::buildFromTextRecursive(const char* text, int len) {
-    if (len <= 0) return nullptr;
+InternalNode* Tree::createInternal(Node* l, Node* r) {
+    auto inner = new (storage->pool.allocateInternal()) InternalNode(l, r);
+    inner->flags = NODE_FLAG_POOLED;
+    return inner;
+}
 
-    // УСЛОВИЕ ЛИСТА:
-    // Если текст влезает в лимит размера, делаем лист.
-    // Это гарантирует, что даже файл без \n будет разбит на куски.
-    //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
-    if (len <= MAX_LEAF_SIZE) {
-        return new LeafNode(text, len); // NOSONAR
-    } 
+// Освободить память узла (дети не трогаются): узел из пула возвращается в пул, остальные — delete
+static void freeNodeMemory(NodePool& pool, Node* node) {
+    if (node->getType() == NodeType::NODE_LEAF && (node->flags & NODE_FLAG_POOLED_DATA)) {
+        static_cast<LeafNode*>(node)->releaseData(&pool);
+    }
 
-    // ПОИСК ТОЧКИ РАЗРЕЗА:
-    // Пытаемся найти \n рядом с серединой, чтобы не резать слова.
-    int half = len / 2;
-    int splitIndex = -1;
-    
-    // Ищем \n в диапазоне +/- 256 байт от середины (или меньше, если файл мал)
-    int searchRange = (len < 512) ? (len / 4) : 256;
+    if (!(node->flags & NODE_FLAG_POOLED)) {
+        // Деструктор не виртуальный — удаляем через настоящий тип узла
+        if (node->getType() == NodeType::NODE_LEAF) delete static_cast<LeafNode*>(node); // NOSONAR
+        else delete static_cast<InternalNode*>(node); // NOSONAR
+        return;
+    }
 
-    // Ищем вправо от середины
-    for (int i = 0; i < searchRange; i++) {
-        if (half + i < len && text[half + i] == '\n') {
-            splitIndex = half + i + 1; // Режем ПОСЛЕ \n
-            break;
-        }
+    if (node->getType() == NodeType::NODE_LEAF) {
+        static_cast<LeafNode*>(node)->~LeafNode();
+        pool.freeLeaf(node);
+    } else {
+        static_cast<InternalNode*>(node)->~InternalNode();
+        pool.freeInternal(node);
     }
+}
+
+void Tree::destroyNode(Node* node) {
+    if (!node) return;
+    if (!(node->flags & NODE_FLAG_POOLED) && heapNodeCount > 0) --heapNodeCount;
+    freeNodeMemory(storage->pool, node);
+}
+
+void Tree::destroySubtree(Node* node) {
+    if (!node) return;
+    // Узел нужен ещё кому-то (снимку) — только отпускаем ссылку
+    if (node->refCount.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
     
-    // Если не нашли, ищем влево
-    if (splitIndex == -1) {
-        for (int i = 0; i < searchRange; i++) {
-            if (half - i > 0 && text[half - i] == '\n') {
-                splitIndex = half - i + 1;
-                break;
-            }
-        }
+    if (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<InternalNode*>(node);
+        for (int i = 0; i < inner->childCount; ++i) destroySubtree(inner->children[i]);
+    }
+    destroyNode(node);
+}
+
+std::size_t Tree::getReservedBytes() const { return storage->pool.reservedBytes(); }
+
+// ==========================================
+// Снимки и копирование пути
+// ==========================================
+
+TreeStorage::~TreeStorage() {
+    // Дерево уже уничтожено: узлы, отпущенные снимками после него, освобождаем здесь
+    for (Node* node : released) freeNodeMemory(pool, node);
+}
+
+// Заголовок перед массивом индекса строк: из какой арены он выделен и сколько занимает
+namespace {
+    struct LineIndexHeader {
+        TreeStorage* owner;
+        int capacity; // байт вместе с заголовком
+    };
+    constexpr int LINE_INDEX_HEADER = static_cast<int>(sizeof(LineIndexHeader));
+
+    LineIndexHeader* lineIndexHeader(const int* index) {
+        return reinterpret_cast<LineIndexHeader*>(reinterpret_cast<char*>(const_cast<int*>(index)) - LINE_INDEX_HEADER);
     }
+}
 
-    // ФОЛЛБЭК (Fallback):
-    // Если \n нет (minified файл) или он далеко — режем жестко пополам.
-    if (splitIndex == -1) {
-        splitIndex = half;
+int* TreeStorage::allocateLineIndex(int count) {
+    if (count <= 0 || count > (INT_MAX - LINE_INDEX_HEADER) / static_cast<int>(sizeof(int))) return nullptr;
+    int capacity = 0;
+    char* block = nullptr;
+    try {
+        std::lock_guard<std::mutex> lock(lineIndexMutex);
+        block = lineIndexArena.allocate(LINE_INDEX_HEADER + count * static_cast<int>(sizeof(int)), capacity);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
     }
+    auto header = reinterpret_cast<LineIndexHeader*>(block);
+    header->owner = this;
+    header->capacity = capacity;
+    return reinterpret_cast<int*>(block + LINE_INDEX_HEADER);
+}
 
+void TreeStorage::freeLineIndex(int* index) {
+    LineIndexHeader* header = lineIndexHeader(index);
+    TreeStorage* owner = header->owner;
+    std::lock_guard<std::mutex> lock(owner->lineIndexMutex);
+    owner->lineIndexArena.deallocate(reinterpret_cast<char*>(header), header->capacity);
+}
 
-    Node* left = nullptr;
-    Node* right = nullptr;
+std::size_t TreeStorage::lineIndexCapacity(const int* index) {
+    return static_cast<std::size_t>(lineIndexHeader(index)->capacity);
+}
 
-    // Построим детей. Если создание одного из них бросит — мы ничего не удаляем,
-    // потому что ничего ещё не было выделено на нашей стороне.
-    left = buildFromTextRecursive(text, splitIndex);
-    right = buildFromTextRecursive(text + splitIndex, len - splitIndex);
+// Отпустить ссылку снимка на поддерево. Вызывается из любого потока, поэтому узлы,
+// на которые больше никто не ссылается, не освобождаются, а уходят в очередь storage.
+static void releaseToStorage(TreeStorage& storage, Node* node) {
+    if (!node) return;
+    if (node->refCount.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
 
-    // Попытка создать internal; если бросит — не забываем удалить детей.
+    if (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<InternalNode*>(node);
+        for (int i = 0; i < inner->childCount; ++i) releaseToStorage(storage, inner->children[i]);
+    }
+    std::lock_guard<std::mutex> lock(storage.releasedMutex);
     try {
-        Node* node = new InternalNode(left, right); //NOSONAR
-        return node;
+        storage.released.push_back(node);
     } catch (...) {
-        // Удаляем уже созданных потомков во избежание утечек.
-        if (left)  clearRecursive(left);
-        if (right) clearRecursive(right);
-        throw;
+        // Не хватило памяти на очередь — узел из пула вернётся вместе с пулом
     }
+    storage.hasReleased.store(true, std::memory_order_release);
 }
 
-void Tree::fromText(const char* text, int len) {
-    clear();
-    if (!text || len <= 0) return;
-    root = buildFromTextRecursive(text, len);
+TreeSnapshot::TreeSnapshot(std::shared_ptr<TreeStorage> storage, Node* root)
+    : TreeReader(std::move(storage), root) {}
+
+TreeSnapshot::~TreeSnapshot() {
+    reset();
 }
 
-// --- Экспорт в текст ---
+TreeSnapshot::TreeSnapshot(const TreeSnapshot& other) : TreeReader(other.storage, other.root) {
+    if (root) root->refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+TreeSnapshot& TreeSnapshot::operator=(const TreeSnapshot& other) {
+    if (this != &other) {
+        TreeSnapshot copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+TreeSnapshot::TreeSnapshot(TreeSnapshot&& other) noexcept
+    : TreeReader(std::move(other.storage), other.root) {
+    other.root = nullptr;
+}
+
+TreeSnapshot& TreeSnapshot::operator=(TreeSnapshot&& other) noexcept {
+    if (this != &other) {
+        reset();
+        root = other.root;
+        storage = std::move(other.storage);
+        other.root = nullptr;
+    }
+    return *this;
+}
+
+void TreeSnapshot::reset() {
+    if (!storage) return;
+    if (root) releaseToStorage(*storage, root);
+    {
+        // Пустая критическая секция: всё, что снимок сделал с узлами, упорядочено перед
+        // Tree::clear(), который сбрасывает пул, увидев, что снимков больше нет
+        std::lock_guard<std::mutex> lock(storage->releasedMutex);
+    }
+    root = nullptr;
+    storage.reset();
+}
+
+TreeSnapshot Tree::snapshot() const {
+    if (root) root->refCount.fetch_add(1, std::memory_order_relaxed);
+    return TreeSnapshot(storage, root);
+}
+
+void Tree::collectRangeLeaves(Node* node, TextOffset& offset, TextOffset& len, std::vector<Node*>& leaves) {
+    if (len <= 0) return;
 
-void Tree::collectTextRecursive(Node* node, char* buffer, int& pos) {
-    if (!node) return;
-    
     if (node->getType() == NodeType::NODE_LEAF) {
         auto leaf = static_cast<LeafNode*>(node);
-        // memcpy быстрее цикла
-        if (leaf->length > 0 && leaf->data) {
-            std::memcpy(buffer + pos, leaf->data, leaf->length);
-            pos += leaf->length;
+        auto from = static_cast<int>(offset);
+        int n = (len < leaf->length - from) ? static_cast<int>(len) : (leaf->length - from);
+        leaves.reserve(leaves.size() + 1); // push_back ниже не бросает — ссылка не потеряется
+        if (n == leaf->length) {
+            leaf->refCount.fetch_add(1, std::memory_order_relaxed);
+            leaves.push_back(leaf);
+        } else {
+            // Часть отображённого листа — такая же ссылка на файл, остальные копируются
+            LeafNode* part = (leaf->flags & NODE_FLAG_MAPPED) ? createMappedLeaf(leaf->data + from, n) : createLeaf(nullptr, n);
+            if (!(leaf->flags & NODE_FLAG_MAPPED)) leaf->copyOut(from, n, part->data);
+            part->recount();
+            leaves.push_back(part);
         }
-    } else {
-        auto inner = static_cast<InternalNode*>(node);
-        collectTextRecursive(inner->left, buffer, pos);
-        collectTextRecursive(inner->right, buffer, pos);
+        len -= n;
+        offset = 0;
+        return;
     }
+
+    auto in = static_cast<InternalNode*>(node);
+    int i = in->findChildByOffset(offset);
+    offset -= in->childOffset(i);
+    for (; len > 0 && i < in->childCount; ++i) collectRangeLeaves(in->children[i], offset, len, leaves);
 }
 
-char* Tree::toText() {
-    if (!root) {
-        auto empty = new char[1]; // NOSONAR
-        empty[0] = '\0';
-        return empty;
+TreeSnapshot Tree::snapshotRange(TextOffset pos, TextOffset len) {
+    TextOffset total = root ? root->getLength() : 0;
+    if (pos < 0) pos = 0;
+    if (len > total - pos) len = total - pos;
+    if (len <= 0) return TreeSnapshot(storage, nullptr);
+
+    drainReleased(false);
+    std::vector<Node*> leaves;
+    try {
+        TextOffset offset = pos;
+        collectRangeLeaves(root, offset, len, leaves);
+    } catch (...) {
+        for (Node* leaf : leaves) destroySubtree(leaf);
+        throw;
     }
-    
-    // ТЕПЕРЬ МЫ ЗНАЕМ ДЛИНУ ЗА O(1)!
-    // Не нужно запускать calculateLengthRecursive
-    int totalLen = root->getLength();
-    
-    auto buffer = new char[totalLen + 1]; // NOSONAR
-    int pos = 0;
-    collectTextRecursive(root, buffer, pos);
-    buffer[pos] = '\0';
-    return buffer;
+    // При нехватке памяти buildFromLeaves сам отпустит листья
+    return TreeSnapshot(storage, buildFromLeaves(std::move(leaves)));
 }
 
-// --- Получение строки (Get Line) ---
+Node* Tree::copyNode(const Node* node) {
+    if (node->getType() == NodeType::NODE_LEAF) {
+        auto src = static_cast<const LeafNode*>(node);
+        // Отображённый лист не меняется — копии достаточно ссылки на те же байты файла
+        LeafNode* leaf = (src->flags & NODE_FLAG_MAPPED) ? createMappedLeaf(src->data, src->length) : createLeaf(nullptr, src->length);
+        if (!(src->flags & NODE_FLAG_MAPPED)) src->copyOut(0, src->length, leaf->data);
+        leaf->lineCount = src->lineCount;
+        leaf->charCount = src->charCount;
+        return leaf;
+    }
+    auto src = static_cast<const InternalNode*>(node);
+    InternalNode* inner = createInternal();
+    inner->height = src->height;
+    inner->childCount = src->childCount;
+    for (int i = 0; i < BTREE_MAX_CHILDREN; ++i) {
+        inner->lengthPrefix[i] = src->lengthPrefix[i];
+        inner->linePrefix[i] = src->linePrefix[i];
+        inner->charPrefix[i] = src->charPrefix[i];
+        inner->children[i] = src->children[i];
+    }
+    // Дети теперь общие для оригинала и копии
+    for (int i = 0; i < inner->childCount; ++i) inner->children[i]->refCount.fetch_add(1, std::memory_order_relaxed);
+    return inner;
+}
 
-LeafNode* Tree::findLeafByLineRecursive(Node* node, int& localLineIndex) {
-    if (!node) return nullptr;
+Node* Tree::mutableChild(InternalNode* inner, int i) {
+    Node* child = inner->children[i];
+    if (child->isUnique()) return child;
+    // Вес копии тот же — префиксы родителя не меняются
+    Node* copy = copyNode(child);
+    inner->children[i] = copy;
+    destroySubtree(child); // отпускаем ссылку родителя на оригинал (он остаётся снимку)
+    return copy;
+}
 
-    if (node->getType() == NodeType::NODE_LEAF) {
-        return static_cast<LeafNode*>(node);
+Node* Tree::mutableRoot() {
+    if (root && !root->isUnique()) {
+        Node* copy = copyNode(root);
+        destroySubtree(root);
+        root = copy;
     }
+    return root;
+}
 
-    auto inner = static_cast<InternalNode*>(node);
-    
-    // Ключевой момент оптимизации:
-    // Мы спрашиваем у левого ребенка, сколько в нем строк. Это O(1) операция.
-    int leftLines = 0;
-    if (inner->left) {
-        leftLines = inner->left->getLineCount();
+void Tree::drainReleased(bool wait) {
+    if (!wait && !storage->hasReleased.load(std::memory_order_acquire)) return;
+
+    // Правка возвращает в пул не больше RELEASED_DRAIN_BATCH узлов: поддерево, разрушенное
+    // в фоне (NodeReclaimer), не должно возвращаться в пул одной долгой правкой
+    std::vector<Node*> nodes;
+    Node* batch[RELEASED_DRAIN_BATCH];
+    std::size_t batchCount = 0;
+    {
+        std::unique_lock<std::mutex> lock(storage->releasedMutex, std::defer_lock);
+        if (wait) {
+            lock.lock();
+        } else if (!lock.try_lock()) {
+            return; // снимок как раз отпускает узлы — заберём при следующей правке
+        }
+        std::vector<Node*>& released = storage->released;
+        if (wait || released.size() <= RELEASED_DRAIN_BATCH) {
+            nodes.swap(released);
+            storage->hasReleased.store(false, std::memory_order_relaxed);
+        } else {
+            batchCount = RELEASED_DRAIN_BATCH;
+            std::copy(released.end() - static_cast<std::ptrdiff_t>(batchCount), released.end(), batch);
+            released.resize(released.size() - batchCount);
+        }
     }
+    for (Node* node : nodes) destroyNode(node);
+    for (std::size_t i = 0; i < batchCount; ++i) destroyNode(batch[i]);
+}
 
-    if (localLineIndex < leftLines) {
-        // Искомая строка слева
-        return findLeafByLineRecursive(inner->left, localLineIndex);
-    } else {
-        // Искомая строка справа. Корректируем индекс.
-        localLineIndex -= leftLines;
-        return findLeafByLineRecursive(inner->right, localLineIndex);
+static long long countHeapNodesRecursive(const Node* node) {
+    if (!node) return 0;
+    long long cnt = (node->flags & NODE_FLAG_POOLED) ? 0 : 1;
+    if (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<const InternalNode*>(node);
+        for (int i = 0; i < inner->childCount; ++i) cnt += countHeapNodesRecursive(inner->children[i]);
     }
+    return cnt;
 }
 
-char* Tree::getLine(int lineNumber) {
-    if (!root || lineNumber < 0) return nullptr;
-    
-    // Проверка: а есть ли такая строка вообще
-    if (lineNumber < 0) return nullptr;
-    if (lineNumber >= root->getLineCount()) return nullptr;
+// Проверка формы B+-дерева: у internal-узла 1..BTREE_MAX_CHILDREN детей одной высоты,
+// height и префиксы согласованы с детьми. Возвращает высоту или -1, если форма нарушена.
+static int wellFormedHeight(const Node* node) {
+    if (node->getType() == NodeType::NODE_LEAF) return 0;
+    auto in = static_cast<const InternalNode*>(node);
+    if (in->childCount < 1 || in->childCount > BTREE_MAX_CHILDREN) return -1;
+
+    int childHeight = -1;
+    for (int i = 0; i < in->childCount; ++i) {
+        const Node* child = in->children[i];
+        if (!child) return -1;
+        int h = wellFormedHeight(child);
+        if (h < 0 || (i > 0 && h != childHeight)) return -1;
+        childHeight = h;
+        if (in->childLength(i) != child->getLength() || in->childLineCount(i) != child->getLineCount() ||
+            in->childCharCount(i) != child->getCharCount()) return -1;
+    }
+    if (in->height != childHeight + 1) return -1;
+    return in->height;
+}
+
+bool TreeReader::isEmpty() const { return root == nullptr; }
+TextOffset TreeReader::getLength() const { return root ? root->getLength() : 0; }
+Node* Tree::getRoot() const { return root; }
+
+void Tree::setRoot(Node* newRoot) {
+    resetFinger();
+    if (root != newRoot) {
+        // Старое содержимое удаляем поштучно: newRoot мог быть собран из узлов этого же пула
+        destroySubtree(root);
+        root = newRoot;
+        // Узлы из new, которые ещё держат снимки, остаются в счётчике до их освобождения
+        heapNodeCount += countHeapNodesRecursive(root);
+    }
+
+    // Дерево собрано снаружи в другой форме (двоичные узлы, цепочки) — перестраиваем.
+    // Корень с одним ребёнком тоже не оставляем.
+    bool wellFormed = !root || wellFormedHeight(root) >= 0;
+    if (wellFormed && root && root->getType() == NodeType::NODE_INTERNAL) {
+        wellFormed = static_cast<InternalNode*>(root)->childCount >= 2;
+    }
+    if (!wellFormed) rebalance();
+}
+
+// --- Построение (Logic Update) ---
+
+// Окрестность середины (в байтах), где лист режется по '\n', а не посреди строки
+static const std::size_t SPLIT_SEARCH_RANGE = 256;
+// Листьев на одну задачу параллельного построения (~1 МБ текста)
+static const std::size_t PARALLEL_FILL_GRAIN = 256;
+
+// Длины листьев для текста: режем по '\n' рядом с серединой, пока кусок больше MAX_LEAF_SIZE.
+// Разрез зависит только от своего куска текста, поэтому крупные половины считаются задачами pool —
+// длины (а значит и форма дерева) выходят те же, что и в одном потоке.
+static void collectLeafLengths(const char* text, TextOffset len, std::vector<int>& lengths, WorkStealingPool* pool) {
+    if (len <= 0) return;
 
+    // УСЛОВИЕ ЛИСТА:
+    // Если текст влезает в лимит размера, делаем лист.
+    // Это гарантирует, что даже файл без \n будет разбит на куски.
+    //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
+    if (len <= MAX_LEAF_SIZE) {
+        lengths.push_back(static_cast<int>(len));
+        return;
+    }
 
-    int localIndex = lineNumber;
-    // Этот метод спустится по дереву за O(log N) и вернет Лист.
-    // localIndex станет номером строки ВНУТРИ этого листа.
-    auto leaf = findLeafByLineRecursive(root, localIndex);
+    // ПОИСК ТОЧКИ РАЗРЕЗА:
+    // Пытаемся найти \n рядом с серединой (+/- 256 байт, сначала вправо), чтобы не резать слова.
+    TextOffset half = len / 2;
+    std::size_t searchRange = (len < 512) ? static_cast<std::size_t>(len / 4) : SPLIT_SEARCH_RANGE;
+    std::int64_t nl = findNearestNewline(text, static_cast<std::size_t>(len), static_cast<std::size_t>(half), searchRange);
+
+    // Режем ПОСЛЕ \n; если его нет (minified файл) или он далеко — режем жестко пополам.
+    TextOffset splitIndex = nl >= 0 ? nl + 1 : half;
+
+    if (pool && len >= Tree::PARALLEL_BUILD_MIN) {
+        // Правая половина — задачей (её может украсть другой поток), левая — здесь же
+        std::vector<int> right;
+        WorkStealingPool::TaskGroup group(*pool);
+        group.run([&]() { collectLeafLengths(text + splitIndex, len - splitIndex, right, pool); });
+        collectLeafLengths(text, splitIndex, lengths, pool);
+        group.wait();
+        lengths.insert(lengths.end(), right.begin(), right.end());
+        return;
+    }
+    collectLeafLengths(text, splitIndex, lengths, pool);
+    collectLeafLengths(text + splitIndex, len - splitIndex, lengths, pool);
+}
+
+void Tree::fromText(const char* text, TextOffset len) {
+    fromText(text, len, len >= PARALLEL_BUILD_MIN ? &WorkStealingPool::shared() : nullptr);
+}
+
+void Tree::fromText(const char* text, TextOffset len, WorkStealingPool* pool) {
+    clear();
+    if (!text || len <= 0) return;
+    root = buildFromText(text, len, pool, false);
+}
+
+Node* Tree::buildFromText(const char* text, TextOffset len, WorkStealingPool* pool, bool mapped) {
+    if (len < PARALLEL_BUILD_MIN) pool = nullptr; // на мелком тексте потоки дороже самой работы
+
+    std::vector<int> lengths;
+    collectLeafLengths(text, len, lengths, pool);
+
+    // Листы выделяются здесь (пул узлов однопоточный), а байты копируются и '\n' считаются
+    // уже параллельно: каждая задача пишет только в свои листы
+    std::vector<Node*> leaves;
+    std::vector<TextOffset> starts;
+    try {
+        leaves.reserve(lengths.size());
+        starts.reserve(lengths.size());
+        TextOffset offset = 0;
+        for (int n : lengths) {
+            leaves.push_back(mapped ? createMappedLeaf(text + offset, n) : createLeaf(nullptr, n));
+            starts.push_back(offset);
+            offset += n;
+        }
+
+        auto fill = [&](std::size_t i) {
+            auto leaf = static_cast<LeafNode*>(leaves[i]);
+            if (!mapped) std::memcpy(leaf->data, text + starts[i], static_cast<std::size_t>(leaf->length));
+            leaf->recount();
+        };
+        if (pool) {
+            pool->parallelFor(0, leaves.size(), PARALLEL_FILL_GRAIN, fill);
+        } else {
+            for (std::size_t i = 0; i < leaves.size(); ++i) fill(i);
+        }
+    } catch (...) {
+        // Уже созданные листья освобождаем, дерево остаётся пустым
+        for (Node* leaf : leaves) destroyNode(leaf);
+        throw;
+    }
+    return buildFromLeaves(std::move(leaves));
+}
+
+void Tree::fromMappedFile(const std::string& path) {
+    fromMappedFile(path, &WorkStealingPool::shared());
+}
+
+void Tree::fromMappedFile(const std::string& path, WorkStealingPool* pool) {
+    auto file = std::make_unique<MappedFile>(path); // бросит — дерево не тронуто
+    clear();
+    // Место под файл заранее: после сборки дерева регистрация не должна бросать
+    storage->mappedFiles.reserve(storage->mappedFiles.size() + 1);
+    if (file->size() > 0) root = buildFromText(file->data(), file->size(), pool, true);
+    // '\n' посчитаны — прочитанные страницы больше не нужны, текст подгрузится при просмотре
+    file->releasePages();
+    storage->mappedFiles.push_back(std::move(file));
+}
+
+bool Tree::mappedFilesChanged() const {
+    for (std::size_t f = storage->detachedFiles; f < storage->mappedFiles.size(); ++f) {
+        if (storage->mappedFiles[f]->changed()) return true;
+    }
+    return false;
+}
+
+bool Tree::usesMappedFile(const std::string& path) const {
+    for (std::size_t f = storage->detachedFiles; f < storage->mappedFiles.size(); ++f) {
+        if (storage->mappedFiles[f]->isSameFile(path)) return true;
+    }
+    return false;
+}
+
+bool Tree::detachMappedFiles(TreeSnapshot* const* snapshots, std::size_t count) {
+    resetFinger();
+    if (storage->detachedFiles == storage->mappedFiles.size()) return true;
+    // Сколько байт каждого файла ещё можно читать: дальше нового конца файла — SIGBUS
+    std::vector<TextOffset> readable;
+    readable.reserve(storage->mappedFiles.size());
+    for (const std::unique_ptr<MappedFile>& file : storage->mappedFiles) readable.push_back(file->readableSize());
+
+    // Новые корни собираются целиком до замены: при исключении дерево и снимки не тронуты
+    bool intact = true;
+    std::unordered_map<const Node*, Node*> copies;
+    std::vector<Node*> fresh;
+    try {
+        fresh.reserve(count + 1);
+        fresh.push_back(root ? detachMappedNode(root, readable, intact, copies) : nullptr);
+        for (std::size_t i = 0; i < count; ++i) {
+            TreeSnapshot* snap = snapshots[i];
+            bool ours = snap && snap->root && snap->storage == storage;
+            fresh.push_back(ours ? detachMappedNode(snap->root, readable, intact, copies) : nullptr);
+        }
+        // Файл усечён: хвосты листьев отброшены, а листья за новым концом опустели —
+        // деревья собираются заново без них (длины в родителях и число детей — как у B+-дерева)
+        for (std::size_t k = 0; !intact && k < fresh.size(); ++k) {
+            if (!fresh[k]) continue;
+            Node* rebuilt = rebuildWithoutEmptyLeaves(fresh[k]);
+            destroySubtree(fresh[k]);
+            fresh[k] = rebuilt;
+        }
+    } catch (...) {
+        for (Node* node : fresh) destroySubtree(node);
+        for (const auto& copy : copies) destroySubtree(copy.second);
+        throw;
+    }
+    for (const auto& copy : copies) destroySubtree(copy.second); // ссылки таблицы копий
+
+    destroySubtree(root);
+    root = fresh[0];
+    for (std::size_t i = 0; i < count; ++i) {
+        TreeSnapshot* snap = snapshots[i];
+        if (snap && snap->root && snap->storage == storage) *snap = TreeSnapshot(storage, fresh[i + 1]);
+    }
+
+    // Снимки могут ещё ссылаться на файлы — тогда они закроются вместе с памятью дерева,
+    // а аренда отпускается сразу: ждущая запись в файл может идти
+    for (std::size_t f = storage->detachedFiles; f < storage->mappedFiles.size(); ++f) storage->mappedFiles[f]->releaseLease();
+    if (storage.use_count() == 1) storage->mappedFiles.clear();
+    storage->detachedFiles = storage->mappedFiles.size();
+    return intact;
+}
+
+Node* Tree::detachMappedNode(Node* node, const std::vector<TextOffset>& readable, bool& intact,
+                             std::unordered_map<const Node*, Node*>& copies) {
+    auto found = copies.find(node);
+    if (found != copies.end()) {
+        found->second->refCount.fetch_add(1, std::memory_order_relaxed);
+        return found->second;
+    }
+
+    Node* copy = nullptr;
+    if (node->getType() == NodeType::NODE_LEAF) {
+        auto leaf = static_cast<LeafNode*>(node);
+        if (!(leaf->flags & NODE_FLAG_MAPPED)) {
+            node->refCount.fetch_add(1, std::memory_order_relaxed);
+            return node;
+        }
+        int keep = leaf->length;
+        for (std::size_t f = 0; f < storage->mappedFiles.size(); ++f) {
+            const char* begin = storage->mappedFiles[f]->data();
+            if (!begin || leaf->data < begin || leaf->data >= begin + storage->mappedFiles[f]->size()) continue;
+            TextOffset available = readable[f] - (leaf->data - begin);
+            if (available < keep) keep = available < 0 ? 0 : static_cast<int>(available);
+            break;
+        }
+        if (keep < leaf->length) intact = false;
+        auto detached = static_cast<LeafNode*>(copyNode(leaf)); // ссылка на те же байты файла
+        try {
+            detached->detachData(keep, &storage->pool);
+        } catch (...) {
+            destroyNode(detached);
+            throw;
+        }
+        copy = detached;
+    } else {
+        auto inner = static_cast<InternalNode*>(node);
+        Node* children[BTREE_MAX_CHILDREN];
+        int done = 0;
+        bool changed = false;
+        try {
+            for (; done < inner->childCount; ++done) {
+                children[done] = detachMappedNode(inner->children[done], readable, intact, copies);
+                changed = changed || children[done] != inner->children[done];
+            }
+            if (changed) copy = createInternal();
+        } catch (...) {
+            for (int k = 0; k < done; ++k) destroySubtree(children[k]);
+            throw;
+        }
+        if (!changed) {
+            // Отображённых листьев нет — узел остаётся общим
+            for (int k = 0; k < done; ++k) destroySubtree(children[k]);
+            node->refCount.fetch_add(1, std::memory_order_relaxed);
+            return node;
+        }
+        auto detached = static_cast<InternalNode*>(copy);
+        for (int k = 0; k < done; ++k) detached->appendChild(children[k]); // '\n' пересчитаны по скопированным байтам
+    }
+
+    copy->refCount.fetch_add(1, std::memory_order_relaxed); // ссылка таблицы копий
+    try {
+        copies.emplace(node, copy);
+    } catch (...) {
+        copy->refCount.fetch_sub(1, std::memory_order_relaxed);
+        destroySubtree(copy);
+        throw;
+    }
+    return copy;
+}
+
+// --- Экспорт в текст ---
+
+void TreeReader::collectTextRecursive(const Node* node, char* buffer, TextOffset& pos) {
+    if (!node) return;
+    
+    if (node->getType() == NodeType::NODE_LEAF) {
+        auto leaf = static_cast<const LeafNode*>(node);
+        // memcpy быстрее цикла (две части вокруг разрыва)
+        if (leaf->length > 0 && leaf->data) {
+            leaf->copyOut(0, leaf->length, buffer + pos);
+            pos += leaf->length;
+        }
+    } else {
+        auto inner = static_cast<const InternalNode*>(node);
+        for (int i = 0; i < inner->childCount; ++i) collectTextRecursive(inner->children[i], buffer, pos);
+    }
+}
+
+char* TreeReader::toText() const {
+    if (!root) {
+        auto empty = new char[1]; // NOSONAR
+        empty[0] = '\0';
+        return empty;
+    }
+    
+    // ТЕПЕРЬ МЫ ЗНАЕМ ДЛИНУ ЗА O(1)!
+    // Не нужно запускать calculateLengthRecursive
+    TextOffset totalLen = root->getLength();
+    
+    auto buffer = new char[static_cast<std::size_t>(totalLen) + 1]; // NOSONAR
+    TextOffset pos = 0;
+    collectTextRecursive(root, buffer, pos);
+    buffer[pos] = '\0';
+    return buffer;
+}
+
+static void collectStatsRecursive(const Node* node, int depth, TreeStats& st) {
+    if (!node->isUnique()) ++st.sharedCount;
+    if (node->getType() == NodeType::NODE_LEAF) {
+        auto leaf = static_cast<const LeafNode*>(node);
+        ++st.leafCount;
+        if (std::size_t bytes = leaf->lineIndexBytes()) {
+            ++st.lineIndexCount;
+            st.lineIndexBytes += bytes;
+        }
+        if (depth > st.maxDepth) st.maxDepth = depth;
+        st.leafDepthSum += static_cast<std::size_t>(depth);
+        int bucket = leaf->length * TreeStats::LEAF_FILL_BUCKETS / MAX_LEAF_SIZE;
+        ++st.leafFill[bucket < TreeStats::LEAF_FILL_BUCKETS ? bucket : TreeStats::LEAF_FILL_BUCKETS - 1];
+        st.payloadBytes += leaf->length;
+        if (leaf->flags & NODE_FLAG_MAPPED) st.mappedBytes += leaf->length;
+        else st.leafBufferBytes += static_cast<std::size_t>(leaf->capacity() + LEAF_PAYLOAD_HEAD);
+        st.nodeHeaderBytes += sizeof(LeafNode);
+        return;
+    }
+    auto inner = static_cast<const InternalNode*>(node);
+    ++st.internalCount;
+    st.nodeHeaderBytes += sizeof(InternalNode);
+    for (int i = 0; i < inner->childCount; ++i) collectStatsRecursive(inner->children[i], depth + 1, st);
+}
+
+// --- Итератор по кускам текста ---
+
+// Кусок, начинающийся в from, тянется до разрыва или до конца листа
+static int chunkEndInLeaf(const LeafNode* leaf, int from) { return from < leaf->gapStart ? leaf->gapStart : leaf->length; }
+// Кусок, кончающийся в to (> 0), начинается с начала листа или сразу за разрывом
+static int chunkStartInLeaf(const LeafNode* leaf, int to) { return to <= leaf->gapStart ? 0 : leaf->gapStart; }
+
+TreeReader::ChunkIterator TreeReader::chunksAt(TextOffset offset) const {
+    ChunkIterator it;
+    if (!root) return it;
+    if (root->getType() == NodeType::NODE_INTERNAL &&
+        static_cast<const InternalNode*>(root)->height >= ChunkIterator::MAX_DEPTH) {
+        throw std::length_error("Tree is too deep for ChunkIterator");
+    }
+    TextOffset total = root->getLength();
+    if (offset < 0) offset = 0;
+    if (offset > total) offset = total;
+
+    // Спуск по префиксам длин; offset == total попадает в конец последнего листа
+    const Node* node = root;
+    TextOffset local = offset;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<const InternalNode*>(node);
+        int i = inner->findChildByOffset(local);
+        it.path[it.depth++] = {inner, i};
+        local -= inner->childOffset(i);
+        node = inner->children[i];
+    }
+    it.leaf = static_cast<const LeafNode*>(node);
+    it.from = static_cast<int>(local);
+    it.to = it.from < it.leaf->length ? chunkEndInLeaf(it.leaf, it.from) : it.from;
+    it.chunkOffset = offset;
+    return it;
+}
+
+std::string_view TreeReader::ChunkIterator::operator*() const {
+    if (!valid()) return {};
+    const char* p = from < leaf->gapStart ? leaf->data + from : leaf->data + from + leaf->gapLength();
+    return {p, static_cast<std::size_t>(to - from)};
+}
+
+void TreeReader::ChunkIterator::descend(const Node* node, bool leftmost) {
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<const InternalNode*>(node);
+        int i = leftmost ? 0 : inner->childCount - 1;
+        path[depth++] = {inner, i};
+        node = inner->children[i];
+    }
+    leaf = static_cast<const LeafNode*>(node);
+}
+
+bool TreeReader::ChunkIterator::nextLeaf() {
+    // Поднимаемся до первого узла, у которого есть ребёнок правее пути
+    int k = depth - 1;
+    while (k >= 0 && path[k].index + 1 >= path[k].node->childCount) --k;
+    if (k < 0) return false;
+    ++path[k].index;
+    depth = k + 1;
+    descend(path[k].node->children[path[k].index], true);
+    return true;
+}
+
+bool TreeReader::ChunkIterator::prevLeaf() {
+    int k = depth - 1;
+    while (k >= 0 && path[k].index == 0) --k;
+    if (k < 0) return false;
+    --path[k].index;
+    depth = k + 1;
+    descend(path[k].node->children[path[k].index], false);
+    return true;
+}
+
+bool TreeReader::ChunkIterator::next() {
+    if (!leaf) return false;
+    chunkOffset += to - from;
+    from = to;
+    while (from >= leaf->length) {
+        if (!nextLeaf()) {
+            to = from; // конец текста: остаёмся в последнем листе
+            return false;
+        }
+        from = 0;
+    }
+    to = chunkEndInLeaf(leaf, from);
+    return true;
+}
+
+bool TreeReader::ChunkIterator::prev() {
+    if (!leaf) return false;
+    to = from;
+    while (to <= 0) {
+        if (!prevLeaf()) {
+            from = to; // начало текста: остаёмся в первом листе
+            return false;
+        }
+        to = leaf->length;
+    }
+    from = chunkStartInLeaf(leaf, to);
+    chunkOffset -= to - from;
+    return true;
+}
+
+// --- Итератор по строкам ---
+
+TreeReader::LineIterator TreeReader::linesAt(LineIndex line) const {
+    LineIterator it;
+    if (!root || line < 0 || line >= getTotalLineCount()) return it;
+    it.lineNumber = line;
+    it.lineOffset = getOffsetForLine(line);
+    it.chunk = chunksAt(it.lineOffset);
+    it.readLine();
+    it.isValid = true;
+    return it;
+}
+
+void TreeReader::LineIterator::readLine() {
+    buffer.clear();
+    inBuffer = false;
+    hasNewline = false;
+    lineText = {};
+    for (; chunk.valid(); chunk.next(), skip = 0) {
+        std::string_view rest = (*chunk).substr(skip);
+        std::size_t nl = rest.find('\n');
+        if (nl != std::string_view::npos) {
+            if (inBuffer) {
+                buffer.append(rest.data(), nl);
+            } else {
+                lineText = rest.substr(0, nl); // строка целиком в куске — без копирования
+            }
+            skip += nl + 1;
+            hasNewline = true;
+            return;
+        }
+        // Строка продолжается в следующем куске
+        if (!rest.empty()) {
+            buffer.append(rest.data(), rest.size());
+            inBuffer = true;
+        }
+    }
+    // Последняя строка текста (без '\n') уже в buffer или пуста
+}
+
+bool TreeReader::LineIterator::next() {
+    if (!isValid || !hasNewline) {
+        isValid = false;
+        return false;
+    }
+    lineOffset += static_cast<TextOffset>(text().size()) + 1;
+    ++lineNumber;
+    readLine();
+    return true;
+}
+
+TreeStats TreeReader::stats() const {
+    TreeStats st;
+    if (root) collectStatsRecursive(root, 0, st);
+    return st;
+}
+
+int TreeReader::depth() const {
+    return root && root->getType() == NodeType::NODE_INTERNAL ? static_cast<const InternalNode*>(root)->height : 0;
+}
+
+// --- Получение строки (Get Line) ---
+
+char* TreeReader::getLine(LineIndex lineNumber) const {
+    if (!root || lineNumber < 0) return nullptr;
+    
+    // Проверка: а есть ли такая строка вообще
+    if (lineNumber >= getTotalLineCount()) return nullptr;
+
+    // Строка может пересекать границу листов, поэтому берём её как диапазон байт:
+    // от начала строки до '\n' (начало следующей строки - 1) или до конца текста.
+    TextOffset startPos = getOffsetForLine(lineNumber);
+    TextOffset endPos = root->getLength();
+    if (lineNumber + 1 < getTotalLineCount()) {
+        endPos = getOffsetForLine(lineNumber + 1) - 1;
+    }
+
+    return getTextRange(startPos, endPos - startPos);
+}
+
+// Tree.cpp
+// Строк на одну больше, чем '\n' (последняя строка может быть пустой)
+LineIndex TreeReader::getTotalLineCount() const {
+    if (!root) return 0;
+    return root->getLineCount() + 1;
+}
+
+// static helper: вычислить байтовое смещение сразу после k-го '\n' (k >= 1) внутри поддерева,
+// т.е. начало строки с индексом k.
+// Предполагается: node != nullptr и k корректен для этого поддерева.
+// При нарушении инвариантов — assertion в debug.
+TextOffset TreeReader::getOffsetForLineRecursive(const Node* node, LineIndex k, TreeStorage* storage) {
+    assert(node != nullptr);
+
+    if (node->getType() == NodeType::NODE_LEAF) {
+        // Т.к. мы проверили getType, static_cast безопасен и быстрее dynamic_cast.
+        auto leaf = static_cast<const LeafNode*>(node);
+        // Защита на случай нарушения инварианта (только debug)
+        assert(leaf != nullptr);
+
+        // k не больше числа '\n' в листе, поэтому помещается в int
+        // Начало строки внутри листа — из его индекса строк (строится при первом обращении)
+        int offset = k <= leaf->lineCount ? leaf->offsetAfterNewline(static_cast<int>(k), storage) : -1;
+        if (offset >= 0) return offset; // offset внутри листа
+        // Если индекс оказался некорректным — бросим понятное исключение в релизе.
+        throw std::out_of_range("Line index out of range inside leaf");
+    } else {
+        // internal node
+        auto in = static_cast<const InternalNode*>(node);
+        assert(in != nullptr);
+
+        // Ребёнка выбираем по префиксам родителя — сами дети не читаются
+        int i = in->findChildByLine(k);
+        return in->childOffset(i) + getOffsetForLineRecursive(in->children[i], k - in->childLineOffset(i), storage);
+    }
+}
+
+
+TextOffset TreeReader::getOffsetForLine(LineIndex lineIndex0Based) const {
+    if (!root) throw std::out_of_range("Tree is empty");
+    if (lineIndex0Based < 0 || lineIndex0Based >= getTotalLineCount()) {
+        std::basic_ostringstream<char> oss;
+        oss << "Line index out of range (0.." << (getTotalLineCount()-1) << ")";
+        throw std::out_of_range(oss.str());
+    }
+    // Строка 0 всегда начинается с начала текста
+    if (lineIndex0Based == 0) return 0;
+    return getOffsetForLineRecursive(root, lineIndex0Based, storage.get());
+}
+
+
+LineIndex TreeReader::getLineForOffset(TextOffset offset) const {
+    return locateLine(offset).line;
+}
+
+TextLocation TreeReader::locate(TextOffset offset) const {
+    TextLocation loc = locateLine(offset);
+    // Символы строки до байта — разность номеров символов (строка может тянуться через много листьев)
+    if (loc.column > 0) loc.charColumn = getCharOffset(loc.lineStart + loc.column) - getCharOffset(loc.lineStart);
+    return loc;
+}
+
+TextLocation TreeReader::locateLine(TextOffset offset) const {
+    TextLocation loc;
+    if (!root) return loc;
+    TextOffset total = root->getLength();
+    if (offset < 0) offset = 0;
+    if (offset > total) offset = total;
+
+    // Ближайший к листу узел пути, у которого левее пути есть '\n': если в самом листе
+    // до offset '\n' нет, строка начинается в его поддереве
+    const InternalNode* lineOwner = nullptr;
+    TextOffset lineOwnerStart = 0;
+    LineIndex lineOwnerNewlines = 0;
+
+    const Node* node = root;
+    TextOffset nodeStart = 0;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<const InternalNode*>(node);
+        int i = inner->findChildByOffset(offset - nodeStart);
+        if (inner->childLineOffset(i) > 0) {
+            lineOwner = inner;
+            lineOwnerStart = nodeStart;
+            lineOwnerNewlines = inner->childLineOffset(i);
+        }
+        loc.line += inner->childLineOffset(i);
+        nodeStart += inner->childOffset(i);
+        node = inner->children[i];
+    }
+
+    auto leaf = static_cast<const LeafNode*>(node);
+    int k = leaf->newlinesBefore(static_cast<int>(offset - nodeStart), storage.get());
+    loc.line += k;
+    if (k > 0) {
+        loc.lineStart = nodeStart + leaf->offsetAfterNewline(k, storage.get());
+    } else if (lineOwner) {
+        // Последний '\n' перед листом — спуск только внутри поддерева lineOwner
+        loc.lineStart = lineOwnerStart + getOffsetForLineRecursive(lineOwner, lineOwnerNewlines, storage.get());
+    }
+    loc.column = offset - loc.lineStart;
+    return loc;
+}
+
+TextOffset TreeReader::getCharCount() const {
+    return root ? root->getCharCount() : 0;
+}
+
+TextOffset TreeReader::getCharOffset(TextOffset byteOffset) const {
+    if (!root || byteOffset <= 0) return 0;
+    if (byteOffset >= root->getLength()) return root->getCharCount();
+
+    // Спуск по префиксам длин, попутно складываем символы всех детей левее пути
+    const Node* node = root;
+    TextOffset local = byteOffset;
+    TextOffset chars = 0;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<const InternalNode*>(node);
+        int i = inner->findChildByOffset(local);
+        chars += inner->childCharOffset(i);
+        local -= inner->childOffset(i);
+        node = inner->children[i];
+    }
+    return chars + static_cast<const LeafNode*>(node)->countChars(0, static_cast<int>(local));
+}
+
+TextOffset TreeReader::getByteOffsetForChar(TextOffset charOffset) const {
+    if (!root || charOffset <= 0) return 0;
+    if (charOffset >= root->getCharCount()) return root->getLength();
+
+    // Спуск по префиксам символов: символ принадлежит листу, где лежит его начальный байт
+    const Node* node = root;
+    TextOffset local = charOffset;
+    TextOffset bytes = 0;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<const InternalNode*>(node);
+        int i = inner->findChildByChar(local);
+        bytes += inner->childOffset(i);
+        local -= inner->childCharOffset(i);
+        node = inner->children[i];
+    }
+    return bytes + static_cast<const LeafNode*>(node)->offsetOfChar(static_cast<int>(local));
+}
+
+TextOffset TreeReader::getByteOffsetForLineColumn(LineIndex line, TextOffset charColumn) const {
+    if (!root) return 0;
+    LineIndex lines = getTotalLineCount();
+    if (line < 0) line = 0;
+    if (line >= lines) line = lines - 1;
+
+    TextOffset lineStart = getOffsetForLine(line);
+    if (charColumn <= 0) return lineStart;
+    // Конец строки — её '\n' (у последней строки — конец текста)
+    TextOffset lineEnd = line + 1 < lines ? getOffsetForLine(line + 1) - 1 : root->getLength();
+    TextOffset pos = getByteOffsetForChar(getCharOffset(lineStart) + charColumn);
+    return pos < lineEnd ? pos : lineEnd;
+}
+
+
+// splitLeafAtOffset: лист остаётся левой половиной, хвост уходит в новый лист.
+// Если createLeaf бросит — лист не изменён (просто остаётся длиннее MAX_LEAF_SIZE).
+Node* Tree::splitLeafAtOffset(LeafNode* leaf, int offset) { //NOSONAR
+    if (!leaf || offset <= 0 || offset >= leaf->length) return nullptr;
+
+    // Разрыв в точке разреза: хвост лежит одним куском сразу за разрывом
+    leaf->moveGap(offset);
+    int rightLen = leaf->length - offset;
+    LeafNode* rightLeaf = createLeaf(leaf->data + offset + leaf->gapLength(), rightLen);
+
+    // Теперь безопасно отрезать хвост у оригинала
+    leaf->eraseAt(offset, rightLen, &storage->pool);
+    return rightLeaf;
+}
+
+
+
+// Вспомогательная: вычислить индекс разреза (поведение как в buildFromTextRecursive)
+int Tree::findSplitIndexForLeaf(const LeafNode* leaf) const {
+    if (!leaf || !leaf->data) return 0;
+    int half = leaf->length / 2;
+    int searchRange = (leaf->length < 512) ? (leaf->length / 4) : static_cast<int>(SPLIT_SEARCH_RANGE);
+
+    // Окно поиска (не больше 2 * SPLIT_SEARCH_RANGE байт) копируем без разрыва и ищем в нём
+    int lo = half > searchRange ? half - searchRange : 0;
+    int hi = half + searchRange < leaf->length ? half + searchRange : leaf->length;
+    char window[2 * SPLIT_SEARCH_RANGE];
+    leaf->copyOut(lo, hi - lo, window);
+    std::int64_t nl = findNearestNewline(window, static_cast<std::size_t>(hi - lo), static_cast<std::size_t>(half - lo),
+                                         static_cast<std::size_t>(searchRange));
+    // Позиция 0 окна (если окно не с начала листа) лежит дальше searchRange — её findNearestNewline не берёт
+    return nl >= 0 ? lo + static_cast<int>(nl) + 1 : half;
+}
+
+// ------------------ insertIntoLeaf (правка на месте через разрыв) ------------------
+Node* Tree::insertIntoLeaf(LeafNode* leaf, int pos, const char* data, int len) {
+    if (pos < 0) pos = 0;
+    if (pos > leaf->length) pos = leaf->length;
+
+    // Вставка в разрыв буфера; при нехватке места insertAt сам расширит буфер
+    // (если бросит — лист остаётся нетронутым и по-прежнему принадлежит дереву).
+    leaf->insertAt(pos, data, len, &storage->pool);
+
+    // Если слишком большой — разбиваем; хвост вставит родитель.
+    //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
+    if (leaf->length > MAX_LEAF_SIZE) {
+        int splitIndex = findSplitIndexForLeaf(leaf);
+        // '\n' у середины сдвигает разрез на SPLIT_SEARCH_RANGE — ни одна половина не должна превысить MAX_LEAF_SIZE
+        if (splitIndex > MAX_LEAF_SIZE || leaf->length - splitIndex > MAX_LEAF_SIZE) splitIndex = leaf->length / 2;
+        return splitLeafAtOffset(leaf, splitIndex);
+    }
+
+    return nullptr;
+}
+
+
+
+// Вставляет [data, data+len) в позицию pos внутри node (node != nullptr).
+// Возвращает нового правого соседа node, если node разделился, иначе nullptr.
+Node* Tree::insertRecursive(Node* node, TextOffset pos, const char* data, int len) {
+    if (node->getType() == NodeType::NODE_LEAF) {
+        // pos внутри листа (findChildForInsert), поэтому помещается в int
+        return insertIntoLeaf(static_cast<LeafNode*>(node), static_cast<int>(pos), data, len);
+    }
+
+    auto inner = static_cast<InternalNode*>(node);
+    int i = inner->findChildForInsert(pos);
+
+    // Полный узел разделится, если разделится ребёнок. Запасной узел берём заранее:
+    // после правки ребёнка выделять память уже нельзя (иначе его хвост некуда деть).
+    InternalNode* spare = nullptr;
+    if (inner->childCount == BTREE_MAX_CHILDREN) spare = createInternal();
+
+    Node* sibling = nullptr;
+    try {
+        // Общий со снимком ребёнок сначала копируется (копирование пути)
+        sibling = insertRecursive(mutableChild(inner, i), pos - inner->childOffset(i), data, len);
+    } catch (...) {
+        if (spare) destroyNode(spare);
+        throw;
+    }
+    inner->updateChild(i);
+
+    if (!sibling) {
+        if (spare) destroyNode(spare);
+        return nullptr;
+    }
+    if (!spare) {
+        inner->insertChild(i + 1, sibling);
+        return nullptr;
+    }
+
+    // Узел полон: верхняя половина детей уходит в запасной узел
+    int keep = (BTREE_MAX_CHILDREN + 1) / 2;
+    while (inner->childCount > keep) {
+        spare->insertChild(0, inner->removeChild(inner->childCount - 1));
+    }
+    if (i + 1 <= inner->childCount) inner->insertChild(i + 1, sibling);
+    else spare->insertChild(i + 1 - inner->childCount, sibling);
+    return spare;
+}
+
+// Удалить len байт, начиная с pos, внутри листа.
+// Правит лист на месте; возвращает его же (или nullptr, если лист опустел и удалён).
+Node* Tree::eraseFromLeaf(LeafNode* leaf, int pos, int len) {
+    if (!leaf || len <= 0) return leaf;
+
+    if (pos < 0) pos = 0;
+    if (pos >= leaf->length) return leaf;
+
+    int delLen = len;
+    if (pos + delLen > leaf->length) delLen = leaf->length - pos;
+
+    if (leaf->length - delLen <= 0) {
+        destroyNode(leaf);
+        return nullptr;
+    }
+
+    leaf->eraseAt(pos, delLen, &storage->pool);
+    return leaf;
+}
+
+
+bool Tree::isUnderfull(const Node* node) {
+    if (node->getType() == NodeType::NODE_LEAF) return node->getLength() < MIN_LEAF_SIZE;
+    return static_cast<const InternalNode*>(node)->childCount < BTREE_MIN_CHILDREN;
+}
+
+bool Tree::mergeOrBorrow(InternalNode* inner, int a) {
+    // Правятся оба соседа — общих со снимком сначала копируем
+    Node* leftNode = mutableChild(inner, a);
+    Node* rightNode = mutableChild(inner, a + 1);
+
+    if (leftNode->getType() == NodeType::NODE_LEAF) {
+        auto l = static_cast<LeafNode*>(leftNode);
+        auto r = static_cast<LeafNode*>(rightNode);
+
+        if (l->length + r->length <= MAX_LEAF_SIZE) {
+            // Слияние: забираем весь текст правого листа и удаляем его
+            r->moveGap(r->length);
+            l->insertAt(l->length, r->data, r->length, &storage->pool);
+            destroyNode(inner->removeChild(a + 1));
+            inner->updateChild(a);
+            ++mergedLeavesCount;
+            return true;
+        }
+
+        // Заём: маленький лист дотягивает до порога за счёт соседа
+        if (l->length < MIN_LEAF_SIZE) {
+            int take = MIN_LEAF_SIZE - l->length;
+            r->moveGap(r->length);
+            l->insertAt(l->length, r->data, take, &storage->pool);
+            r->eraseAt(0, take, &storage->pool);
+        } else {
+            int take = MIN_LEAF_SIZE - r->length;
+            l->moveGap(l->length);
+            r->insertAt(0, l->data + l->length - take, take, &storage->pool);
+            l->eraseAt(l->length - take, take, &storage->pool);
+        }
+        inner->updateChild(a);
+        inner->updateChild(a + 1);
+        return false;
+    }
+
+    auto l = static_cast<InternalNode*>(leftNode);
+    auto r = static_cast<InternalNode*>(rightNode);
+
+    if (l->childCount + r->childCount <= BTREE_MAX_CHILDREN) {
+        // Слияние: все дети r переходят в конец l
+        int junction = l->childCount;
+        while (r->childCount > 0) l->appendChild(r->removeChild(0));
+        destroyNode(inner->removeChild(a + 1));
+        inner->updateChild(a);
+        // Недозаполненные внуки могли оказаться рядом на стыке — чиним стык
+        fixUnderfullAround(l, junction);
+        return true;
+    }
+
+    // Заём детей у соседа
+    if (l->childCount < BTREE_MIN_CHILDREN) {
+        int junction = l->childCount;
+        while (l->childCount < BTREE_MIN_CHILDREN) l->appendChild(r->removeChild(0));
+        fixUnderfullAround(l, junction);
+    } else {
+        int junction = 0;
+        while (r->childCount < BTREE_MIN_CHILDREN) {
+            r->insertChild(0, l->removeChild(l->childCount - 1));
+            ++junction;
+        }
+        fixUnderfullAround(r, junction);
+    }
+    inner->updateChild(a);
+    inner->updateChild(a + 1);
+    return false;
+}
+
+void Tree::fixUnderfullAround(InternalNode* inner, int i) {
+    int hi = i + 1;
+    int j = i > 0 ? i - 1 : 0;
+    while (inner->childCount > 1 && j <= hi && j < inner->childCount) {
+        if (!isUnderfull(inner->children[j])) {
+            ++j;
+            continue;
+        }
+        // Пара (a, a + 1): сосед справа, а у последнего ребёнка — слева
+        int a = (j + 1 < inner->childCount) ? j : j - 1;
+        int before = inner->childCount;
+        mergeOrBorrow(inner, a);
+        if (inner->childCount < before) {
+            // Слились в узел a — проверим его ещё раз (он мог остаться маленьким)
+            --hi;
+            j = a;
+        } else {
+            ++j;
+        }
+    }
+}
+
+void Tree::discardSubtree(Node* node) {
+    if (nodeHeight(node) >= RECLAIM_MIN_HEIGHT && discarded.size() < discarded.capacity()) {
+        discarded.push_back(node); // ёмкость зарезервирована в erase()
+        return;
+    }
+    destroySubtree(node);
+}
+
+void Tree::reclaimDiscarded() {
+    for (Node* node : discarded) {
+        TreeSnapshot subtree(storage, node);
+        try {
+            NodeReclaimer::shared().release(std::move(subtree));
+        } catch (...) {
+            // Очередь не приняла — снимок разрушится здесь же (узлы уйдут в очередь storage)
+        }
+    }
+    discarded.clear();
+}
+
+// Удалить len байт, начиная с pos. Возвращает node или nullptr, если поддерево опустело.
+Node* Tree::eraseRecursive(Node* node, TextOffset pos, TextOffset len) {
+    if (!node || len <= 0) return node;
+
+    // Если лист — делегируем в отдельную функцию (диапазон уже обрезан родителем до листа)
+    if (node->getType() == NodeType::NODE_LEAF) {
+        auto leaf = static_cast<LeafNode*>(node);
+        if (pos >= leaf->length) return leaf;
+        if (len > leaf->length - pos) len = leaf->length - pos;
+        return eraseFromLeaf(leaf, static_cast<int>(pos), static_cast<int>(len));
+    }
+
+    auto inner = static_cast<InternalNode*>(node);
+    int first = inner->findChildByOffset(pos);
+    int i = first;
+    TextOffset localPos = pos - inner->childOffset(i);
+
+    // Проходим детей, задетых диапазоном: целиком покрытые удаляем, крайние правим рекурсивно
+    while (len > 0 && i < inner->childCount) {
+        TextOffset childLen = inner->childLength(i);
+        TextOffset take = (len < childLen - localPos) ? len : (childLen - localPos);
+        if (localPos == 0 && take == childLen) {
+            discardSubtree(inner->removeChild(i));
+        } else {
+            inner->children[i] = eraseRecursive(mutableChild(inner, i), localPos, take);
+            inner->updateChild(i);
+            ++i;
+        }
+        len -= take;
+        localPos = 0;
+    }
+
+    if (inner->childCount == 0) {
+        destroyNode(inner);
+        return nullptr;
+    }
+
+    // Крайние дети могли стать слишком маленькими — сливаем их с соседями
+    fixUnderfullAround(inner, first);
+    return inner;
+}
+
+
+// ==========================================
+// Перестройка дерева
+// ==========================================
+
+static size_t countLeavesRecursive(const Node* node) {
+    if (!node) return 0;
+    if (node->getType() == NodeType::NODE_LEAF) return 1;
+    auto inner = static_cast<const InternalNode*>(node);
+    size_t cnt = 0;
+    for (int i = 0; i < inner->childCount; ++i) cnt += countLeavesRecursive(inner->children[i]);
+    return cnt;
+}
+
+// leaves должен иметь зарезервированную ёмкость (push_back не бросает)
+// Листья поддерева по порядку с дополнительной ссылкой: новое дерево строится над ними,
+// пока старое (или снимок) ещё держит свои
+static void shareLeavesRecursive(Node* node, std::vector<Node*>& leaves) {
+    if (node->getType() == NodeType::NODE_LEAF) {
+        node->refCount.fetch_add(1, std::memory_order_relaxed);
+        leaves.push_back(node);
+        return;
+    }
+    auto inner = static_cast<InternalNode*>(node);
+    for (int i = 0; i < inner->childCount; ++i) shareLeavesRecursive(inner->children[i], leaves);
+}
+
+Node* Tree::buildFromLeaves(std::vector<Node*> nodes) {
+    if (nodes.empty()) return nullptr;
+
+    // Уровень за уровнем: n узлов раскладываем по ceil(n / MAX) родителям поровну
+    // (каждому достаётся не меньше BTREE_MIN_CHILDREN, если n > BTREE_MAX_CHILDREN)
+    while (nodes.size() > 1) {
+        size_t n = nodes.size();
+        size_t groups = (n + BTREE_MAX_CHILDREN - 1) / BTREE_MAX_CHILDREN;
+        std::vector<Node*> parents;
+        size_t next = 0;
+        try {
+            parents.reserve(groups);
+            for (size_t g = 0; g < groups; ++g) {
+                size_t take = n / groups + (g < n % groups ? 1 : 0);
+                InternalNode* parent = createInternal();
+                for (size_t k = 0; k < take; ++k) parent->appendChild(nodes[next++]);
+                parents.push_back(parent);
+            }
+        } catch (...) {
+            for (Node* parent : parents) destroySubtree(parent);
+            for (size_t k = next; k < n; ++k) destroySubtree(nodes[k]);
+            throw;
+        }
+        nodes.swap(parents);
+    }
+    return nodes[0];
+}
+
+void Tree::rebalance() {
+    resetFinger();
+    if (!root || root->getType() == NodeType::NODE_LEAF) return;
+
+    // Новое дерево строится над теми же листьями (+1 ссылка), старое отпускается только после:
+    // при нехватке памяти buildFromLeaves вернёт ссылки, а дерево останется прежним
+    std::vector<Node*> leaves;
+    leaves.reserve(countLeavesRecursive(root));
+    shareLeavesRecursive(root, leaves);
+    Node* rebuilt = buildFromLeaves(std::move(leaves));
+    destroySubtree(root);
+    root = rebuilt;
+}
+
+Node* Tree::rebuildWithoutEmptyLeaves(Node* node) {
+    std::vector<Node*> leaves;
+    leaves.reserve(countLeavesRecursive(node));
+    shareLeavesRecursive(node, leaves);
+    auto empty = std::remove_if(leaves.begin(), leaves.end(), [this](Node* leaf) {
+        if (leaf->getLength() > 0) return false;
+        destroySubtree(leaf);
+        return true;
+    });
+    leaves.erase(empty, leaves.end());
+    return buildFromLeaves(std::move(leaves));
+}
+
+
+long long Tree::getMergedLeavesCount() const { return mergedLeavesCount; }
+
+long long Tree::getFingerHitCount() const { return fingerHits; }
+long long Tree::getFingerMissCount() const { return fingerMisses; }
+
+// ==========================================
+// Палец: путь к последнему затронутому листу
+// ==========================================
+
+bool Tree::fingerCovers(TextOffset from, TextOffset to) const {
+    return finger.leaf && from >= finger.start && to <= finger.start + finger.leaf->length;
+}
+
+bool Tree::seekFinger(TextOffset from, TextOffset to) const {
+    Finger& f = finger;
+    if (f.leaf) {
+        if (fingerCovers(from, to)) return true;
+        // Соседний лист: шаг по пути вверх до первого узла, где можно сдвинуться, и вниз к крайнему листу
+        bool forward = from >= f.start + f.leaf->length;
+        bool backward = from < f.start;
+        int d = f.depth - 1;
+        if (forward) {
+            while (d >= 0 && f.index[d] + 1 >= f.path[d]->childCount) --d;
+        } else if (backward) {
+            while (d >= 0 && f.index[d] == 0) --d;
+        }
+        if ((forward || backward) && d >= 0) {
+            f.index[d] += forward ? 1 : -1;
+            Node* node = f.path[d]->children[f.index[d]];
+            for (++d; node->getType() == NodeType::NODE_INTERNAL; ++d) {
+                auto inner = static_cast<InternalNode*>(node);
+                f.path[d] = inner;
+                f.index[d] = forward ? 0 : inner->childCount - 1;
+                node = inner->children[f.index[d]];
+            }
+            auto next = static_cast<LeafNode*>(node);
+            if (forward) {
+                f.start += f.leaf->length;
+                f.lineStart += f.leaf->lineCount;
+            } else {
+                f.start -= next->length;
+                f.lineStart -= next->lineCount;
+            }
+            f.leaf = next;
+            if (fingerCovers(from, to)) return true;
+        }
+    }
+
+    // Спуск от корня: точка — на границе листьев берём левый (как вставка), диапазон — лист его начала
+    f.depth = 0;
+    f.start = 0;
+    f.lineStart = 0;
+    Node* node = root;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto inner = static_cast<InternalNode*>(node);
+        TextOffset local = from - f.start;
+        int i = to > from ? inner->findChildByOffset(local) : inner->findChildForInsert(local);
+        f.path[f.depth] = inner;
+        f.index[f.depth] = i;
+        ++f.depth;
+        f.start += inner->childOffset(i);
+        f.lineStart += inner->childLineOffset(i);
+        node = inner->children[i];
+    }
+    f.leaf = static_cast<LeafNode*>(node);
+    return false;
+}
+
+void Tree::ownFingerPath() {
+    // Путь уже изменяемый, если ни один его узел не общий со снимком — тогда ничего не копируется
+    try {
+        Node* node = mutableRoot();
+        for (int d = 0; d < finger.depth; ++d) {
+            finger.path[d] = static_cast<InternalNode*>(node);
+            node = mutableChild(finger.path[d], finger.index[d]);
+        }
+        finger.leaf = static_cast<LeafNode*>(node);
+    } catch (...) {
+        resetFinger(); // часть пути уже заменена копиями
+        throw;
+    }
+}
 
-    if (!leaf) return nullptr;
+void Tree::updateFingerPath() {
+    for (int d = finger.depth - 1; d >= 0; --d) finger.path[d]->updateChild(finger.index[d]);
+}
 
-    // Дальше логика поиска внутри листа (почти как у тебя было)
-    int currentLine = 0;
-    int startPos = 0;
-    int endPos = -1;
-    bool foundStart = false;
+bool Tree::insertAtFinger(TextOffset pos, const char* data, int len) {
+    bool hit = seekFinger(pos, pos);
+    if (!fingerCovers(pos, pos) || finger.leaf->length + len > MAX_LEAF_SIZE) {
+        ++fingerMisses;
+        return false;
+    }
+    ownFingerPath();
+    // При исключении (bad_alloc) лист не изменён, палец остаётся верным
+    finger.leaf->insertAt(static_cast<int>(pos - finger.start), data, len, &storage->pool);
+    updateFingerPath();
+    ++(hit ? fingerHits : fingerMisses);
+    return true;
+}
 
-    // Если localIndex == 0, значит строка начинается с начала листа
-    if (localIndex == 0) foundStart = true;
+bool Tree::eraseAtFinger(TextOffset pos, TextOffset len) {
+    bool hit = seekFinger(pos, pos + len);
+    // Лист не должен стать недозаполненным (корень-лист — только не опустеть): иначе нужно слияние
+    if (!fingerCovers(pos, pos + len) ||
+        finger.leaf->length - len < (finger.depth > 0 ? MIN_LEAF_SIZE : 1)) {
+        ++fingerMisses;
+        return false;
+    }
+    ownFingerPath();
+    finger.leaf->eraseAt(static_cast<int>(pos - finger.start), static_cast<int>(len), &storage->pool);
+    updateFingerPath();
+    ++(hit ? fingerHits : fingerMisses);
+    return true;
+}
 
+bool Tree::compactStep() {
+    TextOffset total = root ? root->getLength() : 0;
+    if (!root || root->getType() == NodeType::NODE_LEAF || compactCursor >= total) {
+        compactCursor = 0;
+        return false;
+    }
+    drainReleased(false);
+
+    // Родитель листа, в котором стоит курсор прохода
+    seekFinger(compactCursor, compactCursor + 1);
+    int depth = finger.depth;
+    InternalNode* parent = finger.path[depth - 1];
+    compactCursor = finger.start - parent->childOffset(finger.index[depth - 1]) + parent->totalLength();
+    bool more = compactCursor < total;
+    if (!more) compactCursor = 0; // следующий шаг начнёт новый проход
+    // Структура под родителем сейчас изменится: палец сбрасывается, его путь (path) нужен ниже
+    resetFinger();
+    // Узел под общим со снимком предком тоже общий, хотя его refCount == 1
+    for (int d = 0; d < depth; ++d) {
+        if (!finger.path[d]->isUnique()) return more;
+    }
 
-    for (int i = 0; i < leaf->length; i++) {
-        // Поиск конца строки (выполняется, если начало уже найдено)
-        if (foundStart) { // Уровень 2
-            if (leaf->data[i] == '\n') { // Уровень 3
-                endPos = i;
-                break;
-            }
-            continue; // Если не нашли конец, продолжаем сканирование
-        }
-        
-        // Поиск начала строки (выполняется, если !foundStart)
-        
-        // Если это не перенос строки, пропускаем (Level 2)
-        if (leaf->data[i] != '\n') {
+    auto packable = [](const Node* node) {
+        auto leaf = static_cast<const LeafNode*>(node);
+        return node->isUnique() && !(leaf->flags & NODE_FLAG_MAPPED) && leaf->length < COMPACT_TARGET_FILL;
+    };
+
+    // Серии подряд идущих листьев, которые ужимаются хотя бы на один лист: [first, first + count) -> packed
+    struct Run {
+        int first;
+        int count;
+        int packed;
+    };
+    Run runs[BTREE_MAX_CHILDREN];
+    int runCount = 0;
+    int freshCount = 0;
+    for (int i = 0; i < parent->childCount;) {
+        if (!packable(parent->children[i])) {
+            ++i;
             continue;
         }
-
-        // Это перенос строки, увеличиваем счетчик
-        currentLine++;
-        
-        // Проверяем, достигли ли мы нужной строки (Level 2)
-        if (currentLine == localIndex) {
-            startPos = i + 1; // Начало сразу после \n
-            foundStart = true;
+        int j = i;
+        TextOffset bytes = 0;
+        while (j < parent->childCount && packable(parent->children[j])) bytes += parent->childLength(j++);
+        int packed = static_cast<int>((bytes + COMPACT_TARGET_FILL - 1) / COMPACT_TARGET_FILL);
+        if (packed < j - i) {
+            runs[runCount++] = Run{i, j - i, packed};
+            freshCount += packed;
         }
-        
-        // После нахождения начала, продолжаем итерацию, чтобы следующий символ
-        // был обработан блоком 'if (foundStart)' для поиска конца.
+        i = j;
     }
+    if (runCount == 0) return more;
 
-    // Если дошли до конца листа, а \n не встретили — значит строка идет до конца блока
-    if (foundStart && endPos == -1) {
-        endPos = leaf->length;
+    // Новые листья выделяются до правки дерева: при исключении оно не тронуто
+    LeafNode* fresh[BTREE_MAX_CHILDREN];
+    int made = 0;
+    try {
+        for (int r = 0; r < runCount; ++r) {
+            const Run& run = runs[r];
+            TextOffset bytes = parent->childOffset(run.first + run.count) - parent->childOffset(run.first);
+            int src = run.first;
+            int srcPos = 0;
+            for (int k = 0; k < run.packed; ++k) {
+                // Поровну: каждый лист не короче MIN_LEAF_SIZE (исходные листья были не короче)
+                int len = static_cast<int>(bytes / run.packed + (k < bytes % run.packed ? 1 : 0));
+                LeafNode* leaf = createLeaf(nullptr, len);
+                fresh[made++] = leaf;
+                for (int filled = 0; filled < len;) {
+                    auto from = static_cast<const LeafNode*>(parent->children[src]);
+                    int n = from->length - srcPos < len - filled ? from->length - srcPos : len - filled;
+                    from->copyOut(srcPos, n, leaf->data + filled);
+                    filled += n;
+                    srcPos += n;
+                    if (srcPos == from->length) {
+                        ++src;
+                        srcPos = 0;
+                    }
+                }
+                leaf->recount();
+            }
+        }
+    } catch (...) {
+        for (int k = 0; k < made; ++k) destroyNode(fresh[k]);
+        throw;
     }
 
-    if (!foundStart) return nullptr; // Что-то пошло не так
-
-    int lineLen = endPos - startPos;
-    // Защита от отрицательной длины
-    if (lineLen < 0) lineLen = 0; 
-
-    auto result = new char[lineLen + 1]; // NOSONAR
-    if (lineLen > 0) {
-        std::memcpy(result, leaf->data + startPos, lineLen);
+    // Замена серий справа налево (номера детей левее не сдвигаются); веса родителя не меняются
+    for (int r = runCount - 1; r >= 0; --r) {
+        const Run& run = runs[r];
+        for (int k = run.count - 1; k >= 0; --k) destroyNode(parent->removeChild(run.first + k));
+        made -= run.packed;
+        for (int k = 0; k < run.packed; ++k) parent->insertChild(run.first + k, fresh[made + k]);
     }
-    result[lineLen] = '\0';
 
-    return result;
+    // Родитель мог стать недозаполненным — сливаем вверх по пути, пока это нужно
+    for (int d = depth - 2; d >= 0 && isUnderfull(finger.path[d + 1]); --d) {
+        fixUnderfullAround(finger.path[d], finger.index[d]);
+    }
+    while (root->getType() == NodeType::NODE_INTERNAL && static_cast<InternalNode*>(root)->childCount == 1) {
+        Node* child = static_cast<InternalNode*>(root)->children[0];
+        destroyNode(root);
+        root = child;
+    }
+    return more;
 }
 
-// Tree.cpp
-int Tree::getTotalLineCount() const {
+LineIndex Tree::getLineForOffset(TextOffset offset) const {
     if (!root) return 0;
-    return root->getLineCount();
+    TextOffset total = root->getLength();
+    if (offset < 0) offset = 0;
+    if (offset > total) offset = total;
+
+    ++(seekFinger(offset, offset) ? fingerHits : fingerMisses);
+    return finger.lineStart + finger.leaf->newlinesBefore(static_cast<int>(offset - finger.start), storage.get());
 }
 
-// static helper: вычислить байтовое смещение для начала указанной строки внутри поддерева.
-// Предполагается: node != nullptr и lineIndex корректен для этого поддерева.
-// При нарушении инвариантов — assertion в debug.
-static int getOffsetForLineRecursive(Node* node, int lineIndex) {
-    assert(node != nullptr);
+TextLocation Tree::locate(TextOffset offset) const {
+    if (!root) return TextLocation();
+    TextOffset total = root->getLength();
+    if (offset < 0) offset = 0;
+    if (offset > total) offset = total;
+
+    bool hit = seekFinger(offset, offset);
+    const LeafNode* leaf = finger.leaf;
+    int local = static_cast<int>(offset - finger.start);
+    int k = leaf->newlinesBefore(local, storage.get());
+    if (k == 0) {
+        // Строка начинается левее листа — её начало ищет обычный спуск
+        ++fingerMisses;
+        return TreeReader::locate(offset);
+    }
+    ++(hit ? fingerHits : fingerMisses);
+    int lineStartLocal = leaf->offsetAfterNewline(k, storage.get());
+    TextLocation loc;
+    loc.line = finger.lineStart + k;
+    loc.lineStart = finger.start + lineStartLocal;
+    loc.column = local - lineStartLocal;
+    loc.charColumn = leaf->countChars(lineStartLocal, local - lineStartLocal);
+    return loc;
+}
 
-    if (node->getType() == NodeType::NODE_LEAF) {
-        // Т.к. мы проверили getType, static_cast безопасен и быстрее dynamic_cast.
-        auto leaf = static_cast<LeafNode*>(node);
-        // Защита на случай нарушения инварианта (только debug)
-        assert(leaf != nullptr);
+void Tree::insert(TextOffset pos, const char* data, TextOffset len) {
+    if (len <= 0) return;
 
-        int linesSeen = 0;
-        for (int i = 0; i < leaf->length; ++i) {
-            if (linesSeen == lineIndex) return i; // offset внутри листа
-            if (leaf->data[i] == '\n') ++linesSeen;
-        }
-        if (linesSeen == lineIndex) return leaf->length;
-        // Если индекс оказался некорректным — бросим понятное исключение в релизе.
-        throw std::out_of_range("Line index out of range inside leaf");
-    } else {
-        // internal node
-        auto in = static_cast<InternalNode*>(node);
-        assert(in != nullptr);
+    TextOffset total = 0;
+    if (root) total = root->getLength();
+    if (len > INT64_MAX - total) throw std::length_error("Tree::insert: document length overflows TextOffset");
+    if (pos < 0) pos = 0;
+    if (pos > total) pos = total;
 
-        int leftLines = in->left ? in->left->getLineCount() : 0;
-        if (lineIndex < leftLines) {
-            return getOffsetForLineRecursive(in->left, lineIndex);
-        } else {
-            int leftLen = in->left ? in->left->getLength() : 0;
-            return leftLen + getOffsetForLineRecursive(in->right, lineIndex - leftLines);
-        }
+    drainReleased(false);
+    if (len > MAX_LEAF_SIZE) {
+        resetFinger();
+        // Крупная вставка не влезает в один лист: собираем её отдельным поддеревом
+        spliceNode(pos, buildFromText(data, len, len >= PARALLEL_BUILD_MIN ? &WorkStealingPool::shared() : nullptr, false));
+        return;
     }
-}
+    // Лист с вставкой не длиннее 2 * MAX_LEAF_SIZE и режется пополам (см. insertIntoLeaf)
+    int chunk = static_cast<int>(len);
 
+    if (!root) {
+        root = createLeaf(data, chunk);
+        return;
+    }
+    // Вставка, помещающаяся в лист пальца, не спускается от корня
+    if (insertAtFinger(pos, data, chunk)) return;
+    resetFinger();
+    mutableRoot();
+
+    // Корень может разделиться — новый корень выделяем заранее (см. insertRecursive)
+    InternalNode* newRoot = nullptr;
+    if (root->getType() == NodeType::NODE_LEAF
+            ? root->getLength() + chunk > MAX_LEAF_SIZE
+            : static_cast<InternalNode*>(root)->childCount == BTREE_MAX_CHILDREN) {
+        newRoot = createInternal();
+    }
 
-int Tree::getOffsetForLine(int lineIndex0Based) const {
-    if (!root) throw std::out_of_range("Tree is empty");
-    if (lineIndex0Based < 0 || lineIndex0Based >= getTotalLineCount()) {
-        std::basic_ostringstream<char> oss;
-        oss << "Line index out of range (0.." << (getTotalLineCount()-1) << ")";
-        throw std::out_of_range(oss.str());
+    Node* sibling = nullptr;
+    try {
+        sibling = insertRecursive(root, pos, data, chunk);
+    } catch (...) {
+        if (newRoot) destroyNode(newRoot);
+        throw;
+    }
+
+    if (sibling) {
+        newRoot->appendChild(root);
+        newRoot->appendChild(sibling);
+        root = newRoot;
+    } else if (newRoot) {
+        destroyNode(newRoot);
     }
-    return getOffsetForLineRecursive(root, lineIndex0Based);
 }
 
+void Tree::erase(TextOffset pos, TextOffset len) {
+    if (!root || len <= 0) return;
+    TextOffset total = root->getLength();
+    if (pos < 0) pos = 0;
+    if (pos >= total) return;
+
+    // Сравнение через вычитание: pos + len может переполниться
+    if (len > total - pos) len = total - pos;
 
-// Поиск листа по смещению (внутри Leaf — localOffset станет смещением в листе)
-LeafNode* Tree::findLeafByOffsetRecursive(Node* node, int& localOffset) {
-    if (!node) return nullptr;
-    if (node->getType() == NodeType::NODE_LEAF) {
-        return static_cast<LeafNode*>(node);
+    drainReleased(false);
+    if (eraseAtFinger(pos, len)) return;
+    resetFinger();
+    // Место под отцепленные поддеревья: не больше двух краёв на уровень (без места — освобождаются сразу)
+    try {
+        discarded.reserve(static_cast<std::size_t>(2 * BTREE_MAX_CHILDREN * (nodeHeight(root) + 1)));
+    } catch (const std::bad_alloc&) {
+        discarded.shrink_to_fit();
     }
-    auto inner = static_cast<InternalNode*>(node);
-    int leftLen = 0;
-    if (inner->left) leftLen = inner->left->getLength();
-    if (localOffset < leftLen) {
-        return findLeafByOffsetRecursive(inner->left, localOffset);
-    } else {
-        localOffset -= leftLen;
-        return findLeafByOffsetRecursive(inner->right, localOffset);
+    root = eraseRecursive(mutableRoot(), pos, len);
+    reclaimDiscarded();
+
+    // Корень с единственным ребёнком — лишний уровень
+    while (root && root->getType() == NodeType::NODE_INTERNAL &&
+           static_cast<InternalNode*>(root)->childCount == 1) {
+        Node* child = static_cast<InternalNode*>(root)->children[0];
+        destroyNode(root);
+        root = child;
     }
 }
 
-// splitLeafAtOffset: возвращает новый суб-дерево указатель (InternalNode или Leaf/NULL)
-Node* Tree::splitLeafAtOffset(LeafNode* leaf, int offset) { //NOSONAR
-    if (!leaf) return nullptr;
-    if (offset < 0) offset = 0;
-    if (offset > leaf->length) offset = leaf->length;
-
-    int leftLen = offset;
-    int rightLen = leaf->length - offset;
-
-    LeafNode* leftLeaf = nullptr;
-    LeafNode* rightLeaf = nullptr;
+void Tree::applyEdits(const TextEdit* edits, std::size_t count) {
+    if (!edits || count == 0) return;
+    TextOffset total = root ? root->getLength() : 0;
+
+    // Проверяем весь пакет до первой правки: ошибка не должна оставить его применённым наполовину
+    std::vector<TextEdit> sorted(edits, edits + count);
+    TextOffset growth = 0; // итоговая длина — total + growth
+    for (TextEdit& edit : sorted) {
+        if (edit.pos < 0 || edit.pos > total || edit.eraseLen < 0 || edit.textLen < 0 ||
+            (edit.textLen > 0 && !edit.text)) {
+            throw std::invalid_argument("Tree::applyEdits: edit out of range");
+        }
+        if (edit.eraseLen > total - edit.pos) edit.eraseLen = total - edit.pos;
+        if (edit.textLen > INT64_MAX - total - growth) {
+            throw std::length_error("Tree::applyEdits: document length overflows TextOffset");
+        }
+        growth += edit.textLen - edit.eraseLen;
+    }
+    // С одного места сначала вставка, потом удаление; иначе — порядок массива
+    std::stable_sort(sorted.begin(), sorted.end(), [](const TextEdit& a, const TextEdit& b) {
+        if (a.pos != b.pos) return a.pos < b.pos;
+        return a.eraseLen == 0 && b.eraseLen > 0;
+    });
+    for (std::size_t k = 1; k < sorted.size(); ++k) {
+        if (sorted[k].pos - sorted[k - 1].pos < sorted[k - 1].eraseLen) {
+            throw std::invalid_argument("Tree::applyEdits: edits overlap");
+        }
+    }
 
-    // Попытка создать левый лист (если нужен)
-    if (leftLen > 0) {
+    drainReleased(false);
+    if (static_cast<TextOffset>(count) <= total / (static_cast<TextOffset>(MAX_LEAF_SIZE) * APPLY_EDITS_LEAVES_PER_EDIT)) {
+        // Правки по одной, но поверх прежнего корня, который держим лишней ссылкой: первая правка
+        // на каждом пути копирует его (как при снимке). Исключение посреди пакета — возвращаем
+        // прежний корень, и пакет не применён даже частично.
+        Node* saved = root;
+        if (saved) saved->refCount.fetch_add(1, std::memory_order_relaxed);
         try {
-            leftLeaf = new LeafNode(leaf->data, leftLen); //NOSONAR
+            // С конца: смещения ещё не применённых правок не сдвигаются
+            for (std::size_t k = sorted.size(); k-- > 0;) {
+                const TextEdit& edit = sorted[k];
+                erase(edit.pos, edit.eraseLen);
+                insert(edit.pos, edit.text, edit.textLen);
+            }
         } catch (...) {
-            if (leftLeaf)  clearRecursive(leftLeaf);
-            if (rightLeaf) clearRecursive(rightLeaf);
+            resetFinger();
+            destroySubtree(root);
+            root = saved;
             throw;
         }
+        destroySubtree(saved);
+        return;
     }
+    applyEditsPass(sorted);
+}
 
-    // Попытка создать правый лист (если нужен)
-    if (rightLen > 0) {
+void Tree::applyEditsPass(const std::vector<TextEdit>& sorted) {
+    resetFinger();
+    // Старые листья по порядку, каждый с дополнительной ссылкой: само дерево не трогается до конца
+    // прохода, при исключении ссылки просто возвращаются и текст остаётся прежним.
+    std::vector<Node*> old;
+    std::vector<char> touched;
+    old.reserve(countLeavesRecursive(root));
+    touched.resize(old.capacity());
+    if (root) shareLeavesRecursive(root, old);
+
+    // Новый порядок листьев: second — нетронутый старый лист, иначе новый
+    std::vector<std::pair<Node*, bool>> out;
+    // Текст подряд идущих затронутых листьев с применёнными правками; [0, consumed) уже в листьях
+    std::string pending;
+    std::size_t consumed = 0;
+
+    auto emit = [&](int n) {
+        LeafNode* leaf = createLeaf(pending.data() + consumed, n);
         try {
-            rightLeaf = new LeafNode(leaf->data + offset, rightLen); //NOSONAR
+            out.emplace_back(leaf, false);
         } catch (...) {
-            // если левый уже создан — удалить его, чтобы не было утечки
-            if (leftLeaf) { delete leftLeaf; leftLeaf = nullptr; }//NOSONAR
+            destroyNode(leaf);
             throw;
         }
-    }
-
-    // На этом моменте leftLeaf/rightLeaf созданы успешно (возможны nullptr).
-    // Создаём возвращаемую структуру и только после успешного создания — удаляем исходный leaf.
-    Node* result = nullptr;
+        consumed += static_cast<std::size_t>(n);
+    };
+    // Полные листья из накопленного текста — как в TreeBuilder: MAX_LEAF_SIZE байт, разрез после
+    // последнего '\n' второй половины. Хвост не короче MAX_LEAF_SIZE остаётся ждать продолжения.
+    auto drain = [&]() {
+        while (pending.size() - consumed > static_cast<std::size_t>(2 * MAX_LEAF_SIZE)) {
+            const int half = MAX_LEAF_SIZE / 2;
+            std::int64_t nl = findLastNewline(pending.data() + consumed + half, static_cast<std::size_t>(MAX_LEAF_SIZE - half));
+            emit(nl >= 0 ? half + static_cast<int>(nl) + 1 : MAX_LEAF_SIZE);
+        }
+        // Сдвигаем буфер, только когда отданное длиннее остатка (амортизированно O(1) на байт)
+        if (consumed > 0 && consumed >= pending.size() - consumed) {
+            pending.erase(0, consumed);
+            consumed = 0;
+        }
+    };
+    // Затронутый участок кончился: остаток режется на листы, как в fromText
+    auto flush = [&]() {
+        if (pending.size() > consumed) {
+            std::vector<int> lengths;
+            collectLeafLengths(pending.data() + consumed, static_cast<TextOffset>(pending.size() - consumed), lengths, nullptr);
+            for (int n : lengths) emit(n);
+        }
+        pending.clear();
+        consumed = 0;
+    };
+    auto appendText = [&](const char* text, TextOffset len) {
+        while (len > 0) {
+            std::size_t n = len < 2 * MAX_LEAF_SIZE ? static_cast<std::size_t>(len) : static_cast<std::size_t>(2 * MAX_LEAF_SIZE);
+            pending.append(text, n);
+            drain();
+            text += n;
+            len -= static_cast<TextOffset>(n);
+        }
+    };
+    auto appendLeaf = [&](const LeafNode* leaf, int from, int n) {
+        std::size_t at = pending.size();
+        pending.resize(at + static_cast<std::size_t>(n));
+        leaf->copyOut(from, n, &pending[at]);
+        drain();
+    };
+
+    Node* rebuilt = nullptr;
     try {
-        if (!leftLeaf && !rightLeaf) {
-            result = nullptr;
-        } else if (!leftLeaf) {
-            result = rightLeaf;
-            rightLeaf = nullptr; // ownership перенесён
-        } else if (!rightLeaf) {
-            result = leftLeaf;
-            leftLeaf = nullptr;
-        } else {
-            result = new InternalNode(leftLeaf, rightLeaf);//NOSONAR
-            leftLeaf = nullptr; rightLeaf = nullptr;
+        out.reserve(old.size());
+        std::size_t e = 0;
+        TextOffset leafStart = 0;
+        TextOffset skipUntil = 0; // конец последнего удаления (может захватывать следующие листья)
+        for (std::size_t i = 0; i < old.size(); ++i) {
+            auto leaf = static_cast<LeafNode*>(old[i]);
+            TextOffset leafEnd = leafStart + leaf->length;
+            bool last = i + 1 == old.size();
+            // Правка в конце текста относится к последнему листу, на границе листьев — к правому
+            auto inLeaf = [&](const TextEdit& edit) { return edit.pos < leafEnd || (last && edit.pos == leafEnd); };
+
+            bool hit = skipUntil > leafStart || (e < sorted.size() && inLeaf(sorted[e]));
+            // Короткий хвост затронутого участка доливаем нетронутым соседом, а не оставляем листом
+            if (!hit && pending.size() - consumed > 0 && pending.size() - consumed < static_cast<std::size_t>(MIN_LEAF_SIZE)) {
+                hit = true;
+            }
+            if (!hit) {
+                flush();
+                out.emplace_back(leaf, true);
+                leafStart = leafEnd;
+                continue;
+            }
+
+            touched[i] = 1;
+            int at = skipUntil > leafStart ? static_cast<int>(std::min<TextOffset>(skipUntil - leafStart, leaf->length)) : 0;
+            for (; e < sorted.size() && inLeaf(sorted[e]); ++e) {
+                const TextEdit& edit = sorted[e];
+                auto local = static_cast<int>(edit.pos - leafStart);
+                if (local > at) appendLeaf(leaf, at, local - at);
+                appendText(edit.text, edit.textLen);
+                skipUntil = edit.pos + edit.eraseLen;
+                at = std::max(local, static_cast<int>(std::min<TextOffset>(skipUntil - leafStart, leaf->length)));
+            }
+            if (at < leaf->length) appendLeaf(leaf, at, leaf->length - at);
+            leafStart = leafEnd;
         }
+        // Пустое дерево: все правки — вставки в позицию 0
+        for (; e < sorted.size(); ++e) appendText(sorted[e].text, sorted[e].textLen);
+        flush();
+
+        std::vector<Node*> nodes;
+        nodes.reserve(out.size());
+        for (const auto& entry : out) nodes.push_back(entry.first);
+        out.clear();
+
+        // Ссылки на затронутые листья больше не нужны (их держит старое дерево), ссылки на
+        // нетронутые переходят новому. При нехватке памяти buildFromLeaves сам их вернёт.
+        for (std::size_t i = 0; i < old.size(); ++i) {
+            if (touched[i]) destroySubtree(old[i]);
+        }
+        old.clear();
+        rebuilt = buildFromLeaves(std::move(nodes));
     } catch (...) {
-        // Если создание InternalNode упало — удалить дочерние листья (если они ещё у нас)
-        if (leftLeaf) { delete leftLeaf; leftLeaf = nullptr; }//NOSONAR
-        if (rightLeaf) { delete rightLeaf; rightLeaf = nullptr; }//NOSONAR
+        for (const auto& entry : out) {
+            if (!entry.second) destroyNode(entry.first);
+        }
+        for (Node* leaf : old) destroySubtree(leaf);
         throw;
     }
-
-    // Теперь безопасно удалить оригинал — ownership перенесён.
-    delete leaf;//NOSONAR
-    return result;
+    destroySubtree(root);
+    root = rebuilt;
 }
 
 
+// ==========================================
+// Разрез и склейка деревьев
+// ==========================================
+// Все операции работают на дополнительных ссылках: корень дерева получает +1 ссылку и режется/
+// склеивается как общий со снимком (путь копируется). Исходный корень остаётся нетронутым —
+// при исключении дерево просто сохраняет его, при успехе ссылка на него отпускается.
+
+Node* Tree::ownNode(Node* node) {
+    if (node->isUnique()) return node;
+    Node* copy = copyNode(node);
+    destroySubtree(node);
+    return copy;
+}
 
-// Вспомогательная: вычислить индекс разреза (поведение как в buildFromTextRecursive)
-int Tree::findSplitIndexForLeaf(const LeafNode* leaf) const {
-    if (!leaf || !leaf->data) return 0;
-    int half = leaf->length / 2;
-    int searchRange = (leaf->length < 512) ? (leaf->length / 4) : 256;
-
-    // вправо
-    for (int i = 0; i < searchRange; ++i) {
-        int idx = half + i;
-        if (idx < leaf->length && leaf->data[idx] == '\n') return idx + 1;
-    }
-    // влево
-    for (int i = 0; i < searchRange; ++i) {
-        int idx = half - i;
-        if (idx > 0 && idx < leaf->length && leaf->data[idx] == '\n') return idx + 1;
-    }
-    return half;
+// Узел с одним ребёнком заменяется этим ребёнком, пустой — nullptr
+static Node* unwrapSingleChild(Tree& tree, InternalNode* inner) {
+    if (inner->childCount > 1) return inner;
+    Node* child = inner->childCount == 1 ? inner->removeChild(0) : nullptr;
+    tree.destroyNode(inner);
+    return child;
 }
 
-// ------------------ insertIntoLeaf (защита временного буфера) ------------------
-Node* Tree::insertIntoLeaf(LeafNode* leaf, int pos, const char* data, int len) {
-    if (!leaf) {
-        // Прямо создаём лист; если бросит — ничего не утекает здесь.
-        return new LeafNode(data, len);//NOSONAR
+Node* Tree::attachRecursive(Node* node, Node* piece, int pieceHeight, bool atEnd) {
+    auto inner = static_cast<InternalNode*>(node);
+    // Полный узел разделится — запасной узел берём заранее (как в insertRecursive)
+    InternalNode* spare = nullptr;
+    try {
+        if (inner->childCount == BTREE_MAX_CHILDREN) spare = createInternal();
+    } catch (...) {
+        destroySubtree(piece);
+        throw;
     }
+    int keep = (BTREE_MAX_CHILDREN + 1) / 2;
 
-    if (pos < 0) pos = 0;
-    if (pos > leaf->length) pos = leaf->length;
-
-    int leafLen = leaf->length;
-    int newLen = leafLen + len;
+    if (inner->height == pieceHeight + 1) {
+        // piece становится крайним ребёнком узла
+        if (spare) {
+            while (inner->childCount > keep) spare->insertChild(0, inner->removeChild(inner->childCount - 1));
+        }
+        InternalNode* target = atEnd && spare ? spare : inner;
+        int at = atEnd ? target->childCount : 0;
+        target->insertChild(at, piece);
+        try {
+            // Корень меньшего дерева может оказаться недозаполненным — сливаем его с соседом
+            fixUnderfullAround(target, at);
+        } catch (...) {
+            if (spare) destroySubtree(spare);
+            throw;
+        }
+        return spare;
+    }
 
-    // Временный буфер
-    char* buf = nullptr;
+    int i = atEnd ? inner->childCount - 1 : 0;
+    Node* child = nullptr;
+    try {
+        child = mutableChild(inner, i);
+    } catch (...) {
+        if (spare) destroyNode(spare);
+        destroySubtree(piece);
+        throw;
+    }
+    Node* sibling = nullptr;
     try {
-        buf = new char[newLen];//NOSONAR
-    } catch (...) { //NOSONAR
-        throw; // если не выделилось — просто пробросим
+        sibling = attachRecursive(child, piece, pieceHeight, atEnd);
+    } catch (...) {
+        if (spare) destroyNode(spare);
+        throw;
     }
+    inner->updateChild(i);
 
-    if (pos > 0 && leaf->data) {
-        std::memcpy(buf, leaf->data, pos);
-    }
-    if (len > 0 && data) {
-        std::memcpy(buf + pos, data, len);
+    if (!sibling) {
+        if (spare) destroyNode(spare);
+        return nullptr;
     }
-    if (pos < leafLen && leaf->data) {
-        std::memcpy(buf + pos + len, leaf->data + pos, leafLen - pos);
+    if (!spare) {
+        inner->insertChild(i + 1, sibling);
+        return nullptr;
     }
+    while (inner->childCount > keep) spare->insertChild(0, inner->removeChild(inner->childCount - 1));
+    if (i + 1 <= inner->childCount) inner->insertChild(i + 1, sibling);
+    else spare->insertChild(i + 1 - inner->childCount, sibling);
+    return spare;
+}
 
-    // Создаём новый лист; если бросит — освободим buf
-    LeafNode* newLeaf = nullptr;
+Node* Tree::joinNodes(Node* left, Node* right) {
+    if (!left) return right;
+    if (!right) return left;
+
+    InternalNode* top = nullptr;
     try {
-        newLeaf = new LeafNode(buf, newLen);//NOSONAR
+        top = createInternal();
     } catch (...) {
-        delete[] buf;//NOSONAR
+        destroySubtree(left);
+        destroySubtree(right);
         throw;
     }
-    // newLeaf создан успешно — временный buf больше не нужен
-    delete[] buf;//NOSONAR
-
-    // Удаляем исходный лист (ownership перенесён)
-    delete leaf;//NOSONAR
 
-    // Если слишком большой — разбиваем; splitLeafAtOffset берёт владение newLeaf или удалит его при ошибке.
-    //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
-    if (newLeaf->length > MAX_LEAF_SIZE) {
-        int splitIndex = findSplitIndexForLeaf(newLeaf);
-        Node* splitted = nullptr;
+    int hl = nodeHeight(left);
+    int hr = nodeHeight(right);
+    if (hl == hr) {
+        // Одна высота: общий корень над обоими, недозаполненные корни сливаются/занимают у соседа
+        top->appendChild(left);
+        top->appendChild(right);
         try {
-            splitted = splitLeafAtOffset(newLeaf, splitIndex);
-            return splitted;
+            fixUnderfullAround(top, 0);
         } catch (...) {
-            // split упал — newLeaf может быть удалён внутри splitLeafAtOffset при ошибке,
-            // либо если split выбросил до удаления newLeaf — удалим его здесь, но проверить на nullptr.
-            // В нашем splitLeafAtOffset newLeaf не удаляется при исключении (мы защитились), поэтому:
-            if (newLeaf) delete newLeaf;//NOSONAR
+            destroySubtree(top);
             throw;
         }
+        return unwrapSingleChild(*this, top);
     }
 
-    return newLeaf;
+    // Меньшее дерево подвешивается к краю большего на уровне своей высоты:
+    // правому краю левого дерева или левому краю правого
+    bool atEnd = hl > hr;
+    Node* big = atEnd ? left : right;
+    Node* small = atEnd ? right : left;
+    try {
+        big = ownNode(big);
+    } catch (...) {
+        destroyNode(top);
+        destroySubtree(big);
+        destroySubtree(small);
+        throw;
+    }
+    Node* sibling = nullptr;
+    try {
+        sibling = attachRecursive(big, small, atEnd ? hr : hl, atEnd);
+    } catch (...) {
+        destroyNode(top);
+        destroySubtree(big);
+        throw;
+    }
+    if (!sibling) {
+        destroyNode(top);
+        return big;
+    }
+    top->appendChild(big);
+    top->appendChild(sibling);
+    return top;
 }
 
+void Tree::splitNodes(Node* node, TextOffset pos, Node*& left, Node*& right) {
+    left = nullptr;
+    right = nullptr;
+    if (!node) return;
+    if (pos <= 0) {
+        right = node;
+        return;
+    }
+    if (pos >= node->getLength()) {
+        left = node;
+        return;
+    }
 
-
-// Вставляет [data, data+len) в позицию pos внутри node и возвращает новый Node* для замены.
-Node* Tree::insertRecursive(Node* node, int pos, const char* data, int len) {
-    if (len <= 0) return node;
-
-    if (!node) {
-        return new LeafNode(data, len); // NOSONAR
+    try {
+        node = ownNode(node);
+    } catch (...) {
+        destroySubtree(node);
+        throw;
     }
 
     if (node->getType() == NodeType::NODE_LEAF) {
-        return insertIntoLeaf(static_cast<LeafNode*>(node), pos, data, len);
+        auto leaf = static_cast<LeafNode*>(node);
+        try {
+            right = splitLeafAtOffset(leaf, static_cast<int>(pos));
+        } catch (...) {
+            destroyNode(leaf);
+            throw;
+        }
+        left = leaf;
+        return;
     }
 
-    // Internal node: опустим лишнюю вложенность — минимальный код
     auto inner = static_cast<InternalNode*>(node);
+    int i = inner->findChildByOffset(pos);
+    TextOffset local = pos - inner->childOffset(i);
 
-    if (int leftLen = (inner->left ? inner->left->getLength() : 0); pos <= leftLen) {
-        inner->left = insertRecursive(inner->left, pos, data, len);
-    } else {
-        inner->right = insertRecursive(inner->right, pos - leftLen, data, len);
+    // Дети правее разреза уходят в новый узел, левее — остаются в этом
+    InternalNode* rightNode = nullptr;
+    try {
+        rightNode = createInternal();
+    } catch (...) {
+        destroySubtree(inner);
+        throw;
     }
-
-    inner->recalc();
-    return inner;
-}
-
-// Удалить len байт, начиная с pos, внутри листа.
-// Возвращает новый лист (или nullptr), удаляет старый leaf.
-Node* Tree::eraseFromLeaf(LeafNode* leaf, int pos, int len) {
-    if (!leaf || len <= 0) return leaf;
-
-    if (pos < 0) pos = 0;
-    if (pos >= leaf->length) return leaf;
-
-    int delLen = len;
-    if (pos + delLen > leaf->length) delLen = leaf->length - pos;
-
-    int newLen = leaf->length - delLen;
-    if (newLen <= 0) {
-        delete leaf; //NOSONAR
-        return nullptr;
+    int firstRight = local > 0 ? i + 1 : i;
+    while (inner->childCount > firstRight) rightNode->insertChild(0, inner->removeChild(inner->childCount - 1));
+    Node* child = local > 0 ? inner->removeChild(i) : nullptr;
+    Node* leftPart = unwrapSingleChild(*this, inner);
+    Node* rightPart = unwrapSingleChild(*this, rightNode);
+    if (!child) {
+        left = leftPart;
+        right = rightPart;
+        return;
     }
 
-    char* buf = nullptr;
+    // Разрезанный ребёнок: его половины приклеиваются к соседним частям
+    Node* childLeft = nullptr;
+    Node* childRight = nullptr;
     try {
-        buf = new char[newLen]; //NOSONAR
-    } catch (...) { //NOSONAR
+        splitNodes(child, local, childLeft, childRight);
+    } catch (...) {
+        destroySubtree(leftPart);
+        destroySubtree(rightPart);
         throw;
     }
-
-    if (pos > 0 && leaf->data) {
-        std::memcpy(buf, leaf->data, pos);
-    }
-    if (pos + delLen < leaf->length && leaf->data) {
-        int tail = leaf->length - (pos + delLen);
-        std::memcpy(buf + pos, leaf->data + pos + delLen, tail);
+    try {
+        left = joinNodes(leftPart, childLeft);
+    } catch (...) {
+        destroySubtree(childRight);
+        destroySubtree(rightPart);
+        throw;
     }
-
-    LeafNode* newLeaf = nullptr;
     try {
-        newLeaf = new LeafNode(buf, newLen); //NOSONAR
+        right = joinNodes(childRight, rightPart);
     } catch (...) {
-        delete[] buf; //NOSONAR
+        destroySubtree(left);
+        left = nullptr;
         throw;
     }
-    delete[] buf; //NOSONAR
-    delete leaf; //NOSONAR
-    return newLeaf;
 }
 
-
-// Если один/оба ребёнка отсутствуют — заменить internal на существующего ребёнка (или nullptr).
-// Иначе пересчитать кэши и вернуть inner.
-Node* Tree::collapseInternalIfNeeded(InternalNode* inner) {
-    if (!inner) return nullptr;
-
-    if (!inner->left && !inner->right) {
-        delete inner; // NOSONAR
-        return nullptr;
-    }
-    if (!inner->left) {
-        Node* r = inner->right;
-        delete inner; // NOSONAR
-        return r;
+static void collectLeavesRecursive(const Node* node, std::vector<const LeafNode*>& leaves) {
+    if (node->getType() == NodeType::NODE_LEAF) {
+        leaves.push_back(static_cast<const LeafNode*>(node));
+        return;
     }
-    if (!inner->right) {
-        Node* l = inner->left;
-        delete inner; // NOSONAR
-        return l;
+    auto inner = static_cast<const InternalNode*>(node);
+    for (int i = 0; i < inner->childCount; ++i) collectLeavesRecursive(inner->children[i], leaves);
+}
+
+Node* Tree::adoptRoot(const Tree& other) {
+    if (!other.root) return nullptr;
+    if (other.storage == storage) {
+        other.root->refCount.fetch_add(1, std::memory_order_relaxed);
+        return other.root;
     }
 
-    // оба ребёнка существуют — обновляем кэши и возвращаем узел
-    inner->recalc();
-    return inner;
+    // Чужой пул: узлы нельзя перенести, копируем листья (отображённые тоже — файл принадлежит other)
+    std::vector<const LeafNode*> sources;
+    sources.reserve(countLeavesRecursive(other.root));
+    collectLeavesRecursive(other.root, sources);
+    std::vector<Node*> leaves;
+    try {
+        leaves.reserve(sources.size());
+        for (const LeafNode* src : sources) {
+            LeafNode* leaf = createLeaf(nullptr, src->length);
+            src->copyOut(0, src->length, leaf->data);
+            leaf->lineCount = src->lineCount;
+            leaf->charCount = src->charCount;
+            leaves.push_back(leaf); // ёмкость зарезервирована
+        }
+    } catch (...) {
+        for (Node* leaf : leaves) destroyNode(leaf);
+        throw;
+    }
+    return buildFromLeaves(std::move(leaves));
 }
 
-// Удалить len байт, начиная с pos. Возвращает новое поддерево.
-Node* Tree::eraseRecursive(Node* node, int pos, int len) {
-    if (!node || len <= 0) return node;
-
-    // Если лист — делегируем в отдельную функцию
-    if (node->getType() == NodeType::NODE_LEAF) {
-        return eraseFromLeaf(static_cast<LeafNode*>(node), pos, len);
+Tree Tree::split(TextOffset offset) {
+    resetFinger();
+    Tree right(storage);
+    right.heapNodeCount = heapNodeCount; // узлы из new могут оказаться в обеих частях
+    TextOffset total = root ? root->getLength() : 0;
+    if (offset >= total) return right;
+
+    drainReleased(false);
+    if (offset <= 0) {
+        right.root = root;
+        root = nullptr;
+        return right;
     }
+    root->refCount.fetch_add(1, std::memory_order_relaxed);
+    Node* left = nullptr;
+    splitNodes(root, offset, left, right.root);
+    destroySubtree(root);
+    root = left;
+    return right;
+}
 
-    // Internal node
-    auto inner = static_cast<InternalNode*>(node);
+void Tree::concat(Tree&& other) {
+    resetFinger();
+    other.resetFinger();
+    if (&other == this || !other.root) return;
+    drainReleased(false);
 
-    // Используем init-statement (современный стиль)
-    if (int leftLen = (inner->left ? inner->left->getLength() : 0); pos + len <= leftLen) {
-        // Всё удаление в левом поддереве
-        inner->left = eraseRecursive(inner->left, pos, len);
-    } else if (pos >= leftLen) {
-        // Всё удаление в правом
-        inner->right = eraseRecursive(inner->right, pos - leftLen, len);
-    } else {
-        // Разрезано: часть слева, часть справа
-        int leftDel = leftLen - pos;
-        int rightDel = len - leftDel;
-        inner->left = eraseRecursive(inner->left, pos, leftDel);
-        inner->right = eraseRecursive(inner->right, 0, rightDel);
-    }
+    Node* piece = adoptRoot(other);
+    if (root) root->refCount.fetch_add(1, std::memory_order_relaxed);
+    Node* joined = joinNodes(root, piece);
+    destroySubtree(root);
+    root = joined;
 
-    // Свернуть internal если нужно (включая пересчёт кэшей)
-    return collapseInternalIfNeeded(inner);
+    if (other.storage == storage) heapNodeCount += other.heapNodeCount;
+    other.clear();
 }
 
+Tree Tree::extract(TextOffset pos, TextOffset len) {
+    Tree part(storage);
+    part.heapNodeCount = heapNodeCount;
+    part.root = extractNode(pos, len);
+    return part;
+}
 
-void Tree::insert(int pos, const char* data, int len) {
-    if (len <= 0) return;
+TreeSnapshot Tree::cut(TextOffset pos, TextOffset len) {
+    return TreeSnapshot(storage, extractNode(pos, len));
+}
 
-    int total = 0;
-    if (root) total = root->getLength();
+Node* Tree::extractNode(TextOffset pos, TextOffset len) {
+    resetFinger();
+    TextOffset total = root ? root->getLength() : 0;
+    if (pos < 0) pos = 0;
+    if (pos >= total || len <= 0) return nullptr;
+    if (len > total - pos) len = total - pos;
+
+    drainReleased(false);
+    root->refCount.fetch_add(1, std::memory_order_relaxed);
+    Node* head = nullptr;
+    Node* rest = nullptr;
+    splitNodes(root, pos, head, rest);
+    Node* middle = nullptr;
+    Node* tail = nullptr;
+    try {
+        splitNodes(rest, len, middle, tail);
+    } catch (...) {
+        destroySubtree(head);
+        throw;
+    }
+    Node* joined = nullptr;
+    try {
+        joined = joinNodes(head, tail);
+    } catch (...) {
+        destroySubtree(middle);
+        throw;
+    }
+    destroySubtree(root);
+    root = joined;
+    return middle;
+}
+
+void Tree::insertTree(TextOffset pos, Tree&& other) {
+    resetFinger();
+    other.resetFinger();
+    if (&other == this || !other.root) return;
+    TextOffset total = root ? root->getLength() : 0;
     if (pos < 0) pos = 0;
     if (pos > total) pos = total;
 
-    root = insertRecursive(root, pos, data, len);
+    drainReleased(false);
+    spliceNode(pos, adoptRoot(other));
+    if (other.storage == storage) heapNodeCount += other.heapNodeCount;
+    other.clear();
 }
 
-void Tree::erase(int pos, int len) {
-    if (!root || len <= 0) return;
-    int total = root->getLength();
+void Tree::insertSnapshot(TextOffset pos, const TreeSnapshot& text) {
+    if (!text.root) return;
+    TextOffset total = root ? root->getLength() : 0;
     if (pos < 0) pos = 0;
-    if (pos >= total) return;
-
-    if (pos + len > total) len = total - pos;
+    if (pos > total) pos = total;
+    if (text.root->getLength() > INT64_MAX - total) throw std::length_error("Tree::insertSnapshot: document length overflows TextOffset");
 
-    root = eraseRecursive(root, pos, len);
+    drainReleased(false);
+    if (text.storage == storage) {
+        // Узлы снимка становятся общими с деревом (правки дальше скопируют путь)
+        text.root->refCount.fetch_add(1, std::memory_order_relaxed);
+        spliceNode(pos, text.root);
+        return;
+    }
+    // Чужая память: копируем куски снимка, при ошибке убираем уже вставленное
+    TextOffset at = pos;
+    try {
+        text.forEachChunk([this, &at](const char* data, int n) {
+            insert(at, data, n);
+            at += n;
+        });
+    } catch (...) {
+        erase(pos, at - pos);
+        throw;
+    }
 }
 
+void Tree::spliceNode(TextOffset pos, Node* piece) {
+    resetFinger();
+    if (!piece) return;
+    Node* head = nullptr;
+    Node* tail = nullptr;
+    try {
+        if (root) root->refCount.fetch_add(1, std::memory_order_relaxed);
+        splitNodes(root, pos, head, tail);
+    } catch (...) {
+        destroySubtree(piece);
+        throw;
+    }
+    try {
+        head = joinNodes(head, piece);
+    } catch (...) {
+        destroySubtree(tail);
+        throw;
+    }
+    Node* joined = joinNodes(head, tail);
+    destroySubtree(root);
+    root = joined;
+}
 
-void Tree::getTextRangeRecursive(Node* node, int& offset, int& len, char* out, int& outPos) const {
+void TreeReader::getTextRangeRecursive(const Node* node, TextOffset& offset, TextOffset& len, char* out, TextOffset& outPos) {
     if (!node || len <= 0) return;
 
     if (node->getType() == NodeType::NODE_LEAF) {
-        auto leaf = static_cast<LeafNode*>(node); // у тебя уже проверка через getType
+        auto leaf = static_cast<const LeafNode*>(node); // у тебя уже проверка через getType
         if (offset >= leaf->length) {
             offset -= leaf->length;
             return;
         }
 
-        int copyFrom = offset;
-        int toCopy = (len < leaf->length - copyFrom) ? len : (leaf->length - copyFrom);
+        auto copyFrom = static_cast<int>(offset);
+        int toCopy = (len < leaf->length - copyFrom) ? static_cast<int>(len) : (leaf->length - copyFrom);
 
-        std::memcpy(out + outPos, leaf->data + copyFrom, static_cast<size_t>(toCopy));
+        leaf->copyOut(copyFrom, toCopy, out + outPos);
 
         outPos += toCopy;
         len -= toCopy;
         offset = 0;
         return;
     } else {
-        auto in = static_cast<InternalNode*>(node);
-        if (in->left) getTextRangeRecursive(in->left, offset, len, out, outPos);
-        if (len > 0 && in->right) getTextRangeRecursive(in->right, offset, len, out, outPos);
+        auto in = static_cast<const InternalNode*>(node);
+        // Дети целиком до начала диапазона пропускаем по префиксам, не спускаясь в них
+        int i = offset < in->totalLength() ? in->findChildByOffset(offset) : in->childCount;
+        offset -= (i < in->childCount) ? in->childOffset(i) : in->totalLength();
+        for (; len > 0 && i < in->childCount; ++i) {
+            getTextRangeRecursive(in->children[i], offset, len, out, outPos);
+        }
     }
 }
 
-char* Tree::getTextRange(int offset, int len) const {
+char* TreeReader::getTextRange(TextOffset offset, TextOffset len) const {
     // Если дерево пустое — возвращаем nullptr (как раньше).
     if (!root) return nullptr;
 
@@ -755,15 +2896,15 @@ char* Tree::getTextRange(int offset, int len) const {
         return empty;
     }
 
-    int total = root->getLength();
+    TextOffset total = root->getLength();
     if (offset < 0 || offset > total) throw std::out_of_range("Offset out of range");
-    if (offset + len > total) len = total - offset; // обрезка до конца
+    if (len > total - offset) len = total - offset; // обрезка до конца (без переполнения offset + len)
 
     // Выделяем +1 байт для нуль-терминатора.
-    auto out = new char[len + 1]; //NOSONAR // теперь место под '\0'
-    int outPos = 0;
-    int off = offset;
-    int l = len;
+    auto out = new char[static_cast<std::size_t>(len) + 1]; //NOSONAR // теперь место под '\0'
+    TextOffset outPos = 0;
+    TextOffset off = offset;
+    TextOffset l = len;
     getTextRangeRecursive(root, off, l, out, outPos);
 
     // Гарантируем нуль-терминатор; outPos должен быть равен len, но на всякий случай ставим '\0' по outPos.
@@ -772,7 +2913,7 @@ char* Tree::getTextRange(int offset, int len) const {
     return out;
 }
 // --- вспомогательная функция: строим lps (longest prefix suffix) для KMP вручную ---
-void Tree::buildKMPTable(const char* pattern, int patternLen, int* lps) const {
+void TreeReader::buildKMPTable(const char* pattern, int patternLen, int* lps) {
     int len = 0;
     lps[0] = 0;
     int i = 1;
@@ -793,21 +2934,21 @@ void Tree::buildKMPTable(const char* pattern, int patternLen, int* lps) const {
 }
 
 // --- рекурсивный обход листов с поиском ---
-int Tree::findSubstringRecursive(Node* node, const char* pattern, int patternLen, const int* lps, int& j, int& processed) const {
+TextOffset TreeReader::findSubstringRecursive(const Node* node, const char* pattern, int patternLen, const int* lps, int& j, TextOffset& processed) {
     if (!node) return -1;
 
     if (node->getType() == NodeType::NODE_LEAF) {
         // static_cast безопасен, т.к. проверили тип
-        auto leaf = static_cast<LeafNode*>(node);
+        auto leaf = static_cast<const LeafNode*>(node);
         assert(leaf != nullptr);
 
         for (int i = 0; i < leaf->length; ++i) {
-            auto c = static_cast<unsigned char>(leaf->data[i]);
+            auto c = static_cast<unsigned char>(leaf->at(i));
             while (j > 0 && c != static_cast<unsigned char>(pattern[j])) j = lps[j - 1];
             if (c == static_cast<unsigned char>(pattern[j])) j++;
             if (j == patternLen) {
-                int matchEnd = processed + i;
-                int matchStart = matchEnd - patternLen + 1;
+                TextOffset matchEnd = processed + i;
+                TextOffset matchStart = matchEnd - patternLen + 1;
                 return matchStart;
             }
         }
@@ -815,18 +2956,19 @@ int Tree::findSubstringRecursive(Node* node, const char* pattern, int patternLen
         return -1;
     } else {
         // internal node — static_cast после проверки типа
-        auto in = static_cast<InternalNode*>(node);
+        auto in = static_cast<const InternalNode*>(node);
         assert(in != nullptr);
 
-        int r = -1;
-        if (in->left) { r = findSubstringRecursive(in->left, pattern, patternLen, lps, j, processed); if (r != -1) return r; }
-        if (in->right) { r = findSubstringRecursive(in->right, pattern, patternLen, lps, j, processed); if (r != -1) return r; }
+        for (int i = 0; i < in->childCount; ++i) {
+            TextOffset r = findSubstringRecursive(in->children[i], pattern, patternLen, lps, j, processed);
+            if (r != -1) return r;
+        }
         return -1;
     }
 }
 
 
-int Tree::findSubstring(const char* pattern, int patternLen) const {
+TextOffset TreeReader::findSubstring(const char* pattern, int patternLen) const {
     if (!root || !pattern || patternLen <= 0) return -1;
 
     int* lps = nullptr;
@@ -841,8 +2983,8 @@ int Tree::findSubstring(const char* pattern, int patternLen) const {
         buildKMPTable(pattern, patternLen, lps);
 
         int j = 0;
-        int processed = 0;
-        int result = findSubstringRecursive(root, pattern, patternLen, lps, j, processed);
+        TextOffset processed = 0;
+        TextOffset result = findSubstringRecursive(root, pattern, patternLen, lps, j, processed);
 
         delete[] lps; //NOSONAR
         return result;
@@ -860,18 +3002,19 @@ int Tree::findSubstring(const char* pattern, int patternLen) const {
 //  - lps: предвычисленная таблица KMP
 //  - j: текущее состояние автомата KMP (сохраняется между листами)
 //  - processedLines: сколько строк ( '\n' ) уже полностью пройдены раньше (в предыдущих листьях)
-static int findSubstringLineRecursive(Node* node,
-                                      const char* pattern, int patternLen,
-                                      const int* lps,
-                                      int& j,
-                                      int& processedLines) {
+LineIndex TreeReader::findSubstringLineRecursive(const Node* node,
+                                                const char* pattern, int patternLen,
+                                                const int* lps,
+                                                int& j,
+                                                LineIndex& processedLines,
+                                                TreeStorage* storage) {
     if (!node) return -1;
 
     if (node->getType() == NodeType::NODE_LEAF) {
-        auto leaf = static_cast<LeafNode*>(node);
+        auto leaf = static_cast<const LeafNode*>(node);
         // Проходим байты листа, применяем KMP.
         for (int i = 0; i < leaf->length; ++i) {
-            auto c = static_cast<unsigned char>(leaf->data[i]);
+            auto c = static_cast<unsigned char>(leaf->at(i));
             while (j > 0 && c != static_cast<unsigned char>(pattern[j])) {
                 j = lps[j - 1];
             }
@@ -882,11 +3025,8 @@ static int findSubstringLineRecursive(Node* node,
                 int matchStartIndex = matchEndIndex - patternLen + 1;
                 if (matchStartIndex < 0) matchStartIndex = 0; // безопасность
 
-                int localNewlines = 0;
-                // считаем number of '\n' в leaf->data[0 .. matchStartIndex-1]
-                for (int k = 0; k < matchStartIndex && k < leaf->length; ++k) {
-                    if (leaf->data[k] == '\n') ++localNewlines;
-                }
+                // считаем number of '\n' в листе до начала совпадения (по индексу строк листа)
+                int localNewlines = leaf->newlinesBefore(matchStartIndex, storage);
 
                 // итоговый номер строки (0-based)
                 return processedLines + localNewlines;
@@ -897,14 +3037,9 @@ static int findSubstringLineRecursive(Node* node,
         processedLines += leaf->getLineCount();
         return -1;
     } else {
-        auto in = static_cast<InternalNode*>(node);
-        int r = -1;
-        if (in->left) {
-            r = findSubstringLineRecursive(in->left, pattern, patternLen, lps, j, processedLines);
-            if (r != -1) return r;
-        }
-        if (in->right) {
-            r = findSubstringLineRecursive(in->right, pattern, patternLen, lps, j, processedLines);
+        auto in = static_cast<const InternalNode*>(node);
+        for (int i = 0; i < in->childCount; ++i) {
+            LineIndex r = findSubstringLineRecursive(in->children[i], pattern, patternLen, lps, j, processedLines, storage);
             if (r != -1) return r;
         }
         return -1;
@@ -913,7 +3048,7 @@ static int findSubstringLineRecursive(Node* node,
 
 // Публичная обёртка: возвращает номер строки (0-based) где начинается совпадение,
 // или -1 если не найдено.
-int Tree::findSubstringLine(const char* pattern, int patternLen) const {
+LineIndex TreeReader::findSubstringLine(const char* pattern, int patternLen) const {
     if (!root || !pattern || patternLen <= 0) return -1;
 
     // выделяем lps
@@ -931,8 +3066,8 @@ int Tree::findSubstringLine(const char* pattern, int patternLen) const {
         buildKMPTable(pattern, patternLen, lps);
 
         int j = 0;
-        int processedLines = 0;
-        int res = findSubstringLineRecursive(root, pattern, patternLen, lps, j, processedLines);
+        LineIndex processedLines = 0;
+        LineIndex res = findSubstringLineRecursive(root, pattern, patternLen, lps, j, processedLines, storage.get());
 
         delete[] lps; // NOSONAR
         return res;
@@ -1,33 +1,118 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "MappedFile.h"
+#include "NodePool.h"
+
+class WorkStealingPool;
 
 //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ ПОКА ЧТО ПРОСТО ЗАГЛУШКА НЕ ВАЖНО
 //! ПОСЛЕ ПОКА ЧТО ПРОСТО ЗАГЛУШКА НЕ ВАЖНО
 const int MAX_LEAF_SIZE = 4096; //TODO: фикс
 
+// Лист короче этого порога после удаления сливается с соседом или занимает у него байты
+const int MIN_LEAF_SIZE = MAX_LEAF_SIZE / 4;
+
+// Минимальный запас (разрыв) в буфере листа, выделяемый при первой правке листа
+const int LEAF_GAP_MIN = 64;
+
+// Байтовые смещения/длины и номера строк документа — 64-битные (файлы больше 2 ГБ).
+// Внутри листа (<= MAX_LEAF_SIZE байт, см. Tree::insert) смещения остаются int.
+using TextOffset = std::int64_t;
+using LineIndex = std::int64_t;
+
 enum class NodeType : char {
     NODE_INTERNAL = 0,
     NODE_LEAF = 1
 };
 
+// Откуда взята память узла (Node::flags)
+const unsigned char NODE_FLAG_POOLED = 1;      // заголовок узла выделен из NodePool дерева
+const unsigned char NODE_FLAG_POOLED_DATA = 2; // буфер листа выделен из NodePool дерева
+const unsigned char NODE_FLAG_MAPPED = 4;      // data листа указывает в отображённый файл (MappedFile), только чтение
+
+struct TreeStorage;
+
+// Узлы без виртуальных функций: тип хранится в теге, а вес каждого ребёнка (байты и '\n')
+// закэширован в родителе. Спуск по дереву читает только сам родитель — без косвенных вызовов
+// и без обращения к памяти ребёнка ради его длины.
+//
+// Узлы разделяются между деревом и его снимками (Tree::snapshot()): refCount — число родителей
+// (или корней дерева/снимков), ссылающихся на узел. Узел с refCount > 1 неизменяем — перед
+// правкой дерево копирует его (копирование пути), узел с refCount == 1 правится на месте.
 struct Node {
-    virtual NodeType getType() const = 0;
+    NodeType type;           // тег: по нему делается static_cast к LeafNode/InternalNode
+    unsigned char flags = 0; // NODE_FLAG_*; 0 — узел создан обычным new (снаружи дерева)
+    std::atomic<int> refCount{1};
+
+    NodeType getType() const { return type; }
+
+    // Быстрый доступ к статистике (без виртуальных вызовов, определены ниже)
+    inline TextOffset getLength() const; // Вес в байтах
+    inline LineIndex getLineCount() const; // Вес в строках (\n)
+    inline TextOffset getCharCount() const; // Вес в символах UTF-8
+
+    // Узел принадлежит только одному родителю — его можно править на месте
+    bool isUnique() const { return refCount.load(std::memory_order_acquire) == 1; }
 
-    // Быстрый доступ к статистике
-    virtual int getLength() const = 0; // Вес в байтах
-    virtual int getLineCount() const = 0; // Вес в строках (\n)
+    // Деструктор не виртуальный: удалять узел нужно через его настоящий тип (см. Tree::destroyNode)
+    ~Node() = default;
 
-    virtual ~Node() = default;
+protected:
+    explicit Node(NodeType t) : type(t) {}
 };
 
+// Лист хранит текст в буфере с разрывом (gap buffer):
+//   data[0 .. gapStart)                      — первая часть текста
+//   data[gapStart .. gapStart + gapLength())  — свободное место (разрыв)
+//   data[gapStart + gapLength() .. capacity)  — вторая часть текста
+// Разрыв стоит в точке последней правки, поэтому вставка/удаление символа
+// рядом с ней — O(1) без выделения памяти.
+//
+// Лист над отображённым файлом (NODE_FLAG_MAPPED) ссылается на байты файла и разрыва не имеет
+// (capacity == length). Первая правка в середине листа копирует текст в буфер из пула, а отрезание
+// начала или конца листа только сдвигает границы ссылки.
+//
+// Индекс строк листа: lineStarts[k - 1] — логическая позиция сразу после k-го '\n'.
+// Строится лениво при первом поиске строки в листе и сбрасывается любой правкой листа,
+// так что начало k-й строки листа — одно чтение массива вместо сканирования до 4 КБ.
+// Указатель на индекс лежит не в заголовке листа, а в голове его буфера (LeafPayload):
+// заголовок читают при каждом спуске, индекс — только поиск строки внутри листа.
+//
+// Голова буфера листа: LEAF_PAYLOAD_HEAD байт прямо перед data. Есть у каждого листа со своим
+// буфером (из пула или new); у отображённого листа (NODE_FLAG_MAPPED) буфера нет — и индекса строк
+// тоже, строки в нём ищутся векторным сканированием.
+struct LeafPayload {
+    // Индекс строк (lineCount элементов из TreeStorage::allocateLineIndex) или nullptr, пока не построен.
+    // Атомарный: общий со снимком лист могут читать (и строить индекс) несколько потоков сразу.
+    std::atomic<int*> lineStarts{nullptr};
+    int capacity = 0; // байт текста в буфере (без головы)
+};
+const int LEAF_PAYLOAD_HEAD = 16; // кратно 16: текст буфера выровнен так же, как класс размера пула
+static_assert(sizeof(LeafPayload) <= LEAF_PAYLOAD_HEAD, "leaf payload head must fit before the text");
+
 struct LeafNode : public Node {
-    int length;
-    int lineCount; // Количество строк-1 (\n)
-    char* data; // Указатель на строку в памяти (кучи)
+    int length;    // Логическая длина текста (без разрыва)
+    int lineCount; // Количество '\n' в листе
+    int charCount; // Количество символов UTF-8 в листе (см. countCodePoints)
+    int gapStart;
+    char* data;    // Буфер ёмкостью capacity() (за LeafPayload) или байты отображённого файла
 
     LeafNode(const char* str, int len);
-    ~LeafNode() override;
+    // Лист поверх готового буфера ёмкостью >= len: из allocateBuffer или байты отображённого файла
+    // (тогда str == nullptr, а NODE_FLAG_MAPPED ставит вызывающий сразу после конструктора)
+    LeafNode(const char* str, int len, char* buffer);
+    ~LeafNode();
 
     // Запрет копирования (от утечек)
     LeafNode(const LeafNode&) = delete; 
@@ -38,106 +123,723 @@ struct LeafNode : public Node {
     LeafNode(LeafNode&& other) noexcept;
     LeafNode& operator=(LeafNode&& other) noexcept;
 
-    NodeType getType() const override;
-    int getLength() const override;
-    int getLineCount() const override;
+    // Ёмкость буфера хранится в его голове; у отображённого листа разрыва нет
+    int capacity() const { return hasPayload() ? payload()->capacity : length; }
+    int gapLength() const { return capacity() - length; }
+
+    // Байт по логическому индексу (с учётом разрыва)
+    char at(int i) const { return i < gapStart ? data[i] : data[i + gapLength()]; }
+
+    // Скопировать n байт начиная с логической позиции from в dst
+    void copyOut(int from, int n, char* dst) const;
+
+    // Сдвинуть разрыв в логическую позицию pos. moveGap(length) делает
+    // data[0 .. length) непрерывным.
+    void moveGap(int pos);
+
+    // Вставить n байт в позицию pos. Буфер расширяется только если разрыв мал
+    // (новый буфер берётся из pool, если он задан). При исключении (bad_alloc) лист не изменяется.
+    void insertAt(int pos, const char* src, int n, NodePool* pool = nullptr);
+
+    // Удалить n байт начиная с pos (расширяет разрыв, память не трогает; отображённый лист
+    // при удалении из середины копируется в буфер из pool)
+    void eraseAt(int pos, int n, NodePool* pool = nullptr);
+
+    // Скопировать текст отображённого листа в собственный буфер (из pool, если задан).
+    // Байты с позиции readable (файл усечён) отбрасываются, '\n' пересчитываются.
+    void detachData(int readable, NodePool* pool); // O(length)
+
+    // Логическая позиция сразу после k-го (k >= 1) '\n' в листе или -1.
+    // storage — память дерева для индекса строк; без неё индекс не строится (поиск сканированием).
+    int offsetAfterNewline(int k, TreeStorage* storage = nullptr) const; // O(1) по индексу строк
+
+    // Количество '\n' в логическом диапазоне [from, from + n)
+    int countNewlines(int from, int n) const; // O(n)
+
+    // Количество символов UTF-8, начинающихся в [from, from + n)
+    int countChars(int from, int n) const; // O(n)
+    // Логическая позиция начала символа c (0-based); c >= charCount — length
+    int offsetOfChar(int c) const; // O(length)
+    // Пересчитать lineCount и charCount по тексту листа (после заполнения буфера снаружи)
+    void recount(); // O(length)
+
+    // Количество '\n' в [0, pos)
+    int newlinesBefore(int pos, TreeStorage* storage = nullptr) const; // O(log lineCount) по индексу строк
+
+    // Индекс строк (строится при первом вызове из storage) или nullptr, если в листе нет '\n',
+    // storage не задан или на индекс не хватило памяти (тогда поиск идёт сканированием)
+    const int* lineIndex(TreeStorage* storage) const;
+    // Сбросить индекс — вызывается при каждой правке текста листа
+    void invalidateLineIndex();
+    // Память индекса строк (0, если он не построен)
+    std::size_t lineIndexBytes() const;
+
+    // Буфер на capacity >= size байт текста с головой LeafPayload (из pool, если задан, иначе new[]).
+    // Возвращает начало текста.
+    static char* allocateBuffer(int size, int& capacity, NodePool* pool);
+    // Освободить буфер data (свой, из пула или ничего — у отображённого листа) вместе с индексом строк
+    void releaseData(NodePool* pool);
+
+private:
+    // Голова буфера (только у листа со своим буфером)
+    LeafPayload* payload() const { return reinterpret_cast<LeafPayload*>(data - LEAF_PAYLOAD_HEAD); }
+    bool hasPayload() const { return data && !(flags & NODE_FLAG_MAPPED); }
 };
 
+// Ширина internal-узла B+-дерева. Лист 4 КБ и 16 детей на узел: 1 ГБ текста — 5 уровней.
+const int BTREE_MAX_CHILDREN = 16;
+// Не-корневой internal-узел короче этого порога сливается с соседом или занимает у него детей
+const int BTREE_MIN_CHILDREN = BTREE_MAX_CHILDREN / 2;
+
+// Internal-узел B+-дерева: все его дети — поддеревья одной высоты.
+// Веса детей хранятся как префиксные суммы: выбор ребёнка при спуске — сравнение
+// offset со всем массивом сразу (одна кэш-линия, цикл без ветвлений векторизуется),
+// сами дети при этом не читаются.
 struct InternalNode : public Node {
-    Node* left;
-    Node* right;
+    // Высота поддерева (лист = 0); у всех детей высота height - 1
+    int height;
+    int childCount;
 
-    // Суммы детей
-    int totalLength;
-    int totalLineCount;
+    // lengthPrefix[i] — суммарная длина children[0..i], linePrefix[i] — суммарное число '\n',
+    // charPrefix[i] — суммарное число символов UTF-8.
+    // Ячейки [childCount, BTREE_MAX_CHILDREN) заполнены INT64_MAX (не мешают поиску).
+    TextOffset lengthPrefix[BTREE_MAX_CHILDREN];
+    LineIndex linePrefix[BTREE_MAX_CHILDREN];
+    TextOffset charPrefix[BTREE_MAX_CHILDREN];
+    Node* children[BTREE_MAX_CHILDREN];
 
+    InternalNode(); // узел без детей
+    // Узел из двух детей (для ручной сборки дерева и старых .bin файлов); nullptr пропускается
     InternalNode(Node* l, Node* r);
-    ~InternalNode() override = default;
+    ~InternalNode() = default;
+
+    // Сумма детей
+    TextOffset totalLength() const { return childCount ? lengthPrefix[childCount - 1] : 0; }
+    LineIndex totalLineCount() const { return childCount ? linePrefix[childCount - 1] : 0; }
+    TextOffset totalCharCount() const { return childCount ? charPrefix[childCount - 1] : 0; }
 
-    NodeType getType() const override;
-    int getLength() const override;
-    int getLineCount() const override;
+    // Смещение начала ребёнка i (в байтах и в '\n') и его вес — из префиксных сумм
+    TextOffset childOffset(int i) const { return i > 0 ? lengthPrefix[i - 1] : 0; }
+    LineIndex childLineOffset(int i) const { return i > 0 ? linePrefix[i - 1] : 0; }
+    TextOffset childLength(int i) const { return lengthPrefix[i] - childOffset(i); }
+    LineIndex childLineCount(int i) const { return linePrefix[i] - childLineOffset(i); }
+    TextOffset childCharOffset(int i) const { return i > 0 ? charPrefix[i - 1] : 0; }
+    TextOffset childCharCount(int i) const { return charPrefix[i] - childCharOffset(i); }
 
-    void recalc(); // пересчитать totalLength и totalLineCount
+    // Ребёнок, содержащий байт offset (0 <= offset < totalLength())
+    int findChildByOffset(TextOffset offset) const;
+    // Ребёнок для вставки в позицию pos (0 <= pos <= totalLength()); на границе — левый
+    int findChildForInsert(TextOffset pos) const;
+    // Ребёнок, содержащий k-й (k >= 1) '\n' поддерева
+    int findChildByLine(LineIndex k) const;
+    // Ребёнок, содержащий символ c (0 <= c < totalCharCount())
+    int findChildByChar(TextOffset c) const;
+
+    // Вставить/убрать ребёнка в позиции i (места должно хватать), префиксы обновляются
+    void insertChild(int i, Node* child);
+    void appendChild(Node* child) { insertChild(childCount, child); }
+    Node* removeChild(int i);
+
+    // Ребёнок i изменил длину/строки на месте — поправить префиксы (остальные дети не читаются)
+    void updateChild(int i);
+
+    void recalc(); // пересчитать префиксы и height по всем детям
 };
 
-class Tree {
-private:
-    Node* root;
+// Заголовок листа — полкэш-линии: ёмкость и индекс строк лежат в голове буфера (LeafPayload),
+// счётчики остаются в заголовке — у отображённого листа буфера нет. Массив префиксов internal-узла — две кэш-линии
+static_assert(sizeof(LeafNode) <= 32, "LeafNode header must fit in 32 bytes");
+static_assert(sizeof(TextOffset) * BTREE_MAX_CHILDREN <= 128, "prefix array must fit in two cache lines");
 
-    void clearRecursive(Node* node);
-    Node* buildFromTextRecursive(const char* text, int len);
-    
-    // Вспомогательная рекурсия для сбора текста (теперь проще)
-    void collectTextRecursive(Node* node, char* buffer, int& pos);
+inline TextOffset Node::getLength() const {
+    return type == NodeType::NODE_LEAF ? static_cast<const LeafNode*>(this)->length
+                                       : static_cast<const InternalNode*>(this)->totalLength();
+}
 
-    // Вспомогательная функция для поиска листа по номеру строки
-    // Изменяет localLineIndex, приводя его к индексу внутри найденного листа
-    LeafNode* findLeafByLineRecursive(Node* node, int& localLineIndex);
+inline LineIndex Node::getLineCount() const {
+    return type == NodeType::NODE_LEAF ? static_cast<const LeafNode*>(this)->lineCount
+                                       : static_cast<const InternalNode*>(this)->totalLineCount();
+}
 
-    LeafNode* findLeafByOffsetRecursive(Node* node, int& localOffset);
-    Node* splitLeafAtOffset(LeafNode* leaf, int offset);
+inline TextOffset Node::getCharCount() const {
+    return type == NodeType::NODE_LEAF ? static_cast<const LeafNode*>(this)->charCount
+                                       : static_cast<const InternalNode*>(this)->totalCharCount();
+}
 
-    Node* insertIntoLeaf(LeafNode* leaf, int pos, const char* data, int len);
-    int findSplitIndexForLeaf(const LeafNode* leaf) const;
-    // Рекурсивные реализации вставки/удаления (возвращают новый Node* для замены в родителе)
-    Node* insertRecursive(Node* node, int pos, const char* data, int len);
+// Положение байта в тексте (TreeReader::locate())
+struct TextLocation {
+    LineIndex line = 0;      // номер строки (0-based) — количество '\n' до байта
+    TextOffset column = 0;   // байт от начала строки
+    TextOffset charColumn = 0; // символов UTF-8 от начала строки до байта
+    TextOffset lineStart = 0; // смещение начала строки в тексте
+};
 
-    // Удалить len байт в листе, возвращает новый Node* (новый лист или nullptr)
-    Node* eraseFromLeaf(LeafNode* leaf, int pos, int len);
+// Одна правка пакета Tree::applyEdits: заменить [pos, pos + eraseLen) на textLen байт text.
+// pos — смещение в тексте ДО применения пакета (другие правки пакета его не сдвигают).
+struct TextEdit {
+    TextOffset pos = 0;
+    TextOffset eraseLen = 0;     // 0 — чистая вставка
+    const char* text = nullptr;  // может быть nullptr при textLen == 0 (чистое удаление)
+    TextOffset textLen = 0;
+};
+
+// Статистика узлов и памяти дерева (TreeReader::stats())
+struct TreeStats {
+    std::size_t leafCount = 0;
+    std::size_t internalCount = 0;
+    std::size_t lineIndexCount = 0; // листьев с построенным индексом строк
+    std::size_t lineIndexBytes = 0; // память индексов строк
+    std::size_t sharedCount = 0;    // узлов, общих со снимками или журналом отмены (refCount > 1)
+
+    // Глубина листа — рёбер от корня до него (у B+-дерева все листья на одной глубине)
+    int maxDepth = 0;
+    std::size_t leafDepthSum = 0;
+
+    // Заполненность листьев: leafFill[i] — листья длиной от i до i + 1 восьмых MAX_LEAF_SIZE
+    // (полный лист — в последней корзине)
+    static constexpr int LEAF_FILL_BUCKETS = 8;
+    std::size_t leafFill[LEAF_FILL_BUCKETS] = {};
+
+    // Память: текст и то, во что он обходится
+    TextOffset payloadBytes = 0;      // байты текста (getLength())
+    TextOffset mappedBytes = 0;       // из них в листьях над отображённым файлом (память — страницы файла)
+    std::size_t leafBufferBytes = 0;  // буферы остальных листьев (ёмкость вместе с разрывом)
+    std::size_t nodeHeaderBytes = 0;  // заголовки узлов: sizeof(LeafNode) / sizeof(InternalNode)
+
+    std::size_t nodeCount() const { return leafCount + internalCount; }
+    double averageDepth() const { return leafCount ? static_cast<double>(leafDepthSum) / static_cast<double>(leafCount) : 0.0; }
+    // Память узлов дерева (без страниц отображённого файла и без запаса пула)
+    std::size_t allocatedBytes() const { return leafBufferBytes + nodeHeaderBytes + lineIndexBytes; }
+    // Байт сверх текста на узел: разрывы буферов, заголовки, индексы строк
+    double overheadPerNode() const {
+        std::size_t inMemory = static_cast<std::size_t>(payloadBytes - mappedBytes);
+        return nodeCount() ? static_cast<double>(allocatedBytes() - inMemory) / static_cast<double>(nodeCount()) : 0.0;
+    }
+};
+
+// Память дерева: пул узлов и очередь узлов, отпущенных снимками.
+// Общая для дерева и всех его снимков и живёт, пока жив хотя бы один из них.
+struct TreeStorage {
+    // Отображённые файлы, на которые ссылаются листья (Tree::fromMappedFile). Объявлены первыми —
+    // разрушаются последними, после всех узлов.
+    std::vector<std::unique_ptr<MappedFile>> mappedFiles;
+    // mappedFiles[0 .. detachedFiles) уже скопированы (Tree::detachMappedFiles): файлы остаются
+    // отображены, пока их могут держать чужие снимки, но их изменения дерево больше не касаются
+    std::size_t detachedFiles = 0;
+
+    NodePool pool;
+
+    // Узлы, последнюю ссылку на которые отпустил снимок (возможно, из другого потока).
+    // Пул не потокобезопасен, поэтому в пул их возвращает только Tree (drainReleased).
+    std::mutex releasedMutex;
+    std::vector<Node*> released;
+    std::atomic<bool> hasReleased{false};
+
+    // Индексы строк листьев (LeafNode::lineIndex). Их строят и потоки, читающие снимки,
+    // поэтому они выделяются из отдельной арены под своим мьютексом. Tree::clear() сбрасывает
+    // арену вместе с пулом — индексы не нужно освобождать поштучно.
+    std::mutex lineIndexMutex;
+    PayloadArena lineIndexArena;
+
+    // Массив на count элементов или nullptr, если памяти не хватило
+    int* allocateLineIndex(int count);
+    // Вернуть массив из allocateLineIndex в арену его хранилища
+    static void freeLineIndex(int* index);
+    // Сколько байт занимает массив из allocateLineIndex
+    static std::size_t lineIndexCapacity(const int* index);
+
+    TreeStorage() = default;
+    ~TreeStorage(); // освобождает узлы, оставшиеся в released
 
-    // Если internal-узел имеет одного или ни одного ребёнка — заменить и удалить internal.
-    // В противном случае пересчитать кэши и вернуть сам inner.
-    Node* collapseInternalIfNeeded(InternalNode* inner);
+    TreeStorage(const TreeStorage&) = delete;
+    TreeStorage& operator=(const TreeStorage&) = delete;
+};
+
+// Чтение текста по корню B+-дерева — общая часть Tree и TreeSnapshot.
+// Ни один метод не меняет узлы, поэтому снимок можно читать параллельно с правками дерева.
+class TreeReader {
+protected:
+    Node* root = nullptr;
+    // Память узлов (общая у дерева и его снимков); из неё же строятся индексы строк листьев
+    std::shared_ptr<TreeStorage> storage;
+
+    TreeReader() = default;
+    TreeReader(std::shared_ptr<TreeStorage> s, Node* r) : root(r), storage(std::move(s)) {}
+    ~TreeReader() = default;
+
+    // Вспомогательная рекурсия для сбора текста (теперь проще)
+    static void collectTextRecursive(const Node* node, char* buffer, TextOffset& pos);
 
-    Node* eraseRecursive(Node* node, int pos, int len);
+    static void getTextRangeRecursive(const Node* node, TextOffset& offset, TextOffset& len, char* out, TextOffset& outPos);
 
-    void getTextRangeRecursive(Node* node, int& offset, int& len, char* out, int& outPos) const;
+    static void buildKMPTable(const char* pattern, int patternLen, int* lps);
 
-    void buildKMPTable(const char* pattern, int patternLen, int* lps) const;
+    static TextOffset getOffsetForLineRecursive(const Node* node, LineIndex k, TreeStorage* storage);
 
-    int findSubstringRecursive(Node* node, const char* pattern, int patternLen, const int* lps, int& j, int& processed) const;
+    static LineIndex findSubstringLineRecursive(const Node* node, const char* pattern, int patternLen, const int* lps,
+                                                int& j, LineIndex& processedLines, TreeStorage* storage);
+
+    static TextOffset findSubstringRecursive(const Node* node, const char* pattern, int patternLen, const int* lps, int& j, TextOffset& processed);
+
+    template <typename F>
+    static void forEachChunkRecursive(const Node* node, F& fn);
+
+    // locate() без колонки в символах (один спуск)
+    TextLocation locateLine(TextOffset offset) const;
 
 public:
-    Tree(); // O(1) - Простая инициализация
-    ~Tree(); // O(N) - Вызывает clear(), где N - количество узлов в дереве
-    
-    void clear(); // O(N) - Рекурсивно удаляет все узлы дерева
     bool isEmpty() const; // O(1) - Простая проверка указателя root
-    
-    // Построить дерево из текста
-    void fromText(const char* text, int len); // O(N) - где N - длина текста. Рекурсивно делит текст пополам
-    
+
+    // Длина текста в байтах
+    TextOffset getLength() const; // O(1)
+
     // Вытащить дерево в текст
-    char* toText(); // O(N) - где N - общая длина текста. Выделяет память и рекурсивно собирает текст
+    char* toText() const; // O(N) - где N - общая длина текста. Выделяет память и рекурсивно собирает текст
     
     // Получить строку по номеру
-    char* getLine(int lineNumber); // O(log M + L) - где M - количество узлов, L - максимальная длина листа
+    char* getLine(LineIndex lineNumber) const; // O(log M + L) - где M - количество узлов, L - максимальная длина листа
     
     // Получить количество строк в дереве
-    int getTotalLineCount() const; // O(1) - Просто возвращает кэшированное значение из корня
+    LineIndex getTotalLineCount() const; // O(1) - Просто возвращает кэшированное значение из корня
     
     // Вычислить байтовое смещение для начала указанной строки внутри поддерева
-    int getOffsetForLine(int lineIndex0Based) const; // O(log M + L) - где M - количество узлов, L - максимальная длина листа
+    TextOffset getOffsetForLine(LineIndex lineIndex0Based) const; // O(log M + L) - где M - количество узлов, L - максимальная длина листа
     
+    // Номер строки (0-based), в которой лежит байт offset (offset == getLength() — последняя строка).
+    // Спуск по счётчикам '\n' в internal-узлах, в листе — по индексу строк.
+    LineIndex getLineForOffset(TextOffset offset) const; // O(log M)
+    // То же вместе с позицией в строке (в байтах и символах) и началом строки
+    // (offset ограничивается [0, getLength()])
+    TextLocation locate(TextOffset offset) const; // O(log M + L) - где L - максимальная длина листа
+
+    // --- Символы UTF-8: спуск по счётчикам символов в узлах, в листе — векторный подсчёт ---
+    TextOffset getCharCount() const; // O(1)
+    // Сколько символов начинается до байта byteOffset (для начала символа — его номер, 0-based)
+    TextOffset getCharOffset(TextOffset byteOffset) const; // O(log M + L)
+    // Байт, с которого начинается символ charOffset (charOffset >= getCharCount() — getLength())
+    TextOffset getByteOffsetForChar(TextOffset charOffset) const; // O(log M + L)
+    // Байт символа charColumn строки line (line ограничивается строками текста);
+    // колонка за концом строки — конец строки (перед '\n')
+    TextOffset getByteOffsetForLineColumn(LineIndex line, TextOffset charColumn) const; // O(log M + L)
+
     // возвращает новый буфер длиной len (или nullptr, если len==0).
     // Владелец вызывающий код должен вызвать delete[]
-    char* getTextRange(int offset, int len) const; // O(log M + len) - где M - количество узлов
+    char* getTextRange(TextOffset offset, TextOffset len) const; // O(log M + len) - где M - количество узлов
 
-    int findSubstring(const char* pattern, int patternLen) const; // O(N) - где N - общая длина текста. Использует алгоритм Кнута-Морриса-Пратта
+    TextOffset findSubstring(const char* pattern, int patternLen) const; // O(N) - где N - общая длина текста. Использует алгоритм Кнута-Морриса-Пратта
     
     // Возвращает номер строки (0-based), в которой начинается совпадение шаблона,
     // или -1 если не найдено.
-    int findSubstringLine(const char* pattern, int patternLen) const; // O(N) - где N - общая длина текста
+    LineIndex findSubstringLine(const char* pattern, int patternLen) const; // O(N) - где N - общая длина текста
+
+    // Узлы по типам, глубина, заполненность листьев и память (см. TreeStats)
+    TreeStats stats() const; // O(M) - где M - количество узлов
+    // Уровней internal-узлов над листьями (0 — пустое дерево или один лист)
+    int depth() const; // O(1) - высота корня
+
+    // Обойти текст по порядку непрерывными кусками: fn(const char* data, int len)
+    template <typename F>
+    void forEachChunk(F fn) const { forEachChunkRecursive(root, fn); } // O(N)
+
+    // Итератор по непрерывным кускам текста (часть листа до разрыва или после него):
+    // string_view указывает прямо в буфер листа, ничего не копируется.
+    // Действителен, пока дерево не меняется (снимок не меняется никогда).
+    class ChunkIterator {
+    public:
+        ChunkIterator() = default; // ни на что не указывает
+
+        // Есть текущий кусок. На концах текста итератор недействителен, но остаётся на месте:
+        // после выхода за конец prev() возвращает последний кусок, после выхода за начало next() — первый.
+        bool valid() const { return leaf && from < to; }
+        std::string_view operator*() const; // O(1) - текущий кусок (пустой, если !valid())
+        TextOffset offset() const { return chunkOffset; } // O(1) - смещение начала куска в тексте
+
+        bool next(); // O(1) амортизированно - следующий кусок; false, если кусков больше нет
+        bool prev(); // O(1) амортизированно - предыдущий кусок; false, если это был первый
+
+    private:
+        friend class TreeReader;
+        // Дерево выше не бывает: даже при двух детях на узел это 2^32 листьев
+        static constexpr int MAX_DEPTH = 32;
+        struct PathEntry {
+            const InternalNode* node;
+            int index; // номер ребёнка, через которого идёт путь
+        };
+
+        PathEntry path[MAX_DEPTH] = {};
+        int depth = 0;
+        const LeafNode* leaf = nullptr;
+        int from = 0; // логические позиции куска в листе
+        int to = 0;
+        TextOffset chunkOffset = 0;
+
+        void descend(const Node* node, bool leftmost); // до крайнего листа поддерева
+        bool nextLeaf();
+        bool prevLeaf();
+    };
+
+    // Итератор, чей первый кусок начинается с байта offset (offset == getLength() — конец текста)
+    ChunkIterator chunksAt(TextOffset offset) const; // O(log M)
+
+    // Последовательный проход по строкам (отрисовка видимых строк): спуск один раз в linesAt,
+    // дальше каждая строка читается по кускам листьев. text() — байты строки без '\n':
+    // строка внутри одного куска отдаётся прямо из листа, строка через границу кусков
+    // собирается во внутренний буфер итератора. text() действителен до next(); сам итератор —
+    // пока дерево не меняется.
+    class LineIterator {
+    public:
+        LineIterator() = default; // недействителен
+
+        bool valid() const { return isValid; }
+        LineIndex line() const { return lineNumber; } // O(1) - номер строки (0-based)
+        TextOffset offset() const { return lineOffset; } // O(1) - смещение начала строки в тексте
+        std::string_view text() const { return inBuffer ? std::string_view(buffer) : lineText; } // O(1)
+
+        bool next(); // O(L) - где L - длина следующей строки; false, если это была последняя строка
+
+    private:
+        friend class TreeReader;
+        ChunkIterator chunk;     // кусок, в котором начинается следующая строка
+        std::size_t skip = 0;    // начало следующей строки внутри куска
+        std::string buffer;      // строка, пересекающая границу кусков
+        std::string_view lineText; // строка внутри одного куска (вид прямо в лист)
+        bool inBuffer = false;   // строка в buffer (вид не храним: при копировании итератора буфер переезжает)
+        LineIndex lineNumber = 0;
+        TextOffset lineOffset = 0;
+        bool isValid = false;
+        bool hasNewline = false; // строка кончается '\n' (значит, за ней есть ещё одна)
+
+        void readLine();
+    };
+
+    // Итератор на строке line (0-based); за пределами [0, getTotalLineCount()) — недействителен
+    LineIterator linesAt(LineIndex line) const; // O(log M + L) - где L - длина строки
+};
+
+template <typename F>
+void TreeReader::forEachChunkRecursive(const Node* node, F& fn) {
+    if (!node) return;
+    if (node->getType() == NodeType::NODE_LEAF) {
+        auto leaf = static_cast<const LeafNode*>(node);
+        // Две части вокруг разрыва буфера
+        if (leaf->gapStart > 0) fn(static_cast<const char*>(leaf->data), leaf->gapStart);
+        if (leaf->length > leaf->gapStart) {
+            fn(static_cast<const char*>(leaf->data + leaf->gapStart + leaf->gapLength()), leaf->length - leaf->gapStart);
+        }
+        return;
+    }
+    auto inner = static_cast<const InternalNode*>(node);
+    for (int i = 0; i < inner->childCount; ++i) forEachChunkRecursive(inner->children[i], fn);
+}
+
+class Tree;
+
+// Неизменяемый снимок текста дерева (Tree::snapshot()). Узлы общие с деревом: снимок берётся
+// за O(1), а последующие правки дерева копируют только затронутый путь O(log M).
+// Снимок можно передать в другой поток и читать там, пока дерево правится; снимок может
+// пережить само дерево. Один объект снимка не предназначен для одновременного присваивания
+// из нескольких потоков (как и std::shared_ptr).
+class TreeSnapshot : public TreeReader {
+public:
+    TreeSnapshot() = default; // пустой снимок
+    ~TreeSnapshot(); // O(K) - где K - количество узлов, которые держал только этот снимок
+
+    TreeSnapshot(const TreeSnapshot& other); // O(1)
+    TreeSnapshot& operator=(const TreeSnapshot& other);
+    TreeSnapshot(TreeSnapshot&& other) noexcept;
+    TreeSnapshot& operator=(TreeSnapshot&& other) noexcept;
+
+    void reset(); // отпустить узлы (снимок становится пустым)
+
+private:
+    friend class Tree;
+    TreeSnapshot(std::shared_ptr<TreeStorage> storage, Node* root);
+};
+
+class Tree : public TreeReader {
+private:
+    friend class TreeBuilder; // достраивает листья через insertIntoLeaf и отдаёт готовый корень
+
+    // Сколько узлов дерева создано обычным new (setRoot) — пока они есть, clear() обходит дерево
+    long long heapNodeCount = 0;
+
+    // Сколько листьев было слито с соседями за время жизни дерева (для диагностики)
+    long long mergedLeavesCount = 0;
+
+    // --- Палец: путь к последнему затронутому листу ---
+    // Набор текста, Backspace и перемещение курсора раз за разом попадают в один лист. Палец хранит
+    // путь к нему и его смещение в тексте: операция в этом листе (или в соседнем — шаг по пути)
+    // начинается с пальца без спуска от корня. Любая другая правка структуры сбрасывает палец.
+    struct Finger {
+        static constexpr int MAX_DEPTH = 32; // как у ChunkIterator
+        InternalNode* path[MAX_DEPTH];       // узлы пути от корня к листу
+        int index[MAX_DEPTH];                // номер ребёнка path[d], через которого идёт путь
+        int depth = 0;
+        LeafNode* leaf = nullptr;            // nullptr — палец недействителен
+        TextOffset start = 0;                // смещение листа в тексте
+        LineIndex lineStart = 0;             // '\n' в тексте до листа
+    };
+    // Чтения (getLineForOffset, locate) тоже переставляют палец, поэтому он mutable:
+    // Tree, в отличие от снимков, читается и правится из одного потока
+    mutable Finger finger;
+    mutable long long fingerHits = 0;
+    mutable long long fingerMisses = 0;
+
+    void resetFinger() { finger.leaf = nullptr; }
+    // Поставить палец на лист, целиком содержащий [from, to] (to == from — точка вставки или чтения).
+    // true — лист найден от пальца (тот же лист или сосед), false — спуском от корня
+    // (лист может и не содержать диапазон, если тот пересекает границу листьев).
+    bool seekFinger(TextOffset from, TextOffset to) const;
+    // Лист пальца содержит [from, to]
+    bool fingerCovers(TextOffset from, TextOffset to) const;
+    // Сделать узлы пути пальца изменяемыми (общие со снимками копируются)
+    void ownFingerPath();
+    // Лист пальца изменил длину — поправить префиксы предков
+    void updateFingerPath();
+    // Правки в пределах одного листа без спуска от корня. false — правка не помещается в лист
+    // (лист переполнится или станет недозаполненным) и идёт обычным путём.
+    bool insertAtFinger(TextOffset pos, const char* data, int len);
+    bool eraseAtFinger(TextOffset pos, TextOffset len);
+
+    // Смещение, с которого начнётся следующий шаг compactStep() (подсказка: правки его не сдвигают)
+    TextOffset compactCursor = 0;
+
+    // --- Копирование пути (узлы, общие со снимками) ---
+    // Копия узла: лист копирует текст, internal — массивы детей (дети получают +1 ссылку)
+    Node* copyNode(const Node* node);
+    // Ребёнок i, доступный для правки: общий ребёнок заменяется своей копией
+    Node* mutableChild(InternalNode* inner, int i);
+    // То же для корня
+    Node* mutableRoot();
+    // Вернуть в пул узлы, отпущенные снимками (только из потока владельца дерева).
+    // wait = false — не ждать очередь и взять не больше RELEASED_DRAIN_BATCH узлов, true — все.
+    void drainReleased(bool wait);
+    static constexpr std::size_t RELEASED_DRAIN_BATCH = 1024;
+
+    // Отпустить все узлы дерева. true — память была только у дерева и пул сброшен целиком,
+    // false — её держат ещё снимки или другие деревья (узлы отпущены поштучно)
+    bool releaseNodes();
+    // Перейти в новую пустую память (дерево пусто): общую пусть освобождает последний её держатель,
+    // а следующий clear() снова сбросит пул целиком. Не хватило памяти — остаётся fallback.
+    void adoptFreshStorage(const std::shared_ptr<TreeStorage>& fallback) noexcept;
+
+    // Поддеревья, целиком покрытые удалением (erase): от высоты RECLAIM_MIN_HEIGHT они не
+    // обходятся на месте, а отдаются снимками фоновому NodeReclaimer
+    std::vector<Node*> discarded;
+    static constexpr int RECLAIM_MIN_HEIGHT = 2;
+    void discardSubtree(Node* node);
+    void reclaimDiscarded();
+    // Для snapshotRange(): собрать листья диапазона (целые — общие с деревом, крайние — копии)
+    void collectRangeLeaves(Node* node, TextOffset& offset, TextOffset& len, std::vector<Node*>& leaves);
+
+    // Оставить в листе [0, offset), хвост перенести в новый лист (возвращается; nullptr если хвоста нет)
+    Node* splitLeafAtOffset(LeafNode* leaf, int offset);
+
+    // Возвращает новый правый лист, если лист после вставки превысил MAX_LEAF_SIZE и был разрезан
+    Node* insertIntoLeaf(LeafNode* leaf, int pos, const char* data, int len);
+    int findSplitIndexForLeaf(const LeafNode* leaf) const;
+    // Рекурсивная вставка. Узел правится на месте; если он переполнился и разделился,
+    // возвращается новый правый сосед (его вставляет родитель), иначе nullptr.
+    Node* insertRecursive(Node* node, TextOffset pos, const char* data, int len);
+
+    // Удалить len байт в листе, возвращает новый Node* (новый лист или nullptr)
+    Node* eraseFromLeaf(LeafNode* leaf, int pos, int len);
+
+    // Удалить [pos, pos + len) из поддерева. Возвращает node или nullptr, если поддерево опустело.
+    Node* eraseRecursive(Node* node, TextOffset pos, TextOffset len);
+
+    // --- Слияние недозаполненных узлов (путь удаления) ---
+    // Лист короче MIN_LEAF_SIZE / internal меньше чем с BTREE_MIN_CHILDREN детьми
+    static bool isUnderfull(const Node* node);
+    // Исправить недозаполненных детей inner в окрестности [i - 1, i + 1]
+    void fixUnderfullAround(InternalNode* inner, int i);
+    // Слить детей a и a + 1 (true) или перераспределить между ними байты/детей (false)
+    bool mergeOrBorrow(InternalNode* inner, int a);
+
+    // Проход applyEdits по листьям: sorted — проверенные правки по возрастанию pos
+    void applyEditsPass(const std::vector<TextEdit>& sorted);
+
+    // --- Разрез и склейка деревьев (split/concat) ---
+    // Пустое дерево над памятью другого дерева (результат split/extract)
+    explicit Tree(std::shared_ptr<TreeStorage> sharedStorage);
+    // Узел, который можно править: общий со снимком заменяется копией (ссылка на него отпускается).
+    // При исключении ссылка на node остаётся у вызывающего.
+    Node* ownNode(Node* node);
+    // Склеить деревья left и right (любой высоты, любое может быть nullptr) в одно B+-дерево.
+    // Забирает по ссылке на каждое; при исключении обе отпускаются.
+    Node* joinNodes(Node* left, Node* right);
+    // Подвесить дерево piece высоты pieceHeight к правому (atEnd) или левому краю node (node выше piece
+    // и изменяемый). Возвращает нового правого соседа node, если node разделился.
+    // При исключении до того, как piece подвешен, ссылка на него отпускается.
+    Node* attachRecursive(Node* node, Node* piece, int pieceHeight, bool atEnd);
+    // Разрезать дерево node по pos: left — [0, pos), right — остаток (любое может выйти nullptr).
+    // Забирает ссылку на node; при исключении всё отпускается.
+    void splitNodes(Node* node, TextOffset pos, Node*& left, Node*& right);
+    // Ссылка на текст other для склейки с этим деревом: при общей памяти — его корень (+1 ссылка),
+    // иначе копия его листьев в пуле этого дерева
+    Node* adoptRoot(const Tree& other);
+    // Для extract()/cut(): вырезать [pos, pos + len) из дерева и вернуть поддерево
+    Node* extractNode(TextOffset pos, TextOffset len); // O(log M)
+    // Вклеить дерево piece в позицию pos (0 <= pos <= длины текста). Забирает ссылку на piece;
+    // при исключении дерево не меняется.
+    void spliceNode(TextOffset pos, Node* piece); // O(log M)
+
+    // Собрать B+-дерево снизу вверх (узлы заполнены равномерно).
+    // Забирает владение nodes; при исключении всё освобождает.
+    Node* buildFromLeaves(std::vector<Node*> nodes);
+    // Для fromText()/fromMappedFile(): порезать text на листы и собрать дерево. mapped — листья
+    // ссылаются на text (он должен пережить их), иначе текст копируется в буферы листьев.
+    Node* buildFromText(const char* text, TextOffset len, WorkStealingPool* pool, bool mapped);
+    // Поддерево node без отображённых листьев: ссылка на node, если их в нём нет, иначе копия пути
+    // с копиями листьев в пуле (node и снимки, которые его держат, не меняются).
+    // readable[f] — сколько байт storage->mappedFiles[f] ещё можно читать; copies — уже сделанные
+    // копии узлов (общий лист дерева и журнала копируется один раз), каждая держит +1 ссылку.
+    Node* detachMappedNode(Node* node, const std::vector<TextOffset>& readable, bool& intact,
+                           std::unordered_map<const Node*, Node*>& copies);
+    // Дерево над теми же листьями без пустых (после усечённого файла); nullptr, если пусты все.
+    // Ссылка на node не отпускается — при исключении он не тронут.
+    Node* rebuildWithoutEmptyLeaves(Node* node);
+
+public:
+    Tree(); // O(1) - Простая инициализация
+    ~Tree(); // O(S) - как clear(), где S - количество слэбов пула
+
+    Tree(const Tree&) = delete;
+    Tree& operator=(const Tree&) = delete;
+    // Перемещение: other остаётся пустым деревом над новой пустой памятью
+    Tree(Tree&& other) noexcept; // O(1)
+    Tree& operator=(Tree&& other); // O(S) - как clear()
+    
+    // O(S) - сброс пула памяти, где S - количество слэбов; O(N) - если в дереве есть узлы из setRoot
+    // или память ещё держат снимки, части split/extract (тогда узлы отпускаются поштучно, общие
+    // остаются им, а дерево переходит в новую память — следующий clear() снова сбросит пул целиком)
+    void clear();
     
-    // Вставка в дерево
-    void insert(int pos, const char* data, int len); // O(log M + L) - где M - количество узлов, L - длина вставляемых данных
+    // Построить дерево из текста
+    void fromText(const char* text, TextOffset len); // O(N) - где N - длина текста. Режет текст на листы и собирает дерево снизу вверх
+    // То же на пуле потоков pool (nullptr — в одном потоке). Листы копируются параллельно,
+    // если текст не короче PARALLEL_BUILD_MIN; форма дерева та же, что и при построении в одном потоке.
+    // fromText(text, len) для крупных текстов берёт WorkStealingPool::shared().
+    void fromText(const char* text, TextOffset len, WorkStealingPool* pool); // O(N / P + M) - где P - число потоков
+    static constexpr TextOffset PARALLEL_BUILD_MIN = 4 * 1024 * 1024;
+
+    // Открыть текстовый файл без копирования: файл отображается в память, листья ссылаются на его
+    // байты (режутся так же, как в fromText), правленые листья копируются в пул. Текст читается
+    // один раз ради счётчиков '\n' (на pool — параллельно), после чего страницы файла отдаются
+    // системе: в памяти остаются узлы дерева, правленые листья и недавно прочитанные страницы.
+    // Бросает std::runtime_error, если файл нельзя отобразить (тогда дерево не тронуто).
+    void fromMappedFile(const std::string& path); // O(N / P + M)
+    void fromMappedFile(const std::string& path, WorkStealingPool* pool); // O(N / P + M)
+
+    // Отображённый файл изменила другая программа (после этого его байты в дереве ненадёжны)
+    // или ждёт отзыва аренды, чтобы изменить: детач сейчас ещё скопирует прежний текст
+    bool mappedFilesChanged() const; // O(F) - где F - количество отображённых файлов
+    // Текст ссылается на файл path (перед записью в path текст нужно отвязать от него)
+    bool usesMappedFile(const std::string& path) const; // O(F)
+    // Скопировать текст всех отображённых листьев в пул и закрыть файлы (если снимки их уже не держат).
+    // false — файл успели усечь: байты за его новым концом потеряны и отброшены (текст стал короче,
+    // опустевшие листья выброшены, дерево и снимки пересобраны как B+-деревья).
+    // После этого файлы не считаются используемыми (mappedFilesChanged, usesMappedFile), поэтому
+    // снимки этой памяти, которые ещё будут читаться (журнал отмены), передаются сюда же —
+    // их отображённые листья тоже заменяются копиями. При исключении (bad_alloc) ничего не меняется.
+    bool detachMappedFiles() { return detachMappedFiles(nullptr, 0); } // O(N)
+    bool detachMappedFiles(TreeSnapshot* const* snapshots, std::size_t count); // O(N + S) - где S - узлы снимков
 
-    // Удалить len байт, начиная с pos
-    void erase(int pos, int len); // O(log M + L) - где M - количество узлов, L - длина удаляемых данных
+    // Неизменяемый снимок текущего текста (см. TreeSnapshot)
+    TreeSnapshot snapshot() const; // O(1)
+
+    // Снимок только диапазона [pos, pos + len): листья внутри диапазона разделяются с деревом
+    // (байты не копируются), копируются лишь части двух крайних листьев
+    TreeSnapshot snapshotRange(TextOffset pos, TextOffset len); // O(log M + K) - где K - количество листьев диапазона
+    
+    // Вставка в дерево. Данные длиннее MAX_LEAF_SIZE собираются в отдельное сбалансированное
+    // поддерево (как в fromText, крупные — на пуле потоков) и вклеиваются через split/join,
+    // так что ни один лист не становится длиннее MAX_LEAF_SIZE.
+    // Бросает std::length_error, если длина документа вышла бы за пределы TextOffset
+    void insert(TextOffset pos, const char* data, TextOffset len); // O(log M + L) - где M - количество узлов, L - длина вставляемых данных
+
+    // Удалить len байт, начиная с pos. Целиком покрытые поддеревья отцепляются, не обходясь:
+    // правятся только два крайних пути, а крупные поддеревья освобождает фоновый NodeReclaimer.
+    void erase(TextOffset pos, TextOffset len); // O(log M) - где M - количество узлов
+
+    // Применить пакет правок за один проход слева направо: правки сортируются по pos, каждый
+    // затронутый лист пересобирается один раз, нетронутые листья переиспользуются, а дерево
+    // собирается заново один раз в конце. Маленький пакет на большом тексте дешевле применить
+    // по одной правке с конца (O(K log M)) — так и делается, результат тот же.
+    // Правки с одинаковым pos применяются в порядке массива, вставка — раньше удаления с того же места.
+    // Удаление за концом текста обрезается (как в erase). Бросает std::invalid_argument, если pos
+    // правки вне [0, getLength()] или диапазоны правок пересекаются,
+    // и std::length_error при переполнении длины — в обоих случаях дерево не тронуто.
+    // При нехватке памяти (bad_alloc) дерево тоже остаётся прежним: пакет применяется целиком или никак.
+    void applyEdits(const TextEdit* edits, std::size_t count); // O(K log K + M + L) - где K - количество правок, L - длина затронутых листьев и вставок
+    void applyEdits(const std::vector<TextEdit>& edits) { applyEdits(edits.data(), edits.size()); }
+    // Пакет не длиннее getLength() / (MAX_LEAF_SIZE * APPLY_EDITS_LEAVES_PER_EDIT) правок
+    // применяется по одной правке (пересборка дерева обошлась бы дороже)
+    static constexpr TextOffset APPLY_EDITS_LEAVES_PER_EDIT = 64;
+
+    // --- Разрез и склейка: перенос больших диапазонов без копирования байт ---
+    // Деревья, полученные split/extract, делят память (пул узлов) с исходным, и concat/insertTree
+    // между ними переставляют поддеревья за O(log M). Текст дерева с другой памятью сначала
+    // копируется в пул этого дерева (O(L) - где L - его длина). Деревья с общей памятью правятся
+    // из одного потока (пул не потокобезопасен). При исключении (bad_alloc) оба дерева остаются как были.
+
+    // Оставить в дереве [0, offset), остаток вернуть отдельным деревом
+    Tree split(TextOffset offset); // O(log M)
+    // Дописать текст other в конец (other становится пустым)
+    void concat(Tree&& other); // O(log M)
+    // Вырезать [pos, pos + len) в отдельное дерево
+    Tree extract(TextOffset pos, TextOffset len); // O(log M)
+    // Вставить текст other в позицию pos (other становится пустым)
+    void insertTree(TextOffset pos, Tree&& other); // O(log M)
+    // Удалить [pos, pos + len) и вернуть удалённый текст снимком (журнал отмены хранит его без копирования)
+    TreeSnapshot cut(TextOffset pos, TextOffset len); // O(log M)
+    // Вставить текст снимка в позицию pos: снимок этого дерева вклеивается поддеревом, чужой — копируется
+    void insertSnapshot(TextOffset pos, const TreeSnapshot& text); // O(log M), O(L) - для чужого снимка
+
+    // Полностью перестроить дерево в B+-дерево с равномерно заполненными узлами (листья не копируются).
+    // insert/erase и так поддерживают инвариант B+-дерева; setRoot вызывает rebalance() сам,
+    // если ему передали дерево другой формы (двоичные узлы, старые .bin файлы).
+    // При нехватке памяти дерево не меняется.
+    void rebalance(); // O(M) - где M - количество узлов
+
+    // Сколько раз недозаполненный лист был слит с соседом
+    long long getMergedLeavesCount() const; // O(1)
+
+    // Шаг фонового уплотнения (для простоя редактора): листья одного родителя, идущие подряд и короче
+    // COMPACT_TARGET_FILL, переупаковываются в меньшее число листьев по ~COMPACT_TARGET_FILL байт,
+    // а родитель, оставшийся с малым числом детей, сливается с соседом (как после удаления).
+    // Листья над отображённым файлом и узлы, общие со снимками (журнал отмены), не трогаются.
+    // Каждый шаг начинает со следующего родителя; false — проход по тексту закончен
+    // (следующий вызов начнёт новый). При bad_alloc текст не меняется.
+    bool compactStep(); // O(log M + L) - где L - длина листьев одного родителя (до 64 КБ)
+    static constexpr int COMPACT_TARGET_FILL = MAX_LEAF_SIZE * 3 / 4;
+
+    // Чтения через палец (см. Finger): курсор, двигающийся по соседним байтам, не спускается от корня.
+    // Результат тот же, что у TreeReader.
+    LineIndex getLineForOffset(TextOffset offset) const; // O(1) - в листе пальца или соседнем, иначе O(log M)
+    TextLocation locate(TextOffset offset) const; // O(L) - в листе пальца, где L - максимальная длина листа
+    // Сколько операций (insert, erase, getLineForOffset, locate) начались с пальца и сколько — от корня
+    long long getFingerHitCount() const; // O(1)
+    long long getFingerMissCount() const; // O(1)
     
     Node* getRoot() const; // O(1) - Простое получение указателя
-    void setRoot(Node* newRoot); // O(1) - Простая установка указателя
+    // Узлы newRoot могут быть созданы как через createLeaf/createInternal, так и обычным new.
+    // Если newRoot не B+-дерево (разная глубина листьев, лишние дети) — перестраивается через rebalance().
+    void setRoot(Node* newRoot); // O(N) - проверка формы и подсчёт узлов, созданных не из пула дерева
+
+    // --- Создание узлов в пуле дерева (для внешних построителей, например BinaryTreeFile) ---
+    // createLeaf(nullptr, len) оставляет буфер неинициализированным (lineCount = 0)
+    LeafNode* createLeaf(const char* text, int len); // O(len)
+    // Лист-ссылка на len байт text из отображённого файла дерева (lineCount = 0, байты не копируются)
+    LeafNode* createMappedLeaf(const char* text, int len); // O(1)
+    InternalNode* createInternal(); // O(1) - узел без детей
+    InternalNode* createInternal(Node* l, Node* r); // O(1)
+    void destroyNode(Node* node); // O(1) - только сам узел (дети не трогаются)
+    // O(N) - отпустить ссылку на поддерево: удаляются узлы, на которые больше никто не ссылается
+    // (узлы, общие со снимками, остаются снимкам)
+    void destroySubtree(Node* node);
+
+    std::size_t getReservedBytes() const; // O(1) - память, зарезервированная пулом
 };
 
 #endif // TREE_H
\ No newline at end of file
@@ -0,0 +1,165 @@
+#include "TreeBuilder.h"
+#include "NewlineScan.h"
+#include <cstring>
+
+namespace {
+// Узлов, ждущих родителя на одном уровне: до эмиссии MAX + MIN, при сборке в finish() — ещё два
+constexpr std::size_t LEVEL_CAPACITY = BTREE_MAX_CHILDREN + BTREE_MIN_CHILDREN + 2;
+} // namespace
+
+TreeBuilder::TreeBuilder(Tree& tree) : tree(tree) {
+    tree.clear();
+    ensureLevel(0);
+}
+
+TreeBuilder::~TreeBuilder() {
+    releaseAll();
+}
+
+void TreeBuilder::releaseAll() {
+    if (current) tree.destroyNode(current);
+    current = nullptr;
+    for (std::vector<Node*>& level : levels) {
+        for (Node* node : level) tree.destroySubtree(node);
+        level.clear();
+    }
+}
+
+void TreeBuilder::ensureLevel(std::size_t h) {
+    if (h < levels.size()) return;
+    std::vector<Node*> level;
+    level.reserve(LEVEL_CAPACITY); // дальше push_back уровня не выделяет память
+    levels.push_back(std::move(level));
+}
+
+LeafNode* TreeBuilder::createEmptyLeaf() {
+    LeafNode* leaf = tree.createLeaf(nullptr, MAX_LEAF_SIZE);
+    // Весь буфер — разрыв в конце листа: байты дописываются прямо в data + length
+    leaf->length = 0;
+    leaf->gapStart = 0;
+    return leaf;
+}
+
+void TreeBuilder::append(const char* data, TextOffset len) {
+    while (len > 0) {
+        int available = 0;
+        char* dst = prepare(available);
+        int n = len < available ? static_cast<int>(len) : available;
+        std::memcpy(dst, data, static_cast<std::size_t>(n));
+        commit(n);
+        data += n;
+        len -= n;
+    }
+}
+
+char* TreeBuilder::prepare(int& available) {
+    if (!current) {
+        current = createEmptyLeaf();
+    } else if (current->length >= MAX_LEAF_SIZE) {
+        closeLeaf();
+    }
+    available = MAX_LEAF_SIZE - current->length;
+    return current->data + current->length;
+}
+
+void TreeBuilder::commit(int n) {
+    if (!current || n <= 0) return;
+    if (n > MAX_LEAF_SIZE - current->length) n = MAX_LEAF_SIZE - current->length;
+    current->length += n;
+    current->gapStart = current->length;
+    length += n;
+}
+
+void TreeBuilder::closeLeaf() {
+    // Режем после последнего '\n' второй половины: лист не короче MAX_LEAF_SIZE / 2,
+    // хвост (начало незаконченной строки) уходит в следующий лист
+    //! КРАЙ ПО КОТОРОМУ РЕЖЕТСЯ ЛИСТ - НЕКОРРЕКТНОЕ ПОВЕДЕНИЕ ПОСЛЕ
+    int half = current->length / 2;
+    std::int64_t nl = findLastNewline(current->data + half, static_cast<std::size_t>(current->length - half));
+    int cut = nl >= 0 ? half + static_cast<int>(nl) + 1 : current->length;
+
+    LeafNode* next = createEmptyLeaf(); // при исключении текущий лист не тронут
+    int tail = current->length - cut;
+    std::memcpy(next->data, current->data + cut, static_cast<std::size_t>(tail));
+    next->length = tail;
+    next->gapStart = tail;
+
+    LeafNode* full = current;
+    full->length = cut;
+    full->gapStart = cut;
+    full->recount();
+    current = next;
+    pushNode(full, 0);
+}
+
+void TreeBuilder::pushNode(Node* node, std::size_t h) {
+    try {
+        levels[h].push_back(node);
+    } catch (...) {
+        tree.destroySubtree(node);
+        throw;
+    }
+    if (levels[h].size() < static_cast<std::size_t>(BTREE_MAX_CHILDREN + BTREE_MIN_CHILDREN)) return;
+
+    // Полный родитель из первых MAX узлов. Последние MIN остаются ждать: если текст на них
+    // кончится, в finish() им хватит узлов на собственного родителя.
+    ensureLevel(h + 1);
+    InternalNode* parent = tree.createInternal();
+    std::vector<Node*>& level = levels[h];
+    for (int i = 0; i < BTREE_MAX_CHILDREN; ++i) parent->appendChild(level[static_cast<std::size_t>(i)]);
+    level.erase(level.begin(), level.begin() + BTREE_MAX_CHILDREN);
+    pushNode(parent, h + 1);
+}
+
+void TreeBuilder::finish() {
+    if (finished) return;
+
+    if (current && current->length == 0) {
+        tree.destroyNode(current);
+        current = nullptr;
+    }
+    if (current && current->length < MIN_LEAF_SIZE && !levels[0].empty()) {
+        // Короткий хвост текста доливаем в предыдущий лист (переполненный разрежется пополам)
+        auto prev = static_cast<LeafNode*>(levels[0].back());
+        Node* extra = tree.insertIntoLeaf(prev, prev->length, current->data, current->length);
+        tree.destroyNode(current);
+        current = nullptr;
+        if (extra) pushNode(extra, 0);
+    }
+    if (current) {
+        current->recount();
+        LeafNode* last = current;
+        current = nullptr;
+        pushNode(last, 0);
+    }
+
+    // Остатки уровней снизу вверх: n узлов — ceil(n / MAX) родителей поровну (как в buildFromLeaves).
+    // Ниже верхнего уровня узлов не меньше BTREE_MIN_CHILDREN, так что родители заполнены хотя бы наполовину.
+    for (std::size_t h = 0; h + 1 < levels.size() || levels[h].size() > 1; ++h) {
+        ensureLevel(h + 1);
+        std::vector<Node*>& nodes = levels[h];
+        std::size_t n = nodes.size();
+        std::size_t groups = (n + BTREE_MAX_CHILDREN - 1) / BTREE_MAX_CHILDREN;
+        std::size_t next = 0;
+        try {
+            for (std::size_t g = 0; g < groups; ++g) {
+                std::size_t take = n / groups + (g < n % groups ? 1 : 0);
+                InternalNode* parent = tree.createInternal();
+                levels[h + 1].push_back(parent); // ёмкость зарезервирована
+                for (std::size_t k = 0; k < take; ++k) parent->appendChild(nodes[next++]);
+            }
+        } catch (...) {
+            nodes.erase(nodes.begin(), nodes.begin() + static_cast<std::ptrdiff_t>(next)); // уже у родителей
+            throw;
+        }
+        nodes.clear();
+    }
+
+    std::vector<Node*>& top = levels.back();
+    Node* root = top.empty() ? nullptr : top[0];
+    top.clear();
+    tree.resetFinger();
+    tree.destroySubtree(tree.root);
+    tree.root = root;
+    finished = true;
+}
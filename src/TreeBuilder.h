@@ -0,0 +1,56 @@
+#ifndef TREE_BUILDER_H
+#define TREE_BUILDER_H
+
+#include <cstddef>
+#include <vector>
+#include "Tree.h"
+
+// Построение дерева из потока текста (файл, pipe, сокет — общая длина заранее не нужна).
+// Куски любого размера дописываются в конец. Листы заполняются до MAX_LEAF_SIZE и режутся
+// по последнему '\n' во второй половине (без '\n' — ровно по MAX_LEAF_SIZE), а готовые узлы
+// сразу собираются в B+-дерево снизу вверх: на каждом уровне ждут родителя не больше
+// BTREE_MAX_CHILDREN + BTREE_MIN_CHILDREN узлов, так что память построителя — O(log N).
+//
+// Узлы создаются в пуле дерева; пока идёт построение, дерево не используется.
+// finish() отдаёт дерево целиком; построитель, разрушенный без finish(), оставляет дерево пустым.
+// После исключения (bad_alloc) построение продолжать нельзя — только разрушить построитель.
+class TreeBuilder {
+public:
+    explicit TreeBuilder(Tree& tree); // O(S) - дерево очищается (см. Tree::clear)
+    ~TreeBuilder(); // O(K) - где K - количество ещё не отданных дереву узлов
+
+    TreeBuilder(const TreeBuilder&) = delete;
+    TreeBuilder& operator=(const TreeBuilder&) = delete;
+
+    // Дописать [data, data + len) в конец текста
+    void append(const char* data, TextOffset len); // O(len)
+
+    // Запись прямо в буфер листа (например, read() из файла — без промежуточного буфера):
+    // prepare даёт место под available > 0 байт, commit(n) сообщает, что первые n из них заполнены
+    char* prepare(int& available); // O(1) амортизированно
+    void commit(int n); // O(1) амортизированно, '\n' считаются при закрытии листа
+
+    // Завершить построение: дерево получает весь текст (повторный вызов ничего не делает)
+    void finish(); // O(log N)
+
+    TextOffset getLength() const { return length; } // O(1) - сколько байт уже дописано
+
+private:
+    Tree& tree;
+    LeafNode* current = nullptr; // заполняемый лист (буфер на MAX_LEAF_SIZE байт, разрыв в конце)
+    // levels[h] — готовые узлы высоты h, ещё без родителя (по порядку текста)
+    std::vector<std::vector<Node*>> levels;
+    TextOffset length = 0;
+    bool finished = false;
+
+    LeafNode* createEmptyLeaf();
+    // Лист заполнен: закрыть его по '\n', хвост перенести в новый текущий лист
+    void closeLeaf();
+    // Отдать готовый узел уровню h; набралось BTREE_MAX_CHILDREN + BTREE_MIN_CHILDREN — первые
+    // BTREE_MAX_CHILDREN уходят полным родителем на уровень выше (при исключении node освобождается)
+    void pushNode(Node* node, std::size_t h);
+    void ensureLevel(std::size_t h);
+    void releaseAll();
+};
+
+#endif // TREE_BUILDER_H
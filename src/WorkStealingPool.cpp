@@ -0,0 +1,156 @@
+#include "WorkStealingPool.h"
+#include <utility>
+
+namespace {
+// Пул и номер рабочего потока, который выполняет текущий код (у посторонних потоков — nullptr/-1)
+thread_local const WorkStealingPool* workerPool = nullptr;
+thread_local int workerIndex = -1;
+} // namespace
+
+// ==========================================
+// Реализация TaskGroup
+// ==========================================
+
+WorkStealingPool::TaskGroup::~TaskGroup() {
+    waitAll();
+}
+
+void WorkStealingPool::TaskGroup::run(std::function<void()> task) {
+    pending.fetch_add(1, std::memory_order_relaxed);
+    try {
+        pool.push(Task{std::move(task), this});
+    } catch (...) {
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        throw;
+    }
+}
+
+void WorkStealingPool::TaskGroup::waitAll() noexcept {
+    int self = pool.currentIndex();
+    while (pending.load(std::memory_order_acquire) > 0) {
+        // Пока ждём — помогаем: выполняем свои или чужие задачи
+        if (!pool.runOne(self)) std::this_thread::yield();
+    }
+}
+
+void WorkStealingPool::TaskGroup::wait() {
+    waitAll();
+    std::exception_ptr e;
+    {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        std::swap(e, error);
+    }
+    if (e) std::rethrow_exception(e);
+}
+
+// ==========================================
+// Реализация WorkStealingPool
+// ==========================================
+
+WorkStealingPool::WorkStealingPool(unsigned threadCount) {
+    if (threadCount == 0) {
+        unsigned cores = std::thread::hardware_concurrency();
+        threadCount = cores > 1 ? cores - 1 : 1;
+    }
+    for (unsigned i = 0; i <= threadCount; ++i) queues.push_back(std::make_unique<WorkQueue>());
+    try {
+        for (unsigned i = 0; i < threadCount; ++i) threads.emplace_back(&WorkStealingPool::workerLoop, this, static_cast<int>(i));
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : threads) t.join();
+        throw;
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& t : threads) t.join();
+}
+
+WorkStealingPool& WorkStealingPool::shared() {
+    static WorkStealingPool pool;
+    return pool;
+}
+
+int WorkStealingPool::currentIndex() const {
+    return workerPool == this ? workerIndex : -1;
+}
+
+void WorkStealingPool::push(Task task) {
+    int self = currentIndex();
+    WorkQueue& queue = *queues[self >= 0 ? static_cast<std::size_t>(self) : queues.size() - 1];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1, std::memory_order_release);
+    // Захват sleepMutex не даёт потоку проверить queued и уснуть мимо этого notify
+    { std::lock_guard<std::mutex> lock(sleepMutex); }
+    wake.notify_one();
+}
+
+bool WorkStealingPool::popTask(int self, Task& task) {
+    if (queued.load(std::memory_order_acquire) == 0) return false;
+
+    // Своя очередь — с конца
+    if (self >= 0) {
+        WorkQueue& own = *queues[static_cast<std::size_t>(self)];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    // Кража — из начала чужих очередей, начиная с соседа (потоки не толпятся у одной очереди)
+    std::size_t n = queues.size();
+    std::size_t start = self >= 0 ? static_cast<std::size_t>(self) + 1 : 0;
+    for (std::size_t k = 0; k < n; ++k) {
+        std::size_t victim = (start + k) % n;
+        if (static_cast<int>(victim) == self) continue;
+        WorkQueue& queue = *queues[victim];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool WorkStealingPool::runOne(int self) {
+    Task task;
+    if (!popTask(self, task)) return false;
+
+    try {
+        task.fn();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(task.group->errorMutex);
+        if (!task.group->error) task.group->error = std::current_exception();
+    }
+    task.fn = nullptr; // захваченное задачей освобождаем до того, как группа узнает о завершении
+    task.group->pending.fetch_sub(1, std::memory_order_release);
+    return true;
+}
+
+void WorkStealingPool::workerLoop(int index) {
+    workerPool = this;
+    workerIndex = index;
+    for (;;) {
+        if (runOne(index)) continue;
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wake.wait(lock, [this]() { return stopping || queued.load(std::memory_order_acquire) > 0; });
+        if (stopping && queued.load(std::memory_order_acquire) == 0) return;
+    }
+}
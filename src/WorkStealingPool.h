@@ -0,0 +1,100 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с кражей задач для fork/join-параллелизма (массовое построение дерева).
+// У каждого рабочего потока своя очередь: свои задачи он берёт с конца (последние — самые
+// "горячие" в кэше), а простаивающие потоки крадут из начала чужих очередей (самые крупные).
+// Задачи из посторонних потоков попадают в общую очередь, откуда их крадут так же.
+// Ожидающий TaskGroup::wait() поток сам выполняет задачи — вложенные группы не блокируют пул.
+class WorkStealingPool {
+public:
+    // threadCount == 0 — по числу ядер минус один (вызывающий поток помогает в wait())
+    explicit WorkStealingPool(unsigned threadCount = 0);
+    ~WorkStealingPool(); // дожидается рабочих потоков; незавершённых групп быть не должно
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Общий пул процесса (создаётся при первом обращении)
+    static WorkStealingPool& shared();
+
+    unsigned getThreadCount() const { return static_cast<unsigned>(threads.size()); }
+
+    // Группа задач: run() запускает задачу в пуле, wait() дожидается всех задач группы.
+    // Первое исключение задачи пробрасывается из wait(); деструктор ждёт, но ничего не бросает.
+    class TaskGroup {
+    public:
+        explicit TaskGroup(WorkStealingPool& pool) : pool(pool) {}
+        ~TaskGroup();
+
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        void run(std::function<void()> task); // O(1)
+        void wait();
+
+    private:
+        friend class WorkStealingPool;
+        WorkStealingPool& pool;
+        std::atomic<int> pending{0};
+        std::mutex errorMutex;
+        std::exception_ptr error;
+
+        void waitAll() noexcept;
+    };
+
+    // fn(i) для каждого i из [begin, end), кусками по grain индексов на задачу
+    template <typename F>
+    void parallelFor(std::size_t begin, std::size_t end, std::size_t grain, F fn);
+
+private:
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group;
+    };
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // queues[i] — очередь рабочего потока i, последняя — для задач посторонних потоков
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<int> queued{0}; // задач во всех очередях
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void push(Task task);
+    // Выполнить одну задачу: свою (с конца своей очереди) или украденную. false — задач нет.
+    bool runOne(int self);
+    bool popTask(int self, Task& task);
+    void workerLoop(int index);
+    int currentIndex() const; // номер текущего рабочего потока в этом пуле или -1
+};
+
+template <typename F>
+void WorkStealingPool::parallelFor(std::size_t begin, std::size_t end, std::size_t grain, F fn) {
+    if (grain == 0) grain = 1;
+    TaskGroup group(*this);
+    for (std::size_t from = begin; from < end; from += grain) {
+        std::size_t to = end - from > grain ? from + grain : end;
+        group.run([&fn, from, to]() {
+            for (std::size_t i = from; i < to; ++i) fn(i);
+        });
+    }
+    group.wait();
+}
+
+#endif // WORK_STEALING_POOL_H
@@ -0,0 +1,185 @@
+// Микро-бенчмарк спуска по дереву: текущий Tree (B+-дерево, префиксы весов детей в родителе)
+// против прежней раскладки (двоичные узлы, виртуальные getType/getLength/getLineCount,
+// вес читается из ребёнка) над теми же листьями.
+// Запуск: bench_descent [размер текста в МБ, по умолчанию 64]
+#include "../src/Tree.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// --- Реплика старой раскладки узлов (как до перехода на теги) ---
+struct LegacyNode {
+    unsigned char flags = 0;
+    virtual NodeType getType() const = 0;
+    virtual int getLength() const = 0;
+    virtual int getLineCount() const = 0;
+    virtual ~LegacyNode() = default;
+};
+
+struct LegacyLeaf : LegacyNode {
+    int length;
+    int lineCount;
+    char* data;
+    int capacity;
+    int gapStart;
+
+    LegacyLeaf(const LeafNode* src)
+        : length(src->length), lineCount(src->lineCount), data(new char[src->length]), // NOSONAR
+          capacity(src->length), gapStart(src->length) {
+        src->copyOut(0, src->length, data);
+    }
+    ~LegacyLeaf() override { delete[] data; } // NOSONAR
+    NodeType getType() const override { return NodeType::NODE_LEAF; }
+    int getLength() const override { return length; }
+    int getLineCount() const override { return lineCount; }
+};
+
+struct LegacyInternal : LegacyNode {
+    LegacyNode* left;
+    LegacyNode* right;
+    int totalLength;
+    int totalLineCount;
+    int height;
+
+    LegacyInternal(LegacyNode* l, LegacyNode* r)
+        : left(l), right(r),
+          totalLength(l->getLength() + r->getLength()),
+          totalLineCount(l->getLineCount() + r->getLineCount()),
+          height(0) {}
+    ~LegacyInternal() override { delete left; delete right; } // NOSONAR
+    NodeType getType() const override { return NodeType::NODE_INTERNAL; }
+    int getLength() const override { return totalLength; }
+    int getLineCount() const override { return totalLineCount; }
+};
+
+void collectLeaves(const Node* node, std::vector<const LeafNode*>& out) {
+    if (node->getType() == NodeType::NODE_LEAF) {
+        out.push_back(static_cast<const LeafNode*>(node));
+        return;
+    }
+    auto in = static_cast<const InternalNode*>(node);
+    for (int i = 0; i < in->childCount; ++i) collectLeaves(in->children[i], out);
+}
+
+// Сбалансированное двоичное дерево старой раскладки над теми же листьями
+// (узлы выделяются по одному через new, как раньше)
+LegacyNode* buildLegacy(const std::vector<const LeafNode*>& leaves, size_t from, size_t to) {
+    if (to - from == 1) return new LegacyLeaf(leaves[from]); // NOSONAR
+    size_t mid = from + (to - from) / 2;
+    LegacyNode* l = buildLegacy(leaves, from, mid);
+    LegacyNode* r = buildLegacy(leaves, mid, to);
+    return new LegacyInternal(l, r); // NOSONAR
+}
+
+// --- Спуски: смещение -> лист, номер строки -> смещение начала строки ---
+
+int descendOffsetLegacy(const LegacyNode* node, int offset) {
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto in = static_cast<const LegacyInternal*>(node);
+        int leftLen = in->left->getLength(); // косвенный вызов + чтение ребёнка
+        if (offset < leftLen) {
+            node = in->left;
+        } else {
+            offset -= leftLen;
+            node = in->right;
+        }
+    }
+    return offset + static_cast<const LegacyLeaf*>(node)->length;
+}
+
+int descendOffsetWide(const Node* node, int offset) {
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto in = static_cast<const InternalNode*>(node);
+        int i = in->findChildByOffset(offset);
+        offset -= in->childOffset(i);
+        node = in->children[i];
+    }
+    return offset + static_cast<const LeafNode*>(node)->length;
+}
+
+int descendLineLegacy(const LegacyNode* node, int k) {
+    int base = 0;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto in = static_cast<const LegacyInternal*>(node);
+        int leftLines = in->left->getLineCount();
+        if (k <= leftLines) {
+            node = in->left;
+        } else {
+            base += in->left->getLength();
+            k -= leftLines;
+            node = in->right;
+        }
+    }
+    return base + k;
+}
+
+int descendLineWide(const Node* node, int k) {
+    int base = 0;
+    while (node->getType() == NodeType::NODE_INTERNAL) {
+        auto in = static_cast<const InternalNode*>(node);
+        int i = in->findChildByLine(k);
+        base += in->childOffset(i);
+        k -= in->childLineOffset(i);
+        node = in->children[i];
+    }
+    return base + k;
+}
+
+template <typename F>
+double measureNs(const std::vector<int>& queries, F&& fn, long long& sink) {
+    auto start = std::chrono::steady_clock::now();
+    for (int q : queries) sink += fn(q);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / static_cast<double>(queries.size());
+}
+
+int main(int argc, char** argv) {
+    int megabytes = argc > 1 ? std::atoi(argv[1]) : 64;
+    if (megabytes <= 0) megabytes = 64;
+    const int queryCount = 2000000;
+
+    std::mt19937 rng(12345);
+    std::string text;
+    text.reserve(static_cast<size_t>(megabytes) * 1024 * 1024);
+    while (text.size() < static_cast<size_t>(megabytes) * 1024 * 1024) {
+        text.append(static_cast<size_t>(20 + rng() % 60), 'a');
+        text += '\n';
+    }
+
+    Tree tree;
+    tree.fromText(text.c_str(), static_cast<int>(text.size()));
+    std::vector<const LeafNode*> leaves;
+    collectLeaves(tree.getRoot(), leaves);
+    LegacyNode* legacy = buildLegacy(leaves, 0, leaves.size());
+
+    int totalLen = tree.getRoot()->getLength();
+    int totalLines = tree.getRoot()->getLineCount();
+
+    std::vector<int> offsets(queryCount);
+    std::vector<int> lines(queryCount);
+    for (int i = 0; i < queryCount; ++i) {
+        offsets[i] = static_cast<int>(rng() % static_cast<unsigned>(totalLen));
+        lines[i] = 1 + static_cast<int>(rng() % static_cast<unsigned>(totalLines));
+    }
+
+    long long sink = 0;
+    double offLegacy = measureNs(offsets, [legacy](int q) { return descendOffsetLegacy(legacy, q); }, sink);
+    double offWide = measureNs(offsets, [&tree](int q) { return descendOffsetWide(tree.getRoot(), q); }, sink);
+    double lineLegacy = measureNs(lines, [legacy](int q) { return descendLineLegacy(legacy, q); }, sink);
+    double lineWide = measureNs(lines, [&tree](int q) { return descendLineWide(tree.getRoot(), q); }, sink);
+
+    std::cout << "text: " << megabytes << " MB, lines: " << totalLines << ", queries: " << queryCount << "\n";
+    std::cout << "node size: LeafNode " << sizeof(LeafNode) << " B (legacy " << sizeof(LegacyLeaf)
+              << " B), InternalNode " << sizeof(InternalNode) << " B, fanout " << BTREE_MAX_CHILDREN
+              << " (legacy " << sizeof(LegacyInternal) << " B, fanout 2)\n";
+    std::cout << "depth: " << static_cast<const InternalNode*>(tree.getRoot())->height << "\n";
+    std::cout << "offset descent: legacy " << offLegacy << " ns, B+ " << offWide << " ns\n";
+    std::cout << "line descent:   legacy " << lineLegacy << " ns, B+ " << lineWide << " ns\n";
+    std::cout << "(checksum " << sink << ")\n";
+
+    delete legacy; // NOSONAR
+    return 0;
+}
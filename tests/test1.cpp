@@ -435,6 +435,131 @@ void stress_fuzz_random(int iterations = 20, size_t file_size = 2048) {
     std::remove(fn);
 }
 
+// 3.7 Файл версии 1 (двоичные internal-узлы) — должен читаться и перестраиваться в B+-дерево
+void stress_legacy_binary_file() {
+    std::cout << "\n## 🔥 Стресс 3.7: Чтение файла версии 1 (двоичные узлы)" << std::endl;
+    const char* fn = "legacy_v1.bin";
+    auto put_le = [](std::ofstream& out, uint64_t v, int bytes) {
+        for (int i = 0; i < bytes; ++i) out.put(static_cast<char>((v >> (8 * i)) & 0xFF));
+    };
+    {
+        std::ofstream out(fn, std::ios::binary | std::ios::trunc);
+        out.write("TREE", 4);
+        put_le(out, 1, 4);    // version = 1
+        put_le(out, 41, 8);   // rootOffset: internal после двух листьев
+        // лист "abc\n" по смещению 16 (13 байт), лист "def" по смещению 29 (12 байт)
+        out.put(static_cast<char>(NodeType::NODE_LEAF));
+        put_le(out, 4, 4);
+        put_le(out, 1, 4);
+        out.write("abc\n", 4);
+        out.put(static_cast<char>(NodeType::NODE_LEAF));
+        put_le(out, 3, 4);
+        put_le(out, 0, 4);
+        out.write("def", 3);
+        // internal по смещению 41: [type][leftOffset][rightOffset]
+        out.put(static_cast<char>(NodeType::NODE_INTERNAL));
+        put_le(out, 16, 8);
+        put_le(out, 29, 8);
+    }
+
+    BinaryTreeFile bf;
+    bool loaded = false;
+    bool text_ok = false;
+    if (bf.openFile(fn)) {
+        try {
+            Tree t;
+            bf.loadTree(t);
+            loaded = true;
+            char* out = t.toText();
+            text_ok = compare_text(out, "abc\ndef") && t.getTotalLineCount() == 2;
+            delete[] out;
+        } catch (const std::exception& e) {
+            std::cerr << "  Exception при загрузке файла версии 1: " << e.what() << std::endl;
+        }
+        bf.close();
+    }
+    run_test("3.7.1 Load файла версии 1 (не упало)", loaded);
+    run_test("3.7.2 Текст файла версии 1 совпадает", text_ok);
+    std::remove(fn);
+}
+
+// 3.8 Форматы длины листа: версия 2 (int32) читается, версия 3 (varint) проверяет 64-битную длину
+void stress_leaf_length_versions() {
+    std::cout << "\n## 🔥 Стресс 3.8: Длина листа в версиях 2 и 3" << std::endl;
+    const char* fn = "leaf_len.bin";
+    auto put_le = [](std::ofstream& out, uint64_t v, int bytes) {
+        for (int i = 0; i < bytes; ++i) out.put(static_cast<char>((v >> (8 * i)) & 0xFF));
+    };
+    auto try_load = [fn](std::string& text) {
+        BinaryTreeFile bf;
+        if (!bf.openFile(fn)) return false;
+        try {
+            Tree t;
+            bf.loadTree(t);
+            char* out = t.toText();
+            text = out;
+            delete[] out;
+            return true;
+        } catch (const std::exception& e) {
+            std::cout << "  Исключение: " << e.what() << std::endl;
+            return false;
+        }
+    };
+
+    // Версия 2: один лист с int32-длиной и lineCount
+    {
+        std::ofstream out(fn, std::ios::binary | std::ios::trunc);
+        out.write("TREE", 4);
+        put_le(out, 2, 4);
+        put_le(out, 16, 8);
+        out.put(static_cast<char>(NodeType::NODE_LEAF));
+        put_le(out, 6, 4);
+        put_le(out, 1, 4);
+        out.write("v2\nold", 6);
+    }
+    std::string text;
+    run_test("3.8.1 Load файла версии 2", try_load(text) && text == "v2\nold");
+
+    // Версия 3: varint-длина 5 ГБ (больше любого int32) без данных — ошибка, а не переполнение
+    {
+        std::ofstream out(fn, std::ios::binary | std::ios::trunc);
+        out.write("TREE", 4);
+        put_le(out, 3, 4);
+        put_le(out, 16, 8);
+        out.put(static_cast<char>(NodeType::NODE_LEAF));
+        uint64_t len = 5ULL << 30;
+        while (len >= 0x80) {
+            out.put(static_cast<char>((len & 0x7F) | 0x80));
+            len >>= 7;
+        }
+        out.put(static_cast<char>(len));
+    }
+    run_test("3.8.2 Load должен выкинуть ошибку на 64-битную длину листа без данных", !try_load(text));
+
+    // Сохранение пишет версию 3 и читает её обратно (длины листов > 127 — многобайтный varint)
+    std::string big;
+    for (int i = 0; i < 2000; ++i) big += "varint line " + std::to_string(i) + "\n";
+    {
+        Tree t;
+        t.fromText(big.c_str(), big.size());
+        BinaryTreeFile bf;
+        if (bf.openFile(fn)) {
+            bf.saveTree(t);
+            bf.close();
+        }
+    }
+    uint32_t version = 0;
+    {
+        std::ifstream in(fn, std::ios::binary);
+        char hdr[8] = {};
+        in.read(hdr, 8);
+        for (int i = 0; i < 4; ++i) version |= static_cast<uint32_t>(static_cast<unsigned char>(hdr[4 + i])) << (8 * i);
+    }
+    run_test("3.8.3 saveTree пишет версию 3", version == 3);
+    run_test("3.8.4 Round-trip версии 3", try_load(text) && text == big);
+    std::remove(fn);
+}
+
 // =================================================================
 // ГЛАВНАЯ ФУНКЦИЯ ТЕСТИРОВАНИЯ
 // =================================================================
@@ -456,6 +581,8 @@ int main() {
     stress_corrupted_magic();      // испорченный header
     stress_truncated_leaf_len();   // слишком большая длина leaf без данных
     stress_fuzz_random(30, 4096);  // фуззинг
+    stress_legacy_binary_file();   // файл старого формата (версия 1)
+    stress_leaf_length_versions(); // int32-длина листа (версия 2) и varint (версия 3)
 
     std::cout << "\n==================================================" << std::endl;
     std::cout << "🏁 ИТОГ: " << passed_tests << " из " << total_tests << " тестов пройдено." << std::endl;
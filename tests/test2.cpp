@@ -1,13 +1,57 @@
 #include <iostream>
+#include <chrono>
 #include <cstring>
 #include <string>
 #include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <thread>
 #include "Tree.h"
+#include "EditHistory.h"
+#include "NewlineScan.h"
+#include "WorkStealingPool.h"
+#include "TreeBuilder.h"
+#include "NodeReclaimer.h"
 
 // Глобальные счетчики для статистики
 int total_tests = 0;
 int failed_tests = 0;
 
+// Отказ выделения памяти (тесты bad_alloc): сколько ещё operator new в этом потоке пройдёт,
+// прежде чем все следующие бросят std::bad_alloc; -1 — отказов нет
+static thread_local long long allocationsBeforeFailure = -1;
+
+void* operator new(std::size_t size) {
+    if (allocationsBeforeFailure == 0) throw std::bad_alloc();
+    if (allocationsBeforeFailure > 0) --allocationsBeforeFailure;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+// Все формы delete возвращают память в malloc — в пару к operator new выше
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+
 // Вспомогательная функция для преобразования NodeType в строку
 std::string nodeTypeToString(NodeType type) {
     switch(type) {
@@ -361,6 +405,2073 @@ bool testStressWithCyrillic() {
     return true;
 }
 
+// Высота поддерева с проверкой инварианта B+-дерева (-2 если инвариант нарушен):
+// у internal-узла 1..BTREE_MAX_CHILDREN детей одной высоты, height согласован
+int checkedHeight(const Node* node) {
+    if (!node) return -1;
+    if (node->getType() == NodeType::NODE_LEAF) return 0;
+    auto in = static_cast<const InternalNode*>(node);
+    if (in->childCount < 1 || in->childCount > BTREE_MAX_CHILDREN) return -2;
+    int h = -1;
+    for (int i = 0; i < in->childCount; ++i) {
+        int hc = checkedHeight(in->children[i]);
+        if (hc == -2 || (i > 0 && hc != h)) return -2;
+        h = hc;
+    }
+    if (h + 1 != in->height) return -2;
+    return h + 1;
+}
+
+// Тест 10: Балансировка при вставке/удалении
+bool testBalancing() {
+    // Дозапись кусками по 4 КБ (как в EditorWindow::on_load_text) раньше давала цепочку
+    Tree tree;
+    std::string expected;
+    std::string chunk(4096, 'x');
+    for (int i = 0; i < 128; ++i) {
+        chunk[0] = static_cast<char>('a' + (i % 26));
+        chunk[100] = '\n';
+        tree.insert(tree.isEmpty() ? 0 : tree.getRoot()->getLength(), chunk.c_str(), chunk.size());
+        expected += chunk;
+    }
+    int h = checkedHeight(tree.getRoot());
+    ASSERT(h >= 0, "B+-tree invariant violated after sequential appends");
+    ASSERT(h <= 20, ("Tree too deep after sequential appends: " + std::to_string(h)).c_str());
+
+    char* text = tree.toText();
+    ASSERT(compareText(expected.c_str(), text, expected.size()), "Text mismatch after sequential appends");
+    delete[] text;
+
+    // Набор текста в одной точке
+    for (int i = 0; i < 3000; ++i) {
+        tree.insert(10000, "q", 1);
+        expected.insert(10000, "q");
+    }
+    ASSERT(checkedHeight(tree.getRoot()) >= 0, "B+-tree invariant violated after typing");
+
+    // Удаление больших диапазонов
+    tree.erase(5000, 1000000);
+    expected.erase(5000, 1000000);
+    tree.erase(100, 1000);
+    expected.erase(100, 1000);
+    ASSERT(checkedHeight(tree.getRoot()) >= 0, "B+-tree invariant violated after range erase");
+    text = tree.toText();
+    ASSERT(compareText(expected.c_str(), text, expected.size()), "Text mismatch after range erase");
+    delete[] text;
+
+    // rebalance() у вручную собранной цепочки
+    Node* chain = new LeafNode("x", 1);
+    for (int i = 0; i < 1000; ++i) chain = new InternalNode(chain, new LeafNode("y", 1));
+    Tree manual;
+    manual.setRoot(chain);
+    manual.rebalance();
+    h = checkedHeight(manual.getRoot());
+    ASSERT(h >= 0 && h <= 10, "rebalance() should produce a balanced tree");
+    ASSERT_EQUAL(manual.getRoot()->getLength(), 1001, "rebalance() must keep all leaves");
+
+    return true;
+}
+
+// Тест 11: Буфер с разрывом в листе — набор текста без перевыделений
+bool testGapBufferEditing() {
+    Tree tree;
+    std::string model = "Hello\nWorld";
+    tree.fromText(model.c_str(), model.size());
+
+    // Вставка, не влезающая в разрыв, создаёт запас; дальше буфер листа не перевыделяется
+    tree.insert(5, "!!!!!!!!!!!!!!!!!!!!", 20);
+    model.insert(5, "!!!!!!!!!!!!!!!!!!!!");
+    auto leaf = static_cast<LeafNode*>(tree.getRoot());
+    const char* buffer = leaf->data;
+    for (int i = 0; i < 40; ++i) {
+        tree.insert(6 + i, (i % 10 == 9) ? "\n" : "a", 1);
+        model.insert(6 + i, (i % 10 == 9) ? "\n" : "a");
+    }
+    for (int i = 0; i < 10; ++i) {
+        tree.erase(20, 1);
+        model.erase(20, 1);
+    }
+    ASSERT(tree.getRoot() == leaf, "Leaf must be edited in place");
+    ASSERT(leaf->data == buffer, "Typing must not reallocate the leaf buffer");
+
+    char* text = tree.toText();
+    ASSERT(compareText(model.c_str(), text, model.size() + 1), "Text mismatch after gap edits");
+    delete[] text;
+
+    // Случайные правки на многолистовом дереве: сверяем текст, строки и их количество
+    std::string base;
+    for (int i = 0; i < 400; ++i) base += "line " + std::to_string(i) + " of the document\n";
+    tree.fromText(base.c_str(), base.size());
+    model = base;
+    unsigned seed = 12345;
+    auto next = [&seed]() { seed = seed * 1103515245u + 12345u; return (seed >> 8) & 0xFFFF; };
+    for (int op = 0; op < 2000; ++op) {
+        int pos = static_cast<int>(next() % (model.size() + 1));
+        if (next() % 3 != 0) {
+            std::string ins = (next() % 4 == 0) ? "x\ny" : "zz";
+            tree.insert(pos, ins.c_str(), ins.size());
+            model.insert(pos, ins);
+        } else if (!model.empty()) {
+            if (pos >= static_cast<int>(model.size())) pos = model.size() - 1;
+            int len = 1 + next() % 7;
+            tree.erase(pos, len);
+            model.erase(pos, len);
+        }
+    }
+    text = tree.toText();
+    ASSERT(compareText(model.c_str(), text, model.size() + 1), "Text mismatch after random edits");
+    delete[] text;
+
+    int newlines = 0;
+    for (char c : model) if (c == '\n') ++newlines;
+    ASSERT_EQUAL(tree.getTotalLineCount(), newlines + 1, "Line count must be maintained incrementally");
+
+    size_t lineStart = 0;
+    for (int i = 0; i <= newlines; ++i) {
+        size_t lineEnd = model.find('\n', lineStart);
+        if (lineEnd == std::string::npos) lineEnd = model.size();
+        ASSERT_EQUAL(tree.getOffsetForLine(i), static_cast<int>(lineStart), "Offset for line mismatch after edits");
+        char* line = tree.getLine(i);
+        ASSERT(line != nullptr && model.compare(lineStart, lineEnd - lineStart, line) == 0,
+               ("Line " + std::to_string(i) + " mismatch after edits").c_str());
+        delete[] line;
+        lineStart = lineEnd + 1;
+    }
+
+    return true;
+}
+
+// Собрать длины всех листьев слева направо
+void collectLeafLengths(const Node* node, std::vector<int>& out) {
+    if (!node) return;
+    if (node->getType() == NodeType::NODE_LEAF) {
+        out.push_back(node->getLength());
+        return;
+    }
+    auto in = static_cast<const InternalNode*>(node);
+    for (int i = 0; i < in->childCount; ++i) collectLeafLengths(in->children[i], out);
+}
+
+// Тест 12: Слияние недозаполненных листьев после удаления
+bool testUnderfullLeafMerge() {
+    std::string model;
+    for (int i = 0; i < 5000; ++i) model += "row " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), model.size());
+
+    std::vector<int> before;
+    collectLeafLengths(tree.getRoot(), before);
+
+    // Вырезаем большую часть каждого листа мелкими кусками по всему документу
+    unsigned seed = 777;
+    auto next = [&seed]() { seed = seed * 1103515245u + 12345u; return (seed >> 8) & 0xFFFF; };
+    for (int op = 0; op < 1500 && model.size() > 100; ++op) {
+        int pos = static_cast<int>(next() % (model.size() - 50));
+        int len = 1 + next() % 30;
+        tree.erase(pos, len);
+        model.erase(pos, len);
+    }
+
+    char* text = tree.toText();
+    ASSERT(compareText(model.c_str(), text, model.size() + 1), "Text mismatch after merging erases");
+    delete[] text;
+    ASSERT(checkedHeight(tree.getRoot()) >= 0, "B+-tree invariant violated after leaf merges");
+    ASSERT(tree.getMergedLeavesCount() > 0, "Merged leaves counter should grow");
+
+    std::vector<int> after;
+    collectLeafLengths(tree.getRoot(), after);
+    ASSERT(after.size() > 1 && after.size() < before.size(), "Leaf count should shrink with the text");
+    for (size_t i = 0; after.size() > 1 && i < after.size(); ++i) {
+        ASSERT(after[i] >= MIN_LEAF_SIZE, ("Underfull leaf left after erase: " + std::to_string(after[i])).c_str());
+        ASSERT(after[i] <= MAX_LEAF_SIZE, "Leaf exceeds MAX_LEAF_SIZE after merge");
+    }
+
+    int newlines = 0;
+    for (char c : model) if (c == '\n') ++newlines;
+    ASSERT_EQUAL(tree.getTotalLineCount(), newlines + 1, "Line count mismatch after merges");
+    return true;
+}
+
+// Тест 13: Пул узлов — построение и очистка документа
+bool testNodePool() {
+    std::string big;
+    for (int i = 0; i < 50000; ++i) big += "pool line " + std::to_string(i) + "\n";
+
+    Tree tree;
+    tree.fromText(big.c_str(), big.size());
+    ASSERT(tree.getRoot()->flags & NODE_FLAG_POOLED, "fromText must allocate nodes from the pool");
+    size_t reserved = tree.getReservedBytes();
+    ASSERT(reserved >= big.size(), "Pool must hold at least the payload bytes");
+    ASSERT(reserved < big.size() * 2, "Pool overhead too large");
+
+    // clear() — сброс пула целиком
+    tree.clear();
+    ASSERT(tree.isEmpty(), "Tree should be empty after clear");
+    ASSERT_EQUAL(tree.getReservedBytes(), static_cast<size_t>(0), "clear() must release the pool");
+
+    // Повторное использование после сброса + правки, возвращающие память в free-list
+    tree.fromText(big.c_str(), big.size());
+    tree.erase(1000, 100000);
+    big.erase(1000, 100000);
+    tree.insert(500, "pooled", 6);
+    big.insert(500, "pooled");
+    char* text = tree.toText();
+    ASSERT(compareText(big.c_str(), text, big.size() + 1), "Text mismatch after pool reuse");
+    delete[] text;
+
+    // Смешанное дерево: узлы снаружи (new) + правки из пула
+    Tree mixed;
+    mixed.setRoot(new InternalNode(new LeafNode("abc", 3), new LeafNode("def", 3)));
+    mixed.insert(3, "-", 1);
+    mixed.insert(0, big.c_str(), 9000);
+    text = mixed.toText();
+    ASSERT(std::string(text).substr(9000) == "abc-def", "Mixed heap/pool tree mismatch");
+    delete[] text;
+    mixed.clear();
+    ASSERT(mixed.isEmpty(), "Mixed tree should be empty after clear");
+
+    // Память больше никто не держит: перемещённое дерево, вклеенная обратно часть split и
+    // отпущенный снимок не должны мешать сбросу пула
+    Tree moved(std::move(tree));
+    moved.clear();
+    ASSERT_EQUAL(moved.getReservedBytes(), static_cast<size_t>(0), "Moved-from tree must not keep the pool shared");
+    tree.fromText("reuse\n", 6);
+    ASSERT_EQUAL(tree.getLength(), static_cast<TextOffset>(6), "Moved-from tree must stay usable");
+
+    moved.fromText(big.c_str(), big.size());
+    Tree right = moved.split(static_cast<TextOffset>(big.size() / 2));
+    moved.concat(std::move(right));
+    moved.clear();
+    ASSERT_EQUAL(moved.getReservedBytes(), static_cast<size_t>(0), "Split part joined back must not keep the pool shared");
+
+    moved.fromText(big.c_str(), big.size());
+    TreeSnapshot snap = moved.snapshot();
+    snap.reset();
+    moved.clear();
+    ASSERT_EQUAL(moved.getReservedBytes(), static_cast<size_t>(0), "clear() must reset the pool once the snapshot is released");
+
+    // Живой снимок: узлы отпускаются поштучно, но дерево уходит в новую память — следующий clear() снова быстрый
+    moved.fromText(big.c_str(), big.size());
+    snap = moved.snapshot();
+    moved.clear();
+    ASSERT_EQUAL(snap.getLength(), static_cast<TextOffset>(big.size()), "Snapshot must survive clear()");
+    moved.fromText(big.c_str(), big.size());
+    moved.clear();
+    ASSERT_EQUAL(moved.getReservedBytes(), static_cast<size_t>(0), "clear() must reset the new pool while the old snapshot lives");
+    text = snap.toText();
+    ASSERT(compareText(big.c_str(), text, big.size() + 1), "Snapshot text mismatch after clear()");
+    delete[] text;
+
+    return true;
+}
+
+// Проверить, что кэш весов детей (префиксные суммы) в каждом internal-узле совпадает с самими детьми
+bool checkCachedWeights(const Node* node) {
+    if (!node || node->getType() == NodeType::NODE_LEAF) return true;
+    auto in = static_cast<const InternalNode*>(node);
+    for (int i = 0; i < in->childCount; ++i) {
+        if (in->childLength(i) != in->children[i]->getLength()) return false;
+        if (in->childLineCount(i) != in->children[i]->getLineCount()) return false;
+        if (in->childCharCount(i) != in->children[i]->getCharCount()) return false;
+        if (!checkCachedWeights(in->children[i])) return false;
+    }
+    return true;
+}
+
+// Тест 14: Компактные узлы — кэш весов детей в родителе
+bool testCachedChildWeights() {
+    ASSERT(sizeof(LeafNode) <= 32, "LeafNode must fit in 32 bytes");
+    ASSERT(sizeof(TextOffset) * BTREE_MAX_CHILDREN <= 128, "Prefix array must fit in two cache lines");
+
+    std::string model;
+    for (int i = 0; i < 3000; ++i) model += "weights " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), model.size());
+    ASSERT(checkCachedWeights(tree.getRoot()), "Cached weights wrong after fromText");
+
+    unsigned seed = 7;
+    auto rnd = [&seed]() { seed = seed * 1103515245u + 12345u; return (seed >> 8) & 0xFFFFFF; };
+    for (int step = 0; step < 400; ++step) {
+        int pos = static_cast<int>(rnd() % (model.size() + 1));
+        if (rnd() % 3 == 0 && !model.empty()) {
+            int len = static_cast<int>(rnd() % 3000) + 1;
+            if (pos >= static_cast<int>(model.size())) pos = static_cast<int>(model.size()) - 1;
+            tree.erase(pos, len);
+            model.erase(pos, len);
+        } else {
+            std::string chunk(rnd() % 700 + 1, 'w');
+            chunk[chunk.size() / 2] = '\n';
+            tree.insert(pos, chunk.c_str(), chunk.size());
+            model.insert(pos, chunk);
+        }
+        if (!checkCachedWeights(tree.getRoot())) {
+            ASSERT(false, "Cached weights wrong after edit " + std::to_string(step));
+        }
+    }
+
+    char* text = tree.toText();
+    ASSERT(compareText(model.c_str(), text, model.size() + 1), "Text mismatch after random edits");
+    delete[] text;
+
+    // getTextRange пропускает левые поддеревья по кэшу — результат тот же
+    if (model.size() > 100) {
+        char* range = tree.getTextRange(static_cast<int>(model.size()) - 100, 50);
+        ASSERT(model.compare(model.size() - 100, 50, range) == 0, "getTextRange mismatch");
+        delete[] range;
+    }
+    return true;
+}
+
+// Проверить, что у каждого не-корневого internal-узла не меньше BTREE_MIN_CHILDREN детей
+bool checkMinFill(const Node* node, bool isRoot) {
+    if (!node || node->getType() == NodeType::NODE_LEAF) return true;
+    auto in = static_cast<const InternalNode*>(node);
+    if (isRoot ? in->childCount < 2 : in->childCount < BTREE_MIN_CHILDREN) return false;
+    for (int i = 0; i < in->childCount; ++i) {
+        if (!checkMinFill(in->children[i], false)) return false;
+    }
+    return true;
+}
+
+// Тест 15: B+-дерево с широкими узлами
+bool testWideFanout() {
+    // ~4 МБ: 2000+ листьев — при ширине 16 это 3 уровня (двоичное дерево дало бы 11+)
+    std::string model;
+    for (int i = 0; model.size() < 4u * 1024 * 1024; ++i) model += "fanout line " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), model.size());
+    int h = checkedHeight(tree.getRoot());
+    ASSERT(h >= 0, "B+-tree invariant violated after fromText");
+    ASSERT(h <= 4, ("Tree too deep for fanout " + std::to_string(BTREE_MAX_CHILDREN) + ": " + std::to_string(h)).c_str());
+    ASSERT(checkMinFill(tree.getRoot(), true), "fromText must fill nodes at least half");
+
+    // Набор текста в одной точке: листья и узлы делятся, дерево растёт только от корня
+    Tree typed;
+    std::string typedModel;
+    for (int i = 0; i < 60000; ++i) {
+        const char* c = (i % 50 == 49) ? "\n" : "t";
+        typed.insert(static_cast<int>(typedModel.size()) / 2, c, 1);
+        typedModel.insert(typedModel.size() / 2, c);
+    }
+    ASSERT(checkedHeight(typed.getRoot()) >= 0, "B+-tree invariant violated after typing");
+    ASSERT(checkMinFill(typed.getRoot(), true), "Node splits must leave both halves at least half full");
+    char* text = typed.toText();
+    ASSERT(compareText(typedModel.c_str(), text, typedModel.size() + 1), "Text mismatch after typing");
+    delete[] text;
+
+    // Удаления диапазонов разной длины (от байта до сотен листьев)
+    unsigned seed = 4242;
+    auto next = [&seed]() { seed = seed * 1103515245u + 12345u; return (seed >> 8) & 0xFFFFFF; };
+    for (int op = 0; op < 300 && model.size() > 10000; ++op) {
+        int pos = static_cast<int>(next() % model.size());
+        int len = static_cast<int>(next() % (op % 3 == 0 ? 2000000 : 5000)) + 1;
+        tree.erase(pos, len);
+        model.erase(pos, std::min<size_t>(len, model.size() - pos));
+        if (checkedHeight(tree.getRoot()) < 0 || !checkMinFill(tree.getRoot(), true) ||
+            !checkCachedWeights(tree.getRoot())) {
+            ASSERT(false, "B+-tree shape broken after range erase " + std::to_string(op));
+        }
+    }
+    ASSERT_EQUAL(tree.getRoot()->getLength(), static_cast<int>(model.size()), "Length mismatch after range erases");
+    text = tree.toText();
+    ASSERT(compareText(model.c_str(), text, model.size() + 1), "Text mismatch after range erases");
+    delete[] text;
+
+    // Публичный API не изменился: строки и диапазоны по-прежнему сходятся с моделью
+    size_t lineStart = 0;
+    for (int i = 0; i < 200; ++i) {
+        size_t lineEnd = model.find('\n', lineStart);
+        if (lineEnd == std::string::npos) break;
+        ASSERT_EQUAL(tree.getOffsetForLine(i), static_cast<int>(lineStart), "getOffsetForLine mismatch");
+        char* line = tree.getLine(i);
+        ASSERT(line != nullptr && model.compare(lineStart, lineEnd - lineStart, line) == 0, "getLine mismatch");
+        delete[] line;
+        lineStart = lineEnd + 1;
+    }
+    char* range = tree.getTextRange(static_cast<int>(model.size() / 2), 10000);
+    ASSERT(model.compare(model.size() / 2, 10000, range) == 0, "getTextRange mismatch");
+    delete[] range;
+
+    // Удаление всего текста
+    tree.erase(0, tree.getRoot()->getLength());
+    ASSERT(tree.isEmpty(), "Tree must be empty after erasing everything");
+    return true;
+}
+
+// Тест 16: 64-битные смещения и проверки переполнения
+bool testWideOffsets() {
+    ASSERT(sizeof(TextOffset) == 8 && sizeof(LineIndex) == 8, "Offsets and line indices must be 64-bit");
+
+    // Спуск по префиксам за пределами 2 ГБ (сами листья не читаются, поэтому хватит заглушек)
+    InternalNode in;
+    in.childCount = 3;
+    in.lengthPrefix[0] = TextOffset(1) << 31;
+    in.lengthPrefix[1] = TextOffset(1) << 32;
+    in.lengthPrefix[2] = TextOffset(3) << 31;
+    in.linePrefix[0] = 3000000000LL;
+    in.linePrefix[1] = 5000000000LL;
+    in.linePrefix[2] = 6000000000LL;
+    ASSERT_EQUAL(in.findChildByOffset((TextOffset(1) << 31) - 1), 0, "Offset below 2 GiB must stay in child 0");
+    ASSERT_EQUAL(in.findChildByOffset(TextOffset(1) << 31), 1, "Offset at 2 GiB must go to child 1");
+    ASSERT_EQUAL(in.findChildByOffset((TextOffset(1) << 32) + 5), 2, "Offset past 4 GiB must go to child 2");
+    ASSERT_EQUAL(in.findChildForInsert(TextOffset(1) << 32), 1, "Insert at a boundary must pick the left child");
+    ASSERT_EQUAL(in.findChildByLine(3000000001LL), 1, "Line past INT_MAX must go to child 1");
+    ASSERT_EQUAL(in.childOffset(2), TextOffset(1) << 32, "childOffset must be 64-bit");
+    ASSERT_EQUAL(in.totalLength(), TextOffset(3) << 31, "totalLength must be 64-bit");
+
+    // Длины, при которых pos + len переполнился бы, обрабатываются без UB
+    Tree tree;
+    tree.fromText("hello\nworld", 11);
+    const TextOffset huge = INT64_MAX - 5;
+    ASSERT_THROW(tree.insert(0, "x", huge), std::length_error, "Insert overflowing the document length must throw");
+    char* text = tree.toText();
+    ASSERT(compareText(text, "hello\nworld", 12), "Failed insert must not change the tree");
+    delete[] text;
+
+    char* range = tree.getTextRange(6, huge);
+    ASSERT(compareText(range, "world", 6), "getTextRange must clamp a huge length to the end");
+    delete[] range;
+
+    tree.erase(5, huge);
+    text = tree.toText();
+    ASSERT(compareText(text, "hello", 6), "erase must clamp a huge length to the end");
+    delete[] text;
+    ASSERT_EQUAL(tree.getTotalLineCount(), 1, "Line count mismatch after clamped erase");
+    return true;
+}
+
+// Узлы поддерева, принадлежащие только дереву (не разделённые со снимками)
+int countUniqueNodes(const Node* node) {
+    if (!node || !node->isUnique()) return 0;
+    if (node->getType() == NodeType::NODE_LEAF) return 1;
+    auto inner = static_cast<const InternalNode*>(node);
+    int count = 1;
+    for (int i = 0; i < inner->childCount; ++i) count += countUniqueNodes(inner->children[i]);
+    return count;
+}
+
+// Тест 17: Снимки дерева (копирование при записи)
+bool testSnapshots() {
+    std::string model;
+    for (int i = 0; i < 3000; ++i) model += "line " + std::to_string(i) + "\n";
+
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    TreeSnapshot snap = tree.snapshot();
+    ASSERT_EQUAL(snap.getLength(), static_cast<TextOffset>(model.size()), "Snapshot length mismatch");
+
+    // Одна правка после снимка копирует только путь до листа
+    tree.insert(12345, "X", 1);
+    int height = checkedHeight(tree.getRoot());
+    ASSERT(height >= 1, "Tree must stay a valid B+-tree after copy-on-write insert");
+    ASSERT(countUniqueNodes(tree.getRoot()) <= height + 1, "Insert after a snapshot must copy only one path");
+
+    // Снимок не видит правок дерева
+    std::string edited = model;
+    edited.insert(12345, "X");
+    unsigned seed = 7;
+    for (int i = 0; i < 2000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        size_t pos = (seed >> 8) % (edited.size() + 1);
+        if (i % 3 == 0 && !edited.empty()) {
+            size_t len = std::min<size_t>(1 + (seed >> 4) % 300, edited.size() - std::min(pos, edited.size() - 1));
+            pos = std::min(pos, edited.size() - 1);
+            tree.erase(static_cast<TextOffset>(pos), static_cast<TextOffset>(len));
+            edited.erase(pos, len);
+        } else {
+            tree.insert(static_cast<TextOffset>(pos), "ab\ncd", 5);
+            edited.insert(pos, "ab\ncd");
+        }
+    }
+    ASSERT(checkedHeight(tree.getRoot()) >= 0 && checkCachedWeights(tree.getRoot()), "Tree invariants broken by COW edits");
+    char* text = tree.toText();
+    ASSERT(compareText(edited.c_str(), text, edited.size()), "Tree text mismatch after COW edits");
+    delete[] text;
+    text = snap.toText();
+    ASSERT(compareText(model.c_str(), text, model.size()), "Snapshot text changed after tree edits");
+    delete[] text;
+    ASSERT_EQUAL(snap.getTotalLineCount(), 3001, "Snapshot line count changed");
+    char* line = snap.getLine(1234);
+    ASSERT(line && std::string(line) == "line 1234", "Snapshot getLine mismatch");
+    delete[] line;
+    ASSERT_EQUAL(snap.findSubstring("line 2999", 9), static_cast<TextOffset>(model.find("line 2999")), "Snapshot findSubstring mismatch");
+
+    // Обход кусками совпадает с toText
+    std::string chunks;
+    snap.forEachChunk([&chunks](const char* data, int len) { chunks.append(data, static_cast<size_t>(len)); });
+    ASSERT(chunks == model, "forEachChunk must reproduce the snapshot text");
+
+    // Копия снимка и снимок, переживший дерево
+    TreeSnapshot copy = snap;
+    snap.reset();
+    ASSERT(snap.isEmpty(), "reset() must empty the snapshot");
+    ASSERT_EQUAL(copy.getLength(), static_cast<TextOffset>(model.size()), "Snapshot copy length mismatch");
+    TreeSnapshot survivor;
+    {
+        Tree shortLived;
+        shortLived.fromText("temporary\ntext", 14);
+        survivor = shortLived.snapshot();
+        shortLived.insert(0, "more ", 5);
+    }
+    text = survivor.toText();
+    ASSERT(compareText("temporary\ntext", text, 15), "Snapshot must outlive its tree");
+    delete[] text;
+
+    // Чтение снимка в другом потоке, пока дерево правится
+    TreeSnapshot shared = tree.snapshot();
+    std::string expected = edited;
+    bool readerOk = true;
+    std::thread reader([&shared, &expected, &readerOk]() {
+        for (int i = 0; i < 20 && readerOk; ++i) {
+            char* t = shared.toText();
+            readerOk = compareText(expected.c_str(), t, expected.size())
+                && shared.findSubstring("ab\ncd", 5) == static_cast<TextOffset>(expected.find("ab\ncd"));
+            delete[] t;
+        }
+        shared.reset(); // узлы вернутся в пул дерева через его следующую правку
+    });
+    for (int i = 0; i < 500; ++i) {
+        tree.insert(static_cast<TextOffset>((i * 7919) % (edited.size() + 1)), "zz", 2);
+        edited.insert((i * 7919) % (edited.size() + 1), "zz");
+        if (i % 5 == 0) {
+            tree.erase(0, 3);
+            edited.erase(0, 3);
+        }
+    }
+    reader.join();
+    ASSERT(readerOk, "Snapshot read from another thread must see unchanged text");
+    tree.insert(0, "!", 1);
+    edited.insert(0, "!");
+    text = tree.toText();
+    ASSERT(compareText(edited.c_str(), text, edited.size()), "Tree text mismatch after concurrent snapshot reads");
+    delete[] text;
+
+    // clear() при живом снимке
+    TreeSnapshot beforeClear = tree.snapshot();
+    tree.clear();
+    ASSERT(tree.isEmpty(), "Tree must be empty after clear()");
+    ASSERT_EQUAL(beforeClear.getLength(), static_cast<TextOffset>(edited.size()), "Snapshot must survive clear()");
+    return true;
+}
+
+// Тест 18: Журнал отмены/повтора
+bool testEditHistory() {
+    Tree tree;
+    EditHistory history(tree);
+    ASSERT(!history.canUndo() && history.undo() == -1, "Empty history must have nothing to undo");
+
+    // Набор по символу склеивается в одну запись
+    const char* word = "hello";
+    for (int i = 0; i < 5; ++i) history.insert(i, word + i, 1);
+    ASSERT_EQUAL(history.getUndoCount(), 1u, "Typed characters must be coalesced");
+    history.breakCoalescing();
+    history.insert(5, "\xD0\x96", 2); // кириллическая буква — тоже один символ
+    ASSERT_EQUAL(history.getUndoCount(), 2u, "breakCoalescing must start a new record");
+
+    // Backspace дважды — одна запись, удалённые байты восстанавливаются
+    history.erase(6, 1);
+    history.erase(5, 1);
+    history.erase(4, 1);
+    ASSERT_EQUAL(history.getUndoCount(), 3u, "Backspace run must be one record");
+    char* text = tree.toText();
+    ASSERT(compareText("hell", text, 5), "Text mismatch after backspaces");
+    delete[] text;
+    ASSERT_EQUAL(history.undo(), 7, "Undo of an erase must put the cursor after restored text");
+    text = tree.toText();
+    ASSERT(compareText("hello\xD0\x96", text, 8), "Undo must restore erased bytes");
+    delete[] text;
+    ASSERT_EQUAL(history.undo(), 5, "Undo of an insert must put the cursor at its start");
+    ASSERT_EQUAL(history.undo(), 0, "Undo of the typed word");
+    ASSERT(tree.isEmpty() && !history.canUndo(), "Everything must be undone");
+    ASSERT_EQUAL(history.redo(), 5, "Redo of the typed word");
+    ASSERT_EQUAL(history.getRedoCount(), 2u, "Two records must remain to redo");
+    history.insert(0, ">", 1);
+    ASSERT(!history.canRedo(), "A new edit must drop the redo stack");
+
+    // Крупное удаление: текст держится снимком диапазона, а не копией
+    std::string model;
+    for (int i = 0; i < 20000; ++i) model += "row " + std::to_string(i) + "\n";
+    tree.clear();
+    history.clear();
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    const TextOffset erasePos = 777;
+    const TextOffset eraseLen = static_cast<TextOffset>(model.size()) / 2;
+    history.erase(erasePos, eraseLen);
+    ASSERT_EQUAL(tree.getLength(), static_cast<TextOffset>(model.size()) - eraseLen, "Length mismatch after block erase");
+    ASSERT(history.getMemoryUsage() >= static_cast<std::size_t>(eraseLen), "Retained text must be accounted");
+    history.undo();
+    ASSERT(checkedHeight(tree.getRoot()) >= 0 && checkCachedWeights(tree.getRoot()), "Tree invariants broken by undo");
+    text = tree.toText();
+    ASSERT(compareText(model.c_str(), text, model.size()), "Undo of a block erase must restore the text");
+    delete[] text;
+    history.redo();
+    ASSERT_EQUAL(tree.getLength(), static_cast<TextOffset>(model.size()) - eraseLen, "Redo of a block erase");
+    history.undo();
+
+    // Случайные правки: откат всего возвращает исходный текст, повтор — итоговый
+    std::string edited = model;
+    unsigned seed = 11;
+    for (int i = 0; i < 600; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        size_t pos = (seed >> 8) % (edited.size() + 1);
+        if (i % 4 == 0) history.breakCoalescing();
+        if (i % 2 == 0 && pos < edited.size()) {
+            size_t len = (i % 10 == 0) ? 1 + (seed >> 4) % 9000 : 1;
+            len = std::min(len, edited.size() - pos);
+            history.erase(static_cast<TextOffset>(pos), static_cast<TextOffset>(len));
+            edited.erase(pos, len);
+        } else {
+            std::string piece = (i % 10 == 1) ? std::string(5000 + i, 'q') : std::string(1, static_cast<char>('a' + i % 26));
+            history.insert(static_cast<TextOffset>(pos), piece.c_str(), static_cast<TextOffset>(piece.size()));
+            edited.insert(pos, piece);
+        }
+    }
+    text = tree.toText();
+    ASSERT(compareText(edited.c_str(), text, edited.size()), "Text mismatch after journaled edits");
+    delete[] text;
+    while (history.canUndo()) history.undo();
+    text = tree.toText();
+    ASSERT(compareText(model.c_str(), text, model.size()), "Undoing everything must restore the original");
+    delete[] text;
+    while (history.canRedo()) history.redo();
+    text = tree.toText();
+    ASSERT(compareText(edited.c_str(), text, edited.size()), "Redoing everything must restore the edited text");
+    delete[] text;
+
+    // Лимит памяти: старые записи забываются, последняя остаётся
+    std::size_t records = history.getUndoCount();
+    ASSERT(records > 1, "Random edits must produce several records");
+    history.setMemoryLimit(1);
+    ASSERT_EQUAL(history.getUndoCount(), 1u, "Memory limit must drop old records but keep the last one");
+    ASSERT(history.getMemoryUsage() > 0, "The kept record must be accounted");
+    history.clear();
+    ASSERT_EQUAL(history.getMemoryUsage(), 0u, "clear() must release all records");
+    return true;
+}
+
+// Тест 19: Индекс строк листа
+bool testLeafLineIndex() {
+    std::string model;
+    for (int i = 0; i < 5000; ++i) model += std::string(static_cast<size_t>(i % 37), 'x') + "\n";
+    std::vector<TextOffset> starts(1, 0);
+    for (size_t i = 0; i < model.size(); ++i) {
+        if (model[i] == '\n') starts.push_back(static_cast<TextOffset>(i + 1));
+    }
+
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    TreeStats st = tree.stats();
+    ASSERT(st.leafCount > 1, "Text must span several leaves");
+    ASSERT_EQUAL(st.lineIndexCount, 0u, "Line indexes must be built lazily");
+    ASSERT_EQUAL(st.lineIndexBytes, 0u, "No line index memory before lookups");
+
+    for (size_t k = 0; k < starts.size(); ++k) {
+        ASSERT_EQUAL(tree.getOffsetForLine(static_cast<LineIndex>(k)), starts[k], "Line start mismatch");
+    }
+    st = tree.stats();
+    ASSERT_EQUAL(st.lineIndexCount, st.leafCount, "Every leaf with lines must have an index after lookups");
+    ASSERT(st.lineIndexBytes >= static_cast<size_t>(tree.getTotalLineCount() - 1) * sizeof(int), "Index memory must cover all newlines");
+
+    // Правка сбрасывает индекс своего листа, и следующий поиск видит новый текст
+    tree.insert(starts[100] + 3, "a\nb\n", 4);
+    model.insert(static_cast<size_t>(starts[100] + 3), "a\nb\n");
+    ASSERT(tree.stats().lineIndexCount < st.lineIndexCount, "Edit must invalidate the leaf index");
+    tree.erase(starts[2000], 50);
+    model.erase(static_cast<size_t>(starts[2000]), 50);
+    starts.assign(1, 0);
+    for (size_t i = 0; i < model.size(); ++i) {
+        if (model[i] == '\n') starts.push_back(static_cast<TextOffset>(i + 1));
+    }
+    ASSERT_EQUAL(tree.getTotalLineCount(), static_cast<LineIndex>(starts.size()), "Line count mismatch after edits");
+    for (size_t k = 0; k < starts.size(); k += 7) {
+        ASSERT_EQUAL(tree.getOffsetForLine(static_cast<LineIndex>(k)), starts[k], "Line start mismatch after edits");
+    }
+    char* line = tree.getLine(101);
+    ASSERT(line && std::string(line) == "b", "getLine must use the rebuilt index");
+    delete[] line;
+    ASSERT_EQUAL(tree.findSubstringLine("a\nb", 3), 100, "findSubstringLine must count lines via the index");
+
+    // Индекс общего со снимком листа строят несколько потоков сразу
+    TreeSnapshot snap = tree.snapshot();
+    tree.insert(0, "\n", 1);
+    bool readerOk = true;
+    std::thread reader([&snap, &starts, &readerOk]() {
+        for (size_t k = 0; k < starts.size() && readerOk; k += 3) {
+            readerOk = snap.getOffsetForLine(static_cast<LineIndex>(k)) == starts[k];
+        }
+    });
+    bool ok = true;
+    for (size_t k = 0; k < starts.size() && ok; k += 5) {
+        ok = tree.getOffsetForLine(static_cast<LineIndex>(k + 1)) == starts[k] + 1;
+    }
+    reader.join();
+    ASSERT(ok && readerOk, "Concurrent line lookups on shared leaves mismatch");
+    snap.reset();
+
+    tree.clear();
+    ASSERT_EQUAL(tree.stats().leafCount, 0u, "Empty tree must have no leaves");
+    return true;
+}
+
+// Тест 20: Векторные ядра поиска '\n' (все реализации, доступные процессору)
+bool testNewlineKernels() {
+    std::string buf;
+    unsigned seed = 3;
+    for (int i = 0; i < 3000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        buf += ((seed >> 16) % 7 == 0) ? '\n' : static_cast<char>('a' + (seed >> 8) % 26);
+    }
+    buf += std::string(700, '\n') + std::string(300, 'z'); // длинные серии: переполнение байтовых счётчиков
+
+    const NewlineKernel kinds[] = {NewlineKernel::NEWLINE_SCALAR, NewlineKernel::NEWLINE_SSE2, NewlineKernel::NEWLINE_AVX2};
+    for (NewlineKernel kind : kinds) {
+        if (!selectNewlineKernel(kind)) continue;
+        ASSERT(activeNewlineKernel() == kind, "selectNewlineKernel must switch the implementation");
+        // Невыровненные начала и длины, включая хвосты короче вектора
+        for (size_t from = 0; from < 70; from += 3) {
+            for (size_t n : {size_t(0), size_t(1), size_t(15), size_t(31), size_t(33), size_t(200), buf.size() - from}) {
+                const char* data = buf.data() + from;
+                std::vector<int64_t> positions;
+                for (size_t i = 0; i < n; ++i) {
+                    if (data[i] == '\n') positions.push_back(static_cast<int64_t>(i));
+                }
+                ASSERT_EQUAL(countNewlines(data, n), positions.size(), "countNewlines mismatch");
+                ASSERT_EQUAL(findLastNewline(data, n), positions.empty() ? -1 : positions.back(), "findLastNewline mismatch");
+                for (size_t k = 1; k <= positions.size() + 1; k += 1 + positions.size() / 50) {
+                    int64_t expected = k <= positions.size() ? positions[k - 1] : -1;
+                    ASSERT_EQUAL(findNthNewline(data, n, k), expected, "findNthNewline mismatch");
+                }
+                if (n == 0) continue;
+                size_t center = n / 2;
+                size_t range = n < 512 ? n / 4 : 256;
+                int64_t nearest = -1;
+                for (size_t i = 0; i < range && nearest < 0; ++i) {
+                    if (center + i < n && data[center + i] == '\n') nearest = static_cast<int64_t>(center + i);
+                }
+                for (size_t i = 0; i < range && nearest < 0; ++i) {
+                    if (center > i && data[center - i] == '\n') nearest = static_cast<int64_t>(center - i);
+                }
+                ASSERT_EQUAL(findNearestNewline(data, n, center, range), nearest, "findNearestNewline mismatch");
+            }
+        }
+    }
+    ASSERT(selectNewlineKernel(bestNewlineKernel()), "The best kernel must be selectable");
+
+    // Построение и правки дерева поверх ядер
+    Tree tree;
+    tree.fromText(buf.c_str(), static_cast<TextOffset>(buf.size()));
+    ASSERT_EQUAL(tree.getTotalLineCount(), static_cast<LineIndex>(countNewlines(buf.data(), buf.size())) + 1, "Tree line count mismatch");
+    return true;
+}
+
+// Форма дерева строкой: листы — длина и число '\n', internal — дети в скобках
+void describeShape(const Node* node, std::string& out) {
+    if (node->getType() == NodeType::NODE_LEAF) {
+        auto leaf = static_cast<const LeafNode*>(node);
+        out += std::to_string(leaf->length) + ":" + std::to_string(leaf->lineCount) + " ";
+        return;
+    }
+    auto inner = static_cast<const InternalNode*>(node);
+    out += "(";
+    for (int i = 0; i < inner->childCount; ++i) describeShape(inner->children[i], out);
+    out += ")";
+}
+
+// Тест 21: Параллельное построение из текста (та же форма, что и в одном потоке)
+bool testParallelBuild() {
+    WorkStealingPool pool(4);
+    ASSERT_EQUAL(pool.getThreadCount(), 4u, "Pool thread count mismatch");
+
+    // Пул: все индексы обработаны ровно один раз, исключение задачи доходит до wait()
+    std::vector<int> hits(10000, 0);
+    pool.parallelFor(0, hits.size(), 37, [&hits](size_t i) { hits[i]++; });
+    ASSERT(std::all_of(hits.begin(), hits.end(), [](int h) { return h == 1; }), "parallelFor must visit every index once");
+    bool thrown = false;
+    try {
+        pool.parallelFor(0, 100, 1, [](size_t i) {
+            if (i == 42) throw std::runtime_error("task failed");
+        });
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    ASSERT(thrown, "Task exception must be rethrown from wait()");
+
+    // Текст больше PARALLEL_BUILD_MIN: строки разной длины и длинный кусок без '\n'
+    std::string text;
+    unsigned seed = 21;
+    while (text.size() < static_cast<size_t>(Tree::PARALLEL_BUILD_MIN) * 3) {
+        seed = seed * 1103515245u + 12345u;
+        text.append(1 + (seed >> 16) % 300, static_cast<char>('a' + (seed >> 8) % 26));
+        text += '\n';
+        if (text.size() > 5000000 && text.size() < 5000400) text.append(100000, 'm');
+    }
+
+    Tree serial;
+    serial.fromText(text.c_str(), static_cast<TextOffset>(text.size()), nullptr);
+    Tree parallel;
+    parallel.fromText(text.c_str(), static_cast<TextOffset>(text.size()), &pool);
+
+    std::string serialShape, parallelShape;
+    describeShape(serial.getRoot(), serialShape);
+    describeShape(parallel.getRoot(), parallelShape);
+    ASSERT(serialShape == parallelShape, "Parallel build must produce the same tree shape");
+    ASSERT(checkedHeight(parallel.getRoot()) >= 1, "Parallel build must produce a valid B+-tree");
+    ASSERT_EQUAL(parallel.getTotalLineCount(), static_cast<LineIndex>(countNewlines(text.data(), text.size())) + 1, "Line count mismatch");
+
+    char* out = parallel.getTextRange(0, parallel.getLength());
+    bool same = std::memcmp(out, text.data(), text.size()) == 0;
+    delete[] out;
+    ASSERT(same, "Parallel build must keep the text");
+
+    // Дерево после параллельного построения правится как обычное
+    parallel.insert(1234567, "XYZ\n", 4);
+    text.insert(1234567, "XYZ\n");
+    ASSERT_EQUAL(parallel.getLength(), static_cast<TextOffset>(text.size()), "Length after edit mismatch");
+
+    // fromText без пула выбирает общий пул сам — результат тот же
+    Tree shared;
+    shared.fromText(text.c_str(), static_cast<TextOffset>(text.size()));
+    ASSERT_EQUAL(shared.getTotalLineCount(), parallel.getTotalLineCount(), "Shared pool build mismatch");
+    return true;
+}
+
+// Листья дерева по порядку
+void collectLeaves(const Node* node, std::vector<const LeafNode*>& leaves) {
+    if (!node) return;
+    if (node->getType() == NodeType::NODE_LEAF) {
+        leaves.push_back(static_cast<const LeafNode*>(node));
+        return;
+    }
+    auto inner = static_cast<const InternalNode*>(node);
+    for (int i = 0; i < inner->childCount; ++i) collectLeaves(inner->children[i], leaves);
+}
+
+// Тест 22: Потоковое построение (куски любого размера, длина заранее неизвестна)
+bool testTreeBuilder() {
+    std::string model;
+    for (int i = 0; model.size() < 3u * 1024 * 1024; ++i) model += "streamed line " + std::to_string(i * 7919 % 100003) + "\n";
+    model.append(20000, 'q'); // длинная строка без '\n' в конце
+
+    Tree tree;
+    tree.insert(0, "old text", 8);
+    {
+        TreeBuilder builder(tree);
+        unsigned seed = 22;
+        size_t pos = 0;
+        while (pos < model.size()) {
+            seed = seed * 1103515245u + 12345u;
+            size_t n = std::min<size_t>((seed >> 16) % 9000, model.size() - pos); // бывают и пустые куски
+            if (seed & 1) {
+                builder.append(model.data() + pos, static_cast<TextOffset>(n));
+                pos += n;
+            } else {
+                int available = 0;
+                char* dst = builder.prepare(available);
+                ASSERT(available > 0, "prepare must offer space");
+                int part = std::min<int>(available, static_cast<int>(n));
+                std::memcpy(dst, model.data() + pos, static_cast<size_t>(part));
+                builder.commit(part);
+                pos += static_cast<size_t>(part);
+            }
+        }
+        ASSERT_EQUAL(builder.getLength(), static_cast<TextOffset>(model.size()), "Builder length mismatch");
+        builder.finish();
+    }
+
+    ASSERT_EQUAL(tree.getLength(), static_cast<TextOffset>(model.size()), "Built tree length mismatch");
+    ASSERT_EQUAL(tree.getTotalLineCount(), static_cast<LineIndex>(countNewlines(model.data(), model.size())) + 1, "Built tree line count mismatch");
+    char* out = tree.getTextRange(0, tree.getLength());
+    bool same = std::memcmp(out, model.data(), model.size()) == 0;
+    delete[] out;
+    ASSERT(same, "Built tree text mismatch");
+    ASSERT(checkedHeight(tree.getRoot()) >= 1, "Builder must produce a valid B+-tree");
+    ASSERT(checkMinFill(tree.getRoot(), true), "Builder must fill nodes at least half");
+    ASSERT(checkCachedWeights(tree.getRoot()), "Cached weights wrong after builder");
+
+    // Листья не длиннее MAX_LEAF_SIZE и режутся по '\n' (кроме строки без '\n')
+    std::vector<const LeafNode*> leaves;
+    collectLeaves(tree.getRoot(), leaves);
+    size_t aligned = 0;
+    for (const LeafNode* leaf : leaves) {
+        ASSERT(leaf->length > 0 && leaf->length <= MAX_LEAF_SIZE, "Leaf size out of bounds");
+        if (leaf->at(leaf->length - 1) == '\n') ++aligned;
+    }
+    ASSERT(aligned + 8 >= leaves.size(), "Leaves must end at newlines");
+
+    // Дерево правится как обычное
+    tree.insert(100, "X\n", 2);
+    model.insert(100, "X\n");
+    ASSERT_EQUAL(tree.getLength(), static_cast<TextOffset>(model.size()), "Length after edit mismatch");
+
+    // Мелкий текст — один лист; пустой — пустое дерево
+    Tree small;
+    {
+        TreeBuilder builder(small);
+        builder.append("a\nb", 3);
+        builder.finish();
+        builder.finish(); // повторный вызов ничего не делает
+    }
+    ASSERT(small.getRoot() && small.getRoot()->getType() == NodeType::NODE_LEAF, "Small text must be one leaf");
+    ASSERT_EQUAL(small.getTotalLineCount(), 2, "Small text line count mismatch");
+    {
+        TreeBuilder builder(small);
+        builder.finish();
+    }
+    ASSERT(small.getRoot() == nullptr, "Empty stream must give an empty tree");
+
+    // Построитель без finish() оставляет дерево пустым
+    {
+        TreeBuilder builder(small);
+        builder.append(model.data(), 100000);
+    }
+    ASSERT(small.getRoot() == nullptr && small.getLength() == 0, "Abandoned builder must leave the tree empty");
+    return true;
+}
+
+// Тест 23: Итератор по кускам текста (вперёд и назад с любого смещения)
+bool testChunkIterator() {
+    Tree empty;
+    ASSERT(!empty.chunksAt(0).valid(), "Empty tree must give an invalid iterator");
+
+    std::string model;
+    for (int i = 0; i < 4000; ++i) model += "chunk " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    // Правки оставляют разрывы внутри листьев — куски по обе стороны разрыва
+    unsigned seed = 23;
+    for (int i = 0; i < 300; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        TextOffset pos = static_cast<TextOffset>((seed >> 8) % model.size());
+        tree.insert(pos, "ins", 3);
+        model.insert(static_cast<size_t>(pos), "ins");
+    }
+
+    for (TextOffset start : {TextOffset(0), TextOffset(1), TextOffset(4095), TextOffset(4096), TextOffset(12345),
+                             static_cast<TextOffset>(model.size() - 1)}) {
+        std::string forward;
+        auto it = tree.chunksAt(start);
+        ASSERT_EQUAL(it.offset(), start, "Iterator must start at the requested offset");
+        for (; it.valid(); it.next()) {
+            ASSERT_EQUAL(it.offset(), start + static_cast<TextOffset>(forward.size()), "Chunk offset mismatch");
+            ASSERT(!(*it).empty(), "Chunks must not be empty");
+            forward += *it;
+        }
+        ASSERT(forward == model.substr(static_cast<size_t>(start)), "Forward iteration mismatch");
+
+        // После выхода за конец prev() идёт обратно до самого начала
+        std::string backward;
+        while (it.prev()) backward.insert(0, *it);
+        ASSERT(backward == model, "Backward iteration mismatch");
+        ASSERT_EQUAL(it.offset(), 0, "Backward iteration must end at offset 0");
+        ASSERT(it.next() && it.offset() == 0, "next() after the beginning must return the first chunk");
+    }
+
+    // Назад от середины — текст до неё
+    auto mid = tree.chunksAt(50000);
+    std::string before;
+    while (mid.prev()) before.insert(0, *mid);
+    ASSERT(before == model.substr(0, 50000), "Backward iteration from the middle mismatch");
+
+    // Конец текста и снимок
+    ASSERT(!tree.chunksAt(tree.getLength()).valid(), "Iterator at the end must be invalid");
+    TreeSnapshot snap = tree.snapshot();
+    tree.erase(0, 1000);
+    std::string fromSnapshot;
+    for (auto it = snap.chunksAt(0); it.valid(); it.next()) fromSnapshot += *it;
+    ASSERT(fromSnapshot == model, "Snapshot iteration mismatch");
+    return true;
+}
+
+// Тест 24: Итератор по строкам (строки через границы листьев, последняя пустая строка)
+bool testLineIterator() {
+    ASSERT(!Tree().linesAt(0).valid(), "Empty tree must give an invalid line iterator");
+
+    std::string model;
+    unsigned seed = 24;
+    for (int i = 0; i < 3000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        // Бывают пустые строки и строки длиннее листа
+        size_t len = (seed >> 16) % 17 == 0 ? 9000 + (seed >> 8) % 3000 : (seed >> 16) % 90;
+        model.append(len, static_cast<char>('a' + i % 26));
+        model += '\n';
+    }
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    tree.insert(777, "gap", 3); // разрыв внутри листа
+    model.insert(777, "gap");
+
+    std::vector<std::string> expected;
+    std::vector<TextOffset> starts;
+    size_t from = 0;
+    for (;;) {
+        size_t nl = model.find('\n', from);
+        starts.push_back(static_cast<TextOffset>(from));
+        expected.push_back(model.substr(from, nl == std::string::npos ? std::string::npos : nl - from));
+        if (nl == std::string::npos) break;
+        from = nl + 1;
+    }
+    ASSERT_EQUAL(static_cast<LineIndex>(expected.size()), tree.getTotalLineCount(), "Line count mismatch");
+
+    for (LineIndex first : {LineIndex(0), LineIndex(1), LineIndex(1500), static_cast<LineIndex>(expected.size() - 2)}) {
+        auto it = tree.linesAt(first);
+        LineIndex line = first;
+        for (; it.valid(); it.next(), ++line) {
+            ASSERT_EQUAL(it.line(), line, "Line number mismatch");
+            ASSERT_EQUAL(it.offset(), starts[static_cast<size_t>(line)], "Line offset mismatch");
+            ASSERT(it.text() == expected[static_cast<size_t>(line)], "Line text mismatch");
+        }
+        ASSERT_EQUAL(line, static_cast<LineIndex>(expected.size()), "Iterator must stop after the last line");
+        ASSERT(!it.next(), "next() after the end must return false");
+    }
+    ASSERT(tree.linesAt(static_cast<LineIndex>(expected.size() - 1)).text().empty(), "Last line after final newline must be empty");
+    ASSERT(!tree.linesAt(static_cast<LineIndex>(expected.size())).valid(), "Line past the end must be invalid");
+
+    // Копия итератора со строкой во внутреннем буфере остаётся корректной
+    for (size_t i = 0; i < expected.size(); ++i) {
+        if (expected[i].size() <= static_cast<size_t>(MAX_LEAF_SIZE)) continue;
+        auto original = tree.linesAt(static_cast<LineIndex>(i));
+        auto copy = original;
+        original.next();
+        ASSERT(copy.text() == expected[i], "Copied iterator must keep its line");
+        break;
+    }
+    return true;
+}
+
+// Тест 25: Строка и позиция по байтовому смещению за один спуск
+bool testLocate() {
+    Tree empty;
+    ASSERT_EQUAL(empty.getLineForOffset(5), 0, "Empty tree line mismatch");
+
+    std::string model;
+    unsigned seed = 25;
+    for (int i = 0; i < 2500; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        // Строки длиннее нескольких листьев: начало строки далеко слева от листа с offset
+        size_t len = (seed >> 16) % 29 == 0 ? 20000 : (seed >> 16) % 70;
+        model.append(len, 'x');
+        model += '\n';
+    }
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    for (int i = 0; i < 200; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        TextOffset pos = static_cast<TextOffset>((seed >> 8) % model.size());
+        const char* piece = (seed & 1) ? "a\nb" : "yy";
+        tree.insert(pos, piece, static_cast<TextOffset>(std::strlen(piece)));
+        model.insert(static_cast<size_t>(pos), piece);
+    }
+
+    // Эталон — проход по модели; проверяем каждый 211-й байт, байты вокруг '\n' и конец текста
+    LineIndex line = 0;
+    TextOffset lineStart = 0;
+    for (size_t off = 0; off <= model.size(); ++off) {
+        bool nearNewline = off > 0 && model[off - 1] == '\n';
+        if (off % 211 == 0 || nearNewline || off == model.size()) {
+            TextLocation loc = tree.locate(static_cast<TextOffset>(off));
+            ASSERT_EQUAL(loc.line, line, "locate line mismatch");
+            ASSERT_EQUAL(loc.lineStart, lineStart, "locate lineStart mismatch");
+            ASSERT_EQUAL(loc.column, static_cast<TextOffset>(off) - lineStart, "locate column mismatch");
+            ASSERT_EQUAL(tree.getLineForOffset(static_cast<TextOffset>(off)), line, "getLineForOffset mismatch");
+        }
+        if (off < model.size() && model[off] == '\n') {
+            ++line;
+            lineStart = static_cast<TextOffset>(off + 1);
+        }
+    }
+    ASSERT_EQUAL(tree.getLineForOffset(tree.getLength() + 100), tree.getTotalLineCount() - 1, "Offset past the end must clamp");
+    ASSERT_EQUAL(tree.locate(-5).line, 0, "Negative offset must clamp");
+    return true;
+}
+
+// Тест 26: Дерево над отображённым файлом (листья ссылаются на байты файла)
+bool testMappedFile() {
+    const char* path = "test2_mapped.txt";
+    std::string model;
+    for (int i = 0; i < 6000; ++i) model += "line " + std::to_string(i) + (i % 7 == 0 ? std::string(90, 'w') : "") + "\n";
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(model.data(), static_cast<std::streamsize>(model.size()));
+    }
+
+    Tree missing;
+    bool threw = false;
+    try {
+        missing.fromMappedFile("test2_missing_dir/none.txt");
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ASSERT(threw, "Missing file must throw");
+
+    // Файл уже открыт на запись другой программой: аренду не взять, и правки файла видны
+    // отображению сразу — здесь проверяется именно этот путь (с арендой запись ждала бы детача)
+    std::fstream writer(path, std::ios::binary | std::ios::in | std::ios::out);
+    Tree tree;
+    tree.fromMappedFile(path, nullptr);
+    ASSERT_EQUAL(tree.getLength(), static_cast<TextOffset>(model.size()), "Mapped length mismatch");
+    ASSERT_EQUAL(tree.getTotalLineCount(), static_cast<LineIndex>(6001), "Mapped line count mismatch");
+    ASSERT(tree.usesMappedFile(path), "Tree must reference the mapped file");
+    ASSERT(!tree.mappedFilesChanged(), "Untouched file reported as changed");
+    TreeSnapshot original = tree.snapshot();
+
+    // Правки: в середине листа, срез начала и конца листа, удаление через границы листьев
+    unsigned seed = 26;
+    for (int i = 0; i < 300; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        TextOffset pos = static_cast<TextOffset>((seed >> 8) % model.size());
+        if (seed & 1) {
+            tree.insert(pos, "ab\n", 3);
+            model.insert(static_cast<size_t>(pos), "ab\n");
+        } else {
+            TextOffset len = static_cast<TextOffset>((seed >> 4) % 600);
+            if (len > static_cast<TextOffset>(model.size()) - pos) len = static_cast<TextOffset>(model.size()) - pos;
+            tree.erase(pos, len);
+            model.erase(static_cast<size_t>(pos), static_cast<size_t>(len));
+        }
+    }
+    tree.erase(0, 3);
+    model.erase(0, 3);
+    char* text = tree.getTextRange(0, tree.getLength());
+    ASSERT(std::string(text, static_cast<size_t>(tree.getLength())) == model, "Text after edits mismatch");
+    delete[] text;
+    ASSERT_EQUAL(tree.getTotalLineCount(), static_cast<LineIndex>(std::count(model.begin(), model.end(), '\n') + 1), "Line count after edits mismatch");
+    ASSERT(checkedHeight(tree.getRoot()) >= 1 && checkCachedWeights(tree.getRoot()), "Tree must stay a B+-tree");
+    ASSERT_EQUAL(original.getTotalLineCount(), static_cast<LineIndex>(6001), "Snapshot must keep the file text");
+
+    // Файл дописали — текст копируется к себе, файл остаётся открыт, пока его держит снимок
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out << "appended\n";
+    }
+    ASSERT(tree.mappedFilesChanged(), "Appended file not detected");
+    ASSERT(tree.detachMappedFiles(), "Appended file must be copied intact");
+    text = tree.getTextRange(0, tree.getLength());
+    ASSERT(std::string(text, static_cast<size_t>(tree.getLength())) == model, "Text after detach mismatch");
+    delete[] text;
+    original.reset();
+    ASSERT(tree.detachMappedFiles(), "Second detach must be a no-op");
+    ASSERT(!tree.usesMappedFile(path), "Detached tree must not reference the file");
+
+    // Файл усекли: байты за новым концом потеряны и отбрасываются, опустевшие листья — тоже
+    Tree cut;
+    cut.fromMappedFile(path, nullptr);
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << "fresh\n";
+    }
+    ASSERT(cut.mappedFilesChanged(), "Truncated file not detected");
+    ASSERT(!cut.detachMappedFiles(), "Truncation must be reported");
+    ASSERT_EQUAL(cut.getLength(), static_cast<TextOffset>(6), "Detach must keep only the readable bytes");
+    ASSERT_EQUAL(cut.getTotalLineCount(), static_cast<LineIndex>(2), "Lines must be recounted from copied bytes");
+    ASSERT(checkedHeight(cut.getRoot()) >= 0 && checkMinFill(cut.getRoot(), true) && checkCachedWeights(cut.getRoot()), "Cached weights must follow the recounted lines");
+
+    std::remove(path);
+    return true;
+}
+
+// Тест 27: Счётчики символов UTF-8 в узлах и пересчёт байт <-> символ <-> (строка, колонка)
+bool testCharMetrics() {
+    // Ядра подсчёта: 1-4-байтовые символы и длинная серия многобайтовых (переполнение байтовых счётчиков)
+    std::string buf;
+    const char* pieces[] = {"a", "\xD0\xB6", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\n"};
+    unsigned seed = 27;
+    for (int i = 0; i < 2500; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        buf += pieces[(seed >> 16) % 5];
+    }
+    for (int i = 0; i < 3000; ++i) buf += "\xE2\x82\xAC";
+    const NewlineKernel kinds[] = {NewlineKernel::NEWLINE_SCALAR, NewlineKernel::NEWLINE_SSE2, NewlineKernel::NEWLINE_AVX2};
+    for (NewlineKernel kind : kinds) {
+        if (!selectNewlineKernel(kind)) continue;
+        for (size_t from = 0; from < 40; from += 3) {
+            for (size_t n : {size_t(0), size_t(1), size_t(17), size_t(33), size_t(500), buf.size() - from}) {
+                const char* data = buf.data() + from;
+                std::vector<int64_t> starts;
+                for (size_t i = 0; i < n; ++i) {
+                    if ((static_cast<unsigned char>(data[i]) & 0xC0) != 0x80) starts.push_back(static_cast<int64_t>(i));
+                }
+                ASSERT_EQUAL(countCodePoints(data, n), starts.size(), "countCodePoints mismatch");
+                for (size_t k = 1; k <= starts.size() + 1; k += 1 + starts.size() / 40) {
+                    int64_t expected = k <= starts.size() ? starts[k - 1] : -1;
+                    ASSERT_EQUAL(findNthCodePoint(data, n, k), expected, "findNthCodePoint mismatch");
+                }
+            }
+        }
+    }
+    ASSERT(selectNewlineKernel(bestNewlineKernel()), "The best kernel must be selectable");
+
+    // Дерево: правки (в том числе режущие символ пополам на границе листов), затем сверка с моделью
+    std::string model = buf;
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    for (int i = 0; i < 300; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        TextOffset pos = static_cast<TextOffset>((seed >> 8) % model.size());
+        if (seed & 1) {
+            const char* piece = pieces[(seed >> 4) % 5];
+            tree.insert(pos, piece, static_cast<TextOffset>(std::strlen(piece)));
+            model.insert(static_cast<size_t>(pos), piece);
+        } else {
+            TextOffset len = static_cast<TextOffset>((seed >> 4) % 9);
+            if (len > static_cast<TextOffset>(model.size()) - pos) len = static_cast<TextOffset>(model.size()) - pos;
+            tree.erase(pos, len);
+            model.erase(static_cast<size_t>(pos), static_cast<size_t>(len));
+        }
+    }
+    ASSERT(checkCachedWeights(tree.getRoot()), "Cached char counts must match the children");
+
+    std::vector<TextOffset> charStarts; // байт начала каждого символа
+    for (size_t i = 0; i < model.size(); ++i) {
+        if ((static_cast<unsigned char>(model[i]) & 0xC0) != 0x80) charStarts.push_back(static_cast<TextOffset>(i));
+    }
+    ASSERT_EQUAL(tree.getCharCount(), static_cast<TextOffset>(charStarts.size()), "Total char count mismatch");
+    for (size_t c = 0; c < charStarts.size(); c += 37) {
+        ASSERT_EQUAL(tree.getByteOffsetForChar(static_cast<TextOffset>(c)), charStarts[c], "getByteOffsetForChar mismatch");
+        ASSERT_EQUAL(tree.getCharOffset(charStarts[c]), static_cast<TextOffset>(c), "getCharOffset mismatch");
+    }
+    ASSERT_EQUAL(tree.getByteOffsetForChar(tree.getCharCount() + 5), tree.getLength(), "Char past the end must clamp");
+    ASSERT_EQUAL(tree.getCharOffset(tree.getLength()), tree.getCharCount(), "End offset must map to char count");
+
+    // Колонки в символах: locate и обратный переход по (строка, колонка)
+    LineIndex line = 0;
+    TextOffset lineStart = 0;
+    TextOffset column = 0;
+    for (size_t c = 0; c < charStarts.size(); ++c) {
+        TextOffset off = charStarts[c];
+        if (c % 53 == 0) {
+            TextLocation loc = tree.locate(off);
+            ASSERT_EQUAL(loc.line, line, "locate line mismatch");
+            ASSERT_EQUAL(loc.charColumn, column, "locate charColumn mismatch");
+            // Колонка 0 — начало строки (даже если там осиротевшие байты-продолжения разрезанного символа)
+            ASSERT_EQUAL(tree.getByteOffsetForLineColumn(line, column), column == 0 ? lineStart : off, "getByteOffsetForLineColumn mismatch");
+            ASSERT_EQUAL(tree.getByteOffsetForLineColumn(line, column + 100000) >= off, true, "Column past the end must clamp");
+        }
+        if (model[static_cast<size_t>(off)] == '\n') {
+            ASSERT_EQUAL(tree.getByteOffsetForLineColumn(line, column + 100000), off, "Column past the end must stop before newline");
+            ++line;
+            lineStart = off + 1;
+            column = 0;
+        } else {
+            ++column;
+        }
+    }
+    ASSERT_EQUAL(lineStart <= tree.getLength(), true, "Model walk out of range");
+    return true;
+}
+
+// Тест 28: Пакет правок за один проход (Tree::applyEdits) против модели std::string
+bool testApplyEdits() {
+    std::string model;
+    for (int i = 0; i < 60000; ++i) model += "line " + std::to_string(i) + " \xD0\xB6\xD0\xB6 text\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    TreeSnapshot before = tree.snapshot(); // листья общие со снимком: проход не должен их испортить
+    const std::string original = model;
+
+    unsigned seed = 28;
+    std::vector<std::string> texts; // байты вставок живут до конца пакета
+    for (int round = 0; round < 6; ++round) {
+        // Непересекающиеся правки по возрастанию, затем перемешиваем
+        std::vector<TextEdit> edits;
+        texts.clear();
+        texts.reserve(4000);
+        TextOffset pos = 0;
+        size_t count = round == 5 ? 3 : 400 + 700 * static_cast<size_t>(round); // последний пакет — по одной правке
+        for (size_t k = 0; k < count; ++k) {
+            seed = seed * 1103515245u + 12345u;
+            pos += static_cast<TextOffset>((seed >> 8) % (round == 3 ? 9000 : 600)); // round 3 — редкие правки
+            if (pos > static_cast<TextOffset>(model.size())) break;
+            TextEdit edit;
+            edit.pos = pos;
+            edit.eraseLen = (seed & 1) ? static_cast<TextOffset>((seed >> 4) % (k % 50 == 0 ? 20000 : 40)) : 0;
+            if (edit.eraseLen > static_cast<TextOffset>(model.size()) - pos) edit.eraseLen = static_cast<TextOffset>(model.size()) - pos;
+            if ((seed & 6) != 0) {
+                texts.push_back(std::string(static_cast<size_t>((seed >> 12) % (k % 97 == 0 ? 12000 : 30)), static_cast<char>('a' + k % 26)));
+                if (k % 5 == 0) texts.back() += '\n';
+                edit.text = texts.back().data();
+                edit.textLen = static_cast<TextOffset>(texts.back().size());
+            }
+            edits.push_back(edit);
+            pos += edit.eraseLen + 1;
+        }
+        std::vector<TextEdit> shuffled = edits;
+        for (size_t k = shuffled.size(); k > 1; --k) {
+            seed = seed * 1103515245u + 12345u;
+            std::swap(shuffled[k - 1], shuffled[(seed >> 8) % k]);
+        }
+        tree.applyEdits(shuffled);
+        for (size_t k = edits.size(); k-- > 0;) {
+            model.replace(static_cast<size_t>(edits[k].pos), static_cast<size_t>(edits[k].eraseLen), edits[k].text ? edits[k].text : "", static_cast<size_t>(edits[k].textLen));
+        }
+
+        ASSERT_EQUAL(tree.getLength(), static_cast<TextOffset>(model.size()), "Length after batch mismatch");
+        char* text = tree.getTextRange(0, tree.getLength());
+        bool same = std::string(text, static_cast<size_t>(tree.getLength())) == model;
+        delete[] text;
+        ASSERT(same, "Text after batch mismatch");
+        ASSERT_EQUAL(tree.getTotalLineCount(), static_cast<LineIndex>(std::count(model.begin(), model.end(), '\n') + 1), "Line count after batch mismatch");
+        ASSERT(checkedHeight(tree.getRoot()) >= 1 && checkCachedWeights(tree.getRoot()), "Tree must stay a B+-tree after batch");
+    }
+    char* snapText = before.getTextRange(0, before.getLength());
+    ASSERT(std::string(snapText, static_cast<size_t>(before.getLength())) == original, "Snapshot must keep the text before the batch");
+    delete[] snapText;
+
+    // Удаление и вставка с одного места: вставка идёт первой, порядок вставок сохраняется
+    Tree small;
+    small.fromText("abcdef", 6);
+    std::vector<TextEdit> same(3);
+    same[0].pos = 2;
+    same[0].eraseLen = 2;
+    same[1].pos = 2;
+    same[1].text = "X";
+    same[1].textLen = 1;
+    same[2].pos = 2;
+    same[2].text = "Y";
+    same[2].textLen = 1;
+    small.applyEdits(same);
+    char* smallText = small.getTextRange(0, small.getLength());
+    ASSERT(std::string(smallText, static_cast<size_t>(small.getLength())) == "abXYef", "Same-position edits order mismatch");
+    delete[] smallText;
+
+    // Пересечение и выход за текст — исключение, дерево не тронуто
+    std::vector<TextEdit> overlap(2);
+    overlap[0].pos = 1;
+    overlap[0].eraseLen = 3;
+    overlap[1].pos = 3;
+    overlap[1].text = "Z";
+    overlap[1].textLen = 1;
+    bool thrown = false;
+    try {
+        small.applyEdits(overlap);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    ASSERT(thrown, "Overlapping edits must throw");
+    overlap.resize(1);
+    overlap[0].pos = small.getLength() + 1;
+    thrown = false;
+    try {
+        small.applyEdits(overlap);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    ASSERT(thrown, "Edit past the end must throw");
+    ASSERT_EQUAL(small.getLength(), static_cast<TextOffset>(6), "Failed batch must not touch the tree");
+
+    // Пустое дерево: вставки в позицию 0, длинная режется на листы
+    Tree empty;
+    std::string big(3 * MAX_LEAF_SIZE + 17, 'q');
+    std::vector<TextEdit> inserts(2);
+    inserts[0].text = "head";
+    inserts[0].textLen = 4;
+    inserts[1].text = big.data();
+    inserts[1].textLen = static_cast<TextOffset>(big.size());
+    empty.applyEdits(inserts);
+    ASSERT_EQUAL(empty.getLength(), static_cast<TextOffset>(big.size() + 4), "Inserts into empty tree mismatch");
+    ASSERT(checkedHeight(empty.getRoot()) >= 1 && checkCachedWeights(empty.getRoot()), "Tree from inserts must be a B+-tree");
+    return true;
+}
+
+// Текст дерева целиком (для сверки с моделью)
+static std::string treeText(const TreeReader& tree) {
+    if (tree.getLength() == 0) return std::string();
+    char* text = tree.getTextRange(0, tree.getLength());
+    std::string result(text, static_cast<size_t>(tree.getLength()));
+    delete[] text;
+    return result;
+}
+
+// Пустое дерево или B+-дерево с заполненными наполовину узлами и верными весами
+static bool isValidTree(const Node* root) {
+    return !root || (checkedHeight(root) >= 0 && checkMinFill(root, true) && checkCachedWeights(root));
+}
+
+static void collectLeafPointers(const Node* node, std::vector<const Node*>& leaves) {
+    if (!node) return;
+    if (node->getType() == NodeType::NODE_LEAF) {
+        leaves.push_back(node);
+        return;
+    }
+    auto in = static_cast<const InternalNode*>(node);
+    for (int i = 0; i < in->childCount; ++i) collectLeafPointers(in->children[i], leaves);
+}
+
+// Тест 29: Разрез и склейка деревьев (split/concat/extract/insertTree) без копирования байт
+bool testSplitConcat() {
+    std::string model;
+    for (int i = 0; model.size() < 1024u * 1024; ++i) model += "block " + std::to_string(i) + " \xD0\xB6 move\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+
+    // Перенос блока: вырезать и вставить в другое место — листья переставляются, а не копируются
+    std::vector<const Node*> before;
+    collectLeafPointers(tree.getRoot(), before);
+    std::sort(before.begin(), before.end());
+    TextOffset from = 150000;
+    TextOffset len = 450000;
+    Tree block = tree.extract(from, len);
+    std::string cut = model.substr(static_cast<size_t>(from), static_cast<size_t>(len));
+    model.erase(static_cast<size_t>(from), static_cast<size_t>(len));
+    ASSERT(treeText(block) == cut, "Extracted text mismatch");
+    ASSERT(treeText(tree) == model, "Text after extract mismatch");
+    tree.insertTree(350000, std::move(block));
+    model.insert(350000, cut);
+    ASSERT(block.getLength() == 0 && block.getRoot() == nullptr, "insertTree must empty the source tree");
+    ASSERT(treeText(tree) == model, "Text after block move mismatch");
+    ASSERT(isValidTree(tree.getRoot()), "Tree must stay a B+-tree after block move");
+    std::vector<const Node*> after;
+    collectLeafPointers(tree.getRoot(), after);
+    size_t fresh = 0;
+    for (const Node* leaf : after) fresh += std::binary_search(before.begin(), before.end(), leaf) ? 0 : 1;
+    ASSERT(fresh <= 16, ("Block move copied too many leaves: " + std::to_string(fresh)).c_str());
+
+    // Случайные разрезы и склейки, часть — при живом снимке (путь копируется, снимок не меняется)
+    unsigned seed = 29;
+    for (int round = 0; round < 60; ++round) {
+        seed = seed * 1103515245u + 12345u;
+        TreeSnapshot snap;
+        if (round % 3 == 0) snap = tree.snapshot();
+        std::string snapModel = model;
+        TextOffset total = static_cast<TextOffset>(model.size());
+        TextOffset at = static_cast<TextOffset>((seed >> 8) % static_cast<unsigned>(total + 1));
+        if (round % 4 == 0) at = round % 8 == 0 ? 0 : total; // края
+        Tree right = tree.split(at);
+        ASSERT(treeText(tree) == model.substr(0, static_cast<size_t>(at)), "Left part after split mismatch");
+        ASSERT(treeText(right) == model.substr(static_cast<size_t>(at)), "Right part after split mismatch");
+        ASSERT(isValidTree(tree.getRoot()), "Left part must be a B+-tree");
+        ASSERT(isValidTree(right.getRoot()), "Right part must be a B+-tree");
+
+        // Склеиваем в обратном порядке: right + tree
+        right.concat(std::move(tree));
+        model = model.substr(static_cast<size_t>(at)) + model.substr(0, static_cast<size_t>(at));
+        tree = std::move(right);
+        ASSERT(treeText(tree) == model, "Text after concat mismatch");
+        ASSERT(isValidTree(tree.getRoot()), "Tree must stay a B+-tree after concat");
+        if (round % 3 == 0) ASSERT(treeText(snap) == snapModel, "Snapshot must not change after split/concat");
+
+        // Мелкие куски (лист и меньше) — в разные места
+        TextOffset piecePos = static_cast<TextOffset>((seed >> 4) % model.size());
+        TextOffset pieceLen = static_cast<TextOffset>((seed >> 12) % (round % 2 ? 50u : 9000u));
+        Tree piece = tree.extract(piecePos, pieceLen);
+        std::string pieceText = model.substr(static_cast<size_t>(piecePos), static_cast<size_t>(pieceLen));
+        model.erase(static_cast<size_t>(piecePos), static_cast<size_t>(pieceLen));
+        TextOffset dest = static_cast<TextOffset>((seed >> 3) % (model.size() + 1));
+        tree.insertTree(dest, std::move(piece));
+        model.insert(static_cast<size_t>(dest), pieceText);
+        ASSERT(treeText(tree) == model, "Text after piece move mismatch");
+        ASSERT(isValidTree(tree.getRoot()), "Tree must stay a B+-tree after piece move");
+    }
+    // Обычные правки после перестановок
+    tree.insert(12345, "edit\n", 5);
+    model.insert(12345, "edit\n");
+    tree.erase(1000, 70000);
+    model.erase(1000, 70000);
+    ASSERT(treeText(tree) == model, "Edits after split/concat mismatch");
+    ASSERT_EQUAL(tree.getTotalLineCount(), static_cast<LineIndex>(std::count(model.begin(), model.end(), '\n') + 1), "Line count after split/concat mismatch");
+
+    // Дерево с другой памятью копируется в пул получателя
+    Tree foreign;
+    std::string extra(20000, 'x');
+    foreign.fromText(extra.c_str(), static_cast<TextOffset>(extra.size()));
+    tree.insertTree(5, std::move(foreign));
+    model.insert(5, extra);
+    ASSERT(foreign.getLength() == 0, "Foreign tree must be emptied");
+    Tree small;
+    small.fromText("tail", 4);
+    tree.concat(std::move(small));
+    model += "tail";
+    ASSERT(treeText(tree) == model, "Text after foreign concat mismatch");
+    ASSERT(checkedHeight(tree.getRoot()) >= 1 && checkMinFill(tree.getRoot(), true), "Tree must stay a B+-tree after foreign concat");
+
+    // Пустые деревья и крайние позиции
+    Tree empty;
+    Tree none = empty.split(10);
+    ASSERT(none.getLength() == 0 && empty.getLength() == 0, "Split of empty tree must be empty");
+    empty.concat(tree.extract(0, 10));
+    ASSERT(treeText(empty) == model.substr(0, 10), "Concat into empty tree mismatch");
+    return true;
+}
+
+// Тест 30: Крупная вставка собирается сбалансированным поддеревом — листья не длиннее MAX_LEAF_SIZE
+bool testLargePaste() {
+    std::string model;
+    for (int i = 0; model.size() < 600000; ++i) model += "paste target " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    TreeSnapshot before = tree.snapshot();
+    const std::string original = model;
+
+    auto maxLeaf = [](const Tree& t) {
+        std::vector<const Node*> leaves;
+        collectLeafPointers(t.getRoot(), leaves);
+        int longest = 0;
+        for (const Node* leaf : leaves) longest = std::max(longest, static_cast<const LeafNode*>(leaf)->length);
+        return longest;
+    };
+
+    // Вставки около порога и намного больше листа, в том числе без '\n' и в края текста
+    std::string noNewlines(1024 * 1024, 'z');
+    std::string lines;
+    for (int i = 0; lines.size() < 512u * 1024; ++i) lines += "pasted " + std::to_string(i) + "\n";
+    unsigned seed = 30;
+    const size_t sizes[] = {size_t(MAX_LEAF_SIZE), size_t(MAX_LEAF_SIZE) + 1, 3 * size_t(MAX_LEAF_SIZE) + 7, 100000, lines.size(), noNewlines.size()};
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+        seed = seed * 1103515245u + 12345u;
+        const std::string& source = k % 2 ? noNewlines : lines;
+        size_t n = std::min(sizes[k], source.size());
+        TextOffset pos = k == 0 ? 0 : (k == 1 ? tree.getLength() : static_cast<TextOffset>((seed >> 8) % model.size()));
+        tree.insert(pos, source.data(), static_cast<TextOffset>(n));
+        model.insert(static_cast<size_t>(pos), source, 0, n);
+        ASSERT(treeText(tree) == model, "Text after large paste mismatch");
+        ASSERT(isValidTree(tree.getRoot()), "Tree must stay a B+-tree after large paste");
+        ASSERT(maxLeaf(tree) <= MAX_LEAF_SIZE, ("Leaf longer than MAX_LEAF_SIZE after paste: " + std::to_string(maxLeaf(tree))).c_str());
+    }
+    ASSERT(treeText(before) == original, "Snapshot must not see the paste");
+
+    // Обычный набор и вставки до MAX_LEAF_SIZE тоже не дают длинных листьев (разрез у '\n' не перекашивает половины)
+    for (int i = 0; i < 2000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        size_t n = 1 + (seed >> 4) % static_cast<unsigned>(i % 10 == 0 ? MAX_LEAF_SIZE : 40);
+        TextOffset pos = static_cast<TextOffset>((seed >> 8) % (model.size() + 1));
+        tree.insert(pos, lines.data() + i, static_cast<TextOffset>(n));
+        model.insert(static_cast<size_t>(pos), lines, static_cast<size_t>(i), n);
+    }
+    ASSERT(treeText(tree) == model, "Text after typing mismatch");
+    ASSERT(maxLeaf(tree) <= MAX_LEAF_SIZE, "Leaf longer than MAX_LEAF_SIZE after typing");
+    ASSERT(isValidTree(tree.getRoot()), "Tree must stay a B+-tree after typing");
+
+    // Вставка в пустое дерево
+    Tree empty;
+    empty.insert(0, noNewlines.data(), 50000);
+    ASSERT_EQUAL(empty.getLength(), static_cast<TextOffset>(50000), "Paste into empty tree length mismatch");
+    ASSERT(maxLeaf(empty) <= MAX_LEAF_SIZE && isValidTree(empty.getRoot()), "Paste into empty tree must be balanced");
+    return true;
+}
+
+// Тест 31: Удаление большого диапазона отцепляет поддеревья, а освобождает их фоновый поток
+bool testLazyRangeErase() {
+    std::string model;
+    for (int i = 0; model.size() < 8u * 1024 * 1024; ++i) model += "erase range line " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    TreeSnapshot whole = tree.snapshot();
+    const std::string original = model;
+
+    // 90% текста: остаются только крайние пути, поддеревья уходят в NodeReclaimer
+    std::size_t releasedBefore = NodeReclaimer::shared().getReleasedCount();
+    TextOffset from = 100000;
+    TextOffset len = static_cast<TextOffset>(model.size() * 9 / 10);
+    tree.erase(from, len);
+    model.erase(static_cast<size_t>(from), static_cast<size_t>(len));
+    ASSERT(treeText(tree) == model, "Text after large erase mismatch");
+    ASSERT(isValidTree(tree.getRoot()), "Tree must stay a B+-tree after large erase");
+    NodeReclaimer::shared().waitIdle();
+    ASSERT(NodeReclaimer::shared().getReleasedCount() > releasedBefore, "Covered subtrees must go to the reclaimer");
+    ASSERT(treeText(whole) == original, "Snapshot must keep the erased subtrees");
+    whole.reset();
+    NodeReclaimer::shared().waitIdle();
+
+    // Освобождённые узлы возвращаются в пул по частям — правки продолжают работать
+    for (int i = 0; i < 200; ++i) {
+        tree.insert(static_cast<TextOffset>(i * 7), "ab", 2);
+        model.insert(static_cast<size_t>(i * 7), "ab");
+        tree.erase(static_cast<TextOffset>(i * 11), 1);
+        model.erase(static_cast<size_t>(i * 11), 1);
+    }
+    ASSERT(treeText(tree) == model, "Edits after lazy reclaim mismatch");
+    ASSERT(isValidTree(tree.getRoot()), "Tree must stay a B+-tree after lazy reclaim");
+
+    // Журнал: крупное удаление вырезает поддерево (cut), отмена вклеивает его обратно
+    {
+        EditHistory history(tree);
+        std::vector<const Node*> before;
+        collectLeafPointers(tree.getRoot(), before);
+        std::sort(before.begin(), before.end());
+        TextOffset cutFrom = 5000;
+        TextOffset cutLen = tree.getLength() - 10000;
+        std::string removed = model.substr(static_cast<size_t>(cutFrom), static_cast<size_t>(cutLen));
+        history.erase(cutFrom, cutLen);
+        ASSERT_EQUAL(tree.getLength(), static_cast<TextOffset>(model.size()) - cutLen, "History erase length mismatch");
+        ASSERT_EQUAL(history.undo(), cutFrom + cutLen, "Undo of a large erase must put the cursor after the text");
+        ASSERT(treeText(tree) == model, "Undo of a large erase mismatch");
+        ASSERT(isValidTree(tree.getRoot()), "Tree must stay a B+-tree after undo");
+        std::vector<const Node*> after;
+        collectLeafPointers(tree.getRoot(), after);
+        size_t fresh = 0;
+        for (const Node* leaf : after) fresh += std::binary_search(before.begin(), before.end(), leaf) ? 0 : 1;
+        ASSERT(fresh <= 16, ("Undo must reuse the cut leaves, copied: " + std::to_string(fresh)).c_str());
+        ASSERT_EQUAL(history.redo(), cutFrom, "Redo of a large erase");
+        ASSERT(treeText(tree) == model.substr(0, static_cast<size_t>(cutFrom)) + model.substr(static_cast<size_t>(cutFrom + cutLen)),
+               "Redo of a large erase mismatch");
+        history.clear(); // крупный текст записи тоже освобождается в фоне
+    }
+    NodeReclaimer::shared().waitIdle();
+
+    // Когда фоновых снимков не осталось, clear() снова сбрасывает пул целиком
+    tree.clear();
+    ASSERT_EQUAL(tree.getReservedBytes(), static_cast<size_t>(0), "clear() must release the pool after reclaim");
+    return true;
+}
+
+// Тест 32: Палец на последнем листе — набор текста, Backspace и курсор не спускаются от корня
+bool testFingerCache() {
+    std::string model;
+    for (int i = 0; model.size() < 256u * 1024; ++i) model += "finger line " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    const TreeReader& reader = tree; // те же запросы без пальца
+
+    // Записанная сессия: набор в середине текста с Backspace и движением курсора
+    TextOffset cursor = static_cast<TextOffset>(model.size() / 2);
+    TreeSnapshot before;
+    for (int i = 0; i < 6000; ++i) {
+        if (i == 3000) before = tree.snapshot(); // путь пальца становится общим со снимком
+        if (i % 10 == 9) {
+            tree.erase(cursor - 1, 1);
+            model.erase(static_cast<size_t>(cursor - 1), 1);
+            --cursor;
+        } else {
+            char c = (i % 40 == 0) ? '\n' : static_cast<char>('a' + i % 26);
+            tree.insert(cursor, &c, 1);
+            model.insert(static_cast<size_t>(cursor), 1, c);
+            ++cursor;
+        }
+        if (i % 7 == 0) {
+            TextOffset probe = cursor - (i % 5);
+            ASSERT_EQUAL(tree.getLineForOffset(probe), reader.getLineForOffset(probe), "Finger line lookup mismatch");
+            TextLocation a = tree.locate(probe);
+            TextLocation b = reader.locate(probe);
+            ASSERT(a.line == b.line && a.lineStart == b.lineStart && a.column == b.column && a.charColumn == b.charColumn,
+                   "Finger locate mismatch");
+        }
+    }
+    ASSERT(treeText(tree) == model, "Typing session text mismatch");
+    ASSERT(checkedHeight(tree.getRoot()) >= 1 && checkCachedWeights(tree.getRoot()), "Tree invariants broken by finger edits");
+    ASSERT(treeText(before).size() + 1 < model.size(), "Snapshot must not see later typing");
+    long long hits = tree.getFingerHitCount();
+    long long misses = tree.getFingerMissCount();
+    ASSERT(hits > 9 * misses, ("Typing must hit the finger, hits: " + std::to_string(hits) + ", misses: " +
+                               std::to_string(misses)).c_str());
+
+    // Структурные правки сбрасывают палец: дальше правки по всему тексту должны оставаться верными
+    tree.erase(1000, 75000);
+    model.erase(1000, 75000);
+    tree.insert(cursor - 75000, "x", 1);
+    model.insert(static_cast<size_t>(cursor - 75000), "x");
+    Tree tail = tree.split(static_cast<TextOffset>(model.size() / 3));
+    tree.concat(std::move(tail));
+    unsigned seed = 12345;
+    for (int i = 0; i < 3000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        TextOffset pos = static_cast<TextOffset>((seed >> 8) % (model.size() + 1));
+        if (i % 3 == 0 && pos < static_cast<TextOffset>(model.size())) {
+            TextOffset len = static_cast<TextOffset>(1 + (seed >> 4) % 800);
+            if (len > static_cast<TextOffset>(model.size()) - pos) len = static_cast<TextOffset>(model.size()) - pos;
+            tree.erase(pos, len);
+            model.erase(static_cast<size_t>(pos), static_cast<size_t>(len));
+        } else {
+            std::string text(static_cast<size_t>(1 + (seed >> 4) % 600), static_cast<char>('A' + i % 26));
+            tree.insert(pos, text.data(), static_cast<TextOffset>(text.size()));
+            model.insert(static_cast<size_t>(pos), text);
+        }
+        TextOffset probe = static_cast<TextOffset>((seed >> 3) % (model.size() + 1));
+        if (tree.getLineForOffset(probe) != reader.getLineForOffset(probe)) {
+            ASSERT(false, "Finger line lookup mismatch after random edits");
+        }
+    }
+    ASSERT(treeText(tree) == model, "Random edits text mismatch");
+    ASSERT(checkedHeight(tree.getRoot()) >= 1 && checkCachedWeights(tree.getRoot()), "Tree invariants broken by random edits");
+    return true;
+}
+
+// Тест 33: Статистика узлов и памяти — границы, которые должны держаться после правок
+bool testTreeStats() {
+    Tree empty;
+    TreeStats st = empty.stats();
+    ASSERT(st.nodeCount() == 0 && st.allocatedBytes() == 0 && empty.depth() == 0, "Empty tree must have no nodes");
+    empty.insert(0, "one leaf\n", 9);
+    ASSERT(empty.depth() == 0 && empty.stats().leafCount == 1, "Single leaf has depth 0");
+
+    std::string model;
+    for (int i = 0; model.size() < 4u * 1024 * 1024; ++i) model += "stats line " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    st = tree.stats();
+    ASSERT_EQUAL(st.payloadBytes, static_cast<TextOffset>(model.size()), "Payload must equal the text length");
+    ASSERT_EQUAL(st.mappedBytes, static_cast<TextOffset>(0), "Copied text has no mapped bytes");
+    ASSERT(tree.depth() >= 2 && st.maxDepth == tree.depth(), "depth() must match the deepest leaf");
+    ASSERT(st.averageDepth() == static_cast<double>(st.maxDepth), "All B+-tree leaves are at one depth");
+    size_t histogram = 0;
+    for (size_t n : st.leafFill) histogram += n;
+    ASSERT_EQUAL(histogram, st.leafCount, "Fill histogram must cover every leaf");
+    ASSERT(st.leafFill[0] + st.leafFill[1] <= 1, "Built leaves must be at least MIN_LEAF_SIZE");
+    ASSERT_EQUAL(st.nodeHeaderBytes, st.leafCount * sizeof(LeafNode) + st.internalCount * sizeof(InternalNode),
+                 "Header bytes must follow node counts");
+    ASSERT(st.allocatedBytes() >= model.size() && st.allocatedBytes() < model.size() + model.size() / 4,
+           "Built tree must not use much more than its text");
+    ASSERT(st.overheadPerNode() > 0 && st.overheadPerNode() < 512, "Per-node overhead out of bounds");
+    ASSERT_EQUAL(st.sharedCount, 0u, "No snapshots — no shared nodes");
+
+    // Разбросанные правки: листья остаются не меньше MIN_LEAF_SIZE, глубина — логарифмической
+    unsigned seed = 777;
+    for (int i = 0; i < 20000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        TextOffset pos = static_cast<TextOffset>((seed >> 8) % static_cast<unsigned>(tree.getLength()));
+        if (i % 2) tree.erase(pos, 1 + (seed >> 4) % 200);
+        else tree.insert(pos, "some typed text\n", 16);
+    }
+    st = tree.stats();
+    ASSERT_EQUAL(st.payloadBytes, tree.getLength(), "Payload must follow edits");
+    ASSERT(st.leafFill[0] + st.leafFill[1] == 0, "Edited leaves must stay at least MIN_LEAF_SIZE");
+    ASSERT(tree.depth() <= 6 && st.maxDepth == tree.depth(), "Depth must stay logarithmic");
+    ASSERT(st.allocatedBytes() < 3 * static_cast<size_t>(st.payloadBytes), "Edited tree must stay below 3x its text");
+
+    TreeSnapshot snap = tree.snapshot();
+    tree.insert(0, "x", 1);
+    ASSERT(tree.stats().sharedCount > 0, "Path copy leaves nodes shared with the snapshot");
+    snap.reset();
+
+    // Листья над отображённым файлом не занимают буферов
+    const char* path = "test2_stats.txt";
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(model.data(), static_cast<std::streamsize>(model.size()));
+    }
+    Tree mapped;
+    mapped.fromMappedFile(path, nullptr);
+    st = mapped.stats();
+    ASSERT_EQUAL(st.mappedBytes, static_cast<TextOffset>(model.size()), "Mapped text must be counted as mapped");
+    ASSERT_EQUAL(st.leafBufferBytes, 0u, "Mapped leaves have no buffers");
+    mapped.insert(100, "y", 1);
+    ASSERT(mapped.stats().leafBufferBytes > 0 && mapped.stats().leafBufferBytes <= 2u * MAX_LEAF_SIZE,
+           "Only the edited leaf gets a buffer");
+    mapped.clear();
+    std::remove(path);
+    return true;
+}
+
+// Тест 34: Фоновое уплотнение — недозаполненные соседние листья переупаковываются по шагам
+bool testCompaction() {
+    std::string model;
+    for (int i = 0; model.size() < 512u * 1024; ++i) model += "compact line " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    ASSERT(!Tree().compactStep(), "Empty tree has nothing to compact");
+
+    // Долгая правка: листья дробятся вставками и худеют от удалений
+    unsigned seed = 4242;
+    for (int i = 0; i < 5000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        TextOffset pos = static_cast<TextOffset>((seed >> 8) % static_cast<unsigned>(model.size()));
+        if (i % 2) {
+            TextOffset len = static_cast<TextOffset>(1 + (seed >> 4) % 120);
+            if (len > static_cast<TextOffset>(model.size()) - pos) len = static_cast<TextOffset>(model.size()) - pos;
+            tree.erase(pos, len);
+            model.erase(static_cast<size_t>(pos), static_cast<size_t>(len));
+        } else {
+            tree.insert(pos, "inserted text\n", 14);
+            model.insert(static_cast<size_t>(pos), "inserted text\n");
+        }
+    }
+    TreeStats before = tree.stats();
+
+    // Пока жив снимок всего текста, его узлы не трогаются
+    TreeSnapshot snap = tree.snapshot();
+    int steps = 0;
+    while (tree.compactStep()) ++steps;
+    ASSERT(steps > 0, "A pass must take several steps");
+    ASSERT_EQUAL(tree.stats().leafCount, before.leafCount, "Nodes shared with a snapshot must not be compacted");
+    snap.reset();
+
+    while (tree.compactStep()) {
+    }
+    TreeStats after = tree.stats();
+    ASSERT(treeText(tree) == model, "Compaction must not change the text");
+    ASSERT(checkedHeight(tree.getRoot()) >= 1 && checkCachedWeights(tree.getRoot()) && checkMinFill(tree.getRoot(), true),
+           "Tree must stay a B+-tree after compaction");
+    ASSERT(after.leafCount < before.leafCount, ("Compaction must reduce leaves: " + std::to_string(before.leafCount) +
+                                                " -> " + std::to_string(after.leafCount)).c_str());
+    ASSERT(after.leafFill[0] + after.leafFill[1] == 0, "Compacted leaves must stay at least MIN_LEAF_SIZE");
+
+    // Второй проход почти ничего не находит, а правки после уплотнения работают
+    while (tree.compactStep()) {
+    }
+    ASSERT(tree.stats().leafCount >= after.leafCount - after.leafCount / 20, "Second pass must find little to do");
+    for (int i = 0; i < 2000; ++i) {
+        TextOffset pos = static_cast<TextOffset>((static_cast<size_t>(i) * 7919) % model.size());
+        tree.insert(pos, "z", 1);
+        model.insert(static_cast<size_t>(pos), "z");
+    }
+    ASSERT(treeText(tree) == model, "Edits after compaction mismatch");
+    ASSERT(checkedHeight(tree.getRoot()) >= 1 && checkCachedWeights(tree.getRoot()), "Tree must stay valid after edits");
+    return true;
+}
+
+// Тест 35: Запись поверх отображённого файла — журнал отмены не должен читать его после записи
+bool testMappedFileHistory() {
+    const char* path = "test2_mapped_history.txt";
+    std::string model;
+    for (int i = 0; i < 3000; ++i) model += "row " + std::to_string(i) + "\n";
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(model.data(), static_cast<std::streamsize>(model.size()));
+    }
+
+    Tree tree;
+    tree.fromMappedFile(path, nullptr);
+    EditHistory history(tree);
+    // Крупное удаление уходит в журнал поддеревом с листьями над файлом
+    history.erase(1000, 9000);
+    history.insert(0, "head\n", 5);
+    ASSERT(tree.usesMappedFile(path), "Edited tree must still reference the file");
+
+    // Как при сохранении: сначала копируем к себе, потом файл перезаписывается короче
+    ASSERT(history.detachMappedFiles(), "Untouched file must be copied intact");
+    ASSERT(!tree.usesMappedFile(path), "Detached file must not be reported as used");
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << "saved\n";
+    }
+    // Файл уже обработан — таймер проверки не должен снова его копировать
+    ASSERT(!tree.mappedFilesChanged(), "Detached file must not be reported as changed");
+
+    ASSERT(history.undo() >= 0 && history.undo() >= 0, "Both edits must be undoable");
+    char* text = tree.getTextRange(0, tree.getLength());
+    ASSERT(std::string(text, static_cast<size_t>(tree.getLength())) == model, "Undo after save must restore the original text");
+    delete[] text;
+    ASSERT(checkedHeight(tree.getRoot()) >= 1 && checkCachedWeights(tree.getRoot()), "Tree must stay a B+-tree");
+
+    // Снимок вне журнала держит файл открытым: детач всё равно помечает его обработанным
+    Tree other;
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(model.data(), static_cast<std::streamsize>(model.size()));
+    }
+    // Запись "другой программой" ниже не должна ждать отзыва аренды (см. testMappedFile)
+    std::fstream writer(path, std::ios::binary | std::ios::in | std::ios::out);
+    other.fromMappedFile(path, nullptr);
+    TreeSnapshot held = other.snapshot();
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out << "tail\n";
+    }
+    ASSERT(other.mappedFilesChanged(), "Appended file not detected");
+    ASSERT(other.detachMappedFiles(), "Appended file must be copied intact");
+    ASSERT(!other.mappedFilesChanged(), "File still shared with a snapshot must not trigger another detach");
+    held.reset();
+
+    // Файл усечён до детача: листья за новым концом выбрасываются (не остаются пустыми),
+    // а дерево и журнал остаются B+-деревьями
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(model.data(), static_cast<std::streamsize>(model.size()));
+    }
+    Tree cut;
+    cut.fromMappedFile(path, nullptr);
+    EditHistory cutHistory(cut);
+    cutHistory.insert(5000, "mid\n", 4); // лист с правкой уже скопирован к себе и уцелеет
+    std::filesystem::resize_file(path, 10);
+    ASSERT(cut.mappedFilesChanged(), "Truncated file not detected");
+    ASSERT(!cutHistory.detachMappedFiles(), "Truncated file must not be reported as copied intact");
+    std::string kept = treeText(cut);
+    ASSERT(kept.compare(0, 10, model, 0, 10) == 0, "Readable head of the file must be kept");
+    ASSERT(kept.find("mid\n") != std::string::npos, "Copied leaf must survive the truncation");
+    ASSERT(kept.size() < model.size() && kept.find('\0') == std::string::npos, "Unreadable bytes must be dropped, not zero-filled");
+    ASSERT(isValidTree(cut.getRoot()), "Truncated detach must keep the tree a B+-tree");
+    ASSERT(!cutHistory.canUndo(), "Undo positions no longer match the shorter text — history must be dropped");
+
+    std::remove(path);
+    return true;
+}
+
+// Тест 36: Нехватка памяти посреди перестройки — дерево остаётся прежним, а не пустым
+bool testAllocationFailure() {
+    std::string model;
+    for (int i = 0; i < 4000; ++i) model += "line " + std::to_string(i) + "\n";
+    Tree tree;
+    tree.fromText(model.c_str(), static_cast<TextOffset>(model.size()));
+    TreeSnapshot before = tree.snapshot(); // часть листьев общая со снимком
+
+    // Правка на каждый лист — applyEdits идёт проходом по листьям
+    std::vector<TextEdit> edits;
+    std::string expected;
+    TextOffset copied = 0;
+    for (TextOffset pos = 100; pos < static_cast<TextOffset>(model.size()); pos += 1500) {
+        TextEdit edit;
+        edit.pos = pos;
+        edit.eraseLen = 7;
+        edit.text = "EDIT\n";
+        edit.textLen = 5;
+        edits.push_back(edit);
+        expected.append(model, static_cast<size_t>(copied), static_cast<size_t>(pos - copied));
+        expected += "EDIT\n";
+        copied = pos + 7;
+    }
+    expected.append(model, static_cast<size_t>(copied), std::string::npos);
+
+    // k-е выделение памяти отказывает: до первого успешного прохода перебираем каждое
+    bool applied = false;
+    int failures = 0;
+    for (long long k = 0; !applied && k < 100000; ++k) {
+        allocationsBeforeFailure = k;
+        try {
+            tree.applyEdits(edits);
+            applied = true;
+        } catch (const std::bad_alloc&) {
+            ++failures;
+        }
+        allocationsBeforeFailure = -1;
+        if (!applied) {
+            ASSERT(treeText(tree) == model, ("applyEdits must keep the text on bad_alloc, failed allocation " + std::to_string(k)).c_str());
+            ASSERT(isValidTree(tree.getRoot()), "applyEdits must keep the tree valid on bad_alloc");
+        }
+    }
+    ASSERT(applied && failures > 0, "applyEdits never succeeded or never allocated");
+    ASSERT(treeText(tree) == expected, "applyEdits result mismatch after failed attempts");
+    ASSERT(treeText(before) == model, "Snapshot must not change");
+
+    applied = false;
+    failures = 0;
+    for (long long k = 0; !applied && k < 100000; ++k) {
+        allocationsBeforeFailure = k;
+        try {
+            tree.rebalance();
+            applied = true;
+        } catch (const std::bad_alloc&) {
+            ++failures;
+        }
+        allocationsBeforeFailure = -1;
+        if (!applied) {
+            ASSERT(treeText(tree) == expected, "rebalance must keep the text on bad_alloc");
+            ASSERT(isValidTree(tree.getRoot()), "rebalance must keep the tree valid on bad_alloc");
+        }
+    }
+    ASSERT(applied && failures > 0, "rebalance never succeeded or never allocated");
+    ASSERT(treeText(tree) == expected && isValidTree(tree.getRoot()), "rebalance result mismatch");
+
+    // Мелкий пакет на большом документе идёт по одной правке: вставка с разрезом листа и удаление
+    // через границу листов тоже применяются целиком или никак
+    std::string big;
+    for (int i = 0; big.size() < 1024u * 1024; ++i) big += "big line " + std::to_string(i) + "\n";
+    Tree large;
+    large.fromText(big.c_str(), static_cast<TextOffset>(big.size()));
+    const std::string paste(6000, 'p');
+    std::vector<TextEdit> few(3);
+    few[0].pos = 1000;
+    few[0].text = paste.data();
+    few[0].textLen = static_cast<TextOffset>(paste.size());
+    few[1].pos = 300000;
+    few[1].eraseLen = 9000;
+    few[2].pos = 700000;
+    few[2].eraseLen = 10;
+    few[2].text = "SMALL\n";
+    few[2].textLen = 6;
+    std::string bigExpected = big;
+    bigExpected.replace(700000, 10, "SMALL\n");
+    bigExpected.erase(300000, 9000);
+    bigExpected.insert(1000, paste);
+
+    applied = false;
+    failures = 0;
+    for (long long k = 0; !applied && k < 100000; ++k) {
+        allocationsBeforeFailure = k;
+        try {
+            large.applyEdits(few);
+            applied = true;
+        } catch (const std::bad_alloc&) {
+            ++failures;
+        }
+        allocationsBeforeFailure = -1;
+        if (!applied) {
+            ASSERT(treeText(large) == big, ("Small applyEdits batch must keep the text on bad_alloc, failed allocation " + std::to_string(k)).c_str());
+            ASSERT(isValidTree(large.getRoot()), "Small applyEdits batch must keep the tree valid on bad_alloc");
+        }
+    }
+    ASSERT(applied && failures > 1, "Small applyEdits batch never succeeded or failed too early");
+    ASSERT(treeText(large) == bigExpected && isValidTree(large.getRoot()), "Small applyEdits batch result mismatch");
+    return true;
+}
+
+// Тест 37: Отображённый файл переписывают и усекают, пока дерево его читает
+bool testMappedFileRewrite() {
+    const char* path = "test2_mapped_rewrite.txt";
+    std::string model;
+    for (int i = 0; i < 20000; ++i) model += "original " + std::to_string(i) + "\n";
+    auto writeModel = [&]() {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(model.data(), static_cast<std::streamsize>(model.size()));
+    };
+
+    // С арендой: запись другой программы ждёт, пока дерево не скопирует исходный текст
+    writeModel();
+    {
+        Tree tree;
+        tree.fromMappedFile(path, nullptr);
+        std::thread rewrite([path]() {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out << "rewritten\n";
+        });
+        bool changed = false;
+        for (int i = 0; i < 500 && !changed; ++i) {
+            changed = tree.mappedFilesChanged();
+            if (!changed) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT(changed, "Pending write to the mapped file not detected");
+        bool intact = tree.detachMappedFiles();
+        rewrite.join();
+        ASSERT(isValidTree(tree.getRoot()), "Detach during a rewrite must keep the tree valid");
+        if (intact) ASSERT(treeText(tree) == model, "Leased file must be copied before the writer changes it");
+    }
+
+    // Без аренды (файл уже открыт на запись): усечение и перезапись видны отображению сразу
+    writeModel();
+    std::fstream writer(path, std::ios::binary | std::ios::in | std::ios::out);
+    Tree cut;
+    cut.fromMappedFile(path, nullptr);
+    ASSERT(!cut.mappedFilesChanged(), "Untouched file reported as changed");
+    std::filesystem::resize_file(path, 10);
+    // Чтение за новым концом файла — SIGBUS; страницы подменяются нулями, процесс живёт,
+    // а несошедшиеся с байтами счётчики строк дают исключение, а не порчу памяти
+    try {
+        auto lines = cut.linesAt(15000);
+        for (int i = 0; i < 10 && lines.valid(); ++i) lines.next();
+        delete[] cut.getTextRange(cut.getLength() - 100, 100);
+    } catch (const std::exception&) {
+        // ожидаемо: кэш строк описывает прежние байты
+    }
+    ASSERT(cut.mappedFilesChanged(), "Truncated file not detected");
+    ASSERT(!cut.detachMappedFiles(), "Truncation must be reported");
+    ASSERT_EQUAL(cut.getLength(), static_cast<TextOffset>(10), "Only the readable bytes must stay");
+    ASSERT(treeText(cut) == model.substr(0, 10) && isValidTree(cut.getRoot()), "Truncated detach mismatch");
+
+    // Перезапись на месте без смены размера: после детача счётчики пересчитаны по новым байтам
+    writeModel();
+    Tree same;
+    same.fromMappedFile(path, nullptr);
+    std::string rewritten(model.size(), 'r');
+    for (size_t i = 0; i < rewritten.size(); i += 50) rewritten[i] = '\n';
+    writer.seekp(0);
+    writer.write(rewritten.data(), static_cast<std::streamsize>(rewritten.size()));
+    writer.flush();
+    try {
+        auto lines = same.linesAt(15000);
+        for (int i = 0; i < 10 && lines.valid(); ++i) lines.next();
+    } catch (const std::exception&) {
+        // ожидаемо: '\n' уже не там, где их насчитали при открытии
+    }
+    ASSERT(same.mappedFilesChanged(), "Rewritten file not detected");
+    ASSERT(same.detachMappedFiles(), "Same-size rewrite loses no bytes");
+    ASSERT(treeText(same) == rewritten, "Detach must copy the current bytes");
+    ASSERT_EQUAL(same.getTotalLineCount(),
+                 static_cast<LineIndex>(std::count(rewritten.begin(), rewritten.end(), '\n') + 1),
+                 "Line counts must be recomputed after the rewrite");
+    ASSERT(isValidTree(same.getRoot()), "Rewritten detach must keep the tree valid");
+
+    writer.close();
+    std::remove(path);
+    return true;
+}
+
 // Основная функция запуска тестов
 int main() {
     std::cout << "=== Starting Tree Unit Tests ===" << std::endl;
@@ -373,7 +2484,35 @@ int main() {
         testGetOffsetForLine,
         testFindSubstring,
         testGetTextRange,
-        testStressWithCyrillic
+        testStressWithCyrillic,
+        testBalancing,
+        testGapBufferEditing,
+        testUnderfullLeafMerge,
+        testNodePool,
+        testCachedChildWeights,
+        testWideFanout,
+        testWideOffsets,
+        testSnapshots,
+        testEditHistory,
+        testLeafLineIndex,
+        testNewlineKernels,
+        testParallelBuild,
+        testTreeBuilder,
+        testChunkIterator,
+        testLineIterator,
+        testLocate,
+        testMappedFile,
+        testCharMetrics,
+        testApplyEdits,
+        testSplitConcat,
+        testLargePaste,
+        testLazyRangeErase,
+        testFingerCache,
+        testTreeStats,
+        testCompaction,
+        testMappedFileHistory,
+        testAllocationFailure,
+        testMappedFileRewrite
     };
     
     int numTests = sizeof(testFunctions) / sizeof(testFunctions[0]);